@@ -0,0 +1,403 @@
+// Microbenchmarks of the hot paths in utp.c. utp.c is included rather
+// than linked, so the internal functions can be called directly.
+//
+// Each benchmark is run with more and more iterations until it takes at
+// least MIN_NS, and its result is the time per operation (a packet
+// processed, a call, a sample) and the operations per second. The
+// results are written as JSON, so that runs can be compared.
+//
+// usage: bench [-o results.json] [name filter]
+
+#include "../utp.c"
+
+#include <stdint.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+// the time each benchmark runs for, at least
+#define MIN_NS 200000000ull
+// the packets put in flight, and acked, at a time
+#define BATCH 64
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// runs n operations, and returns the nanoseconds they took. Setup done
+// between the operations isn't counted
+typedef uint64_t bench_fn(size_t n);
+
+static FILE *g_out;
+static const char *g_filter;
+static int g_results;
+
+static void bench_run(const char *name, const char *unit, bench_fn *fn)
+{
+	if (g_filter != NULL && strstr(name, g_filter) == NULL) return;
+
+	size_t n = 1;
+	uint64_t ns;
+	for (;;) {
+		ns = fn(n);
+		if (ns >= MIN_NS) break;
+		// aim 20% past MIN_NS, growing at least 2x and at most 100x
+		const uint64_t next = ns == 0 ? n * 100 : n * MIN_NS * 6 / 5 / ns;
+		n = (size_t)max(min(next, n * 100), n * 2);
+	}
+
+	const double ns_per_op = (double)ns / n;
+	fprintf(stderr, "%-32s %12.1f ns/%s %14.0f %ss/s\n", name, ns_per_op, unit, 1e9 / ns_per_op, unit);
+	fprintf(g_out, "%s\n    {\"name\": \"%s\", \"unit\": \"%s\", \"iterations\": %zu, "
+			"\"ns_per_op\": %.1f, \"ops_per_sec\": %.0f}",
+			g_results++ ? "," : "", name, unit, n, ns_per_op, 1e9 / ns_per_op);
+}
+
+static void bench_run_scaled(const char *name, size_t sockets, const char *unit, bench_fn *fn)
+{
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%s/%zu", name, sockets);
+	bench_run(buf, unit, fn);
+}
+
+// Packets sent by the two ends of a connection, end 0 accepting it and
+// end 1 connecting. The send_to userdata is the index of the sender.
+// Packets sent outside of the handshake are dropped
+struct bench_packet {
+	intptr_t from;
+	size_t len;
+	uint8_t data[1500];
+};
+
+static struct bench_packet g_queue[16];
+static size_t g_queued;
+static bool g_capture;
+static struct sockaddr_in g_addr[2];
+static UTPSocket *g_end[2];
+
+static void bench_send_to(void *userdata, const uint8_t *p, size_t len, const struct sockaddr *to, socklen_t tolen)
+{
+	if (!g_capture || g_queued == sizeof(g_queue) / sizeof(g_queue[0])) return;
+	struct bench_packet *pkt = &g_queue[g_queued++];
+	pkt->from = (intptr_t)userdata;
+	pkt->len = len;
+	memcpy(pkt->data, p, len);
+}
+
+static void bench_incoming(void *userdata, UTPSocket *conn)
+{
+	g_end[0] = conn;
+}
+
+static void bench_connect(void)
+{
+	for (int i = 0; i < 2; i++) {
+		g_addr[i].sin_family = AF_INET;
+		g_addr[i].sin_addr.s_addr = htonl(0x7f000001);
+		g_addr[i].sin_port = htons(6881 + i);
+	}
+
+	g_capture = true;
+	g_end[1] = UTP_Create(&bench_send_to, (void*)1, (const struct sockaddr*)&g_addr[0], sizeof(g_addr[0]));
+	UTP_Connect(g_end[1]);
+	// the SYN, SYN-ACK and the ack of it
+	for (int round = 0; round < 4; round++) {
+		for (size_t i = 0; i < g_queued; i++) {
+			const struct bench_packet *pkt = &g_queue[i];
+			const intptr_t to = 1 - pkt->from;
+			UTP_IsIncomingUTP(to == 0 ? &bench_incoming : NULL, &bench_send_to, (void*)to,
+							  pkt->data, pkt->len, (const struct sockaddr*)&g_addr[pkt->from], sizeof(g_addr[0]));
+		}
+		g_queued = 0;
+		UTP_CheckTimeouts();
+	}
+	g_capture = false;
+
+	if (g_end[0] == NULL || g_end[0]->state != CS_CONNECTED || g_end[1]->state != CS_CONNECTED) {
+		fprintf(stderr, "failed to connect\n");
+		exit(1);
+	}
+}
+
+// A packet to conn, as the other end would send it (version 1 header),
+// with room for a selective ack of mask_len bytes. Returns its length
+static size_t bench_packet(const UTPSocket *conn, uint8_t *p, int type, uint16_t ack_nr, size_t mask_len)
+{
+	assert(conn->version == 1);
+	memset(p, 0, PF1_SIZE);
+	p[PF1_TYPE] = type << 4 | 1;
+	set16(p + PF1_CONNID, conn->conn_id_recv);
+	set32(p + PF1_TV_USEC, (uint32_t)g_current_us);
+	set32(p + PF1_DELAY_USEC, 20000);
+	set32(p + PF1_WND_SIZE, 1024 * 1024);
+	set16(p + PF1_SEQ_NR, conn->ack_nr + 1);
+	set16(p + PF1_ACK_NR, ack_nr);
+	if (mask_len == 0) return PF1_SIZE;
+	p[PF1_EXT] = 1;
+	p[PF1_EXT_NEXT] = 0;
+	p[PF1_EXT_LEN] = (uint8_t)mask_len;
+	memset(p + PF1_EXT_DATA, 0, mask_len);
+	return PF1_EXT_DATA + mask_len;
+}
+
+// Put count full packets in flight on the connecting end, regardless of
+// its window. Returns the sequence number of the first
+static uint16_t bench_fill_window(size_t count)
+{
+	UTPSocket *conn = g_end[1];
+	utp_update_clock();
+	conn->max_window = 1024 * 1024;
+	conn->max_window_user = 1024 * 1024;
+	conn->send_quota = 1024 * 1024 * 100;
+	const uint16_t first = conn->seq_nr;
+	for (size_t i = 0; i < count; i++)
+		utp_write_outgoing_packet(conn, utp_get_packet_size(conn), ST_DATA);
+	assert(conn->cur_window_packets == count);
+	return first;
+}
+
+// Ack everything in flight on the connecting end
+static void bench_ack_all(void)
+{
+	UTPSocket *conn = g_end[1];
+	uint8_t p[PF1_SIZE];
+	const size_t len = bench_packet(conn, p, ST_STATE, conn->seq_nr - 1, 0);
+	UTP_ProcessIncoming(conn, p, len, false);
+	assert(conn->cur_window_packets == 0);
+}
+
+// In order data packets, to the accepting end
+static uint64_t bench_data(size_t n)
+{
+	UTPSocket *conn = g_end[0];
+	uint8_t p[PF1_SIZE + 1000];
+	utp_update_clock();
+	const size_t len = bench_packet(conn, p, ST_DATA, conn->seq_nr - 1, 0) + 1000;
+	memset(p + PF1_SIZE, 0, 1000);
+
+	const uint64_t start = bench_now();
+	for (size_t i = 0; i < n; i++) {
+		set16(p + PF1_SEQ_NR, conn->ack_nr + 1);
+		UTP_ProcessIncoming(conn, p, len, false);
+	}
+	return bench_now() - start;
+}
+
+// Acks of one packet each, to the connecting end
+static uint64_t bench_ack(size_t n)
+{
+	UTPSocket *conn = g_end[1];
+	uint8_t p[PF1_SIZE];
+	uint64_t ns = 0;
+	for (size_t done = 0; done < n; done += BATCH) {
+		const size_t count = min(n - done, BATCH);
+		const uint16_t first = bench_fill_window(count);
+		const size_t len = bench_packet(conn, p, ST_STATE, first, 0);
+
+		const uint64_t start = bench_now();
+		for (size_t i = 0; i < count; i++) {
+			set16(p + PF1_ACK_NR, first + i);
+			UTP_ProcessIncoming(conn, p, len, false);
+		}
+		ns += bench_now() - start;
+	}
+	return ns;
+}
+
+// Acks with a selective ack of one more packet each, after the first
+// packet of a batch was lost. The packet count as the operations
+static uint64_t bench_eack(size_t n)
+{
+	UTPSocket *conn = g_end[1];
+	uint8_t p[PF1_EXT_DATA + 8];
+	uint64_t ns = 0;
+	for (size_t done = 0; done < n; done += BATCH - 1) {
+		const size_t count = min(n - done, BATCH - 1);
+		const uint16_t first = bench_fill_window(count + 1);
+		const size_t len = bench_packet(conn, p, ST_STATE, first - 1, 8);
+
+		const uint64_t start = bench_now();
+		for (size_t i = 0; i < count; i++) {
+			p[PF1_EXT_DATA + (i >> 3)] |= 1 << (i & 7);
+			UTP_ProcessIncoming(conn, p, len, false);
+		}
+		ns += bench_now() - start;
+		bench_ack_all();
+	}
+	return ns;
+}
+
+// utp_selective_ack() with every other packet of 32 received
+static uint64_t bench_selective_ack(size_t n)
+{
+	UTPSocket *conn = g_end[1];
+	const uint8_t mask[4] = {0x55, 0x55, 0x55, 0x55};
+	uint64_t ns = 0;
+	for (size_t i = 0; i < n; i++) {
+		const uint16_t first = bench_fill_window(33);
+
+		const uint64_t start = bench_now();
+		utp_selective_ack(conn, first + 1, mask, sizeof(mask));
+		ns += bench_now() - start;
+		bench_ack_all();
+	}
+	return ns;
+}
+
+static uint64_t bench_write_outgoing_packet(size_t n)
+{
+	UTPSocket *conn = g_end[1];
+	uint64_t ns = 0;
+	for (size_t done = 0; done < n; done += BATCH) {
+		const size_t count = min(n - done, BATCH);
+		bench_fill_window(0);
+
+		const uint64_t start = bench_now();
+		for (size_t i = 0; i < count; i++)
+			utp_write_outgoing_packet(conn, utp_get_packet_size(conn), ST_DATA);
+		ns += bench_now() - start;
+		bench_ack_all();
+	}
+	return ns;
+}
+
+// Growing a buffer from 16 to 4096 entries, per doubling
+static uint64_t bench_circbuf_grow(size_t n)
+{
+	uint64_t ns = 0;
+	for (size_t done = 0; done < n; done += 8) {
+		const size_t count = min(n - done, 8);
+		SizableCircularBuffer buf;
+		buf.mask = 15;
+		buf.elements = (void**)calloc(16, sizeof(void*));
+		for (size_t i = 0; i < 16; i++)
+			buf.elements[i] = &buf;
+
+		const uint64_t start = bench_now();
+		for (size_t i = 0; i < count; i++)
+			circbuf_grow(&buf, done + i, buf.mask + 1);
+		ns += bench_now() - start;
+		free(buf.elements);
+	}
+	return ns;
+}
+
+static uint64_t bench_delayhist_add_sample(size_t n)
+{
+	uint32_t hist_buf[DELAY_BASE_HISTORY];
+	DelayHist hist;
+	hist.delay_base_hist = hist_buf;
+	g_current_ms = 0;
+	delayhist_clear(&hist);
+
+	uint32_t sample = 0x12345678;
+	const uint64_t start = bench_now();
+	for (size_t i = 0; i < n; i++) {
+		// a millisecond between samples, and up to 4 ms of jitter
+		g_current_ms++;
+		sample = sample * 1103515245 + 12345;
+		delayhist_add_sample(&hist, 100000 + (sample >> 20));
+	}
+	const uint64_t ns = bench_now() - start;
+	utp_update_clock();
+	return ns;
+}
+
+// Sockets connected to many peers. g_scale_packets[i] is an ack to
+// g_scale[i] from its peer, which has nothing new to ack
+static UTPSocket **g_scale;
+static uint8_t (*g_scale_packets)[PF1_SIZE];
+static size_t g_scale_count;
+
+static void bench_scale_to(size_t count)
+{
+	g_scale = realloc(g_scale, count * sizeof(g_scale[0]));
+	g_scale_packets = realloc(g_scale_packets, count * sizeof(g_scale_packets[0]));
+	for (size_t i = g_scale_count; i < count; i++) {
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(0x0a000000 + (uint32_t)i);
+		addr.sin_port = htons(6881);
+
+		UTPSocket *conn = UTP_Create(&bench_send_to, NULL, (const struct sockaddr*)&addr, sizeof(addr));
+		UTP_Connect(conn);
+		// the SYN-ACK
+		uint8_t p[PF1_SIZE];
+		bench_packet(conn, p, ST_STATE, conn->seq_nr - 1, 0);
+		UTP_IsIncomingUTP(NULL, &bench_send_to, NULL, p, sizeof(p), (const struct sockaddr*)&addr, sizeof(addr));
+		assert(conn->state == CS_CONNECTED);
+
+		g_scale[i] = conn;
+		bench_packet(conn, g_scale_packets[i], ST_STATE, conn->seq_nr - 1, 0);
+	}
+	g_scale_count = count;
+	UTP_CheckTimeouts();
+}
+
+// Packets to the scale sockets, in an order the cache can't predict
+static uint64_t bench_is_incoming_utp(size_t n)
+{
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(6881);
+
+	const uint64_t start = bench_now();
+	for (size_t i = 0; i < n; i++) {
+		const size_t s = (size_t)((i * 2654435761u) % g_scale_count);
+		addr.sin_addr.s_addr = htonl(0x0a000000 + (uint32_t)s);
+		UTP_IsIncomingUTP(NULL, &bench_send_to, NULL, g_scale_packets[s], PF1_SIZE,
+						  (const struct sockaddr*)&addr, sizeof(addr));
+	}
+	return bench_now() - start;
+}
+
+static uint64_t bench_check_timeouts(size_t n)
+{
+	const uint64_t start = bench_now();
+	for (size_t i = 0; i < n; i++)
+		UTP_CheckTimeouts();
+	return bench_now() - start;
+}
+
+int main(int argc, char const* argv[])
+{
+	g_out = stdout;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			g_out = fopen(argv[++i], "w");
+			if (g_out == NULL) {
+				perror(argv[i]);
+				return 1;
+			}
+		} else {
+			g_filter = argv[i];
+		}
+	}
+
+	fprintf(g_out, "{\n  \"socket_size\": %zu,\n  \"benchmarks\": [", sizeof(UTPSocket));
+
+	bench_run("circbuf_grow", "grow", &bench_circbuf_grow);
+	bench_run("delayhist_add_sample", "sample", &bench_delayhist_add_sample);
+
+	bench_connect();
+	bench_run("process_incoming/data", "packet", &bench_data);
+	bench_run("process_incoming/ack", "packet", &bench_ack);
+	bench_run("process_incoming/eack", "packet", &bench_eack);
+	bench_run("selective_ack", "call", &bench_selective_ack);
+	bench_run("write_outgoing_packet", "packet", &bench_write_outgoing_packet);
+
+	const size_t scale[] = {10, 1000, 100000};
+	for (size_t i = 0; i < sizeof(scale) / sizeof(scale[0]); i++) {
+		bench_scale_to(scale[i]);
+		bench_run_scaled("is_incoming_utp", scale[i], "packet", &bench_is_incoming_utp);
+		bench_run_scaled("check_timeouts", scale[i], "call", &bench_check_timeouts);
+	}
+
+	fprintf(g_out, "\n  ]\n}\n");
+	if (g_out != stdout) fclose(g_out);
+	return 0;
+}
@@ -0,0 +1,131 @@
+// Many connections within the process, each sending data to the other
+// end and processing its acks. Measures the time it takes to process
+// a packet, which is dominated by cache misses on the sockets once
+// there are enough of them. Sending is paced in real time, and the
+// time spent waiting for that isn't counted.
+//
+// usage: bench_ack [connections] [packets per connection]
+
+#include "utp.h"
+#include "utp_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+struct packet {
+	sockaddr_in from;
+	std::vector<unsigned char> data;
+};
+
+struct client {
+	sockaddr_in addr;
+	UTPSocket *sock;
+	bool writable;
+};
+
+static std::vector<packet> g_queue;
+static sockaddr_in g_server_addr;
+static size_t g_packets;
+static int g_errors;
+
+static void bench_send_to(void *userdata, const unsigned char *p, size_t len, const struct sockaddr *to, socklen_t tolen)
+{
+	// the userdata is the address of the sending end
+	packet pkt;
+	pkt.from = *(const sockaddr_in*)userdata;
+	pkt.data.assign(p, p + len);
+	g_queue.push_back(pkt);
+}
+
+static void on_read(void *userdata, const unsigned char *bytes, size_t count) {}
+static void on_write(void *userdata, unsigned char *bytes, size_t count) { memset(bytes, 0, count); }
+static size_t get_rb_size(void *userdata) { return 0; }
+static void on_state(void *userdata, int state)
+{
+	client *c = (client*)userdata;
+	if (c && (state == UTP_STATE_CONNECT || state == UTP_STATE_WRITABLE))
+		c->writable = true;
+}
+static void on_error(void *userdata, int errcode) { ++g_errors; }
+static void on_overhead(void *userdata, bool send, size_t count, int type) {}
+
+static UTPFunctionTable g_callbacks = { &on_read, &on_write, &get_rb_size, &on_state, &on_error, &on_overhead };
+
+static void on_incoming(void *userdata, UTPSocket *s)
+{
+	UTP_SetCallbacks(s, &g_callbacks, NULL);
+}
+
+// deliver everything that's been sent, including what's sent in response
+static void deliver()
+{
+	std::vector<packet> q;
+	while (!g_queue.empty()) {
+		q.swap(g_queue);
+		for (size_t i = 0; i < q.size(); ++i) {
+			UTP_IsIncomingUTP(&on_incoming, &bench_send_to, &g_server_addr, &q[i].data[0], q[i].data.size(),
+							  (const struct sockaddr*)&q[i].from, sizeof(q[i].from));
+		}
+		g_packets += q.size();
+		q.clear();
+	}
+}
+
+int main(int argc, char const* argv[])
+{
+	const int connections = argc > 1 ? atoi(argv[1]) : 5000;
+	const int per_connection = argc > 2 ? atoi(argv[2]) : 20;
+
+	memset(&g_server_addr, 0, sizeof(g_server_addr));
+	g_server_addr.sin_family = AF_INET;
+	g_server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	g_server_addr.sin_port = htons(6881);
+
+	// every connection from an address of its own
+	std::vector<client> clients(connections);
+	for (int i = 0; i < connections; ++i) {
+		client &c = clients[i];
+		memset(&c.addr, 0, sizeof(c.addr));
+		c.addr.sin_family = AF_INET;
+		c.addr.sin_addr.s_addr = htonl(0x0a000000 + i / 60000);
+		c.addr.sin_port = htons(1024 + i % 60000);
+		c.writable = false;
+		c.sock = UTP_Create(&bench_send_to, &c.addr, (const struct sockaddr*)&g_server_addr, sizeof(g_server_addr));
+		UTP_SetCallbacks(c.sock, &g_callbacks, &c);
+		UTP_Connect(c.sock);
+	}
+	deliver();
+	UTP_CheckTimeouts();
+	deliver();
+
+	// visit them in a different order than they were created in
+	std::vector<client*> order(connections);
+	for (int i = 0; i < connections; ++i) order[i] = &clients[i];
+	std::random_shuffle(order.begin(), order.end());
+
+	g_packets = 0;
+	const size_t target = (size_t)connections * per_connection;
+	std::chrono::steady_clock::duration elapsed(0);
+	while (g_packets < target && g_errors == 0) {
+		UTP_CheckTimeouts();
+		const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (int i = 0; i < connections; ++i) {
+			if (!order[i]->writable) continue;
+			order[i]->writable = UTP_Write(order[i]->sock, 4000);
+		}
+		deliver();
+		elapsed += std::chrono::steady_clock::now() - start;
+	}
+
+	const double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+	printf("connections: %d packets: %zu ns/packet: %.1f errors: %d\n",
+		   connections, g_packets, ns / (double)(g_packets ? g_packets : 1), g_errors);
+
+	for (int i = 0; i < connections; ++i)
+		UTP_Close(clients[i].sock);
+	return g_errors != 0;
+}
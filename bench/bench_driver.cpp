@@ -0,0 +1,239 @@
+// One uTP connection over loopback, both ends in this process, moving
+// data as fast as it will go through one of these I/O loops:
+//
+//   select  like the loop utp_file used to have, select() and then a
+//           recvfrom() or sendto() per packet
+//   epoll   the driver in utp_epoll.h
+//   uring   the driver in utp_uring.h, when built with UTP_URING_DRIVER
+//
+// Reports the throughput, and the CPU time per packet (data and acks,
+// received by either end) spent in user space and in the kernel. The
+// kernel time is mostly system calls.
+//
+// usage: bench_driver select|epoll|uring [megabytes]
+
+#include "utp.h"
+#include "utp_utils.h"
+#include "utp_epoll.h"
+#ifdef UTP_URING_DRIVER
+#include "utp_uring.h"
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+
+#include <vector>
+
+static size_t g_total;
+static size_t g_sent;
+static size_t g_received;
+static int g_errors;
+static UTPSocket *g_sender;
+static UTPSocket *g_receiver;
+
+static void on_read(void *userdata, const unsigned char *bytes, size_t count) { g_received += count; }
+static void on_write(void *userdata, unsigned char *bytes, size_t count) { memset(bytes, 0, count); g_sent += count; }
+static size_t get_rb_size(void *userdata) { return 0; }
+static void on_state(void *userdata, int state)
+{
+	if (userdata == &g_sender && (state == UTP_STATE_CONNECT || state == UTP_STATE_WRITABLE))
+		UTP_Write(g_sender, g_total - g_sent);
+}
+static void on_error(void *userdata, int errcode) { fprintf(stderr, "error: %s\n", strerror(errcode)); ++g_errors; }
+static void on_overhead(void *userdata, bool send, size_t count, int type) {}
+
+static UTPFunctionTable g_callbacks = { &on_read, &on_write, &get_rb_size, &on_state, &on_error, &on_overhead };
+
+static void on_incoming(void *userdata, UTPSocket *s)
+{
+	g_receiver = s;
+	UTP_SetCallbacks(s, &g_callbacks, &g_receiver);
+}
+
+// the select() loop
+struct select_socket {
+	int fd;
+	struct queued {
+		sockaddr_storage to;
+		socklen_t tolen;
+		size_t len;
+		unsigned char buf[1500];
+	};
+	// packets waiting for room in the kernel's send buffer, at most 32
+	std::vector<queued*> queue;
+};
+
+static void select_send_to(void *userdata, const unsigned char *p, size_t len, const struct sockaddr *to, socklen_t tolen)
+{
+	select_socket *s = (select_socket*)userdata;
+	if (s->queue.empty() && sendto(s->fd, p, len, 0, to, tolen) >= 0)
+		return;
+	if (s->queue.size() >= 32)
+		return;
+	select_socket::queued *q = (select_socket::queued*)malloc(sizeof(select_socket::queued));
+	memcpy(&q->to, to, tolen);
+	q->tolen = tolen;
+	q->len = len;
+	memcpy(q->buf, p, len);
+	s->queue.push_back(q);
+}
+
+static void select_flush(select_socket *s)
+{
+	while (!s->queue.empty()) {
+		select_socket::queued *q = s->queue.front();
+		if (sendto(s->fd, q->buf, q->len, 0, (const sockaddr*)&q->to, q->tolen) < 0 &&
+			(errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		free(q);
+		s->queue.erase(s->queue.begin());
+	}
+}
+
+// the port the kernel picked for fd
+static void bound_port(int fd, sockaddr_in *addr)
+{
+	socklen_t len = sizeof(*addr);
+	getsockname(fd, (sockaddr*)addr, &len);
+}
+
+static int select_bind(sockaddr_in *addr)
+{
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0 || bind(fd, (const sockaddr*)addr, sizeof(*addr)) < 0) {
+		perror("bind");
+		exit(1);
+	}
+	bound_port(fd, addr);
+	int size = 2 * 1024 * 1024;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+	return fd;
+}
+
+static size_t run_select(sockaddr_in server, sockaddr_in client)
+{
+	select_socket s[2];
+	s[0].fd = select_bind(&server);
+	s[1].fd = select_bind(&client);
+
+	g_sender = UTP_Create(&select_send_to, &s[1], (const sockaddr*)&server, sizeof(server));
+	UTP_SetCallbacks(g_sender, &g_callbacks, &g_sender);
+	UTP_Connect(g_sender);
+
+	size_t packets = 0;
+	while (g_received < g_total && g_errors == 0) {
+		fd_set r;
+		FD_ZERO(&r);
+		FD_SET(s[0].fd, &r);
+		FD_SET(s[1].fd, &r);
+		struct timeval tv = {0, 50000};
+		const int ret = select((s[0].fd > s[1].fd ? s[0].fd : s[1].fd) + 1, &r, NULL, NULL, &tv);
+		if (ret > 0) {
+			for (int i = 0; i < 2; ++i) {
+				select_flush(&s[i]);
+				if (!FD_ISSET(s[i].fd, &r)) continue;
+				for (;;) {
+					unsigned char buffer[8192];
+					sockaddr_storage sa;
+					socklen_t salen = sizeof(sa);
+					const ssize_t len = recvfrom(s[i].fd, buffer, sizeof(buffer), 0, (sockaddr*)&sa, &salen);
+					if (len < 0) break;
+					UTP_IsIncomingUTP(i == 0 ? &on_incoming : NULL, &select_send_to, &s[i],
+									  buffer, (size_t)len, (const sockaddr*)&sa, salen);
+					++packets;
+				}
+			}
+		}
+		UTP_CheckTimeouts();
+	}
+	return packets;
+}
+
+template <class Driver, class Create, class Bind, class CreateSocket, class Poll>
+static size_t run_driver(sockaddr_in server, sockaddr_in client,
+						 Create create, Bind bind, CreateSocket create_socket, Poll poll)
+{
+	Driver *d = create();
+	if (d == NULL) {
+		fprintf(stderr, "failed to create the driver: %s\n", strerror(errno));
+		exit(1);
+	}
+	const int server_fd = bind(d, (const sockaddr*)&server, sizeof(server), &on_incoming, NULL);
+	if (server_fd < 0) {
+		perror("bind");
+		exit(1);
+	}
+	bound_port(server_fd, &server);
+	const int fd = bind(d, (const sockaddr*)&client, sizeof(client), NULL, NULL);
+	if (fd < 0) {
+		perror("bind");
+		exit(1);
+	}
+
+	g_sender = create_socket(d, fd, (const sockaddr*)&server, sizeof(server));
+	UTP_SetCallbacks(g_sender, &g_callbacks, &g_sender);
+	UTP_Connect(g_sender);
+
+	size_t packets = 0;
+	while (g_received < g_total && g_errors == 0) {
+		const int n = poll(d, 50);
+		if (n > 0) packets += n;
+	}
+	return packets;
+}
+
+static double cpu_ns(const timeval &tv)
+{
+	return tv.tv_sec * 1e9 + tv.tv_usec * 1e3;
+}
+
+int main(int argc, char const* argv[])
+{
+	const char *loop = argc > 1 ? argv[1] : "epoll";
+	const size_t megabytes = argc > 2 ? atoi(argv[2]) : 100;
+	g_total = megabytes * 1024 * 1024;
+
+	sockaddr_in server, client;
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_addr.s_addr = inet_addr("127.0.0.1");
+	// any free ports, the kernel may not have let go of the last run's yet
+	client = server;
+
+	rusage before, after;
+	getrusage(RUSAGE_SELF, &before);
+	const uint64_t start = UTP_GetMicroseconds();
+
+	size_t packets;
+	if (strcmp(loop, "select") == 0) {
+		packets = run_select(server, client);
+	} else if (strcmp(loop, "epoll") == 0) {
+		packets = run_driver<UTPEpoll>(server, client, &UTPEpoll_Create, &UTPEpoll_Bind,
+									   &UTPEpoll_CreateSocket, &UTPEpoll_Poll);
+#ifdef UTP_URING_DRIVER
+	} else if (strcmp(loop, "uring") == 0) {
+		packets = run_driver<UTPUring>(server, client, &UTPUring_Create, &UTPUring_Bind,
+									   &UTPUring_CreateSocket, &UTPUring_Poll);
+#endif
+	} else {
+		fprintf(stderr, "usage: %s select|epoll|uring [megabytes]\n", argv[0]);
+		return 1;
+	}
+
+	const double seconds = (UTP_GetMicroseconds() - start) / 1e6;
+	getrusage(RUSAGE_SELF, &after);
+	const double n = (double)(packets ? packets : 1);
+	printf("loop: %s megabytes: %zu seconds: %.2f MB/s: %.1f packets: %zu "
+		   "user ns/packet: %.0f sys ns/packet: %.0f errors: %d\n",
+		   loop, megabytes, seconds, g_received / seconds / (1024 * 1024), packets,
+		   (cpu_ns(after.ru_utime) - cpu_ns(before.ru_utime)) / n,
+		   (cpu_ns(after.ru_stime) - cpu_ns(before.ru_stime)) / n, g_errors);
+	return g_errors != 0;
+}
@@ -0,0 +1,547 @@
+// LEDBAT against itself and against loss-based TCP, on the simulated
+// network of the tests (see tests/sim.h). In each scenario the flows
+// share one bottleneck, 10 Mbit/s with a 500 ms buffer, and are measured
+// over the second half of the run, once they have settled:
+//
+//   share        each flow's part of the goodput
+//   jain         Jain's fairness index of the flows' goodput: 1 when they
+//                all get the same, 1/n when one gets everything. Against
+//                TCP, uTP getting out of the way is the right answer
+//   queue delay  percentiles of the time packets waited at the bottleneck.
+//                LEDBAT aims for CCONTROL_TARGET, 100 ms
+//   utilisation  the time the bottleneck spent sending
+//
+// The scenarios:
+//
+//   shared     n uTP flows started together, 4 by default
+//   reno       a uTP flow and a Reno flow. uTP should get out of the way
+//   cubic      a uTP flow and a CUBIC flow
+//   latecomer  a second uTP flow, started once the first has the queue
+//              at its target. The second one takes the queue it finds
+//              for part of the base delay, and pushes the first aside
+//   rtt        uTP flows with 20 ms and 200 ms round trips
+//
+// The TCP flows are a model: whole packets, an ack for every packet
+// that SACKs it, SACK based loss recovery, and an RFC 6298 retransmission
+// timer with Linux's minimum.
+//
+// usage: bench_ledbat [-n flows] [scenario]
+
+#include "../tests/sim.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <set>
+#include <vector>
+
+// the bottleneck, in bytes per second, and its buffer
+#define BANDWIDTH 1250000
+#define BUFFER (BANDWIDTH / 2)
+// the one-way delay to the bottleneck, the rest of a flow's round trip
+// is on the way back
+#define UP_DELAY 5000
+// a full packet, and its payload, the same size as uTP's
+#define PACKET_SIZE 1402
+#define PAYLOAD_SIZE 1382
+#define ACK_SIZE 32
+
+struct flow {
+	flow(const char *name, uint32_t rtt, int start) :
+		_name(name), _rtt(rtt), _start(start), _started(false), _received(0), _measured(0) {}
+	virtual ~flow() {}
+
+	virtual void start(sim &s) = 0;
+	// every millisecond, once started
+	virtual void tick(sim &s) {}
+	// stop sending, and clean up
+	virtual void stop(sim &s) {}
+
+	const char *_name;
+	// the round trip without queueing, in microseconds
+	uint32_t _rtt;
+	// when it starts, in seconds
+	int _start;
+	bool _started;
+	// the bytes received in order, and at the start of the measurement
+	uint64_t _received;
+	uint64_t _measured;
+	sim_endpoint *_sender;
+	sim_endpoint *_receiver;
+};
+
+// the receiving end gets a link of its own, for the acks, with the rest
+// of the round trip
+static void add_endpoints(sim &s, sim_link *bottleneck, flow *f, int i,
+						  sim_packet_proc *sender_proc, sim_packet_proc *receiver_proc,
+						  UTPGotIncomingConnection *incoming_proc)
+{
+	char ip[32];
+	sim_link_config back;
+	back.delay = f->_rtt - UP_DELAY;
+	sim_link *link = s.add_link(back);
+
+	snprintf(ip, sizeof(ip), "10.0.0.%d", i + 1);
+	f->_sender = sender_proc != NULL ? s.add_raw_endpoint(ip, 6881, bottleneck, sender_proc, f)
+		: s.add_endpoint(ip, 6881, bottleneck, NULL, NULL);
+	snprintf(ip, sizeof(ip), "10.0.1.%d", i + 1);
+	f->_receiver = receiver_proc != NULL ? s.add_raw_endpoint(ip, 6881, link, receiver_proc, f)
+		: s.add_endpoint(ip, 6881, link, incoming_proc, f);
+}
+
+// A uTP flow, sending as much as it can
+struct utp_flow : flow {
+	utp_flow(const char *name, uint32_t rtt, int start) :
+		flow(name, rtt, start), _sock(NULL), _incoming(NULL), _destroyed(0) {}
+
+	void start(sim &s);
+	void stop(sim &s);
+
+	UTPSocket *_sock;
+	UTPSocket *_incoming;
+	int _destroyed;
+};
+
+static void utp_flow_read(void *userdata, const unsigned char *bytes, size_t count)
+{
+	((utp_flow*)userdata)->_received += count;
+}
+
+static void utp_flow_write(void *userdata, unsigned char *bytes, size_t count)
+{
+	memset(bytes, 0, count);
+}
+
+static size_t utp_flow_get_rb_size(void *userdata)
+{
+	return 0;
+}
+
+static void utp_flow_state(void *userdata, int state)
+{
+	utp_flow *f = (utp_flow*)userdata;
+	switch (state) {
+	case UTP_STATE_CONNECT:
+	case UTP_STATE_WRITABLE:
+		if (f->_sock != NULL) UTP_Write(f->_sock, 1 << 30);
+		break;
+	case UTP_STATE_EOF:
+		UTP_Close(f->_incoming);
+		break;
+	case UTP_STATE_DESTROYING:
+		++f->_destroyed;
+		break;
+	}
+}
+
+static void utp_flow_error(void *userdata, int errcode)
+{
+	fprintf(stderr, "%s: error %s\n", ((utp_flow*)userdata)->_name, strerror(errcode));
+}
+
+static void utp_flow_overhead(void *userdata, bool send, size_t count, int type) {}
+
+static UTPFunctionTable utp_flow_sender_callbacks = {
+	&utp_flow_read, &utp_flow_write, &utp_flow_get_rb_size, &utp_flow_state, &utp_flow_error, &utp_flow_overhead
+};
+
+// the receiving end doesn't write
+static void utp_flow_receiver_state(void *userdata, int state)
+{
+	if (state == UTP_STATE_WRITABLE) return;
+	utp_flow_state(userdata, state);
+}
+
+static UTPFunctionTable utp_flow_receiver_callbacks = {
+	&utp_flow_read, &utp_flow_write, &utp_flow_get_rb_size, &utp_flow_receiver_state, &utp_flow_error, &utp_flow_overhead
+};
+
+static void utp_flow_incoming(void *userdata, UTPSocket *conn)
+{
+	utp_flow *f = (utp_flow*)userdata;
+	f->_incoming = conn;
+	UTP_SetCallbacks(conn, &utp_flow_receiver_callbacks, f);
+}
+
+void utp_flow::start(sim &s)
+{
+	_sock = s.create_socket(_sender, _receiver);
+	UTP_SetCallbacks(_sock, &utp_flow_sender_callbacks, this);
+	UTP_Connect(_sock);
+}
+
+void utp_flow::stop(sim &s)
+{
+	if (_sock == NULL) return;
+	UTP_Close(_sock);
+	for (int i = 0; i < 600 && _destroyed < 2; ++i)
+		s.run(100000);
+}
+
+// A TCP flow, with Reno's or CUBIC's congestion control
+struct tcp_flow : flow {
+	tcp_flow(const char *name, uint32_t rtt, int start, bool cubic) :
+		flow(name, rtt, start), _cubic(cubic), _stopped(false),
+		_snd_una(0), _snd_nxt(0), _recover(0), _in_recovery(false), _dupacks(0),
+		_cwnd(2), _ssthresh(1e9), _srtt(0), _rttvar(0), _rto(1000000), _rto_deadline(0),
+		_w_max(0), _epoch_start(0), _k(0), _rcv_nxt(0) {}
+
+	void start(sim &s);
+	void tick(sim &s);
+	void stop(sim &s) { _stopped = true; }
+
+	void send_segment(sim &s, uint32_t seq);
+	void send_more(sim &s);
+	void on_ack(sim &s, uint32_t ack, uint32_t sack, uint64_t ts);
+	void on_data(sim &s, uint32_t seq, uint64_t ts);
+	void on_loss(sim &s);
+	void grow(sim &s);
+
+	bool _cubic;
+	bool _stopped;
+
+	// the sender, in packets
+	uint32_t _snd_una;
+	uint32_t _snd_nxt;
+	uint32_t _recover;
+	bool _in_recovery;
+	int _dupacks;
+	double _cwnd;
+	double _ssthresh;
+	// the packets past _snd_una the receiver has, and the holes between
+	// them resent since the loss
+	std::set<uint32_t> _sacked;
+	std::set<uint32_t> _resent;
+	// in microseconds
+	uint64_t _srtt;
+	uint64_t _rttvar;
+	uint64_t _rto;
+	uint64_t _rto_deadline;
+	// CUBIC's window before the last loss, when the growth since started,
+	// and the seconds it takes to get back to _w_max
+	double _w_max;
+	uint64_t _epoch_start;
+	double _k;
+
+	// the receiver
+	uint32_t _rcv_nxt;
+	std::set<uint32_t> _out_of_order;
+};
+
+struct tcp_segment {
+	uint32_t seq;
+	uint32_t ack;
+	// the packet this acks, a SACK of one
+	uint32_t sack;
+	// the sender's time, echoed in the ack
+	uint64_t ts;
+};
+
+// CUBIC's constants, see RFC 8312
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+void tcp_flow::send_segment(sim &s, uint32_t seq)
+{
+	unsigned char buf[PACKET_SIZE];
+	tcp_segment seg = { seq, 0, 0, s.now() };
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, &seg, sizeof(seg));
+	s.send(_sender, buf, sizeof(buf), _receiver);
+}
+
+// During recovery, the packets in flight are the ones not acked, less
+// the holes below the highest SACK that haven't been resent. The holes
+// are resent first, then new data (RFC 6675, simplified)
+void tcp_flow::send_more(sim &s)
+{
+	if (_stopped) return;
+	if (_snd_nxt == _snd_una) _rto_deadline = s.now() + _rto;
+	if (!_in_recovery || _sacked.empty()) {
+		while (_snd_nxt - _snd_una < (uint32_t)_cwnd)
+			send_segment(s, _snd_nxt++);
+		return;
+	}
+
+	const uint32_t highest = *_sacked.rbegin();
+	uint32_t hole = _snd_una;
+	for (;;) {
+		const uint32_t holes = highest - _snd_una - (uint32_t)_sacked.size() + 1;
+		const uint32_t pipe = _snd_nxt - _snd_una - (uint32_t)_sacked.size() - holes + (uint32_t)_resent.size();
+		if (pipe >= (uint32_t)_cwnd) break;
+		while (hole != highest && (_sacked.count(hole) || _resent.count(hole))) ++hole;
+		if (hole != highest) {
+			_resent.insert(hole);
+			send_segment(s, hole);
+		} else {
+			send_segment(s, _snd_nxt++);
+		}
+	}
+}
+
+void tcp_flow::on_loss(sim &s)
+{
+	if (_cubic) {
+		// fast convergence: give up some more to a newcomer
+		_w_max = _cwnd < _w_max ? _cwnd * (1 + CUBIC_BETA) / 2 : _cwnd;
+		_ssthresh = std::max(_cwnd * CUBIC_BETA, 2.0);
+		_epoch_start = 0;
+	} else {
+		_ssthresh = std::max(_cwnd / 2, 2.0);
+	}
+}
+
+void tcp_flow::grow(sim &s)
+{
+	if (_cwnd < _ssthresh) {
+		_cwnd += 1;
+		return;
+	}
+	if (!_cubic) {
+		_cwnd += 1 / _cwnd;
+		return;
+	}
+	if (_epoch_start == 0) {
+		_epoch_start = s.now();
+		if (_w_max < _cwnd) _w_max = _cwnd;
+		_k = cbrt(_w_max * (1 - CUBIC_BETA) / CUBIC_C);
+	}
+	const double t = (s.now() - _epoch_start) / 1000000.0;
+	const double rtt = std::max(_srtt, (uint64_t)1000) / 1000000.0;
+	double target = CUBIC_C * pow(t + rtt - _k, 3) + _w_max;
+	// the TCP-friendly region, as fast as Reno at least
+	const double reno = _w_max * CUBIC_BETA + 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * t / rtt;
+	target = std::max(target, reno);
+	_cwnd += target > _cwnd ? (target - _cwnd) / _cwnd : 0.01 / _cwnd;
+}
+
+void tcp_flow::on_ack(sim &s, uint32_t ack, uint32_t sack, uint64_t ts)
+{
+	if ((int32_t)(sack - ack) > 0 && (int32_t)(sack - _snd_nxt) < 0) {
+		_sacked.insert(sack);
+		_resent.erase(sack);
+	}
+
+	if ((int32_t)(ack - _snd_una) > 0) {
+		const uint32_t acked = ack - _snd_una;
+		_snd_una = ack;
+		// after a timeout, packets sent before it are still arriving
+		if ((int32_t)(_snd_nxt - ack) < 0) _snd_nxt = ack;
+		_dupacks = 0;
+		_sacked.erase(_sacked.begin(), _sacked.lower_bound(ack));
+		_resent.erase(_resent.begin(), _resent.lower_bound(ack));
+
+		const uint64_t rtt = s.now() - ts;
+		if (_srtt == 0) {
+			_srtt = rtt;
+			_rttvar = rtt / 2;
+		} else {
+			_rttvar = (3 * _rttvar + (_srtt > rtt ? _srtt - rtt : rtt - _srtt)) / 4;
+			_srtt = (7 * _srtt + rtt) / 8;
+		}
+		// at least 200 ms over the rtt, like Linux, or the first resend
+		// times out waiting behind a full queue
+		_rto = _srtt + std::max(4 * _rttvar, (uint64_t)200000);
+		_rto_deadline = s.now() + _rto;
+
+		if (_in_recovery) {
+			if ((int32_t)(ack - _recover) >= 0) _in_recovery = false;
+		} else {
+			for (uint32_t i = 0; i < acked; ++i) grow(s);
+		}
+	} else if (ack == _snd_una && _snd_nxt != _snd_una && !_in_recovery && ++_dupacks == 3) {
+		on_loss(s);
+		_cwnd = _ssthresh;
+		_in_recovery = true;
+		_recover = _snd_nxt;
+		_resent.clear();
+	}
+	send_more(s);
+}
+
+void tcp_flow::on_data(sim &s, uint32_t seq, uint64_t ts)
+{
+	if (seq == _rcv_nxt) {
+		++_rcv_nxt;
+		_received += PAYLOAD_SIZE;
+		std::set<uint32_t>::iterator i;
+		while ((i = _out_of_order.find(_rcv_nxt)) != _out_of_order.end()) {
+			_out_of_order.erase(i);
+			++_rcv_nxt;
+			_received += PAYLOAD_SIZE;
+		}
+	} else if ((int32_t)(seq - _rcv_nxt) > 0) {
+		_out_of_order.insert(seq);
+	}
+
+	unsigned char buf[ACK_SIZE];
+	tcp_segment seg = { 0, _rcv_nxt, seq, ts };
+	memcpy(buf, &seg, sizeof(seg));
+	s.send(_receiver, buf, sizeof(buf), _sender);
+}
+
+static void tcp_flow_sender_packet(void *userdata, const unsigned char *p, size_t len, sim_endpoint *from)
+{
+	tcp_flow *f = (tcp_flow*)userdata;
+	tcp_segment seg;
+	memcpy(&seg, p, sizeof(seg));
+	f->on_ack(*f->_sender->_link->_sim, seg.ack, seg.sack, seg.ts);
+}
+
+static void tcp_flow_receiver_packet(void *userdata, const unsigned char *p, size_t len, sim_endpoint *from)
+{
+	tcp_flow *f = (tcp_flow*)userdata;
+	tcp_segment seg;
+	memcpy(&seg, p, sizeof(seg));
+	f->on_data(*f->_sender->_link->_sim, seg.seq, seg.ts);
+}
+
+void tcp_flow::start(sim &s)
+{
+	send_more(s);
+}
+
+void tcp_flow::tick(sim &s)
+{
+	if (_stopped || _snd_nxt == _snd_una || s.now() < _rto_deadline) return;
+	// go back to the first packet not acked, and start over
+	on_loss(s);
+	_cwnd = 1;
+	_snd_nxt = _snd_una;
+	_in_recovery = false;
+	_dupacks = 0;
+	_sacked.clear();
+	_resent.clear();
+	_rto = std::min(_rto * 2, (uint64_t)60000000);
+	_rto_deadline = s.now() + _rto;
+	send_more(s);
+}
+
+// the bytes waiting at the bottleneck
+static uint64_t queued_bytes(const sim_link *link)
+{
+	const uint64_t now = link->_sim->now() * 1000;
+	return link->_busy_until > now ? (link->_busy_until - now) * BANDWIDTH / 1000000000 : 0;
+}
+
+static double jain_index(const std::vector<double> &x)
+{
+	double sum = 0, squares = 0;
+	for (size_t i = 0; i < x.size(); ++i) {
+		sum += x[i];
+		squares += x[i] * x[i];
+	}
+	return squares == 0 ? 0 : sum * sum / (x.size() * squares);
+}
+
+// run the flows for seconds, and report on the second half
+static void run_scenario(const char *name, std::vector<flow*> &flows, int seconds)
+{
+	sim s(1);
+	sim_link_config config;
+	config.bandwidth = BANDWIDTH;
+	config.buffer = BUFFER;
+	config.delay = UP_DELAY;
+	sim_link *bottleneck = s.add_link(config);
+
+	for (size_t i = 0; i < flows.size(); ++i) {
+		tcp_flow *tcp = dynamic_cast<tcp_flow*>(flows[i]);
+		if (tcp != NULL)
+			add_endpoints(s, bottleneck, tcp, (int)i, &tcp_flow_sender_packet, &tcp_flow_receiver_packet, NULL);
+		else
+			add_endpoints(s, bottleneck, flows[i], (int)i, NULL, NULL, &utp_flow_incoming);
+	}
+
+	const uint64_t begin = s.now();
+	const int measure = seconds / 2;
+	uint64_t queued = 0;
+	for (int ms = 0; ms < seconds * 1000; ++ms) {
+		if (ms == measure * 1000) {
+			for (size_t i = 0; i < flows.size(); ++i) flows[i]->_measured = flows[i]->_received;
+			bottleneck->_stats = sim_link_stats();
+			queued = queued_bytes(bottleneck);
+		}
+		for (size_t i = 0; i < flows.size(); ++i) {
+			flow *f = flows[i];
+			if (!f->_started && ms >= f->_start * 1000) {
+				f->_started = true;
+				f->start(s);
+			}
+			if (f->_started) f->tick(s);
+		}
+		s.run(begin + (ms + 1) * 1000ull - s.now());
+	}
+
+	const double window = seconds - measure;
+	std::vector<double> goodput;
+	double total = 0;
+	for (size_t i = 0; i < flows.size(); ++i) {
+		goodput.push_back((flows[i]->_received - flows[i]->_measured) / window);
+		total += goodput.back();
+	}
+
+	printf("%s: measured from %d to %d s\n", name, measure, seconds);
+	for (size_t i = 0; i < flows.size(); ++i) {
+		printf("  %-8s rtt: %3u ms start: %3d s share: %5.1f%% %8.1f kB/s\n",
+			   flows[i]->_name, flows[i]->_rtt / 1000, flows[i]->_start,
+			   total > 0 ? goodput[i] * 100 / total : 0, goodput[i] / 1024);
+	}
+	const sim_link_stats &stats = bottleneck->_stats;
+	printf("  jain: %.3f queue delay p50: %u ms p95: %u ms p99: %u ms utilisation: %.1f%%\n\n",
+		   jain_index(goodput), stats.queue_delay_percentile(50) / 1000,
+		   stats.queue_delay_percentile(95) / 1000, stats.queue_delay_percentile(99) / 1000,
+		   (stats.delivered_bytes + queued - queued_bytes(bottleneck)) * 100.0 / (BANDWIDTH * window));
+
+	for (size_t i = 0; i < flows.size(); ++i) {
+		flows[i]->stop(s);
+		delete flows[i];
+	}
+	flows.clear();
+}
+
+int main(int argc, char const* argv[])
+{
+	int n = 4;
+	const char *filter = NULL;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) n = atoi(argv[++i]);
+		else if (argv[i][0] == '-') {
+			fprintf(stderr, "usage: %s [-n flows] [shared|reno|cubic|latecomer|rtt]\n", argv[0]);
+			return 1;
+		}
+		else filter = argv[i];
+	}
+
+	static char names[64][16];
+	std::vector<flow*> flows;
+	if (filter == NULL || strcmp(filter, "shared") == 0) {
+		for (int i = 0; i < n && i < 64; ++i) {
+			snprintf(names[i], sizeof(names[i]), "utp%d", i + 1);
+			flows.push_back(new utp_flow(names[i], 50000, 0));
+		}
+		run_scenario("shared", flows, 120);
+	}
+	if (filter == NULL || strcmp(filter, "reno") == 0) {
+		flows.push_back(new utp_flow("utp", 50000, 0));
+		flows.push_back(new tcp_flow("reno", 50000, 10, false));
+		run_scenario("reno", flows, 120);
+	}
+	if (filter == NULL || strcmp(filter, "cubic") == 0) {
+		flows.push_back(new utp_flow("utp", 50000, 0));
+		flows.push_back(new tcp_flow("cubic", 50000, 10, true));
+		run_scenario("cubic", flows, 120);
+	}
+	if (filter == NULL || strcmp(filter, "latecomer") == 0) {
+		flows.push_back(new utp_flow("first", 50000, 0));
+		flows.push_back(new utp_flow("late", 50000, 30));
+		run_scenario("latecomer", flows, 120);
+	}
+	if (filter == NULL || strcmp(filter, "rtt") == 0) {
+		flows.push_back(new utp_flow("short", 20000, 0));
+		flows.push_back(new utp_flow("long", 200000, 0));
+		run_scenario("rtt", flows, 120);
+	}
+	return 0;
+}
@@ -0,0 +1,445 @@
+// Round trips of small messages, the way RPC traffic uses a connection.
+// Each of n connections sends a message of a given size, and the other
+// end echoes it back once it has all of it, and so on, one message in
+// flight per connection. Reports the round trip times over:
+//
+//   mem  uTP over an in-memory transport, on the real clock, so the
+//        time is the library's, and its timers', the delayed ack one
+//        among them
+//   udp  uTP over loopback UDP, with the driver in utp_epoll.h
+//   raw  the same messages as plain UDP datagrams over loopback, the
+//        least a round trip on this host can take
+//
+// Both ends are in this process, on one thread. Each size and number of
+// connections runs for the given number of round trips, or 5 seconds,
+// whichever is sooner.
+//
+// usage: bench_rtt [-t transports] [-s sizes] [-c connections] [-n round trips]
+// the lists are comma separated. By default all transports, sizes of
+// 64, 200, 1400 and 8192 bytes, 1, 10 and 100 connections, and 10000
+// round trips
+
+#include "utp.h"
+#include "utp_utils.h"
+#include "utp_epoll.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// how long one size and number of connections is measured for at most
+#define MEASURE_NS 5000000000ull
+// how long to wait for the last round trips, the handshakes and the
+// closes, before giving up on them
+#define WAIT_NS 10000000000ull
+// the largest datagram over IPv4
+#define RAW_MAX_SIZE 65507
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// one end of a connection
+struct end {
+	UTPSocket *sock;
+	bool client;
+	bool connected;
+	bool destroyed;
+	// bytes written by the application that didn't fit in the window yet
+	size_t pending;
+	// bytes of the message being received
+	size_t received;
+	// when the client sent its message
+	uint64_t sent;
+};
+
+static size_t g_size;
+static size_t g_target;
+static uint64_t g_deadline;
+static size_t g_started;
+static std::vector<uint64_t> g_rtts;
+static std::vector<end*> g_ends;
+static size_t g_destroyed;
+static int g_errors;
+
+static void end_write(end *e, size_t bytes)
+{
+	e->pending += bytes;
+	UTP_Write(e->sock, e->pending);
+}
+
+// the client sends the next message, if there's time for another
+static void send_request(end *e)
+{
+	if (g_started >= g_target || now_ns() >= g_deadline) return;
+	++g_started;
+	e->sent = now_ns();
+	end_write(e, g_size);
+}
+
+static void on_read(void *userdata, const unsigned char *bytes, size_t count)
+{
+	end *e = (end*)userdata;
+	e->received += count;
+	while (e->received >= g_size) {
+		e->received -= g_size;
+		if (e->client) {
+			g_rtts.push_back(now_ns() - e->sent);
+			send_request(e);
+		} else {
+			end_write(e, g_size);
+		}
+	}
+}
+
+static void on_write(void *userdata, unsigned char *bytes, size_t count)
+{
+	memset(bytes, 0, count);
+	((end*)userdata)->pending -= count;
+}
+
+static size_t get_rb_size(void *userdata) { return 0; }
+
+static void on_state(void *userdata, int state)
+{
+	end *e = (end*)userdata;
+	switch (state) {
+	case UTP_STATE_CONNECT:
+		e->connected = true;
+		// fall through
+	case UTP_STATE_WRITABLE:
+		if (e->pending > 0) UTP_Write(e->sock, e->pending);
+		break;
+	case UTP_STATE_EOF:
+		if (!e->client) UTP_Close(e->sock);
+		break;
+	case UTP_STATE_DESTROYING:
+		e->destroyed = true;
+		++g_destroyed;
+		break;
+	}
+}
+
+static void on_error(void *userdata, int errcode) { fprintf(stderr, "error: %s\n", strerror(errcode)); ++g_errors; }
+static void on_overhead(void *userdata, bool send, size_t count, int type) {}
+
+static UTPFunctionTable g_callbacks = { &on_read, &on_write, &get_rb_size, &on_state, &on_error, &on_overhead };
+
+static end *new_end(UTPSocket *s, bool client)
+{
+	end *e = new end();
+	e->sock = s;
+	e->client = client;
+	g_ends.push_back(e);
+	UTP_SetCallbacks(s, &g_callbacks, e);
+	return e;
+}
+
+static void on_incoming(void *userdata, UTPSocket *s)
+{
+	new_end(s, false);
+}
+
+// the in-memory transport. The clients share one address, and the
+// connection ids tell them apart, as they would on one UDP socket
+struct packet {
+	bool to_server;
+	std::vector<unsigned char> data;
+};
+
+static std::vector<packet> g_queue;
+static sockaddr_in g_mem_client;
+static sockaddr_in g_mem_server;
+
+static void mem_send_to(void *userdata, const unsigned char *p, size_t len, const struct sockaddr *to, socklen_t tolen)
+{
+	// the userdata is the address of the sending end
+	packet pkt;
+	pkt.to_server = userdata == &g_mem_client;
+	pkt.data.assign(p, p + len);
+	g_queue.push_back(pkt);
+}
+
+static UTPSocket *mem_create_socket()
+{
+	return UTP_Create(&mem_send_to, &g_mem_client, (const struct sockaddr*)&g_mem_server, sizeof(g_mem_server));
+}
+
+// deliver everything that's been sent, including what's sent in
+// response, and then see to the timers, waiting for the next one if
+// there's nothing else to do
+static void mem_step()
+{
+	std::vector<packet> q;
+	while (!g_queue.empty()) {
+		q.swap(g_queue);
+		for (size_t i = 0; i < q.size(); ++i) {
+			if (q[i].to_server)
+				UTP_IsIncomingUTP(&on_incoming, &mem_send_to, &g_mem_server, &q[i].data[0], q[i].data.size(),
+								  (const struct sockaddr*)&g_mem_client, sizeof(g_mem_client));
+			else
+				UTP_IsIncomingUTP(NULL, &mem_send_to, &g_mem_client, &q[i].data[0], q[i].data.size(),
+								  (const struct sockaddr*)&g_mem_server, sizeof(g_mem_server));
+		}
+		q.clear();
+	}
+	const int timeout = UTP_NextTimeout();
+	if (timeout > 0) usleep(std::min(timeout, 10) * 1000);
+	UTP_CheckTimeouts();
+}
+
+// uTP over loopback
+static UTPEpoll *g_ep;
+static int g_ep_client_fd;
+static sockaddr_in g_ep_server;
+
+static UTPSocket *udp_create_socket()
+{
+	return UTPEpoll_CreateSocket(g_ep, g_ep_client_fd, (const struct sockaddr*)&g_ep_server, sizeof(g_ep_server));
+}
+
+static void udp_step()
+{
+	if (UTPEpoll_Poll(g_ep, 10) < 0) {
+		perror("epoll");
+		exit(1);
+	}
+}
+
+// step until done() or WAIT_NS have passed, returns done()
+static bool run_until(void (*step)(), bool (*done)())
+{
+	const uint64_t give_up = now_ns() + WAIT_NS;
+	while (!done() && now_ns() < give_up) step();
+	return done();
+}
+
+static bool connected()
+{
+	// the server's ends are connected when they get the first message
+	for (size_t i = 0; i < g_ends.size(); ++i)
+		if (g_ends[i]->client && !g_ends[i]->connected) return false;
+	return true;
+}
+
+static bool answered() { return g_rtts.size() == g_started; }
+static bool destroyed() { return g_destroyed == g_ends.size(); }
+
+static void run_utp(UTPSocket *(*create_socket)(), void (*step)(), size_t connections)
+{
+	g_destroyed = 0;
+	std::vector<end*> clients;
+	for (size_t i = 0; i < connections; ++i) {
+		end *e = new_end(create_socket(), true);
+		clients.push_back(e);
+		UTP_Connect(e->sock);
+	}
+	if (!run_until(step, &connected)) {
+		fprintf(stderr, "connecting timed out\n");
+		++g_errors;
+	}
+
+	g_deadline = now_ns() + MEASURE_NS;
+	for (size_t i = 0; i < clients.size(); ++i) send_request(clients[i]);
+	if (!run_until(step, &answered)) {
+		fprintf(stderr, "%zu round trips timed out\n", g_started - g_rtts.size());
+		++g_errors;
+	}
+
+	for (size_t i = 0; i < clients.size(); ++i) UTP_Close(clients[i]->sock);
+	if (!run_until(step, &destroyed)) {
+		fprintf(stderr, "closing timed out\n");
+		++g_errors;
+	} else {
+		for (size_t i = 0; i < g_ends.size(); ++i) delete g_ends[i];
+		g_ends.clear();
+	}
+}
+
+// plain UDP over loopback. The messages carry the number of their
+// connection in the first 4 bytes
+static int raw_bind(sockaddr_in *addr)
+{
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0 || bind(fd, (const sockaddr*)addr, sizeof(*addr)) < 0) {
+		perror("bind");
+		exit(1);
+	}
+	socklen_t len = sizeof(*addr);
+	getsockname(fd, (sockaddr*)addr, &len);
+	int size = 2 * 1024 * 1024;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+	return fd;
+}
+
+static void run_raw(size_t connections)
+{
+	sockaddr_in client, server;
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_addr.s_addr = inet_addr("127.0.0.1");
+	client = server;
+	const int fds[2] = { raw_bind(&client), raw_bind(&server) };
+
+	std::vector<unsigned char> buf(std::max(g_size, (size_t)RAW_MAX_SIZE));
+	std::vector<uint64_t> sent(connections);
+	g_deadline = now_ns() + MEASURE_NS;
+	for (uint32_t i = 0; i < connections && g_started < g_target; ++i) {
+		memcpy(&buf[0], &i, sizeof(i));
+		sent[i] = now_ns();
+		sendto(fds[0], &buf[0], g_size, 0, (const sockaddr*)&server, sizeof(server));
+		++g_started;
+	}
+	while (g_rtts.size() < g_started) {
+		pollfd p[2] = { { fds[0], POLLIN, 0 }, { fds[1], POLLIN, 0 } };
+		// the datagrams that don't make it are lost for good
+		if (poll(p, 2, WAIT_NS / 1000000) <= 0) {
+			fprintf(stderr, "%zu round trips lost\n", g_started - g_rtts.size());
+			++g_errors;
+			break;
+		}
+		for (;;) {
+			sockaddr_in from;
+			socklen_t fromlen = sizeof(from);
+			const ssize_t len = recvfrom(fds[1], &buf[0], buf.size(), 0, (sockaddr*)&from, &fromlen);
+			if (len < 0) break;
+			sendto(fds[1], &buf[0], len, 0, (const sockaddr*)&from, fromlen);
+		}
+		for (;;) {
+			const ssize_t len = recv(fds[0], &buf[0], buf.size(), 0);
+			if (len < (ssize_t)sizeof(uint32_t)) break;
+			uint32_t i;
+			memcpy(&i, &buf[0], sizeof(i));
+			g_rtts.push_back(now_ns() - sent[i]);
+			if (g_started < g_target && now_ns() < g_deadline) {
+				sent[i] = now_ns();
+				sendto(fds[0], &buf[0], g_size, 0, (const sockaddr*)&server, sizeof(server));
+				++g_started;
+			}
+		}
+	}
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static double percentile(const std::vector<uint64_t> &sorted, double p)
+{
+	if (sorted.empty()) return 0;
+	return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))] / 1000.0;
+}
+
+static std::vector<std::string> split(const char *list)
+{
+	std::vector<std::string> items;
+	std::string s(list);
+	size_t start = 0;
+	for (;;) {
+		const size_t comma = s.find(',', start);
+		items.push_back(s.substr(start, comma - start));
+		if (comma == std::string::npos) return items;
+		start = comma + 1;
+	}
+}
+
+static std::vector<size_t> split_numbers(const char *list)
+{
+	const std::vector<std::string> items = split(list);
+	std::vector<size_t> numbers;
+	for (size_t i = 0; i < items.size(); ++i) numbers.push_back(strtoul(items[i].c_str(), NULL, 10));
+	return numbers;
+}
+
+int main(int argc, char *argv[])
+{
+	std::vector<std::string> transports = split("mem,udp,raw");
+	std::vector<size_t> sizes = split_numbers("64,200,1400,8192");
+	std::vector<size_t> counts = split_numbers("1,10,100");
+	size_t round_trips = 10000;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "t:s:c:n:")) != -1) {
+		switch (opt) {
+		case 't': transports = split(optarg); break;
+		case 's': sizes = split_numbers(optarg); break;
+		case 'c': counts = split_numbers(optarg); break;
+		case 'n': round_trips = strtoul(optarg, NULL, 10); break;
+		default:
+			fprintf(stderr, "usage: %s [-t mem,udp,raw] [-s sizes] [-c connections] [-n round trips]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	memset(&g_mem_client, 0, sizeof(g_mem_client));
+	g_mem_client.sin_family = AF_INET;
+	g_mem_client.sin_addr.s_addr = inet_addr("10.0.0.1");
+	g_mem_client.sin_port = htons(1024);
+	g_mem_server = g_mem_client;
+	g_mem_server.sin_addr.s_addr = inet_addr("10.0.0.2");
+
+	printf("transport     size connections round trips   p50 us   p99 us p99.9 us   max us errors\n");
+	fflush(stdout);
+	for (size_t t = 0; t < transports.size(); ++t) {
+		const std::string &transport = transports[t];
+		if (transport == "udp" && g_ep == NULL) {
+			g_ep = UTPEpoll_Create();
+			if (g_ep == NULL) {
+				perror("UTPEpoll_Create");
+				return 1;
+			}
+			memset(&g_ep_server, 0, sizeof(g_ep_server));
+			g_ep_server.sin_family = AF_INET;
+			g_ep_server.sin_addr.s_addr = inet_addr("127.0.0.1");
+			// any free ports
+			sockaddr_in client = g_ep_server;
+			const int server_fd = UTPEpoll_Bind(g_ep, (const sockaddr*)&g_ep_server, sizeof(g_ep_server), &on_incoming, NULL);
+			g_ep_client_fd = UTPEpoll_Bind(g_ep, (const sockaddr*)&client, sizeof(client), NULL, NULL);
+			if (server_fd < 0 || g_ep_client_fd < 0) {
+				perror("bind");
+				return 1;
+			}
+			socklen_t len = sizeof(g_ep_server);
+			getsockname(server_fd, (sockaddr*)&g_ep_server, &len);
+		}
+		for (size_t s = 0; s < sizes.size(); ++s) {
+			for (size_t c = 0; c < counts.size(); ++c) {
+				g_size = sizes[s];
+				g_target = round_trips;
+				g_started = 0;
+				g_rtts.clear();
+				g_errors = 0;
+				if (transport == "mem") {
+					run_utp(&mem_create_socket, &mem_step, counts[c]);
+				} else if (transport == "udp") {
+					run_utp(&udp_create_socket, &udp_step, counts[c]);
+				} else if (transport == "raw") {
+					if (g_size < sizeof(uint32_t) || g_size > RAW_MAX_SIZE) continue;
+					run_raw(counts[c]);
+				} else {
+					fprintf(stderr, "unknown transport: %s\n", transport.c_str());
+					return 1;
+				}
+				std::sort(g_rtts.begin(), g_rtts.end());
+				printf("%-9s %8zu %11zu %11zu %8.1f %8.1f %8.1f %8.1f %6d\n",
+					   transport.c_str(), g_size, counts[c], g_rtts.size(),
+					   percentile(g_rtts, 0.5), percentile(g_rtts, 0.99), percentile(g_rtts, 0.999),
+					   g_rtts.empty() ? 0 : g_rtts.back() / 1000.0, g_errors);
+				fflush(stdout);
+			}
+		}
+	}
+	if (g_ep != NULL && g_ends.empty()) UTPEpoll_Destroy(g_ep);
+	return 0;
+}
@@ -0,0 +1,347 @@
+// What many mostly idle connections cost. n connections are set up
+// between clients with addresses of their own and one server, all in
+// this process, over an in-memory transport and on a virtual clock (see
+// UTP_SetSystemFunctions()), then taken through these phases:
+//
+//   connect  the handshakes
+//   idle     two minutes without data, only keepalives
+//   trickle  a minute of 1% of the connections sending 200 bytes every
+//            100 ms
+//   burst    every connection sending 16 kB at once
+//
+// For each phase it reports the resident and heap memory per connection,
+// counting both ends, the allocations per connection during the phase,
+// the CPU time of a UTP_CheckTimeouts() tick and per socket, and the
+// packets per connection per minute (the handshakes just per
+// connection) and the CPU time per packet, much of which is finding its
+// socket. Each connection count runs in a process of its own, so one
+// doesn't inherit the memory of another.
+//
+// usage: bench_scale [connections...]   (1000 and 10000 by default)
+
+#include "utp.h"
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <vector>
+
+// Counts the allocations, glibc's functions do the work
+#ifdef __GLIBC__
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void __libc_free(void *p);
+}
+
+static size_t g_allocs;
+
+extern "C" void *malloc(size_t size) { ++g_allocs; return __libc_malloc(size); }
+extern "C" void *calloc(size_t n, size_t size) { ++g_allocs; return __libc_calloc(n, size); }
+extern "C" void *realloc(void *p, size_t size) { ++g_allocs; return __libc_realloc(p, size); }
+extern "C" void free(void *p) { __libc_free(p); }
+#else
+static size_t g_allocs;
+#endif
+
+static size_t heap_bytes()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	struct mallinfo2 mi = mallinfo2();
+	return mi.uordblks + mi.hblkhd;
+#else
+	return 0;
+#endif
+}
+
+static size_t rss_bytes()
+{
+	unsigned long size = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f != NULL) {
+		if (fscanf(f, "%lu %lu", &size, &resident) != 2) resident = 0;
+		fclose(f);
+	}
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+static uint64_t cpu_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// the virtual clock, in microseconds
+static uint64_t g_now = 1000000;
+
+static uint64_t get_microseconds(void *userdata) { return g_now; }
+
+static UTPSystemFunctions g_system = { &get_microseconds, NULL };
+
+// Each client reaches the server at an address of its own too. Clients
+// on hosts of their own would share the server's address, but in one
+// process they'd share its 65536 connection ids
+struct client {
+	sockaddr_in addr;
+	sockaddr_in server_addr;
+	UTPSocket *sock;
+	// bytes written by the application that didn't fit in the window yet
+	size_t pending;
+};
+
+// a packet waiting in the arena
+struct queued {
+	uint32_t offset;
+	uint16_t len;
+	bool to_server;
+	uint32_t client;
+};
+
+// the server's send_to userdata
+static char g_server;
+static std::vector<client> g_clients;
+// the packets sent, and the ones being delivered. They keep their
+// memory, so they stop allocating once they're big enough
+static std::vector<unsigned char> g_arena;
+static std::vector<queued> g_queue;
+static std::vector<unsigned char> g_delivering_arena;
+static std::vector<queued> g_delivering;
+static uint64_t g_received;
+static int g_errors;
+
+// the client at an address, see run()
+static uint32_t client_index(const sockaddr_in *addr)
+{
+	return (ntohl(addr->sin_addr.s_addr) - 0x0a000000) * 60000 + ntohs(addr->sin_port) - 1024;
+}
+
+static void bench_send_to(void *userdata, const unsigned char *p, size_t len, const struct sockaddr *to, socklen_t tolen)
+{
+	// the userdata is the sending end, the server or a client
+	queued q;
+	q.offset = (uint32_t)g_arena.size();
+	q.len = (uint16_t)len;
+	q.to_server = userdata != &g_server;
+	q.client = q.to_server ? (uint32_t)((client*)userdata - &g_clients[0]) : client_index((const sockaddr_in*)to);
+	g_arena.insert(g_arena.end(), p, p + len);
+	g_queue.push_back(q);
+}
+
+static void on_read(void *userdata, const unsigned char *bytes, size_t count) { g_received += count; }
+// the clients send, the server's sockets have no userdata
+static void on_write(void *userdata, unsigned char *bytes, size_t count)
+{
+	memset(bytes, 0, count);
+	if (userdata != NULL) ((client*)userdata)->pending -= count;
+}
+
+static size_t get_rb_size(void *userdata) { return 0; }
+
+static void on_state(void *userdata, int state)
+{
+	client *c = (client*)userdata;
+	if (c != NULL && state == UTP_STATE_WRITABLE && c->pending > 0)
+		UTP_Write(c->sock, c->pending);
+}
+
+static void client_write(client &c, size_t bytes)
+{
+	c.pending += bytes;
+	UTP_Write(c.sock, c.pending);
+}
+static void on_error(void *userdata, int errcode) { ++g_errors; }
+static void on_overhead(void *userdata, bool send, size_t count, int type) {}
+
+static UTPFunctionTable g_callbacks = { &on_read, &on_write, &get_rb_size, &on_state, &on_error, &on_overhead };
+
+static void on_incoming(void *userdata, UTPSocket *s)
+{
+	UTP_SetCallbacks(s, &g_callbacks, NULL);
+}
+
+// what a phase took
+struct phase {
+	const char *name;
+	uint64_t start_us;
+	size_t allocs;
+	uint64_t ticks;
+	uint64_t tick_ns;
+	uint64_t packets;
+	uint64_t packet_ns;
+};
+
+static phase g_phase;
+
+// deliver everything that's been sent, including what's sent in response
+static void deliver()
+{
+	std::vector<unsigned char> &arena = g_delivering_arena;
+	std::vector<queued> &q = g_delivering;
+	while (!g_queue.empty()) {
+		arena.swap(g_arena);
+		q.swap(g_queue);
+		const uint64_t start = cpu_ns();
+		for (size_t i = 0; i < q.size(); ++i) {
+			client &c = g_clients[q[i].client];
+			if (q[i].to_server)
+				UTP_IsIncomingUTP(&on_incoming, &bench_send_to, &g_server, &arena[q[i].offset], q[i].len,
+								  (const struct sockaddr*)&c.addr, sizeof(c.addr));
+			else
+				UTP_IsIncomingUTP(NULL, &bench_send_to, &c, &arena[q[i].offset], q[i].len,
+								  (const struct sockaddr*)&c.server_addr, sizeof(c.server_addr));
+		}
+		g_phase.packet_ns += cpu_ns() - start;
+		g_phase.packets += q.size();
+		arena.clear();
+		q.clear();
+	}
+}
+
+static void tick()
+{
+	const uint64_t start = cpu_ns();
+	UTP_CheckTimeouts();
+	g_phase.tick_ns += cpu_ns() - start;
+	++g_phase.ticks;
+	deliver();
+}
+
+// move the clock on to the next timer, or until, whichever is sooner
+static void advance(uint64_t until)
+{
+	g_now = std::min(g_now + (uint64_t)std::max(UTP_NextTimeout(), 1) * 1000, until);
+}
+
+static void begin_phase(const char *name)
+{
+	memset(&g_phase, 0, sizeof(g_phase));
+	g_phase.name = name;
+	g_phase.start_us = g_now;
+	g_phase.allocs = g_allocs;
+}
+
+static void end_phase(size_t connections, size_t base_rss, size_t base_heap)
+{
+	const phase &p = g_phase;
+	// the handshakes take no time on the virtual clock, so they're
+	// counted per connection rather than per minute
+	const double minutes = g_now > p.start_us ? (g_now - p.start_us) / 60e6 : 1;
+	printf("%11zu %-8s %9.0f %9.0f %11.2f %10.1f %10.1f %13.2f %10.0f %6d\n",
+		   connections, p.name,
+		   (double)(rss_bytes() - base_rss) / connections,
+		   (double)(heap_bytes() - base_heap) / connections,
+		   (double)(g_allocs - p.allocs) / connections,
+		   p.ticks ? p.tick_ns / 1000.0 / p.ticks : 0,
+		   p.ticks ? (double)p.tick_ns / p.ticks / (2 * connections) : 0,
+		   p.packets / minutes / connections,
+		   p.packets ? (double)p.packet_ns / p.packets : 0,
+		   g_errors);
+	fflush(stdout);
+}
+
+static void run(size_t connections)
+{
+	UTP_SetSystemFunctions(&g_system, NULL);
+
+	// sized up front, to count the library's allocations rather than
+	// these. The transport's buffers grow a few times during the burst
+	g_clients.resize(connections);
+	g_queue.reserve(connections * 2);
+	g_arena.reserve(connections * 64);
+	g_delivering.reserve(connections * 2);
+	g_delivering_arena.reserve(connections * 64);
+
+	const size_t base_rss = rss_bytes();
+	const size_t base_heap = heap_bytes();
+
+	begin_phase("connect");
+	for (size_t i = 0; i < connections; ++i) {
+		client &c = g_clients[i];
+		memset(&c.addr, 0, sizeof(c.addr));
+		c.addr.sin_family = AF_INET;
+		c.addr.sin_addr.s_addr = htonl(0x0a000000 + (uint32_t)(i / 60000));
+		c.addr.sin_port = htons(1024 + i % 60000);
+		c.server_addr = c.addr;
+		c.server_addr.sin_addr.s_addr = htonl(0x0b000000 + (uint32_t)(i / 60000));
+		c.sock = UTP_Create(&bench_send_to, &c, (const struct sockaddr*)&c.server_addr, sizeof(c.server_addr));
+		UTP_SetCallbacks(c.sock, &g_callbacks, &c);
+		UTP_Connect(c.sock);
+	}
+	deliver();
+	tick();
+	end_phase(connections, base_rss, base_heap);
+
+	begin_phase("idle");
+	const uint64_t idle_end = g_now + 120000000;
+	while (g_now < idle_end) {
+		advance(idle_end);
+		tick();
+	}
+	end_phase(connections, base_rss, base_heap);
+
+	begin_phase("trickle");
+	const uint64_t trickle_end = g_now + 60000000;
+	uint64_t next_write = g_now;
+	size_t writer = 0;
+	while (g_now < trickle_end) {
+		if (g_now >= next_write) {
+			for (size_t i = 0; i < connections / 100; ++i) {
+				client_write(g_clients[writer], 200);
+				writer = (writer + 7919) % connections;
+			}
+			deliver();
+			next_write += 100000;
+		}
+		advance(std::min(next_write, trickle_end));
+		tick();
+	}
+	end_phase(connections, base_rss, base_heap);
+
+	begin_phase("burst");
+	const uint64_t target = g_received + connections * 16384ull;
+	for (size_t i = 0; i < connections; ++i)
+		client_write(g_clients[i], 16384);
+	deliver();
+	const uint64_t burst_end = g_now + 60000000;
+	while (g_received < target && g_now < burst_end) {
+		advance(burst_end);
+		tick();
+	}
+	// a burst that doesn't get through in a minute is an error too
+	if (g_received < target) ++g_errors;
+	end_phase(connections, base_rss, base_heap);
+}
+
+int main(int argc, char const* argv[])
+{
+	std::vector<size_t> counts;
+	for (int i = 1; i < argc; ++i) counts.push_back(strtoul(argv[i], NULL, 10));
+	if (counts.empty()) {
+		counts.push_back(1000);
+		counts.push_back(10000);
+	}
+
+	printf("connections phase    rss/conn heap/conn allocs/conn    tick us tick ns/sock packets/conn/min ns/packet errors\n");
+	fflush(stdout);
+	for (size_t i = 0; i < counts.size(); ++i) {
+		const pid_t pid = fork();
+		if (pid == 0) {
+			run(counts[i]);
+			_exit(g_errors != 0);
+		}
+		int status = 0;
+		waitpid(pid, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "%zu connections failed\n", counts[i]);
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,270 @@
+#include "sim.h"
+
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+// the virtual time, in microseconds, and the state of the library's
+// random numbers. The clock outlives a simulation, like the library's
+// state does
+static uint64_t g_sim_now;
+static uint64_t g_sim_utp_random;
+
+// splitmix64
+static uint64_t sim_random(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+// uniform in [0, 1)
+static double sim_uniform(uint64_t *state)
+{
+	return (sim_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t sim_get_microseconds(void *userdata) { return g_sim_now; }
+static uint32_t sim_utp_random(void *userdata) { return (uint32_t)sim_random(&g_sim_utp_random); }
+
+static UTPSystemFunctions sim_system_funcs = { &sim_get_microseconds, &sim_utp_random };
+
+sim_link_config::sim_link_config() :
+	bandwidth(0), buffer(0), delay(0), jitter(0), loss(0), burst_loss(0), burst_length(1),
+	reorder(0), reorder_delay(0), drop_first(0), drop_every(0), reorder_every(0),
+	drop_proc(NULL), drop_userdata(NULL)
+{
+}
+
+sim_link_stats::sim_link_stats() :
+	packets(0), bytes(0), delivered_bytes(0), lost(0), dropped(0)
+{
+}
+
+uint32_t sim_link_stats::queue_delay_percentile(int p) const
+{
+	if (queue_delay.empty()) return 0;
+	std::vector<uint32_t> sorted(queue_delay);
+	const size_t i = std::min(sorted.size() * p / 100, sorted.size() - 1);
+	std::nth_element(sorted.begin(), sorted.begin() + i, sorted.end());
+	return sorted[i];
+}
+
+sim_link::sim_link(sim *s, const sim_link_config &config, uint64_t seed) :
+	_sim(s), _config(config), _random(seed), _busy_until(0), _burst(false),
+	_loss_counter(0), _reorder_counter(0)
+{
+}
+
+void sim_link::send(sim_endpoint *from, const unsigned char *p, size_t len, const struct sockaddr_in *to)
+{
+	++_stats.packets;
+	_stats.bytes += len;
+
+	if (_config.drop_first > 0) {
+		--_config.drop_first;
+		++_stats.lost;
+		return;
+	}
+
+	if (_config.drop_every > 0) {
+		if (_loss_counter == _config.drop_every) {
+			_loss_counter = 0;
+			++_stats.lost;
+			return;
+		}
+		++_loss_counter;
+	}
+
+	if (_config.drop_proc != NULL && _config.drop_proc(_config.drop_userdata, p, len)) {
+		++_stats.lost;
+		return;
+	}
+
+	// a burst ends after each lost packet with probability
+	// 1 / burst_length, so that's its mean length
+	if (!_burst && _config.burst_loss > 0 && sim_uniform(&_random) < _config.burst_loss)
+		_burst = true;
+	if (_burst) {
+		if (sim_uniform(&_random) * _config.burst_length < 1) _burst = false;
+		++_stats.lost;
+		return;
+	}
+
+	if (_config.loss > 0 && sim_uniform(&_random) < _config.loss) {
+		++_stats.lost;
+		return;
+	}
+
+	// through the bottleneck, in nanoseconds
+	const uint64_t now = _sim->now() * 1000;
+	uint64_t sent = now;
+	if (_config.bandwidth > 0) {
+		const uint64_t start = std::max(now, _busy_until);
+		const uint64_t queued = (start - now) * _config.bandwidth / 1000000000;
+		if (_config.buffer > 0 && queued + len > _config.buffer) {
+			++_stats.dropped;
+			return;
+		}
+		_stats.queue_delay.push_back((uint32_t)((start - now) / 1000));
+		_busy_until = start + len * 1000000000 / _config.bandwidth;
+		sent = _busy_until;
+	}
+	_stats.delivered_bytes += len;
+
+	bool reorder = _config.reorder > 0 && sim_uniform(&_random) < _config.reorder;
+	++_reorder_counter;
+	if (_config.reorder_every > 0 && _reorder_counter >= _config.reorder_every) {
+		_reorder_counter = 0;
+		reorder = true;
+	}
+
+	uint64_t delay = _config.delay;
+	if (reorder) delay = _config.reorder_delay;
+	else if (_config.jitter > 0) delay += sim_random(&_random) % _config.jitter;
+
+	sim_packet *pkt = (sim_packet*)malloc(sizeof(sim_packet) - 1 + len);
+	pkt->time = (sent + 999) / 1000 + delay;
+	pkt->seq = _sim->_seq++;
+	pkt->from = from;
+	pkt->to = *to;
+	pkt->len = len;
+	memcpy(pkt->data, p, len);
+	_sim->_packets.push(pkt);
+}
+
+static void sim_send_to(void *userdata, const unsigned char *p, size_t len, const struct sockaddr *to, socklen_t tolen)
+{
+	sim_endpoint *ep = (sim_endpoint*)userdata;
+	if (to->sa_family != AF_INET) return;
+	ep->_link->send(ep, p, len, (const struct sockaddr_in*)to);
+}
+
+// the library passes the send_to userdata, the endpoint, to incoming_proc
+static void sim_incoming(void *userdata, UTPSocket *conn)
+{
+	sim_endpoint *ep = (sim_endpoint*)userdata;
+	ep->_incoming_proc(ep->_userdata, conn);
+}
+
+sim::sim(uint64_t seed) : _random(seed), _seq(0)
+{
+	// time never goes back for the library
+	g_sim_now = (g_sim_now / 1000000 + 1) * 1000000;
+	_timer = g_sim_now;
+	g_sim_utp_random = seed ^ 0x5a5a5a5a5a5a5a5aull;
+	UTP_SetSystemFunctions(&sim_system_funcs, NULL);
+}
+
+sim::~sim()
+{
+	while (!_packets.empty()) {
+		free(_packets.top());
+		_packets.pop();
+	}
+	for (size_t i = 0; i < _links.size(); ++i) delete _links[i];
+	for (size_t i = 0; i < _endpoints.size(); ++i) delete _endpoints[i];
+}
+
+sim_link *sim::add_link(const sim_link_config &config)
+{
+	sim_link *link = new sim_link(this, config, random());
+	_links.push_back(link);
+	return link;
+}
+
+sim_endpoint *sim::add_endpoint(const char *ip, int port, sim_link *link,
+								UTPGotIncomingConnection *incoming_proc, void *userdata)
+{
+	sim_endpoint *ep = new sim_endpoint;
+	memset(&ep->_addr, 0, sizeof(ep->_addr));
+	ep->_addr.sin_family = AF_INET;
+	ep->_addr.sin_addr.s_addr = inet_addr(ip);
+	ep->_addr.sin_port = htons(port);
+	ep->_link = link;
+	ep->_incoming_proc = incoming_proc;
+	ep->_packet_proc = NULL;
+	ep->_userdata = userdata;
+	_endpoints.push_back(ep);
+	return ep;
+}
+
+sim_endpoint *sim::add_raw_endpoint(const char *ip, int port, sim_link *link,
+									sim_packet_proc *packet_proc, void *userdata)
+{
+	sim_endpoint *ep = add_endpoint(ip, port, link, NULL, userdata);
+	ep->_packet_proc = packet_proc;
+	return ep;
+}
+
+UTPSocket *sim::create_socket(sim_endpoint *from, const sim_endpoint *to)
+{
+	return UTP_Create(&sim_send_to, from, (const struct sockaddr*)&to->_addr, sizeof(to->_addr));
+}
+
+void sim::send(sim_endpoint *from, const unsigned char *p, size_t len, const sim_endpoint *to)
+{
+	from->_link->send(from, p, len, &to->_addr);
+}
+
+void sim::run(uint64_t us)
+{
+	const uint64_t end = g_sim_now + us;
+	for (;;) {
+		// uTP's next timer. Packets, and the application, may have made
+		// it sooner
+		_timer = std::min(_timer, next_timer());
+		sim_packet *pkt = _packets.empty() ? NULL : _packets.top();
+		if (pkt != NULL && pkt->time <= _timer) {
+			if (pkt->time > end) break;
+			_packets.pop();
+			g_sim_now = std::max(g_sim_now, pkt->time);
+			deliver(pkt);
+		} else {
+			if (_timer > end) break;
+			g_sim_now = _timer;
+			UTP_CheckTimeouts();
+			_timer = next_timer();
+		}
+	}
+	g_sim_now = end;
+}
+
+// on a millisecond boundary, since that's the resolution of uTP's timers
+uint64_t sim::next_timer()
+{
+	return (g_sim_now / 1000 + std::max(UTP_NextTimeout(), 1)) * 1000;
+}
+
+void sim::deliver(sim_packet *pkt)
+{
+	for (size_t i = 0; i < _endpoints.size(); ++i) {
+		sim_endpoint *ep = _endpoints[i];
+		if (ep->_addr.sin_addr.s_addr != pkt->to.sin_addr.s_addr || ep->_addr.sin_port != pkt->to.sin_port)
+			continue;
+		if (ep->_packet_proc != NULL) {
+			ep->_packet_proc(ep->_userdata, pkt->data, pkt->len, pkt->from);
+			break;
+		}
+		UTP_IsIncomingUTP(ep->_incoming_proc != NULL ? &sim_incoming : NULL, &sim_send_to, ep, pkt->data, pkt->len,
+						  (const struct sockaddr*)&pkt->from->_addr, sizeof(pkt->from->_addr));
+		// with a listen backlog, incoming connections wait here
+		if (ep->_incoming_proc != NULL) {
+			while (UTPSocket *conn = UTP_Accept())
+				ep->_incoming_proc(ep->_userdata, conn);
+		}
+		break;
+	}
+	free(pkt);
+}
+
+uint64_t sim::now() const
+{
+	return g_sim_now;
+}
+
+uint64_t sim::random()
+{
+	return sim_random(&_random);
+}
@@ -0,0 +1,159 @@
+#ifndef __SIM_H__
+#define __SIM_H__
+
+// A discrete-event network simulator for the tests, running on virtual
+// time. The library's clock (see UTP_SetSystemFunctions()) is the
+// simulator's, and it jumps from one event to the next: a packet arriving, or a uTP timer
+// expiring. A minute of traffic takes as long to simulate as it takes
+// to process its packets, and a run only depends on its seed.
+//
+// Endpoints are UDP sockets. Each sends through a link, and several may
+// share one, for a common bottleneck. Raw endpoints aren't uTP: they get
+// packets handed to them, for models of other protocols. A link models the bottleneck's
+// bandwidth and buffer, propagation delay and jitter, random and bursty
+// loss, and reordering.
+
+#include "utp.h"
+
+#include <queue>
+#include <vector>
+
+#ifdef WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+struct sim_link_config {
+	sim_link_config();
+
+	// bytes per second through the bottleneck, 0 for no bottleneck
+	uint64_t bandwidth;
+	// bytes queued at the bottleneck before packets are dropped, 0 for
+	// no limit
+	size_t buffer;
+	// propagation delay, and up to jitter more at random, in microseconds
+	uint32_t delay;
+	uint32_t jitter;
+	// probability a packet is lost
+	double loss;
+	// probability a burst of losses starts, and the mean number of
+	// packets lost in a burst
+	double burst_loss;
+	double burst_length;
+	// probability a packet takes reorder_delay instead of delay and jitter
+	double reorder;
+	uint32_t reorder_delay;
+	// drop the first drop_first packets, then one in every drop_every + 1
+	int drop_first;
+	int drop_every;
+	// one in every reorder_every packets takes reorder_delay
+	int reorder_every;
+	// drop the packets drop_proc returns true for, NULL for none
+	bool (*drop_proc)(void *userdata, const unsigned char *p, size_t len);
+	void *drop_userdata;
+};
+
+struct sim_link_stats {
+	sim_link_stats();
+
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t delivered_bytes;
+	// lost to loss, and dropped by a full bottleneck buffer
+	uint64_t lost;
+	uint64_t dropped;
+	// time each packet waited at the bottleneck, in microseconds
+	std::vector<uint32_t> queue_delay;
+
+	// the queue delay at percentile p (0-100)
+	uint32_t queue_delay_percentile(int p) const;
+};
+
+struct sim;
+struct sim_endpoint;
+
+// a packet for a raw endpoint, sent by from
+typedef void sim_packet_proc(void *userdata, const unsigned char *p, size_t len, sim_endpoint *from);
+
+struct sim_link {
+	sim_link(sim *s, const sim_link_config &config, uint64_t seed);
+
+	void send(sim_endpoint *from, const unsigned char *p, size_t len, const struct sockaddr_in *to);
+
+	sim *_sim;
+	sim_link_config _config;
+	sim_link_stats _stats;
+	uint64_t _random;
+	// when the bottleneck is done sending what's queued, in nanoseconds
+	uint64_t _busy_until;
+	bool _burst;
+	int _loss_counter;
+	int _reorder_counter;
+};
+
+struct sim_endpoint {
+	struct sockaddr_in _addr;
+	sim_link *_link;
+	// incoming connections, NULL to refuse them
+	UTPGotIncomingConnection *_incoming_proc;
+	// packets, for a raw endpoint
+	sim_packet_proc *_packet_proc;
+	void *_userdata;
+};
+
+struct sim_packet {
+	uint64_t time;
+	// ties are delivered in the order they were sent
+	uint64_t seq;
+	sim_endpoint *from;
+	struct sockaddr_in to;
+	size_t len;
+	unsigned char data[1];
+};
+
+struct sim_packet_later {
+	bool operator()(const sim_packet *lhs, const sim_packet *rhs) const
+	{ return lhs->time != rhs->time ? lhs->time > rhs->time : lhs->seq > rhs->seq; }
+};
+
+// The library has one clock, so there is one simulation at a time. A new
+// one starts on a whole second, and seeds the library's random numbers,
+// so runs with the same seed line up
+struct sim {
+	sim(uint64_t seed);
+	~sim();
+
+	sim_link *add_link(const sim_link_config &config);
+	// the endpoint at ip:port, sending through link
+	sim_endpoint *add_endpoint(const char *ip, int port, sim_link *link,
+							   UTPGotIncomingConnection *incoming_proc, void *userdata);
+	// a raw endpoint at ip:port, sending through link
+	sim_endpoint *add_raw_endpoint(const char *ip, int port, sim_link *link,
+								   sim_packet_proc *packet_proc, void *userdata);
+	// a uTP socket on from, to the endpoint to
+	UTPSocket *create_socket(sim_endpoint *from, const sim_endpoint *to);
+	// send a packet from a raw endpoint
+	void send(sim_endpoint *from, const unsigned char *p, size_t len, const sim_endpoint *to);
+
+	// handle the packets and timers of the next us microseconds
+	void run(uint64_t us);
+
+	// the virtual time, in microseconds
+	uint64_t now() const;
+	// a random number, from the simulation's seed
+	uint64_t random();
+
+	uint64_t next_timer();
+	void deliver(sim_packet *pkt);
+
+	uint64_t _random;
+	uint64_t _seq;
+	// when UTP_CheckTimeouts() is called next
+	uint64_t _timer;
+	std::vector<sim_link*> _links;
+	std::vector<sim_endpoint*> _endpoints;
+	std::priority_queue<sim_packet*, std::vector<sim_packet*>, sim_packet_later> _packets;
+};
+
+#endif //__SIM_H__
@@ -1,5 +1,5 @@
 #include "utp.h"
-#include "utp_utils.h"
+#include "sim.h"
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
@@ -16,18 +16,9 @@
 #endif
 #endif
 
-#ifdef _WIN32
-#define msleep(x) Sleep(x)
-#else
-#include <unistd.h>
-#define msleep(x) usleep(x*1000)
-#endif
-
 #define utassert assert
 #define utassert_failmsg(expr,failstmt) if (!(expr)) { failstmt; utassert(#expr); }
 
-extern "C" uint32_t g_current_ms;
-
 struct utp_socket {
 
 	utp_socket(UTPSocket* s);
@@ -55,6 +46,9 @@ struct utp_socket {
 	bool _readable;
 	bool _writable;
 	bool _ignore_reset;
+	bool _expect_refused;
+	int _error;
+	bool _closed;
 	bool _destroyed;
 
 	UTPSocket* _sock;
@@ -71,139 +65,42 @@ UTPFunctionTable utp_callbacks = {
 
 utp_socket* incoming = NULL;
 
-struct TestUdpOutgoing {
-	int timestamp;
-	struct sockaddr_storage addr;
-	socklen_t addrlen;
-	size_t len;
-	unsigned char mem[1];
-};
-
-struct test_manager
-{
-	test_manager() :
-		_receiver(NULL), _loss_counter(0), _loss_every(0), _reorder_counter(0), _reorder_every(0)
-	{
-	}
-	void drop_one_packet_every(int x) { _loss_every = x; }
-	void reorder_one_packet_every(int x) { _reorder_every = x; }
-	void IncomingUTP(UTPSocket* conn)
-	{
-		//printf("\nIn IncomingUTP\n");
-		utassert_failmsg(incoming == NULL, printf("\nincoming expected NULL actual %p\n", incoming));
-		incoming = new utp_socket(conn);
-		incoming->_connected = true;
-		incoming->_writable = true;
-	}
-
-	void Send(const unsigned char *p, size_t len, const struct sockaddr *to, socklen_t tolen);
-	void Flush(uint32_t start_time, uint32_t max_time);
-	void clear();
-	void bind(test_manager* receiver)
-	{
-		_receiver = receiver;
-	}
-
-	~test_manager()
-	{
-		clear();
-	}
-
-	test_manager* _receiver;
-	int _loss_counter;
-	int _loss_every;
-
-	int _reorder_counter;
-	int _reorder_every;
-
-	std::vector<TestUdpOutgoing*> _send_buffer;
-};
-
-bool ComparePacketTimestamp(const TestUdpOutgoing* lhs, const TestUdpOutgoing* rhs)
-{
-	return lhs->timestamp < rhs->timestamp;
-}
-
 void test_incoming_proc(void *userdata, UTPSocket* conn)
 {
-	((test_manager*)userdata)->IncomingUTP(conn);
+	//printf("\nIn IncomingUTP\n");
+	utassert_failmsg(incoming == NULL, printf("\nincoming expected NULL actual %p\n", incoming));
+	incoming = new utp_socket(conn);
+	incoming->_connected = true;
+	incoming->_writable = true;
 }
 
-void test_send_to_proc(void *userdata, const unsigned char *p, size_t len, const struct sockaddr *to, socklen_t tolen)
-{
-	((test_manager*)userdata)->Send(p, len, to, tolen);
-}
+// The simulated network of the test running, with the sender at
+// 127.0.0.1:12346 and the receiver at 127.0.0.1:12345
+sim* g_sim = NULL;
+sim_endpoint* g_sender_ep = NULL;
+sim_endpoint* g_receiver_ep = NULL;
 
-void test_manager::Flush(uint32_t start_time, uint32_t max_time)
+// 10 to 40 ms one way, and the packets reordered by that take 9 ms
+sim_link_config test_link()
 {
-	//printf("In test_manager::Flush");
-	std::sort(_send_buffer.begin(), _send_buffer.end(), ComparePacketTimestamp);
-
-	for (size_t i = 0; i < _send_buffer.size(); ++i) {
-		TestUdpOutgoing *uo = _send_buffer[i];
-//		utassert(uo);
-
-		if ((uint32_t)uo->timestamp > g_current_ms) continue;
-
-		if (_receiver) {
-			// Lookup the right UTP socket that can handle this message
-			UTP_IsIncomingUTP(&test_incoming_proc, &test_send_to_proc, _receiver, uo->mem, uo->len,
-							  (const struct sockaddr*)&uo->addr, uo->addrlen);
-		}
-
-		_send_buffer[i] = _send_buffer.back();
-		_send_buffer.pop_back();
-		--i;
-		free(uo);
-	}
+	sim_link_config link;
+	link.delay = 10000;
+	link.jitter = 30000;
+	link.reorder_delay = 9000;
+	return link;
 }
 
-void test_manager::clear()
+void test_network(sim& s, const sim_link_config& up, const sim_link_config& down)
 {
-	_loss_every = 0;
-	_reorder_every = 0;
-	_loss_counter = 0;
-	_reorder_counter = 0;
-	for(size_t i = 0; i < _send_buffer.size(); i++) {
-		free(_send_buffer[i]);
-	}
-	_send_buffer.clear();
+	g_sim = &s;
+	g_sender_ep = s.add_endpoint("127.0.0.1", 12346, s.add_link(up), NULL, NULL);
+	g_receiver_ep = s.add_endpoint("127.0.0.1", 12345, s.add_link(down), &test_incoming_proc, NULL);
 }
 
-void test_manager::Send(const unsigned char *p, size_t len, const struct sockaddr *to, socklen_t tolen)
-{
-	if (_loss_every > 0 && _loss_counter == _loss_every) {
-		_loss_counter = 0;
-		//printf("DROP!\n");
-		return;
-	} else {
-		++_loss_counter;
-	}
-
-	int delay = 10 + rand() % 30;
-
-	++_reorder_counter;
-	if (_reorder_counter >= _reorder_every && _reorder_every > 0) {
-		delay = 9;
-		_reorder_counter = 0;
-	}
-
-	TestUdpOutgoing *q = (TestUdpOutgoing*)malloc(sizeof(TestUdpOutgoing) - 1 + len);
-	q->timestamp = g_current_ms + delay;
-	memcpy(&q->addr, to, tolen);
-	q->addrlen = tolen;
-	q->len = len;
-	memcpy(q->mem, p, len);
-	_send_buffer.push_back(q);
-}
-
-test_manager* send_udp_manager = 0;
-test_manager* receive_udp_manager = 0;
-
 utp_socket::utp_socket(UTPSocket* s) :
 	_buf_size(0), _read_bytes(0),
 	_connected(false), _readable(false), _writable(false), _ignore_reset(false),
-	_destroyed(false),  _sock(s)
+	_expect_refused(false), _error(0), _closed(false), _destroyed(false),  _sock(s)
 {
 //	printf("utp_socket: %x sock: %x\n", this, _sock);
 	utassert(s);
@@ -213,6 +110,7 @@ utp_socket::utp_socket(UTPSocket* s) :
 void utp_socket::close()
 {
 //	printf("~utp_socket: %x\n", this);
+	_closed = true;
 	UTP_Close(_sock);
 }
 
@@ -293,11 +191,15 @@ void utp_socket::on_utp_error(void *socket, int errcode)
 {
 	printf("\nUTP ERROR: %d for socket %p\n", errcode, socket);
 	utp_socket* usock = ((utp_socket*)socket);
-	if (!usock->_ignore_reset || errcode != ECONNRESET) {
+	usock->_error = errcode;
+	if ((!usock->_ignore_reset || errcode != ECONNRESET) &&
+		(!usock->_expect_refused || errcode != ECONNREFUSED)) {
 		g_error = true;
 		utassert(false);
 	}
-	usock->close();
+	// a reset may arrive after we've closed the socket, e.g. when the peer
+	// is already gone by the time our FIN is resent
+	if (!usock->_closed) usock->close();
 }
 
 size_t utp_socket::write(char const* buf, size_t count)
@@ -313,23 +215,10 @@ size_t utp_socket::write(char const* buf, size_t count)
 	return to_write;
 }
 
+// 5 ms of virtual time
 void tick()
 {
-	static int tick_counter = 0;
-
-	++tick_counter;
-	if (tick_counter == 10) {
-		tick_counter = 0;
-		UTP_CheckTimeouts();
-	}
-
-	uint32_t start_time = UTP_GetMilliseconds();
-	uint32_t max_time = 1000;
-
-	send_udp_manager->Flush(start_time, max_time);
-	receive_udp_manager->Flush(start_time, max_time);
-
-	msleep(5);
+	g_sim->run(5000);
 }
 
 enum flags_t {
@@ -337,42 +226,63 @@ enum flags_t {
 	simulate_packetloss = 2,
 	simulate_packetreorder = 4,
 	heavy_loss = 8,
+	large_window = 16,
+	rcvbuf_autotune = 32,
+	sndbuf_autotune = 64,
+	ack_frequency = 128,
+	syn_cookies = 256,
+	lose_synack = 512,
+	accept_queue = 1024,
 };
 
 void test_transfer(int flags)
 {
-	sockaddr_in sin;
-	memset(&sin, 0, sizeof(sin));
-	sin.sin_family = AF_INET;
-	sin.sin_addr.s_addr = inet_addr("127.0.0.1");
-	sin.sin_port = htons(12345);
-
-	UTPSocket* sock = UTP_Create(&test_send_to_proc, send_udp_manager,
-								 (const struct sockaddr*)&sin, sizeof(sin));
-
-	utp_socket* sender = new utp_socket(sock);
-	if (flags & use_utp_v1) {
-		UTP_SetSockopt(sender->_sock, SO_UTPVERSION, 1);
-	} else {
-		UTP_SetSockopt(sender->_sock, SO_UTPVERSION, 0);
-	}
-
-	send_udp_manager->clear();
-	receive_udp_manager->clear();
+	sim_link_config up = test_link();
+	sim_link_config down = test_link();
 
 	if (flags & simulate_packetloss) {
-		send_udp_manager->drop_one_packet_every(33);
-		receive_udp_manager->drop_one_packet_every(47);
+		up.drop_every = 33;
+		down.drop_every = 47;
 
 		if (flags & heavy_loss) {
-			send_udp_manager->drop_one_packet_every(7);
-			receive_udp_manager->drop_one_packet_every(13);
+			up.drop_every = 7;
+			down.drop_every = 13;
 		}
 	}
 
+	if (flags & lose_synack) {
+		// the SYN is resent, and must be answered from the same socket
+		down.drop_first = 1;
+	}
+
 	if (flags & simulate_packetreorder) {
-		send_udp_manager->reorder_one_packet_every(27);
-		receive_udp_manager->reorder_one_packet_every(23);
+		up.reorder_every = 27;
+		down.reorder_every = 23;
+	}
+
+	sim s(flags);
+	test_network(s, up, down);
+
+	// applies to the incoming socket as well
+	UTP_SetGlobalOpt(UTP_GLOBAL_RCVBUF_AUTOTUNE, (flags & rcvbuf_autotune) != 0);
+	UTP_SetGlobalOpt(UTP_GLOBAL_SNDBUF_AUTOTUNE, (flags & sndbuf_autotune) != 0);
+	UTP_SetGlobalOpt(UTP_GLOBAL_SYN_COOKIES, (flags & syn_cookies) != 0);
+	// both ends share the host, so the sender counts as one
+	UTP_SetGlobalOpt(UTP_GLOBAL_LISTEN_BACKLOG, (flags & accept_queue) ? 4 : 0);
+	UTP_SetGlobalOpt(UTP_GLOBAL_MAX_CONNS_PER_HOST, (flags & accept_queue) ? 2 : 0);
+	UTP_SetGlobalOpt(UTP_GLOBAL_MAX_HALF_OPEN, (flags & accept_queue) ? 1 : 0);
+
+	utp_socket* sender = new utp_socket(s.create_socket(g_sender_ep, g_receiver_ep));
+	if (flags & use_utp_v1) {
+		UTP_SetSockopt(sender->_sock, SO_UTPVERSION, 1);
+	} else {
+		UTP_SetSockopt(sender->_sock, SO_UTPVERSION, 0);
+	}
+	if (flags & large_window) {
+		UTP_SetSockopt(sender->_sock, SO_UTPLARGEWINDOW, 1);
+	}
+	if (flags & ack_frequency) {
+		UTP_SetSockopt(sender->_sock, SO_UTPACKFREQUENCY, 1);
 	}
 
 	UTP_Connect(sender->_sock);
@@ -408,6 +318,11 @@ void test_transfer(int flags)
 	}
 	utassert_failmsg(incoming->_read_bytes == written, printf("\nread_bytes: %zu written: %zu\n", incoming->_read_bytes, written));
 
+	UTPLossStats loss;
+	UTP_GetLossStats(sender->_sock, &loss);
+	printf("lost: %u spurious: %u timeouts: %u probes: %u reorder window: %u us\n",
+		   loss._nlost, loss._nspurious, loss._ntimeout, loss._nprobe, loss._reorder_window);
+
 	sender->close();
 
 	for (int i = 0; i < 1500; ++i) {
@@ -440,6 +355,789 @@ void test_transfer(int flags)
 	delete sender;
 	delete incoming;
 	incoming = NULL;
+	g_sim = NULL;
+}
+
+// A SYN from a host with too many connections is refused
+void test_refused(int flags)
+{
+	sim s(flags);
+	test_network(s, test_link(), test_link());
+
+	utassert(!UTP_SetGlobalOpt(UTP_GLOBAL_LISTEN_BACKLOG, -1));
+	utassert(!UTP_SetGlobalOpt(UTP_GLOBAL_MAX_CONNS_PER_HOST, -1));
+	utassert(!UTP_SetGlobalOpt(UTP_GLOBAL_MAX_HALF_OPEN, -1));
+	UTP_SetGlobalOpt(UTP_GLOBAL_SYN_COOKIES, (flags & syn_cookies) != 0);
+	UTP_SetGlobalOpt(UTP_GLOBAL_LISTEN_BACKLOG, (flags & accept_queue) ? 4 : 0);
+	// the connecting socket itself is the one connection
+	UTP_SetGlobalOpt(UTP_GLOBAL_MAX_CONNS_PER_HOST, 1);
+
+	utp_socket* sender = new utp_socket(s.create_socket(g_sender_ep, g_receiver_ep));
+	sender->_expect_refused = true;
+	UTP_Connect(sender->_sock);
+
+	for (int i = 0; i < 1500; ++i) {
+		tick();
+		if (sender->_error) break;
+	}
+	utassert(sender->_error == ECONNREFUSED);
+	utassert(!sender->_connected);
+	utassert(incoming == NULL);
+
+	for (int i = 0; i < 1500; ++i) {
+		tick();
+		if (sender->_destroyed) break;
+	}
+	utassert(sender->_destroyed);
+
+	UTP_SetGlobalOpt(UTP_GLOBAL_MAX_CONNS_PER_HOST, 0);
+	delete sender;
+	g_sim = NULL;
+}
+
+// A bulk transfer, with as much data as the connection takes, between
+// two ends of a simulated network
+struct bulk_end {
+	UTPSocket* sock;
+	bool sender;
+	bool destroyed;
+	uint64_t received;
+};
+
+void bulk_read(void* socket, const unsigned char* bytes, size_t count)
+{
+	((bulk_end*)socket)->received += count;
+}
+
+void bulk_write(void *socket, unsigned char *bytes, size_t count)
+{
+	memset(bytes, 0, count);
+}
+
+size_t bulk_get_rb_size(void *socket)
+{
+	return 0;
+}
+
+void bulk_state(void *socket, int state)
+{
+	bulk_end* e = (bulk_end*)socket;
+	switch(state) {
+	case UTP_STATE_CONNECT:
+	case UTP_STATE_WRITABLE:
+		if (e->sender) UTP_Write(e->sock, 1 << 30);
+		break;
+	case UTP_STATE_EOF:
+		UTP_Close(e->sock);
+		break;
+	case UTP_STATE_DESTROYING:
+		e->destroyed = true;
+		break;
+	}
+}
+
+void bulk_error(void *socket, int errcode)
+{
+	printf("\nUTP ERROR: %d for socket %p\n", errcode, socket);
+	g_error = true;
+	utassert(false);
+}
+
+void bulk_overhead(void *socket, bool send, size_t count, int type) {}
+
+UTPFunctionTable bulk_callbacks = {
+	&bulk_read, &bulk_write, &bulk_get_rb_size, &bulk_state, &bulk_error, &bulk_overhead
+};
+
+void bulk_incoming(void *userdata, UTPSocket* conn)
+{
+	bulk_end* e = (bulk_end*)userdata;
+	e->sock = conn;
+	UTP_SetCallbacks(conn, &bulk_callbacks, e);
+}
+
+struct bulk_result {
+	uint64_t received;
+	uint64_t lost;
+	uint64_t dropped;
+	// queuing delay at the bottleneck, in milliseconds
+	uint32_t queue_delay_p50;
+	uint32_t queue_delay_p95;
+	UTPLossStats loss;
+
+	bool operator==(const bulk_result& r) const
+	{
+		return received == r.received && lost == r.lost && dropped == r.dropped &&
+			queue_delay_p50 == r.queue_delay_p50 && queue_delay_p95 == r.queue_delay_p95 &&
+			memcmp(&loss, &r.loss, sizeof(loss)) == 0;
+	}
+};
+
+// Sends through up for the given virtual time, then closes the connection
+bulk_result test_bulk(uint64_t seed, const sim_link_config& up, int seconds, bool large)
+{
+	sim s(seed);
+	sim_link_config down;
+	down.delay = up.delay;
+
+	bulk_end sender = {NULL, true, false, 0};
+	bulk_end receiver = {NULL, false, false, 0};
+	sim_endpoint* a = s.add_endpoint("10.0.0.1", 6881, s.add_link(up), NULL, NULL);
+	sim_endpoint* b = s.add_endpoint("10.0.0.2", 6881, s.add_link(down), &bulk_incoming, &receiver);
+
+	sender.sock = s.create_socket(a, b);
+	UTP_SetCallbacks(sender.sock, &bulk_callbacks, &sender);
+	UTP_SetSockopt(sender.sock, SO_UTPLARGEWINDOW, large);
+	UTP_Connect(sender.sock);
+	s.run(seconds * 1000000ull);
+
+	bulk_result r;
+	const sim_link_stats& stats = s._links[0]->_stats;
+	r.received = receiver.received;
+	r.lost = stats.lost;
+	r.dropped = stats.dropped;
+	r.queue_delay_p50 = stats.queue_delay_percentile(50) / 1000;
+	r.queue_delay_p95 = stats.queue_delay_percentile(95) / 1000;
+	UTP_GetLossStats(sender.sock, &r.loss);
+	printf("%.1f kB/s, lost: %u dropped: %u queue delay p50: %u ms p95: %u ms, "
+		   "uTP lost: %u spurious: %u timeouts: %u probes: %u\n",
+		   r.received / 1024.0 / seconds, (unsigned)r.lost, (unsigned)r.dropped,
+		   r.queue_delay_p50, r.queue_delay_p95,
+		   r.loss._nlost, r.loss._nspurious, r.loss._ntimeout, r.loss._nprobe);
+
+	UTP_Close(sender.sock);
+	for (int i = 0; i < 600 && !(sender.destroyed && receiver.destroyed); ++i)
+		s.run(100000);
+	utassert(sender.destroyed && receiver.destroyed);
+	return r;
+}
+
+// 1 Mbit/s with a 20 ms delay and a 100 kB (800 ms) buffer, for ten
+// minutes. LEDBAT keeps the queue near its 100 ms target instead of
+// filling the buffer, and still uses most of the link
+void test_bufferbloat()
+{
+	sim_link_config up;
+	up.bandwidth = 125000;
+	up.buffer = 100000;
+	up.delay = 20000;
+	up.loss = 0.001;
+	const bulk_result r = test_bulk(1, up, 600, false);
+	utassert(r.received > up.bandwidth * 600 * 8 / 10);
+	utassert(r.queue_delay_p50 <= 150);
+}
+
+// The same bottleneck for two minutes, with the target delay turned
+// down to 25 ms for new sockets. The queue follows it
+void test_target_delay()
+{
+	utassert(!UTP_SetGlobalOpt(SO_UTPTARGETDELAY, 0));
+	utassert(UTP_SetGlobalOpt(SO_UTPTARGETDELAY, 25));
+	sim_link_config up;
+	up.bandwidth = 125000;
+	up.buffer = 100000;
+	up.delay = 20000;
+	const bulk_result r = test_bulk(1, up, 120, false);
+	UTP_SetGlobalOpt(SO_UTPTARGETDELAY, 100);
+	utassert(r.received > up.bandwidth * 120 * 7 / 10);
+	utassert(r.queue_delay_p50 <= 40);
+}
+
+// Loss in bursts, jitter and reordering: the same seed gives the same
+// transfer
+void test_deterministic()
+{
+	sim_link_config up;
+	up.bandwidth = 1000000;
+	up.buffer = 200000;
+	up.delay = 30000;
+	up.jitter = 5000;
+	up.burst_loss = 0.002;
+	up.burst_length = 4;
+	up.reorder = 0.01;
+	up.reorder_delay = 20000;
+	const bulk_result r1 = test_bulk(42, up, 20, false);
+	const bulk_result r2 = test_bulk(42, up, 20, false);
+	utassert(r1 == r2);
+}
+
+// A clean 10 Mbit/s link. Nearly every data packet and ack takes the
+// header prediction fast path
+void test_header_prediction()
+{
+	sim_link_config up;
+	up.bandwidth = 1250000;
+	up.buffer = 200000;
+	up.delay = 20000;
+	UTPGlobalStats before, after;
+	UTP_GetGlobalStats(&before);
+	const bulk_result r = test_bulk(5, up, 20, false);
+	UTP_GetGlobalStats(&after);
+	utassert(r.received > up.bandwidth * 20 * 8 / 10);
+
+	uint32_t received = 0;
+	for (int i = 0; i < 5; ++i)
+		received += after._nraw_recv[i] - before._nraw_recv[i];
+	const uint32_t acks = after._npredicted_ack - before._npredicted_ack;
+	const uint32_t data = after._npredicted_data - before._npredicted_data;
+	printf("predicted acks: %u data: %u of %u packets (%.1f%%)\n",
+		   acks, data, received, (acks + data) * 100.0 / received);
+	utassert(acks > 0 && data > 0);
+	utassert((acks + data) * 10 > received * 9);
+}
+
+// Drops the first transmission of the nth data packet a socket sends
+// (counting from 1), for a sim_link_config's drop_proc
+struct drop_nth {
+	int n;
+	bool started;
+	uint16_t first_seq;
+	bool dropped;
+};
+
+bool drop_nth_proc(void *userdata, const unsigned char *p, size_t len)
+{
+	drop_nth* d = (drop_nth*)userdata;
+	// a version 1 ST_DATA packet, with a payload
+	if (len <= 20 || p[0] != 0x01) return false;
+	const uint16_t seq = (uint16_t)(p[16] << 8 | p[17]);
+	if (!d->started) {
+		d->started = true;
+		d->first_seq = seq;
+	}
+	if (d->dropped || (uint16_t)(seq - d->first_seq) != d->n - 1) return false;
+	d->dropped = true;
+	return true;
+}
+
+// RACK. A packet that's a little late, less than the reordering window,
+// isn't taken for lost. One that's later than three packets after it is,
+// until RACK has seen the network reorder packets: the first one is
+// resent, found out to be spurious, and no others are. A packet that is
+// lost in the middle of a transfer is resent once the packets after it
+// are acked, without waiting for the timeout
+void test_rack()
+{
+	sim_link_config up;
+	up.bandwidth = 1000000;
+	up.buffer = 200000;
+	up.delay = 20000;
+	up.reorder_every = 50;
+	up.reorder_delay = 22000;
+	bulk_result r = test_bulk(7, up, 20, false);
+	utassert(r.lost == 0 && r.dropped == 0);
+	utassert(r.loss._nlost == 0 && r.loss._ntimeout == 0);
+
+	up.reorder_delay = 25000;
+	r = test_bulk(7, up, 20, false);
+	utassert(r.lost == 0 && r.dropped == 0);
+	utassert(r.loss._nlost <= 1 && r.loss._nspurious == r.loss._nlost && r.loss._ntimeout == 0);
+
+	sim_link_config drop;
+	drop.bandwidth = 1000000;
+	drop.buffer = 200000;
+	drop.delay = 20000;
+	drop_nth d = {500, false, 0, false};
+	drop.drop_proc = &drop_nth_proc;
+	drop.drop_userdata = &d;
+	r = test_bulk(7, drop, 20, false);
+	utassert(d.dropped && r.lost == 1 && r.dropped == 0);
+	utassert(r.loss._nlost == 1 && r.loss._ntimeout == 0);
+}
+
+// A transfer of g_finite_left bytes
+static size_t g_finite_left;
+
+void finite_write(void *socket, unsigned char *bytes, size_t count)
+{
+	memset(bytes, 0, count);
+	g_finite_left -= count;
+}
+
+void finite_state(void *socket, int state)
+{
+	bulk_end* e = (bulk_end*)socket;
+	if (state == UTP_STATE_CONNECT || state == UTP_STATE_WRITABLE) {
+		if (g_finite_left > 0) UTP_Write(e->sock, g_finite_left);
+	} else {
+		bulk_state(socket, state);
+	}
+}
+
+UTPFunctionTable finite_callbacks = {
+	&bulk_read, &finite_write, &bulk_get_rb_size, &finite_state, &bulk_error, &bulk_overhead
+};
+
+// The last data packet of a transfer is lost. Nothing after it is acked
+// to tell RACK, but the tail loss probe gets the receiver to ack what
+// it has, well before the retransmission timeout
+void test_tail_loss_probe()
+{
+	sim s(13);
+	sim_link_config up;
+	up.delay = 20000;
+	drop_nth d = {10, false, 0, false};
+	up.drop_proc = &drop_nth_proc;
+	up.drop_userdata = &d;
+	sim_link_config down;
+	down.delay = 20000;
+
+	bulk_end sender = {NULL, true, false, 0};
+	bulk_end receiver = {NULL, false, false, 0};
+	sim_endpoint* a = s.add_endpoint("10.0.0.1", 6881, s.add_link(up), NULL, NULL);
+	sim_endpoint* b = s.add_endpoint("10.0.0.2", 6881, s.add_link(down), &bulk_incoming, &receiver);
+
+	sender.sock = s.create_socket(a, b);
+	UTP_SetCallbacks(sender.sock, &finite_callbacks, &sender);
+	const size_t total = 10 * UTP_GetPacketSize(sender.sock);
+	g_finite_left = total;
+	UTP_Connect(sender.sock);
+	for (int i = 0; i < 50 && receiver.received < total; ++i)
+		s.run(100000);
+	utassert(d.dropped);
+	utassert(receiver.received == total);
+
+	UTPLossStats loss;
+	UTP_GetLossStats(sender.sock, &loss);
+	printf("lost: %u probes: %u timeouts: %u\n", loss._nlost, loss._nprobe, loss._ntimeout);
+	utassert(loss._nprobe > 0 && loss._ntimeout == 0);
+
+	UTP_Close(sender.sock);
+	for (int i = 0; i < 100 && !(sender.destroyed && receiver.destroyed); ++i)
+		s.run(100000);
+	utassert(sender.destroyed && receiver.destroyed);
+}
+
+// Watches the receive windows advertised by the receiving ends of up to
+// four connections, for a sim_link_config's drop_proc. Drops nothing
+struct window_spy {
+	uint16_t connid[4];
+	uint32_t window[4];
+	size_t count;
+	// the largest window, and the largest sum of the windows, while
+	// watching
+	uint32_t max_window;
+	uint32_t max_total;
+	bool done;
+};
+
+bool window_spy_proc(void *userdata, const unsigned char *p, size_t len)
+{
+	window_spy* w = (window_spy*)userdata;
+	// a version 1 ST_STATE packet
+	if (w->done || len < 20 || p[0] != 0x21) return false;
+	const uint16_t connid = (uint16_t)(p[2] << 8 | p[3]);
+	size_t i = 0;
+	while (i < w->count && w->connid[i] != connid) ++i;
+	if (i == w->count) {
+		if (i == 4) return false;
+		w->connid[w->count++] = connid;
+	}
+	w->window[i] = (uint32_t)p[12] << 24 | (uint32_t)p[13] << 16 | (uint32_t)p[14] << 8 | p[15];
+	uint32_t total = 0;
+	for (size_t j = 0; j < w->count; ++j)
+		total += w->window[j];
+	w->max_window = std::max(w->max_window, w->window[i]);
+	w->max_total = std::max(w->max_total, total);
+	return false;
+}
+
+// hands each incoming connection the next bulk_end without a socket
+void next_bulk_incoming(void *userdata, UTPSocket* conn)
+{
+	bulk_end* e = (bulk_end*)userdata;
+	while (e->sock != NULL) ++e;
+	bulk_incoming(e, conn);
+}
+
+// count bulk transfers to one host over a 50 Mbit/s bottleneck and a
+// 300 ms round trip, for the given number of seconds. The receiving
+// sockets autotune their receive buffers within budget kB. Returns what
+// they advertised as their receive windows
+window_spy test_rcvbuf_bulk(int count, int budget, int seconds)
+{
+	sim s(17);
+	sim_link_config up;
+	up.bandwidth = 6250000;
+	up.buffer = 1000000;
+	up.delay = 150000;
+	window_spy w;
+	memset(&w, 0, sizeof(w));
+	sim_link_config down;
+	down.delay = 150000;
+	down.drop_proc = &window_spy_proc;
+	down.drop_userdata = &w;
+
+	bulk_end senders[3];
+	bulk_end receivers[3];
+	memset(senders, 0, sizeof(senders));
+	memset(receivers, 0, sizeof(receivers));
+	sim_link* bottleneck = s.add_link(up);
+	sim_endpoint* b = s.add_endpoint("10.0.0.100", 6881, s.add_link(down), &next_bulk_incoming, receivers);
+	for (int i = 0; i < count; ++i) {
+		char ip[16];
+		snprintf(ip, sizeof(ip), "10.0.0.%d", i + 1);
+		sim_endpoint* a = s.add_endpoint(ip, 6881, bottleneck, NULL, NULL);
+		senders[i].sender = true;
+		senders[i].sock = s.create_socket(a, b);
+		UTP_SetCallbacks(senders[i].sock, &bulk_callbacks, &senders[i]);
+		UTP_Connect(senders[i].sock);
+	}
+	// the sockets created from here on are the receiving ones
+	UTP_SetGlobalOpt(UTP_GLOBAL_RCVBUF_AUTOTUNE, 1);
+	UTP_SetGlobalOpt(UTP_GLOBAL_RCVBUF_BUDGET, budget);
+	s.run(seconds * 1000000ull);
+	UTP_SetGlobalOpt(UTP_GLOBAL_RCVBUF_AUTOTUNE, 0);
+	UTP_SetGlobalOpt(UTP_GLOBAL_RCVBUF_BUDGET, 0);
+	w.done = true;
+	printf("%d connections, largest window: %u kB, largest total: %u kB\n",
+		   count, w.max_window / 1024, w.max_total / 1024);
+
+	bool destroyed = false;
+	for (int i = 0; i < count; ++i)
+		UTP_Close(senders[i].sock);
+	for (int i = 0; i < 600 && !destroyed; ++i) {
+		s.run(100000);
+		destroyed = true;
+		for (int j = 0; j < count; ++j)
+			destroyed = destroyed && senders[j].destroyed && receivers[j].destroyed;
+	}
+	utassert(destroyed);
+	return w;
+}
+
+// Receive buffer autotuning on a path with a 1.9 MB bandwidth-delay
+// product. The receive window grows to more than twice its initial
+// 128 kB. Three connections with a 512 kB budget grow into it, and no
+// further
+void test_rcvbuf_autotune()
+{
+	utassert(!UTP_SetGlobalOpt(UTP_GLOBAL_RCVBUF_BUDGET, -1));
+
+	const window_spy one = test_rcvbuf_bulk(1, 0, 30);
+	utassert(one.max_window > 2 * 128 * 1024);
+
+	const window_spy three = test_rcvbuf_bulk(3, 512, 30);
+	utassert(three.count == 3);
+	utassert(three.max_total > 3 * 128 * 1024);
+	utassert(three.max_total <= 512 * 1024);
+}
+
+struct sndbuf_spy {
+	size_t max_sndbuf;
+	size_t max_total;
+	// samples where the send buffer was off twice the congestion window
+	int off_window;
+	int samples;
+};
+
+// count bulk transfers over the same path as test_rcvbuf_bulk, with
+// the sending sockets' send buffers autotuned, sampled every 100 ms
+sndbuf_spy test_sndbuf_bulk(int count, int budget, int seconds)
+{
+	sim s(17);
+	sim_link_config up;
+	up.bandwidth = 6250000;
+	up.buffer = 1000000;
+	up.delay = 150000;
+	sim_link_config down;
+	down.delay = 150000;
+
+	bulk_end senders[3];
+	bulk_end receivers[3];
+	memset(senders, 0, sizeof(senders));
+	memset(receivers, 0, sizeof(receivers));
+	sim_link* bottleneck = s.add_link(up);
+	sim_endpoint* b = s.add_endpoint("10.0.0.100", 6881, s.add_link(down), &next_bulk_incoming, receivers);
+	// only the sending sockets are autotuned
+	UTP_SetGlobalOpt(UTP_GLOBAL_SNDBUF_AUTOTUNE, 1);
+	UTP_SetGlobalOpt(UTP_GLOBAL_SNDBUF_BUDGET, budget);
+	for (int i = 0; i < count; ++i) {
+		char ip[16];
+		snprintf(ip, sizeof(ip), "10.0.0.%d", i + 1);
+		sim_endpoint* a = s.add_endpoint(ip, 6881, bottleneck, NULL, NULL);
+		senders[i].sender = true;
+		senders[i].sock = s.create_socket(a, b);
+		UTP_SetCallbacks(senders[i].sock, &bulk_callbacks, &senders[i]);
+		UTP_Connect(senders[i].sock);
+	}
+	UTP_SetGlobalOpt(UTP_GLOBAL_SNDBUF_AUTOTUNE, 0);
+
+	sndbuf_spy r;
+	memset(&r, 0, sizeof(r));
+	for (int t = 0; t < seconds * 10; ++t) {
+		s.run(100000);
+		size_t total = 0;
+		for (int i = 0; i < count; ++i) {
+			UTPBufferStats st;
+			UTP_GetBufferStats(senders[i].sock, &st);
+			const size_t target = std::min(std::max(st._max_window * 2, (size_t)64 * 1024), (size_t)32 * 1024 * 1024);
+			if (budget == 0 && st._sndbuf != target) ++r.off_window;
+			++r.samples;
+			r.max_sndbuf = std::max(r.max_sndbuf, st._sndbuf);
+			total += st._sndbuf;
+		}
+		r.max_total = std::max(r.max_total, total);
+	}
+	UTP_SetGlobalOpt(UTP_GLOBAL_SNDBUF_BUDGET, 0);
+	printf("%d connections, largest send buffer: %u kB, largest total: %u kB, off the window: %d/%d\n",
+		   count, unsigned(r.max_sndbuf / 1024), unsigned(r.max_total / 1024), r.off_window, r.samples);
+
+	bool destroyed = false;
+	for (int i = 0; i < count; ++i)
+		UTP_Close(senders[i].sock);
+	for (int i = 0; i < 600 && !destroyed; ++i) {
+		s.run(100000);
+		destroyed = true;
+		for (int j = 0; j < count; ++j)
+			destroyed = destroyed && senders[j].destroyed && receivers[j].destroyed;
+	}
+	utassert(destroyed);
+	return r;
+}
+
+// Send buffer autotuning. The send buffer follows the congestion window
+// up from its initial 64 kB, and three connections with a 512 kB budget
+// grow into it, and no further
+void test_sndbuf_autotune()
+{
+	utassert(!UTP_SetGlobalOpt(UTP_GLOBAL_SNDBUF_BUDGET, -1));
+
+	const sndbuf_spy one = test_sndbuf_bulk(1, 0, 30);
+	utassert(one.max_sndbuf > 4 * 64 * 1024);
+	utassert(one.off_window == 0);
+
+	const sndbuf_spy three = test_sndbuf_bulk(3, 512, 30);
+	utassert(three.max_total > 3 * 64 * 1024);
+	utassert(three.max_total <= 512 * 1024);
+}
+
+// Counts the packets of a connection on the wire, for the drop_procs of
+// both its links. Drops nothing
+struct ack_spy {
+	uint32_t data;
+	// acks from the sender with an ack frequency header
+	uint32_t ack_freq;
+	uint32_t acks;
+	// the SYN-ACK agreed to the ack frequency extension
+	bool agreed;
+};
+
+// the extension of the given type in a version 1 packet, or NULL
+const unsigned char* find_extension(const unsigned char *p, size_t len, int type)
+{
+	const unsigned char* const end = p + len;
+	const unsigned char* data = p + 20;
+	int ext = p[1];
+	while (ext != 0) {
+		if (end - data < 2 || end - data - 2 < data[1]) return NULL;
+		if (ext == type) return data;
+		ext = data[0];
+		data += data[1] + 2;
+	}
+	return NULL;
+}
+
+bool ack_spy_up_proc(void *userdata, const unsigned char *p, size_t len)
+{
+	ack_spy* a = (ack_spy*)userdata;
+	if (len < 20) return false;
+	// a version 1 ST_DATA packet, or an ST_STATE one
+	if (p[0] == 0x01) ++a->data;
+	if (p[0] == 0x21 && find_extension(p, len, 3)) ++a->ack_freq;
+	return false;
+}
+
+bool ack_spy_down_proc(void *userdata, const unsigned char *p, size_t len)
+{
+	ack_spy* a = (ack_spy*)userdata;
+	// a version 1 ST_STATE packet
+	if (len < 20 || p[0] != 0x21) return false;
+	++a->acks;
+	// the extension bits, only sent in the SYN-ACK
+	const unsigned char* bits = find_extension(p, len, 2);
+	if (bits && bits[1] == 8 && (bits[2 + 7] & 2)) a->agreed = true;
+	return false;
+}
+
+// A bulk transfer over 50 Mbit/s and a 100 ms round trip for ten
+// seconds, with the sender asking for the ack frequency extension or not
+ack_spy test_ack_frequency_bulk(bool ack_frequency)
+{
+	sim s(17);
+	ack_spy a;
+	memset(&a, 0, sizeof(a));
+	sim_link_config up;
+	up.bandwidth = 6250000;
+	up.buffer = 1000000;
+	up.delay = 50000;
+	up.drop_proc = &ack_spy_up_proc;
+	up.drop_userdata = &a;
+	sim_link_config down;
+	down.delay = 50000;
+	down.drop_proc = &ack_spy_down_proc;
+	down.drop_userdata = &a;
+
+	bulk_end sender = {NULL, true, false, 0};
+	bulk_end receiver = {NULL, false, false, 0};
+	sim_endpoint* e1 = s.add_endpoint("10.0.0.1", 6881, s.add_link(up), NULL, NULL);
+	sim_endpoint* e2 = s.add_endpoint("10.0.0.2", 6881, s.add_link(down), &bulk_incoming, &receiver);
+
+	sender.sock = s.create_socket(e1, e2);
+	UTP_SetCallbacks(sender.sock, &bulk_callbacks, &sender);
+	UTP_SetSockopt(sender.sock, SO_UTPACKFREQUENCY, ack_frequency);
+	UTP_Connect(sender.sock);
+	s.run(10000000);
+	printf("ack frequency %s: %u data packets, %u ack frequency headers, %u acks\n",
+		   ack_frequency ? "on" : "off", a.data, a.ack_freq, a.acks);
+
+	UTP_Close(sender.sock);
+	for (int i = 0; i < 100 && !(sender.destroyed && receiver.destroyed); ++i)
+		s.run(100000);
+	utassert(sender.destroyed && receiver.destroyed);
+	return a;
+}
+
+// With the ack frequency extension, both ends agree to it in the
+// handshake, the sender tells the receiver how often to ack in its own
+// acks, and the receiver acks less than every other packet
+void test_ack_frequency()
+{
+	const ack_spy off = test_ack_frequency_bulk(false);
+	utassert(!off.agreed && off.ack_freq == 0);
+	utassert(off.acks * 3 > off.data);
+
+	const ack_spy on = test_ack_frequency_bulk(true);
+	utassert(on.agreed && on.ack_freq > 0);
+	utassert((uint64_t)on.acks * off.data < (uint64_t)off.acks * on.data / 2);
+}
+
+// 50 Mbit/s and a 200 ms round trip, more than 511 packets in flight.
+// Without the large window extension the window stops growing at 511
+// packets a round trip. LEDBAT only grows it by a few kB a round trip,
+// so this takes a couple of minutes
+void test_long_fat_network()
+{
+	sim_link_config up;
+	up.bandwidth = 6250000;
+	up.buffer = 1000000;
+	up.delay = 100000;
+	const bulk_result small = test_bulk(3, up, 120, false);
+	const bulk_result large = test_bulk(3, up, 120, true);
+	utassert(small.received < 511 * 1400 * 5 * 120);
+	utassert(large.received > small.received * 5 / 4);
+}
+
+// The receiving end of two packets closes from on_read, as soon as it
+// has them both. Its FIN acks the second, or the sender, closing in
+// turn, takes it for lost and the close for a reset
+void close_on_read(void* socket, const unsigned char* bytes, size_t count)
+{
+	bulk_end* e = (bulk_end*)socket;
+	e->received += count;
+	if (e->received == 2000) UTP_Close(e->sock);
+}
+
+static size_t g_close_sent;
+
+void close_write(void *socket, unsigned char *bytes, size_t count)
+{
+	memset(bytes, 0, count);
+	g_close_sent += count;
+}
+
+void close_state(void *socket, int state)
+{
+	bulk_end* e = (bulk_end*)socket;
+	if (state == UTP_STATE_CONNECT || state == UTP_STATE_WRITABLE) UTP_Write(e->sock, 2000 - g_close_sent);
+	else bulk_state(socket, state);
+}
+
+UTPFunctionTable close_callbacks = {
+	&close_on_read, &close_write, &bulk_get_rb_size, &close_state, &bulk_error, &bulk_overhead
+};
+
+void close_incoming(void *userdata, UTPSocket* conn)
+{
+	bulk_end* e = (bulk_end*)userdata;
+	e->sock = conn;
+	UTP_SetCallbacks(conn, &close_callbacks, e);
+}
+
+void test_close_from_read()
+{
+	sim s(11);
+	sim_link_config link;
+	link.delay = 10000;
+	bulk_end sender = {NULL, true, false, 0};
+	bulk_end receiver = {NULL, false, false, 0};
+	sim_endpoint* a = s.add_endpoint("10.0.0.1", 6881, s.add_link(link), NULL, NULL);
+	sim_endpoint* b = s.add_endpoint("10.0.0.2", 6881, s.add_link(link), &close_incoming, &receiver);
+
+	sender.sock = s.create_socket(a, b);
+	UTP_SetCallbacks(sender.sock, &close_callbacks, &sender);
+	UTP_Connect(sender.sock);
+	for (int i = 0; i < 100 && !(sender.destroyed && receiver.destroyed); ++i)
+		s.run(100000);
+	utassert(receiver.received == 2000);
+	utassert(sender.destroyed && receiver.destroyed);
+}
+
+// Random numbers that count up from g_collide_next, for connection ids
+// of our choosing. The clock stays the simulation's
+static sim* g_collide_sim;
+static uint32_t g_collide_next;
+
+static uint64_t collide_get_microseconds(void *userdata) { return g_collide_sim->now(); }
+static uint32_t collide_random(void *userdata) { return g_collide_next++; }
+
+static void collide_incoming(void *userdata, UTPSocket* conn)
+{
+	bulk_end* receivers = (bulk_end*)userdata;
+	bulk_end* e = receivers[0].sock == NULL ? &receivers[0] : &receivers[1];
+	bulk_incoming(e, conn);
+}
+
+// Two connections to the same host, where the second draws the id the
+// first one receives on. It has to pick another one, or the host takes
+// its SYN for a resend of the first one's. The id is the last of the 16
+// bit ones, so the first one's other id wraps around to 0
+void test_conn_id_collision()
+{
+	sim s(5);
+	g_collide_sim = &s;
+	// a SYN cookie has the ids of the connection, so the host gets them
+	// right even when the connecting end doesn't. Without, it works them
+	// out from the SYN
+	UTP_SetGlobalOpt(UTP_GLOBAL_SYN_COOKIES, 0);
+	UTP_SetGlobalOpt(UTP_GLOBAL_LISTEN_BACKLOG, 0);
+	UTP_SetGlobalOpt(UTP_GLOBAL_MAX_HALF_OPEN, 0);
+	UTPSystemFunctions funcs = { &collide_get_microseconds, &collide_random };
+	UTP_SetSystemFunctions(&funcs, NULL);
+
+	bulk_end senders[2] = {{NULL, true, false, 0}, {NULL, true, false, 0}};
+	bulk_end receivers[2] = {{NULL, false, false, 0}, {NULL, false, false, 0}};
+	sim_link_config link;
+	link.delay = 10000;
+	sim_endpoint* a = s.add_endpoint("10.0.0.1", 6881, s.add_link(link), NULL, NULL);
+	sim_endpoint* b = s.add_endpoint("10.0.0.2", 6881, s.add_link(link), &collide_incoming, receivers);
+
+	for (int i = 0; i < 2; ++i) {
+		senders[i].sock = s.create_socket(a, b);
+		UTP_SetCallbacks(senders[i].sock, &bulk_callbacks, &senders[i]);
+		g_collide_next = 0xffff;
+		UTP_Connect(senders[i].sock);
+	}
+	s.run(2000000);
+	utassert(receivers[0].received > 0 && receivers[1].received > 0);
+
+	for (int i = 0; i < 2; ++i) UTP_Close(senders[i].sock);
+	for (int i = 0; i < 600 && !(senders[0].destroyed && senders[1].destroyed &&
+								 receivers[0].destroyed && receivers[1].destroyed); ++i)
+		s.run(100000);
+	utassert(senders[0].destroyed && senders[1].destroyed);
+	utassert(receivers[0].destroyed && receivers[1].destroyed);
+	g_collide_sim = NULL;
 }
 
 extern "C" bool wrapping_compare_less(uint32_t lhs, uint32_t rhs);
@@ -454,11 +1152,6 @@ int main()
 	utassert(wrapping_compare_less(0x1, 0x0) == false);
 	utassert(wrapping_compare_less(0x1, 0x1) == false);
 
-	send_udp_manager = new test_manager;
-	receive_udp_manager = new test_manager;
-	send_udp_manager->bind(receive_udp_manager);
-	receive_udp_manager->bind(send_udp_manager);
-
 #define _ if (!g_error)
 
 	printf("\nTesting transfer\n");
@@ -482,6 +1175,55 @@ int main()
 	_ test_transfer(use_utp_v1 | simulate_packetloss | simulate_packetreorder | heavy_loss);
 	_ printf("\nTesting transfer using utp v1 with simulated packet reorder\n");
 	_ test_transfer(use_utp_v1 | simulate_packetreorder);
+	_ printf("\nTesting transfer using utp v1 with large window, simulated packet loss and reorder\n");
+	_ test_transfer(use_utp_v1 | large_window | simulate_packetloss | simulate_packetreorder);
+	_ printf("\nTesting transfer using utp v1 with receive buffer autotuning and simulated packet loss\n");
+	_ test_transfer(use_utp_v1 | rcvbuf_autotune | simulate_packetloss);
+	_ printf("\nTesting transfer using utp v1 with send buffer autotuning and simulated packet loss\n");
+	_ test_transfer(use_utp_v1 | sndbuf_autotune | simulate_packetloss);
+	_ printf("\nTesting transfer using utp v1 with ack frequency, simulated packet loss and reorder\n");
+	_ test_transfer(use_utp_v1 | ack_frequency | simulate_packetloss | simulate_packetreorder);
+	_ printf("\nTesting transfer using utp v1 with SYN cookies, large window and simulated packet loss\n");
+	_ test_transfer(use_utp_v1 | syn_cookies | large_window | simulate_packetloss);
+	_ printf("\nTesting transfer using utp v1 with SYN cookies and ack frequency\n");
+	_ test_transfer(use_utp_v1 | syn_cookies | ack_frequency);
+	_ printf("\nTesting transfer with SYN cookies and simulated packet loss\n");
+	_ test_transfer(syn_cookies | simulate_packetloss);
+	_ printf("\nTesting transfer with a lost SYN-ACK\n");
+	_ test_transfer(lose_synack);
+	_ printf("\nTesting transfer using utp v1 with a lost SYN-ACK and simulated packet loss\n");
+	_ test_transfer(use_utp_v1 | lose_synack | simulate_packetloss);
+	_ printf("\nTesting transfer through the accept queue\n");
+	_ test_transfer(accept_queue);
+	_ printf("\nTesting transfer using utp v1 through the accept queue with SYN cookies and simulated packet loss\n");
+	_ test_transfer(use_utp_v1 | accept_queue | syn_cookies | simulate_packetloss);
+	_ printf("\nTesting connection refused for too many connections from one host\n");
+	_ test_refused(0);
+	_ printf("\nTesting connection refused for too many connections from one host with SYN cookies\n");
+	_ test_refused(syn_cookies | accept_queue);
+	_ printf("\nTesting closing from on_read\n");
+	_ test_close_from_read();
+	_ printf("\nTesting two connections to one host drawing the same connection id\n");
+	_ test_conn_id_collision();
+
+	_ printf("\nTesting ten minutes through a bottleneck with a bloated buffer\n");
+	_ test_bufferbloat();
+	_ printf("\nTesting the target delay set for new sockets\n");
+	_ test_target_delay();
+	_ printf("\nTesting the same simulation twice gives the same result\n");
+	_ test_deterministic();
+	_ printf("\nTesting RACK with late and lost packets\n");
+	_ test_rack();
+	_ printf("\nTesting a lost tail packet is recovered by a probe\n");
+	_ test_tail_loss_probe();
+	_ printf("\nTesting receive buffer autotuning on a long fat network\n");
+	_ test_rcvbuf_autotune();
+	_ test_sndbuf_autotune();
+	_ test_ack_frequency();
+	_ printf("\nTesting header prediction on a clean link\n");
+	_ test_header_prediction();
+	_ printf("\nTesting transfer over a long fat network, with and without large window\n");
+	_ test_long_fat_network();
 
 	return 0;
 }
@@ -37,6 +37,15 @@
 #define REORDER_BUFFER_MAX_SIZE 511
 #define OUTGOING_BUFFER_MAX_SIZE 511
 
+// with the large window extension, this many packets may be in flight,
+// and received ahead of ack_nr. It has to stay well below half the
+// sequence number space
+#define LARGE_WINDOW_MAX_SIZE 16383
+
+// the longest EACK bit mask we send, in bytes. Without large windows
+// it's always 4
+#define EACK_MAX_BYTES 252
+
 #define PACKET_SIZE 350
 
 // this is the minimum max_window value. It can never drop below this
@@ -55,10 +64,51 @@
 #define DELAYED_ACK_BYTE_THRESHOLD 2400 // bytes
 #define DELAYED_ACK_TIME_THRESHOLD 100 // milliseconds
 
+// ack frequency extension (SO_UTPACKFREQUENCY). The sender asks for an
+// ack every quarter of its window, but at least every ACK_FREQ_MAX_PACKETS
+// packets, and at least every quarter of an rtt. It tells the other end
+// at most once per rtt, unless nothing was sent for ACK_FREQ_REFRESH
+#define ACK_FREQ_MIN_PACKETS 2
+#define ACK_FREQ_MAX_PACKETS 64
+#define ACK_FREQ_MIN_DELAY 5 // milliseconds
+#define ACK_FREQ_REFRESH 1000 // milliseconds
+#define ACK_FREQ_EXT_LEN 4
+
+// receive buffer autotuning (UTP_GLOBAL_RCVBUF_AUTOTUNE). The receive
+// buffer starts out at RCVBUF_AUTO_INITIAL, and follows twice what the
+// application drains per round trip, within these bounds
+#define RCVBUF_AUTO_INITIAL (128 * 1024)
+#define RCVBUF_AUTO_MIN (16 * 1024)
+#define RCVBUF_AUTO_MAX (32 * 1024 * 1024)
+
+// send buffer autotuning (UTP_GLOBAL_SNDBUF_AUTOTUNE). The send buffer
+// is kept at twice the congestion window, within these bounds
+#define SNDBUF_AUTO_MIN (64 * 1024)
+#define SNDBUF_AUTO_MAX (32 * 1024 * 1024)
+
+// SYN cookies (UTP_GLOBAL_SYN_COOKIES). A cookie is valid for one to
+// two periods of SYN_COOKIE_PERIOD. Only the first packet sent after the
+// SYN-ACK creates the socket. If one of the following
+// SYN_COOKIE_MAX_GAP - 1 gets here first, it's dropped rather than
+// reset, the other end will resend the earlier ones.
+// The cookie is 16 bits, but the low 2 are the extensions, which the
+// packet's own ack_nr supplies, so it carries 14 bits of hash. A packet
+// spoofed without seeing the SYN-ACK is checked against
+// SYN_COOKIE_MAX_GAP gaps in two periods, 16 candidates, and matches
+// one about 1 time in 1024. Enough to stop a SYN flood from filling
+// the accept queue, not to authenticate anyone
+#define SYN_COOKIE_PERIOD 16000 // ms
+#define SYN_COOKIE_MAX_GAP 8
+
 #define RST_INFO_TIMEOUT 10000
+// how long a connection waiting to be accepted may stay half-open
+#define HALF_OPEN_TIMEOUT 10000
 #define RST_INFO_LIMIT 1000
 // 29 seconds determined from measuring many home NAT devices
 #define KEEPALIVE_INTERVAL 29000
+// the longest UTP_NextTimeout() asks the application to wait, so the
+// periodic bookkeeping in UTP_CheckTimeouts() still happens
+#define NEXT_TIMEOUT_MAX 500
 
 
 #define SEQ_NR_MASK 0xFFFF
@@ -72,8 +122,31 @@
 #define LOG_UTP if (g_log_utp) utp_log
 #define LOG_UTPV if (g_log_utp_verbose) utp_log
 
+// The clock and random numbers, see UTP_SetSystemFunctions()
+static uint64_t default_get_microseconds(void *userdata) { return UTP_GetMicroseconds(); }
+static uint32_t default_random(void *userdata) { return UTP_Random(); }
+
+static struct UTPSystemFunctions g_system = { &default_get_microseconds, &default_random };
+static void *g_system_userdata;
+
+static uint32_t utp_random(void)
+{
+	return g_system.random(g_system_userdata);
+}
+
+// The time of the event we're handling. The clock is read once when the
+// application calls in (a packet arriving, a timer tick, a write) and
+// this value is used for everything that happens as a result, so
+// timestamps within one event are consistent, and cheap
+uint64_t g_current_us;
 uint32_t g_current_ms;
 
+static void utp_update_clock(void)
+{
+	g_current_us = g_system.get_microseconds(g_system_userdata);
+	g_current_ms = (uint32_t)(g_current_us / 1000);
+}
+
 // The totals are derived from the following data:
 //  45: IPv6 address including embedded IPv4 address
 //  11: Scope Id
@@ -128,14 +201,52 @@ bool sockaddr_equal(const struct sockaddr *lhs, const struct sockaddr *rhs)
 }
 
 struct RST_Info {
-	struct sockaddr_storage addr;
-	socklen_t addrlen;
+	uint32_t peer;
 	uint32_t connid;
 	uint32_t timestamp;
 	uint16_t ack_nr;
 };
 typedef struct RST_Info RST_Info;
 
+// Every distinct address we have a socket or RST_Info for is stored
+// once, in g_peers. They refer to it by its index, the peer handle, so
+// comparing addresses is comparing handles. See utp_peer_intern()
+struct UTPPeer {
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	// number of sockets and RST_Infos using it. 0 for a free slot
+	uint32_t refs;
+	// next peer in the same g_peer_index bucket, or the next free slot
+	uint32_t next;
+	// the same address with port 0, which counts the sockets with the
+	// host on any port in conns. Holds a reference to it
+	uint32_t host;
+	uint32_t conns;
+};
+typedef struct UTPPeer UTPPeer;
+
+#define PEER_NONE UINT32_MAX
+
+UTPPeer *g_peers;
+size_t g_peers_alloc;
+size_t g_peers_used;
+size_t g_peers_count;
+uint32_t g_peers_free = PEER_NONE;
+// hash buckets of g_peers, a power of two of them, and the key of the hash
+uint32_t *g_peer_index;
+size_t g_peer_index_size;
+uint64_t g_peer_key[2];
+
+static inline const struct sockaddr *utp_peer_addr(uint32_t peer)
+{
+	return (const struct sockaddr *)&g_peers[peer].addr;
+}
+
+static inline socklen_t utp_peer_addrlen(uint32_t peer)
+{
+	return g_peers[peer].addrlen;
+}
+
 // these packet sizes are including the uTP header wich
 // is either 20 or 23 bytes depending on version
 #define PACKET_SIZE_EMPTY_BUCKET 0
@@ -196,6 +307,50 @@ enum {
 	PF1_SIZE_EXT   = 30,
 };
 
+// Whether a socket, or a packet, uses the original header. Built with
+// UTP_V1_ONLY, the library only speaks version 1, this is always false,
+// and the compiler leaves out the code for version 0
+static inline bool utp_is_v0(uint8_t version)
+{
+#ifdef UTP_V1_ONLY
+	(void)version;
+	return false;
+#else
+	return version == 0;
+#endif
+}
+
+// the size of a socket's header template, the largest header there is
+#ifdef UTP_V1_ONLY
+#define HEADER_TEMPLATE_SIZE PF1_SIZE
+#else
+#define HEADER_TEMPLATE_SIZE PF0_SIZE
+#endif
+
+// Bits in the extension bits header (extension type 2), sent in
+// SYN and SYN-ACK. Numbered from the least significant bit of the
+// last byte
+enum {
+	// more than OUTGOING_BUFFER_MAX_SIZE packets in flight
+	EXT_BIT_LARGE_WINDOW = 0,
+	// the ack frequency header (extension type 3) is understood
+	EXT_BIT_ACK_FREQUENCY = 1,
+	// set in a SYN-ACK sent without creating a socket (SYN cookies).
+	// It asks the other end to ack it right away, even if it has
+	// nothing to send, so the socket can be created
+	EXT_BIT_SYN_COOKIE = 2,
+};
+
+static inline bool ext_bit_isset(const uint8_t *ext, int bit)
+{
+	return (ext[7 - bit / 8] & (1 << (bit % 8))) != 0;
+}
+
+static inline void ext_bit_set(uint8_t *ext, int bit)
+{
+	ext[7 - bit / 8] |= 1 << (bit % 8);
+}
+
 enum {
 	ST_DATA = 0,		// Data packet.
 	ST_FIN = 1,			// Finalize the connection. This is the last packet.
@@ -280,8 +435,15 @@ struct OutgoingPacket {
 	size_t length;
 	size_t payload;
 	uint64_t time_sent; // microseconds
-	unsigned transmissions:31;
+	// the packets in flight, in the order they were last sent.
+	// See utp_sent_append()
+	struct OutgoingPacket *sent_prev;
+	struct OutgoingPacket *sent_next;
+	uint16_t seq_nr;
+	unsigned transmissions:30;
 	bool need_resend:1;
+	// declared lost by utp_rack_detect_loss(), as opposed to a timeout
+	bool rack_lost:1;
 	uint8_t data[1];
 };
 typedef struct OutgoingPacket OutgoingPacket;
@@ -376,6 +538,13 @@ bool wrapping_compare_less(uint32_t lhs, uint32_t rhs)
 	return dist_up < dist_down;
 }
 
+// the same as wrapping_compare_less, for 16 bit sequence numbers
+static inline bool seq_less(uint16_t lhs, uint16_t rhs)
+{
+	const uint16_t dist_up = rhs - lhs;
+	return dist_up != 0 && dist_up < 0x8000;
+}
+
 struct DelayHist {
 	uint32_t delay_base;
 
@@ -384,19 +553,26 @@ struct DelayHist {
 	// values are always greater than 0 and measures
 	// the queuing delay in microseconds
 	uint32_t cur_delay_hist[CUR_DELAY_SIZE];
-	size_t cur_delay_idx;
+
+	// the lowest sample since we last stepped the
+	// delay_base_idx. It goes into delay_base_hist
+	// when we step it again
+	uint32_t delay_base_min;
+	// the time when we last stepped the delay_base_idx
+	uint32_t delay_base_time;
+
+	uint8_t cur_delay_idx;
+	uint8_t delay_base_idx;
+	bool delay_base_initialized;
 
 	// this is the history of delay_base. It's
 	// a number that doesn't have an absolute meaning
 	// only relative. It doesn't make sense to initialize
 	// it to anything other than values relative to
 	// what's been seen in the real world.
-	uint32_t delay_base_hist[DELAY_BASE_HISTORY];
-	size_t delay_base_idx;
-	// the time when we last stepped the delay_base_idx
-	uint32_t delay_base_time;
-
-	bool delay_base_initialized;
+	// It's only needed once a minute, so it's kept
+	// with the cold fields of the socket
+	uint32_t *delay_base_hist;
 };
 typedef struct DelayHist DelayHist;
 
@@ -404,6 +580,7 @@ void delayhist_clear(DelayHist *hist)
 {
 	hist->delay_base_initialized = false;
 	hist->delay_base = 0;
+	hist->delay_base_min = 0;
 	hist->cur_delay_idx = 0;
 	hist->delay_base_idx = 0;
 	hist->delay_base_time = g_current_ms;
@@ -426,6 +603,7 @@ void delayhist_shift(DelayHist *hist, const uint32_t offset)
 	for (size_t i = 0; i < DELAY_BASE_HISTORY; i++) {
 		hist->delay_base_hist[i] += offset;
 	}
+	hist->delay_base_min += offset;
 	hist->delay_base += offset;
 }
 
@@ -479,14 +657,15 @@ void delayhist_add_sample(DelayHist *hist, const uint32_t sample)
 			hist->delay_base_hist[i] = sample;
 			continue;
 		}
+		hist->delay_base_min = sample;
 		hist->delay_base = sample;
 		hist->delay_base_initialized = true;
 	}
 
-	if (wrapping_compare_less(sample, hist->delay_base_hist[hist->delay_base_idx])) {
+	if (wrapping_compare_less(sample, hist->delay_base_min)) {
 		// sample is smaller than the current delay_base_hist entry
 		// update it
-		hist->delay_base_hist[hist->delay_base_idx] = sample;
+		hist->delay_base_min = sample;
 	}
 
 	// is sample lower than delay_base? If so, update delay_base
@@ -508,10 +687,12 @@ void delayhist_add_sample(DelayHist *hist, const uint32_t sample)
 	// once every minute
 	if (g_current_ms - hist->delay_base_time > 60 * 1000) {
 		hist->delay_base_time = g_current_ms;
+		hist->delay_base_hist[hist->delay_base_idx] = hist->delay_base_min;
 		hist->delay_base_idx = (hist->delay_base_idx + 1) % DELAY_BASE_HISTORY;
 		// clear up the new delay base history spot by initializing
 		// it to the current sample, then update it
 		hist->delay_base_hist[hist->delay_base_idx] = sample;
+		hist->delay_base_min = sample;
 		hist->delay_base = hist->delay_base_hist[0];
 		// Assign the lowest delay in the last 2 minutes to delay_base
 		for (size_t i = 0; i < DELAY_BASE_HISTORY; i++) {
@@ -531,53 +712,48 @@ uint32_t delayhist_get_value(DelayHist *hist)
 	return value;
 }
 
-struct UTPSocket {
-	struct sockaddr_storage addr;
-	socklen_t addrlen;
-
-	size_t idx;
-
-	uint16_t reorder_count;
-	uint8_t duplicate_ack;
-
-	// the number of bytes we've received but not acked yet
-	size_t bytes_since_ack;
-
-	// the number of packets in the send queue. Packets that haven't
-	// yet been sent count as well as packets marked as needing resend
-	// the oldest un-acked packet in the send queue is seq_nr - cur_window_packets
-	uint16_t cur_window_packets;
-
-	// how much of the window is used, number of bytes in-flight
-	// packets that have not yet been sent do not count, packets
-	// that are marked as needing to be re-sent (due to a timeout)
-	// don't count either
-	size_t cur_window;
-	// maximum window size, in bytes
-	size_t max_window;
-	// SO_SNDBUF setting, in bytes
-	size_t opt_sndbuf;
-	// SO_RCVBUF setting, in bytes
-	size_t opt_rcvbuf;
+// The protocol tunables. New sockets start out with g_tunables, the
+// defines above unless UTP_SetGlobalOpt() changed them, and the SO_UTP*
+// options change them for one socket. See utp_set_tunable()
+struct UTPTunables {
+	// the queueing delay LEDBAT aims for, in microseconds
+	int32_t target_delay;
+	uint32_t max_cwnd_increase;
+	uint32_t duplicate_acks;
+	uint32_t delayed_ack_bytes;
+	uint32_t delayed_ack_time;
+	int32_t keepalive_interval;
+	uint32_t min_window;
+	int32_t max_window_decay;
+	bool packet_pacing;
+};
 
-	// Is a FIN packet in the reassembly buffer?
-	bool got_fin:1;
-	// Timeout procedure
-	bool fast_timeout:1;
+struct UTPTunables g_tunables = {
+	CCONTROL_TARGET, MAX_CWND_INCREASE_BYTES_PER_RTT, DUPLICATE_ACKS_BEFORE_RESEND,
+	DELAYED_ACK_BYTE_THRESHOLD, DELAYED_ACK_TIME_THRESHOLD, KEEPALIVE_INTERVAL,
+	MIN_WINDOW_SIZE, MAX_WINDOW_DECAY, USE_PACKET_PACING
+};
 
-	// max receive window for other end, in bytes
-	size_t max_window_user;
+// The fields used by every packet sent or received come first, and the
+// ones the lookup and ack processing use within the first two cache
+// lines. The cold fields, used once in a while, are at the end. Keep it
+// that way when adding fields. bench/bench_ack measures the effect.
+struct UTPSocket {
+	// handle of the address of the other end, see utp_peer_intern()
+	uint32_t peer;
+	// Connection ID for packets I receive
+	uint32_t conn_id_recv;
+	// Connection ID for packets I send
+	uint32_t conn_id_send;
+	// the header of the packets we send, with the fields that are the
+	// same in all of them filled in, see utp_write_header()
+	uint8_t header[HEADER_TEMPLATE_SIZE];
+	enum CONN_STATE state;
 	// 0 = original uTP header, 1 = second revision
 	uint8_t version;
-	enum CONN_STATE state;
-	// TickCount when we last decayed window (wraps)
-	int32_t last_rwin_decay;
-
-	// the sequence number of the FIN packet. This field is only set
-	// when we have received a FIN, and the flag field has the FIN flag set.
-	// it is used to know when it is safe to destroy the socket, we must have
-	// received all packets up to this sequence number first.
-	uint16_t eof_pkt;
+	// packets acked past the first missing one, see utp_selective_ack()
+	uint16_t duplicate_ack;
+	uint16_t reorder_count;
 
 	// All sequence numbers up to including this have been properly received
 	// by us
@@ -585,7 +761,10 @@ struct UTPSocket {
 	// This is the sequence number for the next packet to be sent.
 	uint16_t seq_nr;
 
-	uint16_t timeout_seq_nr;
+	// the number of packets in the send queue. Packets that haven't
+	// yet been sent count as well as packets marked as needing resend
+	// the oldest un-acked packet in the send queue is seq_nr - cur_window_packets
+	uint16_t cur_window_packets;
 
 	// This is the sequence number of the next packet we're allowed to
 	// do a fast resend with. This makes sure we only do a fast-resend
@@ -593,22 +772,44 @@ struct UTPSocket {
 	// or any later packet (with a higher sequence number).
 	uint16_t fast_resend_seq_nr;
 
-	uint32_t reply_micro;
+	uint16_t timeout_seq_nr;
 
-	// the time when we need to send another ack. If there's
-	// nothing to ack, this is a very large number
-	uint32_t ack_time;
+	// the sequence number of the FIN packet. This field is only set
+	// when we have received a FIN, and the flag field has the FIN flag set.
+	// it is used to know when it is safe to destroy the socket, we must have
+	// received all packets up to this sequence number first.
+	uint16_t eof_pkt;
 
-	uint32_t last_got_packet;
-	uint32_t last_sent_packet;
-	uint32_t last_measured_delay;
-	uint32_t last_maxed_out_window;
+	// the number of packets we've received but not acked yet
+	uint16_t packets_since_ack;
 
-	// the last time we added send quota to the connection
-	// when adding send quota, this is subtracted from the
-	// current time multiplied by max_window / rtt
-	// which is the current allowed send rate.
-	int32_t last_send_quota;
+	// how many packets, and how many milliseconds, the other end lets
+	// us wait before we ack (ack frequency extension). 0 means the
+	// defaults, tun.delayed_ack_bytes and tun.delayed_ack_time
+	uint16_t ack_freq_packets;
+	uint16_t ack_freq_delay;
+
+	// Is a FIN packet in the reassembly buffer?
+	bool got_fin:1;
+	// Timeout procedure
+	bool fast_timeout:1;
+	// The large window extension was asked for by SO_UTPLARGEWINDOW,
+	// and whether the other end agreed to it
+	bool large_window_wanted:1;
+	bool large_window:1;
+	// Same for the ack frequency extension and SO_UTPACKFREQUENCY
+	bool ack_frequency_wanted:1;
+	bool ack_frequency:1;
+	// opt_rcvbuf is autotuned, see utp_rcvbuf_autotune()
+	bool rcvbuf_auto:1;
+	// opt_sndbuf is autotuned, see utp_sndbuf_autotune()
+	bool sndbuf_auto:1;
+	// An incoming connection we haven't heard from since the SYN-ACK
+	bool half_open:1;
+	// An incoming connection for UTP_Accept(), that hasn't been accepted
+	// yet, and whether it's in the accept queue already
+	bool accept_pending:1;
+	bool accept_queued:1;
 
 	// the number of bytes we are allowed to send on
 	// this connection. If this is more than one packet
@@ -618,10 +819,39 @@ struct UTPSocket {
 	// higher accuracy when dealing with low rates
 	int32_t send_quota;
 
-	SendToProc *send_to_proc;
-	void *send_to_userdata;
-	struct UTPFunctionTable func;
-	void *userdata;
+	// the last time we added send quota to the connection
+	// when adding send quota, this is subtracted from the
+	// current time multiplied by max_window / rtt
+	// which is the current allowed send rate.
+	int32_t last_send_quota;
+
+	// the time when we need to send another ack. If there's
+	// nothing to ack, this is a very large number
+	uint32_t ack_time;
+
+	uint32_t last_got_packet;
+	uint32_t last_sent_packet;
+	uint32_t reply_micro;
+
+	// how much of the window is used, number of bytes in-flight
+	// packets that have not yet been sent do not count, packets
+	// that are marked as needing to be re-sent (due to a timeout)
+	// don't count either
+	size_t cur_window;
+	// maximum window size, in bytes
+	size_t max_window;
+	// max receive window for other end, in bytes
+	size_t max_window_user;
+	// SO_SNDBUF setting, in bytes
+	size_t opt_sndbuf;
+	// SO_RCVBUF setting, in bytes
+	size_t opt_rcvbuf;
+	// Last rcv window we advertised, in bytes
+	size_t last_rcv_win;
+	// the number of bytes we've received but not acked yet
+	size_t bytes_since_ack;
+
+	SizableCircularBuffer inbuf, outbuf;
 
 	// Round trip time
 	unsigned rtt;
@@ -629,28 +859,106 @@ struct UTPSocket {
 	unsigned rtt_var;
 	// Round trip timeout
 	unsigned rto;
-	DelayHist rtt_hist;
 	unsigned retransmit_timeout;
 	// The RTO timer will timeout here.
 	unsigned rto_timeout;
+
+	uint32_t last_measured_delay;
+	uint32_t last_maxed_out_window;
+	// TickCount when we last decayed window (wraps)
+	int32_t last_rwin_decay;
+
+	// RACK loss detection, see utp_rack_detect_loss()
+	// the packets in flight, oldest sent first
+	OutgoingPacket *sent_head;
+	OutgoingPacket *sent_tail;
+	// the send time of the most recently sent packet that has been acked,
+	// in microseconds. 0 means nothing has been acked yet
+	uint64_t rack_xmit_time;
+	// the round trip time of that packet, in microseconds
+	uint32_t rack_rtt;
+	// when the reordering timer expires (wraps)
+	uint32_t rack_timeout;
+	// the sequence number of that packet, used to break ties
+	uint16_t rack_seq_nr;
+	// the highest sequence number acked by an earlier packet, and the
+	// highest one acked so far. Used to detect reordering
+	uint16_t rack_fack;
+	uint16_t rack_fack_next;
+	// a loss recovery ends when everything before this has been acked
+	uint16_t rack_recovery_seq;
+	// the reordering window is a multiple of min_rtt/4. It grows
+	// when we find out we have retransmitted spuriously, and
+	// decays back after rack_reo_wnd_persist loss recoveries
+	uint8_t rack_reo_wnd_mult;
+	uint8_t rack_reo_wnd_persist;
+	bool rack_reordering_seen;
+	bool rack_timer;
+	bool rack_in_recovery;
+
+	// tail loss probe, see utp_arm_tail_loss_probe()
+	bool tlp_timer;
+	// a probe has been sent and nothing has been acked since
+	bool tlp_in_flight;
+	// when the probe timer expires (wraps)
+	uint32_t tlp_timeout;
+
 	// When the window size is set to zero, start this timer. It will send a new packet every 30secs.
 	uint32_t zerowindow_time;
 
-	uint32_t conn_seed;
-	// Connection ID for packets I receive
-	uint32_t conn_id_recv;
-	// Connection ID for packets I send
-	uint32_t conn_id_send;
-	// Last rcv window we advertised, in bytes
-	size_t last_rcv_win;
-
 	DelayHist our_hist;
 	DelayHist their_hist;
+	DelayHist rtt_hist;
+
+	SendToProc *send_to_proc;
+	void *send_to_userdata;
+	void *userdata;
+	struct UTPFunctionTable func;
+
+	// total number of bytes passed to on_read
+	uint64_t rcv_delivered;
+
+	struct UTPTunables tun;
+
+	// Cold fields
+
+	size_t idx;
+
+	// what we last asked the other end for in the ack frequency
+	// extension, and when
+	uint16_t ack_freq_sent_packets;
+	uint16_t ack_freq_sent_delay;
+	uint32_t ack_freq_sent_time;
+
+	// number of the bytes passed to on_read the application had
+	// drained from its read buffer, and when, at the last receive
+	// buffer autotuning measurement
+	uint64_t rcv_drained;
+	uint32_t rcv_measure_time;
+	// the round trip time from the one way delays of the packets we
+	// receive, in milliseconds. A socket that only receives has no
+	// other. See utp_take_delay_sample()
+	uint32_t rcv_rtt;
+
+	// when the SYN of a half-open connection came in
+	uint32_t half_open_time;
+
+	uint32_t conn_seed;
+	bool seed_indexed;
+	// next incoming socket in the same g_seed_index bucket
+	struct UTPSocket *seed_next;
+
+	// loss counters, returned by UTP_GetLossStats()
+	uint32_t lost_packets;
+	uint32_t spurious_resends;
+	uint32_t timeouts;
+	uint32_t tail_probes;
 
 	// extension bytes from SYN packet
 	uint8_t extensions[8];
 
-	SizableCircularBuffer inbuf, outbuf;
+	// delay_base_hist of our_hist, their_hist and rtt_hist
+	uint32_t delay_base_hist[3][DELAY_BASE_HISTORY];
 
 #ifdef _DEBUG
 	// Public stats, returned by UTP_GetStats().  See utp.h
@@ -663,6 +971,10 @@ typedef struct UTPSocket UTPSocket;
 // Calculates the current receive window
 static size_t utp_get_rcv_window(const UTPSocket *conn)
 {
+	// Keep the other end from sending until the application accepts
+	// the connection
+	if (conn->accept_queued) return 0;
+
 	// If we don't have a connection (such as during connection
 	// establishment, always act as if we have an empty buffer).
 	if (!conn->userdata) return conn->opt_rcvbuf;
@@ -679,7 +991,7 @@ static size_t utp_get_rcv_window(const UTPSocket *conn)
 // or fail to do one when we really shouldn't.
 static bool utp_can_decay_win(const UTPSocket *conn, int32_t msec)
 {
-	return msec - conn->last_rwin_decay >= MAX_WINDOW_DECAY;
+	return msec - conn->last_rwin_decay >= conn->tun.max_window_decay;
 }
 
 // If we can, decay max window, returns true if we actually did so
@@ -689,35 +1001,48 @@ static void utp_maybe_decay_win(UTPSocket *conn)
 		// TCP uses 0.5
 		conn->max_window = (size_t)(conn->max_window * .5);
 		conn->last_rwin_decay = g_current_ms;
-		if (conn->max_window < MIN_WINDOW_SIZE)
-			conn->max_window = MIN_WINDOW_SIZE;
+		if (conn->max_window < conn->tun.min_window)
+			conn->max_window = conn->tun.min_window;
 	}
 }
 
 static size_t utp_get_header_size(const UTPSocket *conn)
 {
-	return conn->version ? PF1_SIZE : PF0_SIZE;
+	return utp_is_v0(conn->version) ? PF0_SIZE : PF1_SIZE;
 }
 
 static size_t utp_get_header_extensions_size(const UTPSocket *conn)
 {
-	return conn->version ? PF1_SIZE_EXT : PF0_SIZE_EXT;
+	return utp_is_v0(conn->version) ? PF0_SIZE_EXT : PF1_SIZE_EXT;
+}
+
+// the max number of packets in the send queue
+static size_t utp_get_max_window_packets(const UTPSocket *conn)
+{
+	return conn->large_window ? LARGE_WINDOW_MAX_SIZE : OUTGOING_BUFFER_MAX_SIZE;
+}
+
+// the max number of packets past ack_nr we accept into the reorder buffer
+static size_t utp_get_max_reorder_packets(const UTPSocket *conn)
+{
+	return conn->large_window ? LARGE_WINDOW_MAX_SIZE : REORDER_BUFFER_MAX_SIZE;
 }
 
 static void utp_sent_ack(UTPSocket *conn)
 {
 	conn->ack_time = g_current_ms + 0x70000000;
 	conn->bytes_since_ack = 0;
+	conn->packets_since_ack = 0;
 }
 
 static size_t utp_get_udp_mtu(const UTPSocket *conn)
 {
-	return UTP_GetUDPMTU((const struct sockaddr *)&conn->addr, conn->addrlen);
+	return UTP_GetUDPMTU(utp_peer_addr(conn->peer), utp_peer_addrlen(conn->peer));
 }
 
 static size_t utp_get_udp_overhead(const UTPSocket *conn)
 {
-	return UTP_GetUDPOverhead((const struct sockaddr *)&conn->addr, conn->addrlen);
+	return UTP_GetUDPOverhead(utp_peer_addr(conn->peer), utp_peer_addrlen(conn->peer));
 }
 
 static size_t utp_get_overhead(const UTPSocket *conn)
@@ -734,6 +1059,85 @@ UTPSocket **g_utp_sockets;
 size_t g_utp_sockets_alloc;
 size_t g_utp_sockets_count;
 
+// What incoming packets are matched on, for each socket in g_utp_sockets
+// at the same index. Finding the socket for a packet scans this rather
+// than the sockets themselves, which would touch a cache line of every
+// socket
+struct UTPSocketKey {
+	uint32_t peer;
+	uint32_t conn_id_recv;
+	uint32_t conn_id_send;
+};
+struct UTPSocketKey *g_utp_socket_keys;
+
+// Fill in the header template from the version and the id we send on
+static void utp_set_header_template(UTPSocket *conn)
+{
+	uint8_t *h = conn->header;
+	memset(h, 0, sizeof(conn->header));
+	if (utp_is_v0(conn->version)) {
+		set32(h + PF0_CONNID, conn->conn_id_send);
+	} else {
+		h[PF1_TYPE] = 1;
+		set16(h + PF1_CONNID, conn->conn_id_send);
+	}
+}
+
+static void utp_set_conn_ids(UTPSocket *conn, uint32_t conn_id_recv, uint32_t conn_id_send)
+{
+	conn->conn_id_recv = conn_id_recv;
+	conn->conn_id_send = conn_id_send;
+	g_utp_socket_keys[conn->idx].conn_id_recv = conn_id_recv;
+	g_utp_socket_keys[conn->idx].conn_id_send = conn_id_send;
+	utp_set_header_template(conn);
+}
+
+// Whether another socket to peer receives or sends on id. The peer
+// knows its sockets by the ids we send on
+static bool utp_conn_id_in_use(const UTPSocket *conn, uint32_t peer, uint32_t id)
+{
+	for (size_t i = 0; i < g_utp_sockets_count; i++) {
+		const struct UTPSocketKey *key = &g_utp_socket_keys[i];
+		if (key->peer == peer && (key->conn_id_recv == id || key->conn_id_send == id) &&
+			g_utp_sockets[i] != conn)
+			return true;
+	}
+	return false;
+}
+
+// receive buffer autotuning for new sockets, and the memory budget
+// for the receive buffers of all autotuned sockets (0 is unlimited)
+bool g_rcvbuf_autotune;
+size_t g_rcvbuf_budget;
+size_t g_rcvbuf_total;
+
+// same for the send buffers
+bool g_sndbuf_autotune;
+size_t g_sndbuf_budget;
+size_t g_sndbuf_total;
+
+// Incoming sockets, hashed by address and conn_seed, to recognize
+// SYNs that we've already answered. A power of two number of buckets
+UTPSocket **g_seed_index;
+size_t g_seed_index_size;
+size_t g_seed_index_count;
+
+// Incoming connections waiting for UTP_Accept(), if the backlog isn't 0
+size_t g_listen_backlog;
+UTPSocket **g_accept_queue;
+size_t g_accept_queue_alloc;
+size_t g_accept_queue_count;
+
+// limits on incoming connections, 0 is unlimited
+size_t g_max_conns_per_host;
+size_t g_max_half_open;
+size_t g_half_open_count;
+
+// answer SYNs without creating a socket, and the secret key the
+// SYN cookies are derived with
+bool g_syn_cookies;
+uint64_t g_syn_cookie_key[2];
+
 static void UTP_RegisterSentPacket(size_t length) {
 	if (length <= PACKET_SIZE_MID) {
 		if (length <= PACKET_SIZE_EMPTY) {
@@ -761,9 +1165,9 @@ static void utp_send_data(UTPSocket *conn, uint8_t *pkt, size_t length, enum ban
 	// time stamp this packet with local time, the stamp goes into
 	// the header of every packet at the 8th byte for 8 bytes :
 	// two integers, check packet.h for more
-	uint64_t time = UTP_GetMicroseconds();
+	uint64_t time = g_current_us;
 
-	if (conn->version == 0) {
+	if (utp_is_v0(conn->version)) {
 		set32(pkt + PF0_TV_SEC, time / 1000000);
 		set32(pkt + PF0_TV_USEC, time % 1000000);
 		set32(pkt + PF0_DELAY_USEC, conn->reply_micro);
@@ -791,105 +1195,185 @@ static void utp_send_data(UTPSocket *conn, uint8_t *pkt, size_t length, enum ban
 		conn->func.on_overhead(conn->userdata, true, n, type);
 	}
 #if g_log_utp_verbose
-	uint8_t flags = conn->version == 0 ? pkt[PF0_FLAGS] : pkt[PF1_TYPE] >> 4;
-	uint16_t seq_nr = conn->version == 0 ? get16(pkt + PF0_SEQ_NR) : get16(pkt + PF1_SEQ_NR);
-	uint16_t ack_nr = conn->version == 0 ? get16(pkt + PF0_ACK_NR) : get16(pkt + PF1_ACK_NR);
+	uint8_t flags = utp_is_v0(conn->version) ? pkt[PF0_FLAGS] : pkt[PF1_TYPE] >> 4;
+	uint16_t seq_nr = utp_is_v0(conn->version) ? get16(pkt + PF0_SEQ_NR) : get16(pkt + PF1_SEQ_NR);
+	uint16_t ack_nr = utp_is_v0(conn->version) ? get16(pkt + PF0_ACK_NR) : get16(pkt + PF1_ACK_NR);
 	LOG_UTPV("0x%08x: send %s len:%u id:%u timestamp:" I64u " reply_micro:%u flags:%s seq_nr:%u ack_nr:%u",
-	         conn, addrfmt((const struct sockaddr *)&conn->addr, addrbuf), (unsigned)length, conn->conn_id_send,
+	         conn, addrfmt(utp_peer_addr(conn->peer), addrbuf), (unsigned)length, conn->conn_id_send,
 	         time, conn->reply_micro, flagnames[flags], seq_nr, ack_nr);
 #endif
-	send_to_addr(conn->send_to_proc, conn->send_to_userdata, pkt, length, (const struct sockaddr *)&conn->addr, conn->addrlen);
+	send_to_addr(conn->send_to_proc, conn->send_to_userdata, pkt, length, utp_peer_addr(conn->peer), utp_peer_addrlen(conn->peer));
 }
 
-static void utp_send_ack(UTPSocket *conn, bool synack)
+// The extension bits we send in SYN and SYN-ACK. For SYN-ACK, these
+// are the extensions in the SYN that we agreed to
+static void utp_get_extension_bits(const UTPSocket *conn, uint8_t *ext)
 {
-	uint8_t pkt[PF0_SIZE_EXT] = {0};
+	memset(ext, 0, 8);
+	if (conn->large_window_wanted || conn->large_window)
+		ext_bit_set(ext, EXT_BIT_LARGE_WINDOW);
+	if (conn->ack_frequency_wanted || conn->ack_frequency)
+		ext_bit_set(ext, EXT_BIT_ACK_FREQUENCY);
+}
 
-	size_t len;
-	conn->last_rcv_win = utp_get_rcv_window(conn);
-	if (conn->version == 0) {
-		set32(pkt + PF0_CONNID, conn->conn_id_send);
-		set16(pkt + PF0_ACK_NR, conn->ack_nr);
-		set16(pkt + PF0_SEQ_NR, conn->seq_nr);
-		pkt[PF0_FLAGS] = ST_STATE;
-		pkt[PF0_EXT] = 0;
+// Write the header of a packet: the template, and then the fields that
+// change from one packet to the next. utp_send_data() adds the
+// timestamps. Returns the size of the header
+static inline size_t utp_write_header(const UTPSocket *conn, uint8_t *pkt, uint8_t type, uint16_t seq_nr)
+{
+	const size_t header_size = utp_get_header_size(conn);
+	memcpy(pkt, conn->header, header_size);
+	if (utp_is_v0(conn->version)) {
+		pkt[PF0_FLAGS] = type;
 		pkt[PF0_WND_SIZE] = DIV_ROUND_UP(conn->last_rcv_win, PACKET_SIZE);
-		len = PF0_SIZE;
+		set16(pkt + PF0_SEQ_NR, seq_nr);
+		set16(pkt + PF0_ACK_NR, conn->ack_nr);
 	} else {
-		pkt[PF1_TYPE] = ST_STATE << 4 | 1;
-		pkt[PF1_EXT] = 0;
-		set16(pkt + PF1_CONNID, conn->conn_id_send);
-		set16(pkt + PF1_ACK_NR, conn->ack_nr);
-		set16(pkt + PF1_SEQ_NR, conn->seq_nr);
+		pkt[PF1_TYPE] = type << 4 | 1;
 		set32(pkt + PF1_WND_SIZE, conn->last_rcv_win);
-		len = PF1_SIZE;
+		set16(pkt + PF1_SEQ_NR, seq_nr);
+		set16(pkt + PF1_ACK_NR, conn->ack_nr);
 	}
+	return header_size;
+}
 
-	// we never need to send EACK for connections
-	// that are shutting down
-	if (conn->reorder_count != 0 && conn->state < CS_GOT_FIN) {
-		// if reorder count > 0, send an EACK.
-		// reorder count should always be 0
-		// for synacks, so this should not be
-		// as synack
+// How long we may wait before acking received data
+static inline uint32_t utp_ack_delay(const UTPSocket *conn)
+{
+	return conn->ack_freq_delay ? conn->ack_freq_delay : conn->tun.delayed_ack_time;
+}
+
+// Is it time to ack the data we've received?
+static bool utp_ack_due(const UTPSocket *conn)
+{
+	if ((int)(g_current_ms - conn->ack_time) >= 0) return true;
+	if (conn->ack_freq_packets != 0)
+		return conn->packets_since_ack >= conn->ack_freq_packets;
+	return conn->bytes_since_ack > conn->tun.delayed_ack_bytes;
+}
+
+static void utp_send_ack(UTPSocket *conn, bool synack)
+{
+	uint8_t pkt[PF0_SIZE + 2 + EACK_MAX_BYTES + 2 + ACK_FREQ_EXT_LEN] = {0};
+	// where to put the type of the next extension header
+	uint8_t *next_ext;
+
+	conn->last_rcv_win = utp_get_rcv_window(conn);
+	size_t len = utp_write_header(conn, pkt, ST_STATE, conn->seq_nr);
+	next_ext = pkt + (utp_is_v0(conn->version) ? PF0_EXT : PF1_EXT);
+
+	// we never need to send EACK for connections
+	// that are shutting down
+	if (conn->reorder_count != 0 && conn->state < CS_GOT_FIN) {
+		// if reorder count > 0, send an EACK.
+		// reorder count should always be 0
+		// for synacks, so this should not be
+		// as synack
 		assert(!synack);
 		uint8_t *acks;
-		if (conn->version == 0) {
+		uint8_t *acks_len;
+		if (utp_is_v0(conn->version)) {
 			pkt[PF0_EXT] = 1;
 			pkt[PF0_EXT_NEXT] = 0;
-			pkt[PF0_EXT_LEN] = 4;
+			acks_len = pkt + PF0_EXT_LEN;
 			acks = pkt + PF0_EXT_DATA;
+			next_ext = pkt + PF0_EXT_NEXT;
 		} else {
 			pkt[PF1_EXT] = 1;
 			pkt[PF1_EXT_NEXT] = 0;
-			pkt[PF1_EXT_LEN] = 4;
+			acks_len = pkt + PF1_EXT_LEN;
 			acks = pkt + PF1_EXT_DATA;
+			next_ext = pkt + PF1_EXT_NEXT;
 		}
-		uint32_t m = 0;
 
 		// reorder count should only be non-zero
 		// if the packet ack_nr + 1 has not yet
 		// been received
 		assert(circbuf_get(&conn->inbuf, conn->ack_nr + 1) == NULL);
-		size_t window = min((size_t)14+16, circbuf_size(&conn->inbuf));
+		// with large windows, cover as much of the reorder
+		// buffer as we can, in multiples of 4 bytes
+		size_t window = min(conn->large_window ? EACK_MAX_BYTES * 8 : (size_t)14+16, circbuf_size(&conn->inbuf));
+		size_t bytes = 4;
 		// Generate bit mask of segments received.
 		for (size_t i = 0; i < window; i++) {
 			if (circbuf_get(&conn->inbuf, conn->ack_nr + i + 2) != NULL) {
-				m |= 1 << i;
+				acks[i >> 3] |= 1 << (i & 7);
+				bytes = max(bytes, (i / 32 + 1) * 4);
 				LOG_UTPV("0x%08x: EACK packet [%u]", conn, conn->ack_nr + i + 2);
 			}
 		}
-		acks[0] = (uint8_t)m;
-		acks[1] = (uint8_t)(m >> 8);
-		acks[2] = (uint8_t)(m >> 16);
-		acks[3] = (uint8_t)(m >> 24);
-		len += 4 + 2;
-		LOG_UTPV("0x%08x: Sending EACK %u [%u] bits:[%032b]", conn, conn->ack_nr, conn->conn_id_send, m);
+		*acks_len = (uint8_t)bytes;
+		len += bytes + 2;
+		LOG_UTPV("0x%08x: Sending EACK %u [%u] bits:[%032b]", conn, conn->ack_nr, conn->conn_id_send, get32(acks));
 	} else if (synack) {
 		// we only send "extensions" in response to SYN
 		// and the reorder count is 0 in that state
 
 		LOG_UTPV("0x%08x: Sending ACK %u [%u] with extension bits", conn, conn->ack_nr, conn->conn_id_send);
-		if (conn->version == 0) {
+		uint8_t *ext;
+		if (utp_is_v0(conn->version)) {
 			pkt[PF0_EXT] = 2;
 			pkt[PF0_EXT_NEXT] = 0;
 			pkt[PF0_EXT_LEN] = 8;
-			memset(pkt + PF0_EXT_DATA, 0, 8);
+			ext = pkt + PF0_EXT_DATA;
+			next_ext = pkt + PF0_EXT_NEXT;
 		} else {
 			pkt[PF1_EXT] = 2;
 			pkt[PF1_EXT_NEXT] = 0;
 			pkt[PF1_EXT_LEN] = 8;
-			memset(pkt + PF1_EXT_DATA, 0, 8);
+			ext = pkt + PF1_EXT_DATA;
+			next_ext = pkt + PF1_EXT_NEXT;
 		}
+		utp_get_extension_bits(conn, ext);
 		len += 8 + 2;
 	} else {
 		LOG_UTPV("0x%08x: Sending ACK %u [%u]", conn, conn->ack_nr, conn->conn_id_send);
 	}
 
+	// if we're sending data with the ack frequency extension, repeat
+	// what we asked for in every ack, in case it got lost
+	if (conn->ack_frequency && conn->ack_freq_sent_packets != 0) {
+		*next_ext = 3;
+		pkt[len] = 0;
+		pkt[len + 1] = ACK_FREQ_EXT_LEN;
+		set16(pkt + len + 2, conn->ack_freq_sent_packets);
+		set16(pkt + len + 4, conn->ack_freq_sent_delay);
+		len += ACK_FREQ_EXT_LEN + 2;
+	}
+
 	utp_sent_ack(conn);
 	utp_send_data(conn, pkt, len, ack_overhead);
 }
 
+// When sending with the ack frequency extension, tell the other end how
+// often to ack, based on our window and rtt. Acks are how the window
+// grows, so ask for about four of them per window, and per rtt
+static void utp_update_ack_frequency(UTPSocket *conn)
+{
+	if (!conn->ack_frequency || conn->rtt == 0 ||
+		(conn->state != CS_CONNECTED && conn->state != CS_CONNECTED_FULL))
+		return;
+
+	const size_t packet_size = utp_get_packet_size(conn);
+	const uint16_t packets = (uint16_t)min(max(conn->max_window / packet_size / 4, ACK_FREQ_MIN_PACKETS), ACK_FREQ_MAX_PACKETS);
+	const uint16_t delay = (uint16_t)min(max(conn->rtt / 4, ACK_FREQ_MIN_DELAY), conn->tun.delayed_ack_time);
+
+	// no more than once per rtt
+	const uint32_t since = g_current_ms - conn->ack_freq_sent_time;
+	if (conn->ack_freq_sent_packets != 0 && since < conn->rtt) return;
+	// and not for small changes in rtt
+	if (packets == conn->ack_freq_sent_packets &&
+		delay * 4 >= conn->ack_freq_sent_delay * 3 && delay * 4 <= conn->ack_freq_sent_delay * 5 &&
+		since < ACK_FREQ_REFRESH)
+		return;
+
+	conn->ack_freq_sent_packets = packets;
+	conn->ack_freq_sent_delay = delay;
+	conn->ack_freq_sent_time = g_current_ms;
+	LOG_UTPV("0x%08x: Sending ack frequency packets:%u delay:%u", conn, packets, delay);
+	utp_send_ack(conn, false);
+}
+
 static void utp_send_keep_alive(UTPSocket *conn)
 {
 	conn->ack_nr--;
@@ -905,7 +1389,7 @@ static void utp_send_rst(SendToProc *send_to_proc, void *send_to_userdata,
 	uint8_t pkt[PF0_SIZE] = {0};
 
 	size_t len;
-	if (version == 0) {
+	if (utp_is_v0(version)) {
 		set32(pkt + PF0_CONNID, conn_id_send);
 		set16(pkt + PF0_ACK_NR, ack_nr);
 		set16(pkt + PF0_SEQ_NR, seq_nr);
@@ -928,6 +1412,530 @@ static void utp_send_rst(SendToProc *send_to_proc, void *send_to_userdata,
 	send_to_addr(send_to_proc, send_to_userdata, pkt, len, addr, addrlen);
 }
 
+// SipHash-1-3, a keyed hash that someone who doesn't know the key can't
+// find collisions for, over a message of 64 bit words. Hash tables keyed
+// on what the other end sends, and SYN cookies, are built on it. Start
+// with hash_init(), feed it words with hash_add() and get the hash from
+// hash_final(). The same as SipHash-1-3 of the words in little-endian
+struct Hash {
+	uint64_t v0, v1, v2, v3;
+	uint64_t len;
+};
+typedef struct Hash Hash;
+
+#define HASH_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+static inline void hash_round(Hash *h)
+{
+	h->v0 += h->v1; h->v1 = HASH_ROTL(h->v1, 13); h->v1 ^= h->v0; h->v0 = HASH_ROTL(h->v0, 32);
+	h->v2 += h->v3; h->v3 = HASH_ROTL(h->v3, 16); h->v3 ^= h->v2;
+	h->v0 += h->v3; h->v3 = HASH_ROTL(h->v3, 21); h->v3 ^= h->v0;
+	h->v2 += h->v1; h->v1 = HASH_ROTL(h->v1, 17); h->v1 ^= h->v2; h->v2 = HASH_ROTL(h->v2, 32);
+}
+
+static inline void hash_init(Hash *h, const uint64_t *key)
+{
+	h->v0 = key[0] ^ 0x736f6d6570736575ULL;
+	h->v1 = key[1] ^ 0x646f72616e646f6dULL;
+	h->v2 = key[0] ^ 0x6c7967656e657261ULL;
+	h->v3 = key[1] ^ 0x7465646279746573ULL;
+	h->len = 0;
+}
+
+static inline void hash_add(Hash *h, uint64_t m)
+{
+	h->v3 ^= m;
+	hash_round(h);
+	h->v0 ^= m;
+	h->len += 8;
+}
+
+static inline uint64_t hash_final(Hash *h)
+{
+	hash_add(h, h->len << 56);
+	h->v2 ^= 0xff;
+	hash_round(h);
+	hash_round(h);
+	hash_round(h);
+	return h->v0 ^ h->v1 ^ h->v2 ^ h->v3;
+}
+
+static void hash_addr(Hash *h, const struct sockaddr *addr)
+{
+	if (addr->sa_family == AF_INET) {
+		const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+		hash_add(h, (uint64_t)in->sin_port << 32 | in->sin_addr.s_addr);
+	} else {
+		const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+		uint64_t a[2];
+		memcpy(a, &in6->sin6_addr, sizeof(a));
+		hash_add(h, in6->sin6_port);
+		hash_add(h, a[0]);
+		hash_add(h, a[1]);
+	}
+}
+
+static inline size_t utp_peer_bucket(const struct sockaddr *addr)
+{
+	Hash h;
+	hash_init(&h, g_peer_key);
+	hash_addr(&h, addr);
+	return (size_t)hash_final(&h) & (g_peer_index_size - 1);
+}
+
+// The peer handle of addr, or PEER_NONE if nothing refers to it
+static uint32_t utp_peer_find(const struct sockaddr *addr)
+{
+	if (g_peers_count == 0) return PEER_NONE;
+	for (uint32_t p = g_peer_index[utp_peer_bucket(addr)]; p != PEER_NONE; p = g_peers[p].next) {
+		if (sockaddr_equal(utp_peer_addr(p), addr))
+			return p;
+	}
+	return PEER_NONE;
+}
+
+// Copy addr to host with its port set to 0. Returns false if that's
+// what it already was
+static bool sockaddr_host(const struct sockaddr *addr, struct sockaddr_storage *host)
+{
+	if (addr->sa_family == AF_INET) {
+		struct sockaddr_in *in = (struct sockaddr_in *)host;
+		memcpy(in, addr, sizeof(*in));
+		if (in->sin_port == 0) return false;
+		in->sin_port = 0;
+	} else {
+		struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)host;
+		memcpy(in6, addr, sizeof(*in6));
+		if (in6->sin6_port == 0) return false;
+		in6->sin6_port = 0;
+	}
+	return true;
+}
+
+// Get a reference to the peer handle of addr, adding it to the peer
+// table if it's new. Give it back with utp_peer_release()
+static uint32_t utp_peer_intern(const struct sockaddr *addr, socklen_t addrlen)
+{
+	uint32_t p = utp_peer_find(addr);
+	if (p != PEER_NONE) {
+		g_peers[p].refs++;
+		return p;
+	}
+
+	if (g_peers_count >= g_peer_index_size) {
+		// grow, and rehash what's there
+		if (g_peer_index_size == 0)
+			for (size_t i = 0; i < 2; i++)
+				g_peer_key[i] = (uint64_t)utp_random() << 32 ^ (uint64_t)utp_random() << 16 ^ utp_random();
+		g_peer_index_size = max((size_t)16, g_peer_index_size * 2);
+		g_peer_index = realloc(g_peer_index, g_peer_index_size * sizeof(g_peer_index[0]));
+		for (size_t i = 0; i < g_peer_index_size; i++)
+			g_peer_index[i] = PEER_NONE;
+		for (uint32_t i = 0; i < g_peers_used; i++) {
+			if (g_peers[i].refs == 0) continue;
+			const size_t b = utp_peer_bucket(utp_peer_addr(i));
+			g_peers[i].next = g_peer_index[b];
+			g_peer_index[b] = i;
+		}
+	}
+
+	if (g_peers_free != PEER_NONE) {
+		p = g_peers_free;
+		g_peers_free = g_peers[p].next;
+	} else {
+		if (g_peers_used >= g_peers_alloc) {
+			g_peers_alloc = max((size_t)16, g_peers_alloc * 2);
+			g_peers = realloc(g_peers, g_peers_alloc * sizeof(g_peers[0]));
+		}
+		p = (uint32_t)g_peers_used++;
+	}
+
+	UTPPeer *peer = &g_peers[p];
+	assert(addrlen <= sizeof(peer->addr));
+	memcpy(&peer->addr, addr, addrlen);
+	peer->addrlen = addrlen;
+	peer->refs = 1;
+	peer->host = p;
+	peer->conns = 0;
+	const size_t b = utp_peer_bucket(addr);
+	peer->next = g_peer_index[b];
+	g_peer_index[b] = p;
+	g_peers_count++;
+
+	struct sockaddr_storage host;
+	if (sockaddr_host(addr, &host)) {
+		// may move g_peers
+		const uint32_t h = utp_peer_intern((const struct sockaddr *)&host, addrlen);
+		g_peers[p].host = h;
+	}
+	return p;
+}
+
+static void utp_peer_release(uint32_t p)
+{
+	assert(p < g_peers_used && g_peers[p].refs > 0);
+	if (--g_peers[p].refs > 0) return;
+
+	uint32_t *i = &g_peer_index[utp_peer_bucket(utp_peer_addr(p))];
+	while (*i != p) {
+		assert(*i != PEER_NONE);
+		i = &g_peers[*i].next;
+	}
+	*i = g_peers[p].next;
+	g_peers[p].next = g_peers_free;
+	g_peers_free = p;
+	g_peers_count--;
+
+	assert(g_peers[p].conns == 0);
+	if (g_peers[p].host != p)
+		utp_peer_release(g_peers[p].host);
+}
+
+static inline size_t utp_seed_bucket(uint32_t peer, uint32_t conn_seed)
+{
+	Hash h;
+	hash_init(&h, g_peer_key);
+	hash_add(&h, (uint64_t)peer << 32 | conn_seed);
+	return (size_t)hash_final(&h) & (g_seed_index_size - 1);
+}
+
+static void utp_seed_index_add(UTPSocket *conn)
+{
+	if (g_seed_index_count >= g_seed_index_size) {
+		// grow, and rehash what's there
+		const size_t old_size = g_seed_index_size;
+		UTPSocket **old = g_seed_index;
+		g_seed_index_size = max((size_t)16, old_size * 2);
+		g_seed_index = (UTPSocket**)calloc(g_seed_index_size, sizeof(UTPSocket*));
+		for (size_t i = 0; i < old_size; i++) {
+			for (UTPSocket *c = old[i], *next; c; c = next) {
+				next = c->seed_next;
+				const size_t b = utp_seed_bucket(c->peer, c->conn_seed);
+				c->seed_next = g_seed_index[b];
+				g_seed_index[b] = c;
+			}
+		}
+		free(old);
+	}
+
+	const size_t b = utp_seed_bucket(conn->peer, conn->conn_seed);
+	conn->seed_next = g_seed_index[b];
+	g_seed_index[b] = conn;
+	conn->seed_indexed = true;
+	g_seed_index_count++;
+}
+
+static void utp_seed_index_remove(UTPSocket *conn)
+{
+	if (!conn->seed_indexed) return;
+	conn->seed_indexed = false;
+	UTPSocket **p = &g_seed_index[utp_seed_bucket(conn->peer, conn->conn_seed)];
+	for (; *p; p = &(*p)->seed_next) {
+		if (*p == conn) {
+			*p = conn->seed_next;
+			g_seed_index_count--;
+			return;
+		}
+	}
+}
+
+// The incoming socket created for a SYN from peer with conn_seed, if any
+static UTPSocket *utp_seed_index_find(uint32_t peer, uint32_t conn_seed)
+{
+	if (g_seed_index_count == 0 || peer == PEER_NONE) return NULL;
+	UTPSocket *conn = g_seed_index[utp_seed_bucket(peer, conn_seed)];
+	for (; conn; conn = conn->seed_next) {
+		if (conn->conn_seed == conn_seed && conn->peer == peer)
+			return conn;
+	}
+	return NULL;
+}
+
+// Number of sockets with the same host as addr, on any port
+static size_t utp_count_host_conns(const struct sockaddr *addr)
+{
+	struct sockaddr_storage host;
+	sockaddr_host(addr, &host);
+	const uint32_t h = utp_peer_find((const struct sockaddr *)&host);
+	return h == PEER_NONE ? 0 : g_peers[h].conns;
+}
+
+// Whether to refuse a new incoming connection from addr with a RST,
+// because the accept queue is full or we have enough from that host
+static bool utp_refuse_incoming(const struct sockaddr *addr)
+{
+	if (g_listen_backlog && g_accept_queue_count >= g_listen_backlog) {
+		LOG_UTPV("recv SYN, accept queue full (%u)", (unsigned)g_accept_queue_count);
+		return true;
+	}
+	if (g_max_conns_per_host && utp_count_host_conns(addr) >= g_max_conns_per_host) {
+		LOG_UTPV("recv SYN, %s has too many connections", addrfmt(addr, addrbuf));
+		return true;
+	}
+	return false;
+}
+
+static void utp_accept_enqueue(UTPSocket *conn)
+{
+	assert(conn->accept_pending && !conn->accept_queued);
+	if (g_accept_queue_count >= g_accept_queue_alloc) {
+		g_accept_queue_alloc = max((size_t)16, g_accept_queue_alloc * 2);
+		g_accept_queue = realloc(g_accept_queue, g_accept_queue_alloc * sizeof(g_accept_queue[0]));
+	}
+	g_accept_queue[g_accept_queue_count++] = conn;
+	conn->accept_queued = true;
+	LOG_UTPV("0x%08x: queued for accept (%u)", conn, (unsigned)g_accept_queue_count);
+
+	// the SYN-ACK opened our receive window, close it until we're accepted
+	if (conn->state == CS_CONNECTED || conn->state == CS_CONNECTED_FULL)
+		utp_send_ack(conn, false);
+}
+
+static void utp_accept_dequeue(UTPSocket *conn)
+{
+	if (!conn->accept_queued) return;
+	conn->accept_queued = false;
+	for (size_t i = 0; i < g_accept_queue_count; i++) {
+		if (g_accept_queue[i] != conn) continue;
+		g_accept_queue_count--;
+		memmove(g_accept_queue + i, g_accept_queue + i + 1, (g_accept_queue_count - i) * sizeof(g_accept_queue[0]));
+		return;
+	}
+}
+
+static void utp_set_half_open(UTPSocket *conn, bool half_open)
+{
+	if (conn->half_open == half_open) return;
+	conn->half_open = half_open;
+	if (half_open) {
+		conn->half_open_time = g_current_ms;
+		g_half_open_count++;
+	} else {
+		assert(g_half_open_count > 0);
+		g_half_open_count--;
+	}
+}
+
+// A packet for a half-open connection. It has to ack our SYN-ACK, which
+// whoever spoofed a SYN never saw. Returns false if the connection was
+// refused, because the accept queue filled up in the meantime
+static bool utp_complete_handshake(UTPSocket *conn, const uint8_t *pkt, uint8_t version)
+{
+	const uint16_t pk_ack_nr = utp_is_v0(version) ? get16(pkt + PF0_ACK_NR) : get16(pkt + PF1_ACK_NR);
+	if (((conn->seq_nr - 1 - pk_ack_nr) & ACK_NR_MASK) > conn->cur_window_packets)
+		return true;
+
+	utp_set_half_open(conn, false);
+	if (!conn->accept_pending) return true;
+
+	if (g_accept_queue_count >= g_listen_backlog) {
+		LOG_UTPV("0x%08x: accept queue full (%u), refusing", conn, (unsigned)g_accept_queue_count);
+		utp_send_rst(conn->send_to_proc, conn->send_to_userdata, utp_peer_addr(conn->peer),
+					 utp_peer_addrlen(conn->peer), conn->conn_id_send, conn->ack_nr, utp_random(), conn->version);
+		conn->state = CS_DESTROY;
+		return false;
+	}
+	utp_accept_enqueue(conn);
+	return true;
+}
+
+// The extensions we agree to in a SYN cookie, as its 2 low bits
+static unsigned utp_syn_cookie_ext_bits(const uint8_t *ext)
+{
+	return (ext_bit_isset(ext, EXT_BIT_LARGE_WINDOW) ? 1 : 0) |
+		(ext_bit_isset(ext, EXT_BIT_ACK_FREQUENCY) ? 2 : 0);
+}
+
+// The sequence number of a stateless SYN-ACK. The extensions we agreed
+// to in the 2 low bits, and a keyed hash of those, the address, the
+// connection id and the sequence number of the SYN and the time period
+// in the other 14. The key is secret, so only someone who got the
+// SYN-ACK knows the cookie
+static uint16_t utp_syn_cookie(const struct sockaddr *addr, uint32_t conn_seed, uint16_t syn_seq_nr,
+							   uint32_t period, const uint8_t *ext)
+{
+	const unsigned bits = utp_syn_cookie_ext_bits(ext);
+	Hash h;
+	hash_init(&h, g_syn_cookie_key);
+	hash_addr(&h, addr);
+	hash_add(&h, (uint64_t)conn_seed << 32 | (uint32_t)syn_seq_nr << 16 | bits);
+	hash_add(&h, period);
+	return (uint16_t)((hash_final(&h) & ~3u) | bits);
+}
+
+// The extension bits we agree to, out of the ones in a SYN. These are
+// all that's needed to set up the socket later, see utp_get_extension_bits()
+static void utp_syn_cookie_extensions(const uint8_t *pkt, size_t len, uint8_t version, uint8_t *ext)
+{
+	memset(ext, 0, 8);
+
+	const uint8_t *const packet_end = pkt + len;
+	const uint8_t *data = pkt + (utp_is_v0(version) ? PF0_SIZE : PF1_SIZE);
+	uint8_t pk_ext = utp_is_v0(version) ? pkt[PF0_EXT] : pkt[PF1_EXT];
+	while (pk_ext != 0) {
+		data += 2;
+		if ((int)(packet_end - data) < 0 || (int)(packet_end - data) < data[-1]) return;
+		if (pk_ext == 2 && data[-1] == 8) {
+			if (ext_bit_isset(data, EXT_BIT_LARGE_WINDOW)) ext_bit_set(ext, EXT_BIT_LARGE_WINDOW);
+			if (ext_bit_isset(data, EXT_BIT_ACK_FREQUENCY)) ext_bit_set(ext, EXT_BIT_ACK_FREQUENCY);
+		}
+		pk_ext = data[-2];
+		data += data[-1];
+	}
+}
+
+// Check whether a packet for an unknown connection acks one of our SYN
+// cookies. Returns how far its sequence number is past the SYN, 1 if
+// it's the first packet after it, or 0 if it doesn't match. On a match,
+// ext is set to the extension bits we agreed to
+static int utp_syn_cookie_check(const struct sockaddr *addr, uint32_t conn_seed, uint16_t seq_nr,
+								uint16_t ack_nr, uint8_t *ext)
+{
+	// the other end's ack_nr is one less than the seq_nr of our SYN-ACK
+	const uint16_t cookie = (uint16_t)(ack_nr + 1);
+	memset(ext, 0, 8);
+	if (cookie & 1) ext_bit_set(ext, EXT_BIT_LARGE_WINDOW);
+	if (cookie & 2) ext_bit_set(ext, EXT_BIT_ACK_FREQUENCY);
+
+	const uint32_t period = g_current_ms / SYN_COOKIE_PERIOD;
+	for (int gap = 1; gap <= SYN_COOKIE_MAX_GAP; gap++) {
+		// the current period, or the one before
+		for (uint32_t age = 0; age < 2; age++) {
+			if (utp_syn_cookie(addr, conn_seed, seq_nr - gap, period - age, ext) == cookie)
+				return gap;
+		}
+	}
+	return 0;
+}
+
+// Answer a SYN without creating a socket. The SYN-ACK looks the same
+// as the one the socket would send, with its seq_nr set to the cookie
+static void utp_send_syn_cookie_ack(SendToProc *send_to_proc, void *send_to_userdata,
+									const struct sockaddr *addr, socklen_t addrlen, uint8_t version,
+									uint32_t conn_id_send, uint16_t ack_nr, uint16_t seq_nr, const uint8_t *ext)
+{
+	uint8_t pkt[PF0_SIZE + 2 + 8] = {0};
+	const size_t rcvbuf = g_rcvbuf_autotune ? RCVBUF_AUTO_INITIAL :
+		utp_is_v0(version) ? 200 * 1024 : 3 * 1024 * 1024 + 512 * 1024;
+	uint8_t *ext_bits;
+
+	size_t len;
+	if (utp_is_v0(version)) {
+		set32(pkt + PF0_CONNID, conn_id_send);
+		set32(pkt + PF0_TV_SEC, g_current_us / 1000000);
+		set32(pkt + PF0_TV_USEC, g_current_us % 1000000);
+		set32(pkt + PF0_DELAY_USEC, INT_MAX);
+		set16(pkt + PF0_ACK_NR, ack_nr);
+		set16(pkt + PF0_SEQ_NR, seq_nr);
+		pkt[PF0_FLAGS] = ST_STATE;
+		pkt[PF0_EXT] = 2;
+		pkt[PF0_WND_SIZE] = DIV_ROUND_UP(rcvbuf, PACKET_SIZE);
+		pkt[PF0_EXT_NEXT] = 0;
+		pkt[PF0_EXT_LEN] = 8;
+		ext_bits = pkt + PF0_EXT_DATA;
+		len = PF0_SIZE;
+	} else {
+		pkt[PF1_TYPE] = ST_STATE << 4 | 1;
+		pkt[PF1_EXT] = 2;
+		set16(pkt + PF1_CONNID, conn_id_send);
+		set32(pkt + PF1_TV_USEC, g_current_us);
+		set16(pkt + PF1_ACK_NR, ack_nr);
+		set16(pkt + PF1_SEQ_NR, seq_nr);
+		set32(pkt + PF1_WND_SIZE, rcvbuf);
+		pkt[PF1_EXT_NEXT] = 0;
+		pkt[PF1_EXT_LEN] = 8;
+		ext_bits = pkt + PF1_EXT_DATA;
+		len = PF1_SIZE;
+	}
+	memcpy(ext_bits, ext, 8);
+	ext_bit_set(ext_bits, EXT_BIT_SYN_COOKIE);
+	len += 8 + 2;
+
+	LOG_UTPV("%s: Sending SYN cookie ACK id:%u seq_nr:%u ack_nr:%u", addrfmt(addr, addrbuf), conn_id_send, seq_nr, ack_nr);
+	send_to_addr(send_to_proc, send_to_userdata, pkt, len, addr, addrlen);
+}
+
+static void utp_send_packet(UTPSocket *conn, OutgoingPacket *pkt);
+
+// If the last packets of a burst are lost, there's nothing after them that
+// can be acked and tell us about it, and we would have to wait for the RTO.
+// Instead, after about two round trips without an ack, re-send the newest
+// packet to make the other end ack what it has. That's enough to let
+// utp_rack_detect_loss() find the lost packets, without collapsing the
+// window the way a timeout does.
+static void utp_arm_tail_loss_probe(UTPSocket *conn)
+{
+	conn->tlp_timer = false;
+
+	// we need an rtt estimate, and someone to send the probe
+	if (conn->rtt == 0 || conn->cur_window_packets == 0 ||
+		(conn->state != CS_CONNECTED && conn->state != CS_CONNECTED_FULL && conn->state != CS_FIN_SENT))
+		return;
+
+	unsigned pto = conn->rtt * 2;
+	// with fewer packets in flight than it takes for the other end to
+	// ack right away, it's likely to delay its ack
+	if (conn->ack_freq_sent_packets != 0) {
+		if (conn->cur_window_packets < conn->ack_freq_sent_packets) pto += conn->ack_freq_sent_delay;
+	} else if (conn->cur_window_packets == 1) {
+		pto += conn->tun.delayed_ack_time;
+	}
+	if (pto < 10) pto = 10;
+
+	// no point in probing after the timeout
+	if ((int)(g_current_ms + pto - conn->rto_timeout) >= 0) return;
+
+	conn->tlp_timer = true;
+	conn->tlp_timeout = g_current_ms + pto;
+}
+
+static void utp_send_tail_loss_probe(UTPSocket *conn)
+{
+	conn->tlp_timer = false;
+
+	// the newest packet in flight
+	for (uint16_t i = conn->seq_nr - 1; i != (uint16_t)(conn->seq_nr - conn->cur_window_packets - 1); --i) {
+		OutgoingPacket *pkt = (OutgoingPacket*)circbuf_get(&conn->outbuf, i);
+		if (pkt == 0 || pkt->transmissions == 0 || pkt->need_resend) continue;
+
+		LOG_UTPV("0x%08x: Tail loss probe. Resend seq_nr:%u", conn, i);
+
+		conn->tlp_in_flight = true;
+		conn->tail_probes++;
+		utp_send_packet(conn, pkt);
+
+		// give the probe a chance before timing out
+		if ((int)(conn->rto_timeout - g_current_ms) < (int)conn->retransmit_timeout)
+			conn->rto_timeout = g_current_ms + conn->retransmit_timeout;
+		return;
+	}
+}
+
+// A packet is in flight from when it's sent until it's acked or
+// declared lost. Packets in flight are kept in a list in the order they
+// were sent, so loss detection only needs to look at the oldest ones
+static inline bool utp_is_in_flight(const OutgoingPacket *pkt)
+{
+	return pkt->transmissions > 0 && !pkt->need_resend;
+}
+
+static void utp_sent_append(UTPSocket *conn, OutgoingPacket *pkt)
+{
+	pkt->sent_prev = conn->sent_tail;
+	pkt->sent_next = NULL;
+	if (conn->sent_tail) conn->sent_tail->sent_next = pkt;
+	else conn->sent_head = pkt;
+	conn->sent_tail = pkt;
+}
+
+static void utp_sent_unlink(UTPSocket *conn, OutgoingPacket *pkt)
+{
+	if (pkt->sent_prev) pkt->sent_prev->sent_next = pkt->sent_next;
+	else conn->sent_head = pkt->sent_next;
+	if (pkt->sent_next) pkt->sent_next->sent_prev = pkt->sent_prev;
+	else conn->sent_tail = pkt->sent_prev;
+}
+
 static void utp_send_packet(UTPSocket *conn, OutgoingPacket *pkt)
 {
 	// only count against the quota the first time we
@@ -947,15 +1955,20 @@ static void utp_send_packet(UTPSocket *conn, OutgoingPacket *pkt)
 		conn->send_quota = conn->send_quota - (int32_t)(pkt->payload * 100);
 	}
 
+	if (utp_is_in_flight(pkt)) utp_sent_unlink(conn, pkt);
 	pkt->need_resend = false;
 
-	if (conn->version == 0) {
+	if (utp_is_v0(conn->version)) {
 		set16(pkt->data + PF0_ACK_NR, conn->ack_nr);
 	} else {
 		set16(pkt->data + PF1_ACK_NR, conn->ack_nr);
 	}
-	pkt->time_sent = UTP_GetMicroseconds();
+	pkt->time_sent = g_current_us;
 	pkt->transmissions++;
+	utp_sent_append(conn, pkt);
+	if (pkt->transmissions == 1 && !conn->tlp_in_flight) {
+		utp_arm_tail_loss_probe(conn);
+	}
 	utp_sent_ack(conn);
 	utp_send_data(conn, pkt->data, pkt->length,
 		(conn->state == CS_SYN_SENT) ? connect_overhead
@@ -978,12 +1991,12 @@ static bool utp_is_writable(UTPSocket *conn, size_t to_write)
 		conn->last_maxed_out_window = g_current_ms;
 
 	// if we don't have enough quota, we can't write regardless
-	if (USE_PACKET_PACING) {
+	if (conn->tun.packet_pacing) {
 		if (conn->send_quota / 100 < (int32_t)to_write) return false;
 	}
 
 	// subtract one to save space for the FIN packet
-	if (conn->cur_window_packets >= OUTGOING_BUFFER_MAX_SIZE - 1) return false;
+	if (conn->cur_window_packets >= utp_get_max_window_packets(conn) - 1) return false;
 
 	// if sending another packet would not make the window exceed
 	// the max_window, we can write
@@ -996,7 +2009,7 @@ static bool utp_is_writable(UTPSocket *conn, size_t to_write)
 	// in the send buffer. cur_window isn't updated until we flush
 	// the send buffer, so we need to take the number of packets
 	// into account
-	if (USE_PACKET_PACING) {
+	if (conn->tun.packet_pacing) {
 		if (conn->max_window < to_write &&
 			conn->cur_window < conn->max_window &&
 			conn->cur_window_packets == 0) {
@@ -1050,7 +2063,7 @@ static void utp_write_outgoing_packet(UTPSocket *conn, size_t payload, unsigned
 
 	size_t packet_size = utp_get_packet_size(conn);
 	do {
-		assert(conn->cur_window_packets < OUTGOING_BUFFER_MAX_SIZE);
+		assert(conn->cur_window_packets < utp_get_max_window_packets(conn));
 		assert(flags == ST_DATA || flags == ST_FIN);
 
 		size_t added = 0;
@@ -1080,8 +2093,10 @@ static void utp_write_outgoing_packet(UTPSocket *conn, size_t payload, unsigned
 										  header_size +
 										  added);
 			pkt->payload = 0;
+			pkt->seq_nr = conn->seq_nr;
 			pkt->transmissions = 0;
 			pkt->need_resend = false;
+			pkt->rack_lost = false;
 		}
 
 		if (added) {
@@ -1093,27 +2108,13 @@ static void utp_write_outgoing_packet(UTPSocket *conn, size_t payload, unsigned
 
 		conn->last_rcv_win = utp_get_rcv_window(conn);
 
-		uint8_t* p = pkt->data;
-		if (conn->version == 0) {
-			set32(p + PF0_CONNID, conn->conn_id_send);
-			p[PF0_EXT] = 0;
-			p[PF0_WND_SIZE] = DIV_ROUND_UP(conn->last_rcv_win, PACKET_SIZE);
-			set16(p + PF0_ACK_NR, conn->ack_nr);
-			p[PF0_FLAGS] = flags;
-		} else {
-			p[PF1_TYPE] = flags << 4 | 1;
-			p[PF1_EXT] = 0;
-			set16(p + PF1_CONNID, conn->conn_id_send);
-			set32(p + PF1_WND_SIZE, conn->last_rcv_win);
-			set16(p + PF1_ACK_NR, conn->ack_nr);
-		}
+		// a packet that was added to keeps its sequence number
+		utp_write_header(conn, pkt->data, flags, append ? conn->seq_nr : conn->seq_nr - 1);
 
 		if (append) {
 			// Remember the message in the outgoing queue.
 			circbuf_ensure_size(&conn->outbuf, conn->seq_nr, conn->cur_window_packets);
 			circbuf_put(&conn->outbuf, conn->seq_nr, pkt);
-			if (conn->version == 0) set16(p + PF0_SEQ_NR, conn->seq_nr);
-			else set16(p + PF1_SEQ_NR, conn->seq_nr);
 			conn->seq_nr++;
 			conn->cur_window_packets++;
 		}
@@ -1131,12 +2132,212 @@ static void utp_update_send_quota(UTPSocket *conn)
 	if (dt == 0) return;
 	conn->last_send_quota = g_current_ms;
 	size_t add = conn->max_window * dt * 100 / (conn->rtt_hist.delay_base?conn->rtt_hist.delay_base:50);
-	if (add > conn->max_window * 100 && add > MAX_CWND_INCREASE_BYTES_PER_RTT * 100) add = conn->max_window;
+	if (add > conn->max_window * 100 && add > (size_t)conn->tun.max_cwnd_increase * 100) add = conn->max_window;
 	conn->send_quota += (int32_t)add;
 //	LOG_UTPV("0x%08x: UTPSocket::update_send_quota dt:%d rtt:%u max_window:%u quota:%d",
 //			 this, dt, rtt, (unsigned)max_window, send_quota / 100);
 }
 
+// the minimum round trip time seen recently, in microseconds
+static uint64_t utp_min_rtt(const UTPSocket *conn)
+{
+	if (conn->rtt_hist.delay_base_initialized)
+		return (uint64_t)min(conn->rtt_hist.delay_base, conn->rtt) * 1000;
+	return (uint64_t)conn->rtt * 1000;
+}
+
+// RACK: remember the most recently sent packet that got acked.
+// Called for every packet that is acked, cumulatively or selectively
+static void utp_rack_on_ack(UTPSocket *conn, const OutgoingPacket *pkt, uint16_t seq)
+{
+	const uint64_t now = g_current_us;
+	const uint64_t rtt = now - pkt->time_sent;
+
+	// if we declared the packet lost, but it's acked before (or too quickly
+	// after) we re-sent it, it was only reordered or delayed. Widen the
+	// reordering window so we don't keep doing this. Packets a timeout
+	// marked for resend don't count, that says nothing about reordering
+	if (pkt->rack_lost && (pkt->need_resend || rtt < utp_min_rtt(conn))) {
+		conn->spurious_resends++;
+		if (conn->rack_reo_wnd_mult < 16) conn->rack_reo_wnd_mult++;
+		conn->rack_reo_wnd_persist = 16;
+		LOG_UTPV("0x%08x: spurious resend of %u reo_wnd_mult:%u", conn, seq, conn->rack_reo_wnd_mult);
+	}
+
+	// a packet we only sent once is acked after one we sent after it.
+	// The network reorders packets
+	if (conn->rack_xmit_time != 0 && pkt->transmissions == 1 && seq_less(seq, conn->rack_fack)) {
+		conn->rack_reordering_seen = true;
+	}
+	if (conn->rack_xmit_time == 0 || seq_less(conn->rack_fack_next, seq)) {
+		conn->rack_fack_next = seq;
+	}
+
+	// for retransmitted packets we can't tell which transmission
+	// this is an ack for. If it's faster than the min rtt, it's for
+	// an earlier one
+	if (pkt->transmissions > 1 && rtt < utp_min_rtt(conn)) return;
+
+	if (pkt->time_sent > conn->rack_xmit_time ||
+		(pkt->time_sent == conn->rack_xmit_time && seq_less(conn->rack_seq_nr, seq))) {
+		conn->rack_xmit_time = pkt->time_sent;
+		conn->rack_rtt = (uint32_t)rtt;
+		conn->rack_seq_nr = seq;
+	}
+}
+
+// RACK: a loss recovery ends once everything that was in flight when it
+// started has been acked. The reordering window decays back after
+// rack_reo_wnd_persist recoveries
+static void utp_rack_check_recovery(UTPSocket *conn)
+{
+	if (!conn->rack_in_recovery) return;
+	if (conn->cur_window_packets > 0 &&
+		seq_less(conn->seq_nr - conn->cur_window_packets, conn->rack_recovery_seq))
+		return;
+
+	conn->rack_in_recovery = false;
+	if (conn->rack_reo_wnd_persist > 0 && --conn->rack_reo_wnd_persist == 0)
+		conn->rack_reo_wnd_mult = 1;
+}
+
+// RACK: how much reordering we tolerate before declaring a packet lost, in microseconds
+static uint64_t utp_rack_reo_wnd(const UTPSocket *conn)
+{
+	// until we've seen the network reorder packets, enough selectively
+	// acked packets is evidence enough
+	if (!conn->rack_reordering_seen && conn->duplicate_ack >= conn->tun.duplicate_acks)
+		return 0;
+	return min(conn->rack_reo_wnd_mult * utp_min_rtt(conn) / 4, (uint64_t)conn->rtt * 1000);
+}
+
+// Time based loss detection (RACK, RFC 8985). A packet is lost if a
+// packet sent after it has been acked, and the reordering window has
+// passed since it should have been acked. Lost packets are marked as
+// needing resend, which is done by utp_flush_packets().
+// Returns true if any packet was declared lost
+static bool utp_rack_detect_loss(UTPSocket *conn)
+{
+	conn->rack_fack = conn->rack_fack_next;
+	conn->rack_timer = false;
+
+	if (conn->rack_xmit_time == 0 || conn->cur_window_packets == 0) return false;
+
+	const uint64_t now = g_current_us;
+	const uint64_t reo_wnd = utp_rack_reo_wnd(conn);
+	uint64_t wait = UINT64_MAX;
+	bool lost = false;
+
+	OutgoingPacket *next;
+	for (OutgoingPacket *pkt = conn->sent_head; pkt != NULL; pkt = next) {
+		next = pkt->sent_next;
+
+		// only packets sent before the last one that was acked. The
+		// list is in the order they were sent, none of the rest are
+		if (pkt->time_sent > conn->rack_xmit_time) break;
+		if (pkt->time_sent == conn->rack_xmit_time && !seq_less(pkt->seq_nr, conn->rack_seq_nr))
+			continue;
+
+		// nor is the deadline of any of the rest earlier
+		const uint64_t deadline = pkt->time_sent + conn->rack_rtt + reo_wnd;
+		if (deadline > now) {
+			wait = deadline - now;
+			break;
+		}
+
+		// used in parse_log.py
+		LOG_UTP("0x%08x: Packet %u lost. Resending", conn, pkt->seq_nr);
+
+		utp_sent_unlink(conn, pkt);
+		pkt->need_resend = true;
+		pkt->rack_lost = true;
+		assert(conn->cur_window >= pkt->payload);
+		conn->cur_window -= pkt->payload;
+		conn->lost_packets++;
+#ifdef _DEBUG
+		++conn->_stats._rexmit;
+#endif
+		if (seq_less(conn->fast_resend_seq_nr, pkt->seq_nr + 1))
+			conn->fast_resend_seq_nr = pkt->seq_nr + 1;
+		lost = true;
+	}
+
+	if (lost) {
+		// On Loss
+		utp_maybe_decay_win(conn);
+		if (!conn->rack_in_recovery) {
+			conn->rack_in_recovery = true;
+			conn->rack_recovery_seq = conn->seq_nr;
+		}
+	}
+
+	// some packets may still be lost, check again when
+	// their reordering window has passed
+	if (wait != UINT64_MAX) {
+		conn->rack_timer = true;
+		conn->rack_timeout = g_current_ms + (uint32_t)DIV_ROUND_UP(wait, 1000);
+	}
+	return lost;
+}
+
+static void utp_set_rcvbuf(UTPSocket *conn, size_t rcvbuf)
+{
+	if (conn->rcvbuf_auto) {
+		assert(g_rcvbuf_total >= conn->opt_rcvbuf);
+		g_rcvbuf_total = g_rcvbuf_total - conn->opt_rcvbuf + rcvbuf;
+	}
+	conn->opt_rcvbuf = rcvbuf;
+}
+
+// How often to measure for receive buffer autotuning: once per round
+// trip, whether we've measured it sending data or only receiving it
+static uint32_t utp_rcvbuf_interval(const UTPSocket *conn)
+{
+	const uint32_t rtt = conn->rtt ? conn->rtt : conn->rcv_rtt;
+	return rtt ? max(rtt, 10u) : 100;
+}
+
+// Receive buffer autotuning. Once per round trip, measure how much the
+// application drained from its read buffer, and size the receive buffer
+// to twice that, so the window doesn't hold back a sender the application
+// can keep up with. Grow within the global budget, and only shrink when
+// the application is sitting on data (or we're over budget), not just
+// because the sender is idle.
+static void utp_rcvbuf_autotune(UTPSocket *conn)
+{
+	if (!conn->rcvbuf_auto || !conn->userdata) return;
+
+	const uint32_t rtt = utp_rcvbuf_interval(conn);
+	const uint32_t interval = g_current_ms - conn->rcv_measure_time;
+	if (interval < rtt) return;
+
+	const size_t rb_size = conn->func.get_rb_size(conn->userdata);
+	const uint64_t drained = conn->rcv_delivered > rb_size ? conn->rcv_delivered - rb_size : 0;
+	const uint64_t copied = drained > conn->rcv_drained ? drained - conn->rcv_drained : 0;
+	conn->rcv_drained = drained;
+	conn->rcv_measure_time = g_current_ms;
+
+	size_t target = (size_t)min(copied * 2 * rtt / interval, RCVBUF_AUTO_MAX);
+	target = max(target, RCVBUF_AUTO_MIN);
+
+	size_t rcvbuf = conn->opt_rcvbuf;
+	const bool over_budget = g_rcvbuf_budget != 0 && g_rcvbuf_total > g_rcvbuf_budget;
+	if (target > rcvbuf && !over_budget) {
+		size_t grow = target - rcvbuf;
+		if (g_rcvbuf_budget != 0)
+			grow = min(grow, g_rcvbuf_budget - g_rcvbuf_total);
+		rcvbuf += grow;
+	} else if (target < rcvbuf && (rb_size >= rcvbuf / 2 || over_budget)) {
+		rcvbuf = max(target, rcvbuf - rcvbuf / 4);
+	}
+
+	if (rcvbuf != conn->opt_rcvbuf) {
+		LOG_UTPV("0x%08x: rcvbuf autotune:%u copied:%u interval:%u rb:%u",
+				 conn, (unsigned)rcvbuf, (unsigned)copied, interval, (unsigned)rb_size);
+		utp_set_rcvbuf(conn, rcvbuf);
+	}
+}
+
 #ifdef _DEBUG
 static void utp_check_invariant(UTPSocket *conn)
 {
@@ -1151,6 +2352,15 @@ static void utp_check_invariant(UTPSocket *conn)
 		outstanding_bytes += pkt->payload;
 	}
 	assert(outstanding_bytes == conn->cur_window);
+
+	// the same packets are in the list of packets in flight, oldest first
+	outstanding_bytes = 0;
+	for (OutgoingPacket *pkt = conn->sent_head; pkt != NULL; pkt = pkt->sent_next) {
+		assert(utp_is_in_flight(pkt));
+		assert(pkt->sent_next == NULL || pkt->sent_next->time_sent >= pkt->time_sent);
+		outstanding_bytes += pkt->payload;
+	}
+	assert(outstanding_bytes == conn->cur_window);
 }
 #endif
 
@@ -1169,11 +2379,17 @@ static void utp_check_timeouts(UTPSocket *conn)
 			 conn->send_quota / 100, statenames[conn->state], conn->cur_window_packets,
 			 (unsigned)conn->bytes_since_ack, (int)(g_current_ms - conn->ack_time));
 
+	// the reordering window of some packet in flight has passed
+	if (conn->rack_timer && (int)(g_current_ms - conn->rack_timeout) >= 0) {
+		utp_rack_detect_loss(conn);
+	}
+
 	utp_update_send_quota(conn);
 	utp_flush_packets(conn);
+	utp_rcvbuf_autotune(conn);
 
 
-	if (USE_PACKET_PACING) {
+	if (conn->tun.packet_pacing) {
 		// In case the new send quota made it possible to send another packet
 		// Mark the socket as writable. If we don't use pacing, the send
 		// quota does not affect if the socket is writeable
@@ -1199,8 +2415,13 @@ static void utp_check_timeouts(UTPSocket *conn)
 			conn->max_window_user = PACKET_SIZE;
 		}
 
+		if (conn->tlp_timer && (int)(g_current_ms - conn->tlp_timeout) >= 0 &&
+			conn->cur_window_packets > 0) {
+			utp_send_tail_loss_probe(conn);
+		}
+
 		if ((int)(g_current_ms - conn->rto_timeout) >= 0 &&
-			(!(USE_PACKET_PACING) || conn->cur_window_packets > 0) &&
+			(!conn->tun.packet_pacing || conn->cur_window_packets > 0) &&
 			conn->rto_timeout > 0) {
 
 			/*
@@ -1230,6 +2451,7 @@ static void utp_check_timeouts(UTPSocket *conn)
 
 			// On Timeout
 			conn->duplicate_ack = 0;
+			conn->timeouts++;
 
 			// rate = min_rate
 			conn->max_window = utp_get_packet_size(conn);
@@ -1238,7 +2460,8 @@ static void utp_check_timeouts(UTPSocket *conn)
 			// every packet should be considered lost
 			for (int i = 0; i < conn->cur_window_packets; ++i) {
 				OutgoingPacket *pkt = (OutgoingPacket*)circbuf_get(&conn->outbuf, conn->seq_nr - i - 1);
-				if (pkt == 0 || pkt->transmissions == 0 || pkt->need_resend) continue;
+				if (pkt == 0 || !utp_is_in_flight(pkt)) continue;
+				utp_sent_unlink(conn, pkt);
 				pkt->need_resend = true;
 				assert(conn->cur_window >= pkt->payload);
 				conn->cur_window -= pkt->payload;
@@ -1271,12 +2494,11 @@ static void utp_check_timeouts(UTPSocket *conn)
 
 		if (conn->state >= CS_CONNECTED && conn->state <= CS_FIN_SENT) {
 			// Send acknowledgment packets periodically, or when the threshold is reached
-			if (conn->bytes_since_ack > DELAYED_ACK_BYTE_THRESHOLD ||
-				(int)(g_current_ms - conn->ack_time) >= 0) {
+			if (utp_ack_due(conn)) {
 				utp_send_ack(conn, false);
 			}
 
-			if ((int)(g_current_ms - conn->last_sent_packet) >= KEEPALIVE_INTERVAL) {
+			if ((int)(g_current_ms - conn->last_sent_packet) >= conn->tun.keepalive_interval) {
 				utp_send_keep_alive(conn);
 			}
 		}
@@ -1303,6 +2525,15 @@ static void utp_check_timeouts(UTPSocket *conn)
 
 	getout:;
 
+	// A connection nobody accepted yet is ours to clean up
+	if (conn->accept_pending) {
+		if (conn->state == CS_RESET ||
+			(conn->half_open && (int)(g_current_ms - conn->half_open_time) >= HALF_OPEN_TIMEOUT)) {
+			LOG_UTPV("0x%08x: dropping unaccepted connection in state:%s", conn, statenames[conn->state]);
+			conn->state = CS_DESTROY;
+		}
+	}
+
 	// make sure we don't accumulate quota when we don't have
 	// anything to send
 	int32_t limit = smax((int32_t)conn->max_window / 2, 5 * (int32_t)utp_get_packet_size(conn)) * 100;
@@ -1334,11 +2565,14 @@ static int utp_ack_packet(UTPSocket *conn, uint16_t seq)
 			 conn, seq, (unsigned)pkt->payload, pkt->need_resend);
 
 	circbuf_put(&conn->outbuf, seq, NULL);
+	if (!pkt->need_resend) utp_sent_unlink(conn, pkt);
+
+	utp_rack_on_ack(conn, pkt, seq);
 
 	// if we never re-sent the packet, update the RTT estimate
 	if (pkt->transmissions == 1) {
 		// Estimate the round trip time.
-		const uint32_t ertt = (uint32_t)((UTP_GetMicroseconds() - pkt->time_sent) / 1000);
+		const uint32_t ertt = (uint32_t)((g_current_us - pkt->time_sent) / 1000);
 		if (conn->rtt == 0) {
 			// First round trip time sample
 			conn->rtt = ertt;
@@ -1377,7 +2611,7 @@ static size_t utp_selective_ack_bytes(UTPSocket *conn, unsigned base, const uint
 	if (conn->cur_window_packets == 0) return 0;
 
 	size_t acked_bytes = 0;
-	int bits = len * 8;
+	int bits = len * 8 - 1;
 
 	do {
 		unsigned v = base + bits;
@@ -1397,15 +2631,15 @@ static size_t utp_selective_ack_bytes(UTPSocket *conn, unsigned base, const uint
 		if (bits >= 0 && mask[bits>>3] & (1 << (bits & 7))) {
 			assert((int)(pkt->payload) >= 0);
 			acked_bytes += pkt->payload;
-			*min_rtt = smin(*min_rtt, (int64_t)(UTP_GetMicroseconds() - pkt->time_sent));
+			*min_rtt = smin(*min_rtt, (int64_t)(g_current_us - pkt->time_sent));
 			continue;
 		}
 	} while (--bits >= -1);
 	return acked_bytes;
 }
 
-enum { MAX_EACK = 128 };
-
+// Ack the packets in the EACK header. Deciding which of the
+// packets that are not acked are lost is left to utp_rack_detect_loss()
 static void utp_selective_ack(UTPSocket *conn, unsigned base, const uint8_t *mask, uint8_t len)
 {
 	if (conn->cur_window_packets == 0) return;
@@ -1415,12 +2649,6 @@ static void utp_selective_ack(UTPSocket *conn, unsigned base, const uint8_t *mas
 
 	int count = 0;
 
-	// resends is a stack of sequence numbers we need to resend. Since we
-	// iterate in reverse over the acked packets, at the end, the top packets
-	// are the ones we want to resend
-	int resends[MAX_EACK];
-	int nr = 0;
-
 	LOG_UTPV("0x%08x: Got EACK [%032b] base:%u", conn, *(uint32_t*)mask, base);
 	do {
 		// we're iterating over the bits from higher sequence numbers
@@ -1481,74 +2709,45 @@ static void utp_selective_ack(UTPSocket *conn, unsigned base, const uint8_t *mas
 			// the selective ack should never ACK the packet we're waiting for to decrement cur_window_packets
 			assert((v & conn->outbuf.mask) != ((conn->seq_nr - conn->cur_window_packets) & conn->outbuf.mask));
 			utp_ack_packet(conn, v);
-			continue;
-		}
-
-		// Resend segments
-		// if count is less than our re-send limit, we haven't seen enough
-		// acked packets in front of this one to warrant a re-send.
-		// if count == 0, we're still going through the tail of zeroes
-		if (((v - conn->fast_resend_seq_nr) & ACK_NR_MASK) <= OUTGOING_BUFFER_MAX_SIZE &&
-			count >= DUPLICATE_ACKS_BEFORE_RESEND &&
-			conn->duplicate_ack < DUPLICATE_ACKS_BEFORE_RESEND) {
-			// resends is a stack, and we're mostly interested in the top of it
-			// if we're full, just throw away the lower half
-			if (nr >= MAX_EACK - 2) {
-				memmove(resends, &resends[MAX_EACK/2], MAX_EACK/2 * sizeof(resends[0]));
-				nr -= MAX_EACK / 2;
-			}
-			resends[nr++] = v;
-			LOG_UTPV("0x%08x: no ack for %u", conn, v);
-		} else {
-			LOG_UTPV("0x%08x: not resending %u count:%d dup_ack:%u fast_resend_seq_nr:%u",
-					 conn, v, count, conn->duplicate_ack, conn->fast_resend_seq_nr);
 		}
 	} while (--bits >= -1);
 
-	if (((base - 1 - conn->fast_resend_seq_nr) & ACK_NR_MASK) <= OUTGOING_BUFFER_MAX_SIZE &&
-		count >= DUPLICATE_ACKS_BEFORE_RESEND) {
-		// if we get enough duplicate acks to start
-		// resending, the first packet we should resend
-		// is base-1
-		resends[nr++] = (base - 1) & ACK_NR_MASK;
-	} else {
-		LOG_UTPV("0x%08x: not resending %u count:%d dup_ack:%u fast_resend_seq_nr:%u",
-				 conn, base - 1, count, conn->duplicate_ack, conn->fast_resend_seq_nr);
-	}
-
-	bool back_off = false;
-	int i = 0;
-	while (nr > 0) {
-		unsigned v = resends[--nr];
-		// don't consider the tail of 0:es to be lost packets
-		// only unacked packets with acked packets after should
-		// be considered lost
-		OutgoingPacket *pkt = (OutgoingPacket*)circbuf_get(&conn->outbuf, v);
+	// the number of packets acked past the first missing one. This
+	// is the same as the number of duplicate acks in TCP. With the large
+	// window extension, a selective ack covers up to EACK_MAX_BYTES * 8
+	conn->duplicate_ack = (uint16_t)min(count, UINT16_MAX);
+}
 
-		// this may be an old (re-ordered) packet, and some of the
-		// packets in here may have been acked already. In which
-		// case they will not be in the send queue anymore
-		if (!pkt) continue;
+static void utp_set_sndbuf(UTPSocket *conn, size_t sndbuf)
+{
+	if (conn->sndbuf_auto) {
+		assert(g_sndbuf_total >= conn->opt_sndbuf);
+		g_sndbuf_total = g_sndbuf_total - conn->opt_sndbuf + sndbuf;
+	}
+	conn->opt_sndbuf = sndbuf;
+}
 
-		// used in parse_log.py
-		LOG_UTP("0x%08x: Packet %u lost. Resending", conn, v);
+// Send buffer autotuning. Keep room for twice the congestion window, so
+// the window can keep growing while the pipe fills up, but don't reserve
+// more than that. Growing is limited by the global budget, shrinking
+// gives the memory back right away.
+static void utp_sndbuf_autotune(UTPSocket *conn)
+{
+	if (!conn->sndbuf_auto) return;
 
-		// On Loss
-		back_off = true;
-#ifdef _DEBUG
-		++conn->_stats._rexmit;
-#endif
-		utp_send_packet(conn, pkt);
-		conn->fast_resend_seq_nr = v + 1;
+	size_t target = min(conn->max_window * 2, SNDBUF_AUTO_MAX);
+	target = max(target, SNDBUF_AUTO_MIN);
 
-		// Re-send max 4 packets.
-		if (++i >= 4) break;
+	if (target > conn->opt_sndbuf && g_sndbuf_budget != 0) {
+		const size_t room = g_sndbuf_budget > g_sndbuf_total ? g_sndbuf_budget - g_sndbuf_total : 0;
+		target = min(target, conn->opt_sndbuf + room);
 	}
 
-	if (back_off)
-		utp_maybe_decay_win(conn);
-
-	conn->duplicate_ack = count;
+	if (target != conn->opt_sndbuf) {
+		LOG_UTPV("0x%08x: sndbuf autotune:%u max_window:%u total:%u",
+				 conn, (unsigned)target, (unsigned)conn->max_window, (unsigned)g_sndbuf_total);
+		utp_set_sndbuf(conn, target);
+	}
 }
 
 static void utp_apply_ledbat_ccontrol(UTPSocket *conn, size_t bytes_acked, uint32_t actual_delay, int64_t min_rtt)
@@ -1561,7 +2760,7 @@ static void utp_apply_ledbat_ccontrol(UTPSocket *conn, size_t bytes_acked, uint3
 	assert(our_delay != INT_MAX);
 	assert(our_delay >= 0);
 
-	UTP_DelaySample((const struct sockaddr *)&conn->addr, our_delay / 1000);
+	UTP_DelaySample(utp_peer_addr(conn->peer), our_delay / 1000);
 
 	// This test the connection under heavy load from foreground
 	// traffic. Pretend that our delays are very high to force the
@@ -1569,20 +2768,20 @@ static void utp_apply_ledbat_ccontrol(UTPSocket *conn, size_t bytes_acked, uint3
 	//our_delay *= 4;
 
 	// target is microseconds
-	int target = CCONTROL_TARGET;
+	int target = conn->tun.target_delay;
 	if (target <= 0) target = 100000;
 
 	double off_target = target - our_delay;
 
 	// this is the same as:
 	//
-	//    (min(off_target, target) / target) * (bytes_acked / max_window) * MAX_CWND_INCREASE_BYTES_PER_RTT
+	//    (min(off_target, target) / target) * (bytes_acked / max_window) * tun.max_cwnd_increase
 	//
 	// so, it's scaling the max increase by the fraction of the window this ack represents, and the fraction
 	// of the target delay the current delay represents.
 	// The min() around off_target protects against crazy values of our_delay, which may happen when th
 	// timestamps wraps, or by just having a malicious peer sending garbage. This caps the increase
-	// of the window size to MAX_CWND_INCREASE_BYTES_PER_RTT per rtt.
+	// of the window size to tun.max_cwnd_increase per rtt.
 	// as for large negative numbers, this direction is already capped at the min packet size further down
 	// the min around the bytes_acked protects against the case where the window size was recently
 	// shrunk and the number of acked bytes exceeds that. This is considered no more than one full
@@ -1591,14 +2790,14 @@ static void utp_apply_ledbat_ccontrol(UTPSocket *conn, size_t bytes_acked, uint3
 	assert(bytes_acked > 0);
 	double window_factor = (double)min(bytes_acked, conn->max_window) / (double)max(conn->max_window, bytes_acked);
 	double delay_factor = off_target / target;
-	double scaled_gain = MAX_CWND_INCREASE_BYTES_PER_RTT * window_factor * delay_factor;
+	double scaled_gain = conn->tun.max_cwnd_increase * window_factor * delay_factor;
 
-	// since MAX_CWND_INCREASE_BYTES_PER_RTT is a cap on how much the window size (max_window)
+	// since tun.max_cwnd_increase is a cap on how much the window size (max_window)
 	// may increase per RTT, we may not increase the window size more than that proportional
 	// to the number of bytes that were acked, so that once one window has been acked (one rtt)
 	// the increase limit is not exceeded
 	// the +1. is to allow for floating point imprecision
-	assert(scaled_gain <= 1. + MAX_CWND_INCREASE_BYTES_PER_RTT * (int)min(bytes_acked, conn->max_window) / (double)max(conn->max_window, bytes_acked));
+	assert(scaled_gain <= 1. + conn->tun.max_cwnd_increase * (int)min(bytes_acked, conn->max_window) / (double)max(conn->max_window, bytes_acked));
 
 	if (scaled_gain > 0 && g_current_ms - conn->last_maxed_out_window > 300) {
 		// if it was more than 300 milliseconds since we tried to send a packet
@@ -1608,18 +2807,19 @@ static void utp_apply_ledbat_ccontrol(UTPSocket *conn, size_t bytes_acked, uint3
 		scaled_gain = 0;
 	}
 
-	if (scaled_gain + conn->max_window < MIN_WINDOW_SIZE) {
-		conn->max_window = MIN_WINDOW_SIZE;
+	if (scaled_gain + conn->max_window < conn->tun.min_window) {
+		conn->max_window = conn->tun.min_window;
 	} else {
 		conn->max_window = (size_t)(conn->max_window + scaled_gain);
 	}
 
 	// make sure that the congestion window is below max
 	// make sure that we don't shrink our window too small
+	utp_sndbuf_autotune(conn);
 	if (conn->max_window > conn->opt_sndbuf)
 		conn->max_window = conn->opt_sndbuf;
-	if (conn->max_window < MIN_WINDOW_SIZE)
-		conn->max_window = MIN_WINDOW_SIZE;
+	if (conn->max_window < conn->tun.min_window)
+		conn->max_window = conn->tun.min_window;
 
 	// used in parse_log.py
 	LOG_UTP("0x%08x: actual_delay:%u our_delay:%d their_delay:%u off_target:%d max_window:%u "
@@ -1632,7 +2832,7 @@ static void utp_apply_ledbat_ccontrol(UTPSocket *conn, size_t bytes_acked, uint3
 			(unsigned)(conn->cur_window - bytes_acked), (float)(scaled_gain), conn->rtt,
 			(unsigned)(conn->max_window * 1000 / (conn->rtt_hist.delay_base?conn->rtt_hist.delay_base:50)),
 			conn->send_quota / 100, (unsigned)conn->max_window_user, conn->rto, (int)(conn->rto_timeout - g_current_ms),
-			UTP_GetMicroseconds(), conn->cur_window_packets, (unsigned)utp_get_packet_size(conn),
+			g_current_us, conn->cur_window_packets, (unsigned)utp_get_packet_size(conn),
 			conn->their_hist.delay_base, conn->their_hist.delay_base + delayhist_get_value(&conn->their_hist));
 }
 
@@ -1662,12 +2862,12 @@ static void UTP_RegisterRecvPacket(UTPSocket *conn, size_t len)
 // connection is allowed to send
 static size_t utp_get_packet_size(UTPSocket *conn)
 {
-	int header_size = conn->version == 1 ? PF1_SIZE : PF0_SIZE;
+	int header_size = (int)utp_get_header_size(conn);
 
 	size_t mtu = utp_get_udp_mtu(conn);
 
 	if (DYNAMIC_PACKET_SIZE_ENABLED) {
-		size_t max_packet_size = UTP_GetPacketSizeForAddr((const struct sockaddr *)&conn->addr);
+		size_t max_packet_size = UTP_GetPacketSizeForAddr(utp_peer_addr(conn->peer));
 		return min(mtu - header_size, max_packet_size);
 	}
 	else
@@ -1676,6 +2876,217 @@ static size_t utp_get_packet_size(UTPSocket *conn)
 	}
 }
 
+// Record the delays carried by an incoming packet: the one-way delay
+// of the packet itself, to report back, and the delay the other end
+// measured for ours. Returns the latter, 0 if there is none
+static uint32_t utp_take_delay_sample(UTPSocket *conn, uint64_t pk_time, uint32_t pk_delay, int64_t min_rtt)
+{
+	conn->last_measured_delay = g_current_ms;
+
+	// get delay in both directions
+	// record the delay to report back
+	const uint32_t their_delay = pk_time == 0 ? 0 : g_current_us - pk_time;
+	conn->reply_micro = their_delay;
+	uint32_t prev_delay_base = conn->their_hist.delay_base;
+	if (their_delay != 0) delayhist_add_sample(&conn->their_hist, their_delay);
+
+	// if their new delay base is less than their previous one
+	// we should shift our delay base in the other direction in order
+	// to take the clock skew into account
+	if (prev_delay_base != 0 &&
+		wrapping_compare_less(conn->their_hist.delay_base, prev_delay_base)) {
+		// never adjust more than 10 milliseconds
+		if (prev_delay_base - conn->their_hist.delay_base <= 10000) {
+			delayhist_shift(&conn->our_hist, prev_delay_base - conn->their_hist.delay_base);
+		}
+	}
+
+	const uint32_t actual_delay = pk_delay == INT_MAX ? 0 : pk_delay;
+
+	// if the actual delay is 0, it means the other end
+	// hasn't received a sample from us yet, and doesn't
+	// know what it is. We can't update out history unless
+	// we have a true measured sample
+	prev_delay_base = conn->our_hist.delay_base;
+	if (actual_delay != 0) delayhist_add_sample(&conn->our_hist, actual_delay);
+
+	// the delays in the two directions add up to a round trip, the
+	// difference between the clocks cancels out
+	if (their_delay != 0 && actual_delay != 0) {
+		const uint32_t rtt = (their_delay + actual_delay) / 1000;
+		if (rtt < 6000)
+			conn->rcv_rtt = conn->rcv_rtt ? conn->rcv_rtt - conn->rcv_rtt / 8 + rtt / 8 : rtt;
+	}
+
+	// if our new delay base is less than our previous one
+	// we should shift the other end's delay base in the other
+	// direction in order to take the clock skew into account
+	// This is commented out because it creates bad interactions
+	// with our adjustment in the other direction. We don't really
+	// need our estimates of the other peer to be very accurate
+	// anyway. The problem with shifting here is that we're more
+	// likely shift it back later because of a low latency. This
+	// second shift back would cause us to shift our delay base
+	// which then get's into a death spiral of shifting delay bases
+/*	if (prev_delay_base != 0 &&
+		wrapping_compare_less(conn->our_hist.delay_base, prev_delay_base)) {
+		// never adjust more than 10 milliseconds
+		if (prev_delay_base - conn->our_hist.delay_base <= 10000) {
+			conn->their_hist.Shift(prev_delay_base - conn->our_hist.delay_base);
+		}
+	}
+*/
+
+	// if the delay estimate exceeds the RTT, adjust the base_delay to
+	// compensate
+	if (delayhist_get_value(&conn->our_hist) > (uint32_t)min_rtt) {
+		delayhist_shift(&conn->our_hist, delayhist_get_value(&conn->our_hist) - min_rtt);
+	}
+
+	return actual_delay;
+}
+
+// the other end tells us how much room it has to receive
+static void utp_set_peer_window(UTPSocket *conn, uint32_t pk_wnd_size)
+{
+	conn->max_window_user = pk_wnd_size;
+
+	// If max user window is set to 0, then we startup a timer
+	// That will reset it to 1 after 15 seconds.
+	if (conn->max_window_user == 0)
+		// Reset max_window_user to 1 every 15 seconds.
+		conn->zerowindow_time = g_current_ms + 15000;
+}
+
+// if the only packet in flight hasn't been sent yet because of
+// Nagle, send it now that we have room
+static void utp_flush_nagle(UTPSocket *conn)
+{
+	if (conn->cur_window_packets == 1) {
+		OutgoingPacket *pkt = (OutgoingPacket*)circbuf_get(&conn->outbuf, conn->seq_nr - 1);
+		// do we still have quota?
+		if (pkt->transmissions == 0 &&
+			(!conn->tun.packet_pacing || conn->send_quota / 100 >= (int32_t)pkt->length)) {
+			utp_send_packet(conn, pkt);
+
+			// No need to send another ack if there is nothing to reorder.
+			if (conn->reorder_count == 0) {
+				utp_sent_ack(conn);
+			}
+		}
+	}
+}
+
+// In case an ack dropped the current window below
+// the max_window size, Mark the socket as writable
+static void utp_check_writable(UTPSocket *conn)
+{
+	if (conn->state == CS_CONNECTED_FULL && utp_is_writable(conn, utp_get_packet_size(conn))) {
+		conn->state = CS_CONNECTED;
+		LOG_UTPV("0x%08x: Socket writable. max_window:%u cur_window:%u quota:%d packet_size:%u",
+				 conn, (unsigned)conn->max_window, (unsigned)conn->cur_window, conn->send_quota / 100, (unsigned)utp_get_packet_size(conn));
+		conn->func.on_state(conn->userdata, UTP_STATE_WRITABLE);
+	}
+}
+
+// Header prediction. Almost every packet on an established connection
+// is either a plain ack for packets we've sent once, in order, or the
+// next data packet while nothing waits in the reorder buffer. Those take
+// the short paths below. Everything else, extension headers, selective
+// acks, loss recovery, FINs and state changes, takes the general path
+// in UTP_ProcessIncoming
+static bool utp_can_predict(const UTPSocket *conn, uint8_t pk_ext)
+{
+	// with no RACK timer pending, every packet sent before the ones
+	// acked here has been acked or declared lost, so there is no loss
+	// left for utp_rack_detect_loss() to find
+	return pk_ext == 0 &&
+		(conn->state == CS_CONNECTED || conn->state == CS_CONNECTED_FULL) &&
+		!conn->accept_pending && !conn->got_fin &&
+		!conn->rack_timer && !conn->fast_timeout;
+}
+
+// An ack moving ack_nr forward over packets that were only sent once.
+// Returns false, without having changed anything, if the packet isn't one
+static bool utp_predicted_ack(UTPSocket *conn, uint16_t pk_seq_nr, uint16_t pk_ack_nr,
+							  uint64_t pk_time, uint32_t pk_delay, uint32_t pk_wnd_size)
+{
+	const uint16_t oldest = conn->seq_nr - conn->cur_window_packets;
+	const int acks = (pk_ack_nr + 1 - oldest) & ACK_NR_MASK;
+	if (acks == 0 || acks > conn->cur_window_packets) return false;
+	if (((pk_seq_nr - conn->ack_nr - 1) & SEQ_NR_MASK) >= utp_get_max_reorder_packets(conn)) return false;
+
+	size_t acked_bytes = 0;
+	int64_t min_rtt = 0x7fffffffffffffff;
+	for (int i = 0; i < acks; ++i) {
+		const OutgoingPacket *pkt = (OutgoingPacket*)circbuf_get(&conn->outbuf, oldest + i);
+		if (pkt == 0 || pkt->transmissions != 1 || pkt->need_resend) return false;
+		acked_bytes += pkt->payload;
+		min_rtt = smin(min_rtt, (int64_t)(g_current_us - pkt->time_sent));
+	}
+
+	conn->duplicate_ack = 0;
+
+	const uint32_t actual_delay = utp_take_delay_sample(conn, pk_time, pk_delay, min_rtt);
+	if (actual_delay != 0 && acked_bytes >= 1)
+		utp_apply_ledbat_ccontrol(conn, acked_bytes, actual_delay, min_rtt);
+
+	utp_set_peer_window(conn, pk_wnd_size);
+
+	if (wrapping_compare_less(conn->fast_resend_seq_nr, (pk_ack_nr + 1) & ACK_NR_MASK))
+		conn->fast_resend_seq_nr = pk_ack_nr + 1;
+
+	for (int i = 0; i < acks; ++i) {
+		utp_ack_packet(conn, conn->seq_nr - conn->cur_window_packets);
+		conn->cur_window_packets--;
+	}
+	// skip packets that were already acked by an EACK
+	while (conn->cur_window_packets > 0 && !circbuf_get(&conn->outbuf, conn->seq_nr - conn->cur_window_packets))
+		conn->cur_window_packets--;
+
+	utp_rack_check_recovery(conn);
+	utp_flush_nagle(conn);
+
+	conn->rack_fack = conn->rack_fack_next;
+	conn->tlp_in_flight = false;
+	utp_arm_tail_loss_probe(conn);
+
+	if (acked_bytes > 0) {
+		utp_update_ack_frequency(conn);
+	}
+
+	utp_check_writable(conn);
+	return true;
+}
+
+// The next data packet in sequence, not acking anything new.
+// Returns the number of bytes of payload
+static size_t utp_predicted_data(UTPSocket *conn, const uint8_t *data, size_t count,
+								 uint64_t pk_time, uint32_t pk_delay, uint32_t pk_wnd_size)
+{
+	utp_take_delay_sample(conn, pk_time, pk_delay, 0x7fffffffffffffff);
+	utp_set_peer_window(conn, pk_wnd_size);
+	utp_flush_nagle(conn);
+	utp_check_writable(conn);
+
+	conn->ack_nr++;
+	conn->bytes_since_ack += count;
+	conn->packets_since_ack++;
+	if (count > 0) {
+		LOG_UTPV("0x%08x: Got Data len:%u (rb:%u)", conn, (unsigned)count, (unsigned)conn->func.get_rb_size(conn->userdata));
+		conn->func.on_read(conn->userdata, data, count);
+		conn->rcv_delivered += count;
+	}
+
+	conn->ack_time = g_current_ms + min(conn->ack_time - g_current_ms, utp_ack_delay(conn));
+
+	// on_read may have closed the socket
+	if ((conn->state == CS_CONNECTED || conn->state == CS_CONNECTED_FULL) && utp_ack_due(conn)) {
+		utp_send_ack(conn, false);
+	}
+	return count;
+}
+
 // Process an incoming packet
 // syn is true if this is the first packet received. It will cut off parsing
 // as soon as the header is done
@@ -1683,8 +3094,6 @@ size_t UTP_ProcessIncoming(UTPSocket *conn, const uint8_t *pkt, size_t len, bool
 {
 	UTP_RegisterRecvPacket(conn, len);
 
-	g_current_ms = UTP_GetMilliseconds();
-
 	utp_update_send_quota(conn);
 
 	const uint8_t *packet_end = pkt + len;
@@ -1696,7 +3105,7 @@ size_t UTP_ProcessIncoming(UTPSocket *conn, const uint8_t *pkt, size_t len, bool
 	uint32_t pk_delay;
 	uint32_t pk_wnd_size;
 	uint8_t pk_ext;
-	if (conn->version == 0) {
+	if (utp_is_v0(conn->version)) {
 		pk_seq_nr = get16(pkt + PF0_SEQ_NR);
 		pk_ack_nr = get16(pkt + PF0_ACK_NR);
 		pk_flags = pkt[PF0_FLAGS];
@@ -1720,9 +3129,6 @@ size_t UTP_ProcessIncoming(UTPSocket *conn, const uint8_t *pkt, size_t len, bool
 			 conn, flagnames[pk_flags], pk_seq_nr, pk_ack_nr, statenames[conn->state], conn->version,
 			 pk_time, pk_delay);
 
-	// mark receipt time
-	uint64_t time = UTP_GetMicroseconds();
-
 	// RSTs are handled earlier, since the connid matches the send id not the recv id
 	assert(pk_flags != ST_RESET);
 
@@ -1737,6 +3143,24 @@ size_t UTP_ProcessIncoming(UTPSocket *conn, const uint8_t *pkt, size_t len, bool
 		LOG_UTPV("0x%08x: Invalid packet size (less than header size)", conn);
 		return 0;
 	}
+
+	// the common cases first, see utp_can_predict()
+	if (!syn && utp_can_predict(conn, pk_ext)) {
+		if (pk_flags == ST_STATE &&
+			utp_predicted_ack(conn, pk_seq_nr, pk_ack_nr, pk_time, pk_delay, pk_wnd_size)) {
+			conn->last_got_packet = g_current_ms;
+			_global_stats._npredicted_ack++;
+			return 0;
+		}
+		if (pk_flags == ST_DATA && conn->reorder_count == 0 &&
+			pk_seq_nr == ((conn->ack_nr + 1) & SEQ_NR_MASK) &&
+			pk_ack_nr == ((conn->seq_nr - conn->cur_window_packets - 1) & ACK_NR_MASK)) {
+			conn->last_got_packet = g_current_ms;
+			_global_stats._npredicted_data++;
+			return utp_predicted_data(conn, data, packet_end - data, pk_time, pk_delay, pk_wnd_size);
+		}
+	}
+
 	// Skip the extension headers
 	while (pk_ext != 0) {
 		// Verify that the packet is valid.
@@ -1760,6 +3184,19 @@ size_t UTP_ProcessIncoming(UTPSocket *conn, const uint8_t *pkt, size_t len, bool
 			LOG_UTPV("0x%08x: got extension bits:%02x%02x%02x%02x%02x%02x%02x%02x", conn,
 				conn->extensions[0], conn->extensions[1], conn->extensions[2], conn->extensions[3],
 				conn->extensions[4], conn->extensions[5], conn->extensions[6], conn->extensions[7]);
+			break;
+		case 3: // ack frequency
+			if (data[-1] != ACK_FREQ_EXT_LEN) {
+				LOG_UTPV("0x%08x: Invalid len of ack frequency header", conn);
+				return 0;
+			}
+			if (conn->ack_frequency) {
+				conn->ack_freq_packets = max(min(get16(data), ACK_FREQ_MAX_PACKETS), 1);
+				conn->ack_freq_delay = min(get16(data + 2), conn->tun.delayed_ack_time);
+				LOG_UTPV("0x%08x: got ack frequency packets:%u delay:%u", conn,
+					conn->ack_freq_packets, conn->ack_freq_delay);
+			}
+			break;
 		}
 		pk_ext = data[-2];
 		data += data[-1];
@@ -1772,13 +3209,28 @@ size_t UTP_ProcessIncoming(UTPSocket *conn, const uint8_t *pkt, size_t len, bool
 		conn->ack_nr = (pk_seq_nr - 1) & SEQ_NR_MASK;
 	}
 
-	g_current_ms = UTP_GetMilliseconds();
+	if (syn || conn->state == CS_SYN_SENT) {
+		// the SYN asks for extensions, the SYN-ACK tells us which
+		// ones the other end agreed to
+		conn->large_window = ext_bit_isset(conn->extensions, EXT_BIT_LARGE_WINDOW) &&
+			(syn || conn->large_window_wanted);
+		conn->ack_frequency = ext_bit_isset(conn->extensions, EXT_BIT_ACK_FREQUENCY) &&
+			(syn || conn->ack_frequency_wanted);
+	}
+
 	conn->last_got_packet = g_current_ms;
 
 	if (syn) {
 		return 0;
 	}
 
+	// nobody to hand data to until the connection is accepted. We told
+	// the other end our window is closed, it will be resent
+	if (conn->accept_pending && pk_flags != ST_STATE) {
+		LOG_UTPV("0x%08x: not accepted yet, dropping packet", conn);
+		return 0;
+	}
+
 	// seqnr is the number of packets past the expected
 	// packet this is. ack_nr is the last acked, seq_nr is the
 	// current. Subtracring 1 makes 0 mean "this is the next
@@ -1786,119 +3238,68 @@ size_t UTP_ProcessIncoming(UTPSocket *conn, const uint8_t *pkt, size_t len, bool
 	const unsigned seqnr = (pk_seq_nr - conn->ack_nr - 1) & SEQ_NR_MASK;
 
 	// Getting an invalid sequence number?
-	if (seqnr >= REORDER_BUFFER_MAX_SIZE) {
-		if (seqnr >= (SEQ_NR_MASK + 1) - REORDER_BUFFER_MAX_SIZE && pk_flags != ST_STATE) {
-			conn->ack_time = g_current_ms + min(conn->ack_time - g_current_ms, (unsigned)DELAYED_ACK_TIME_THRESHOLD);
+	const size_t max_reorder = utp_get_max_reorder_packets(conn);
+	if (seqnr >= max_reorder) {
+		if (seqnr >= (SEQ_NR_MASK + 1) - max_reorder && pk_flags != ST_STATE) {
+			conn->ack_time = g_current_ms + min(conn->ack_time - g_current_ms, conn->tun.delayed_ack_time);
 		}
 		LOG_UTPV("    Got old Packet/Ack (%u/%u)=%u!", pk_seq_nr, conn->ack_nr, seqnr);
 		return 0;
 	}
 
 	// Process acknowledgment
-	// acks is the number of packets that was acked
-	int acks = (pk_ack_nr - (conn->seq_nr - 1 - conn->cur_window_packets)) & ACK_NR_MASK;
-
-	// this happens when we receive an old ack nr
-	if (acks > conn->cur_window_packets) acks = 0;
-
-	// if we get the same ack_nr as in the last packet
-	// increase the duplicate_ack counter, otherwise reset
-	// it to 0
-	if (conn->cur_window_packets > 0) {
-		if (pk_ack_nr == ((conn->seq_nr - conn->cur_window_packets - 1) & ACK_NR_MASK) &&
-			conn->cur_window_packets > 0) {
-			//++conn->duplicate_ack;
-		} else {
-			conn->duplicate_ack = 0;
-		}
-
-		// TODO: if duplicate_ack == DUPLICATE_ACK_BEFORE_RESEND
-		// and fast_resend_seq_nr <= ack_nr + 1
-		//    resend ack_nr + 1
-	}
-
-	// figure out how many bytes were acked
-	size_t acked_bytes = 0;
-
-	// the minimum rtt of all acks
-	// this is the upper limit on the delay we get back
-	// from the other peer. Our delay cannot exceed
-	// the rtt of the packet. If it does, clamp it.
-	// this is done in apply_ledbat_ccontrol()
-	int64_t min_rtt = 0x7fffffffffffffff;
-
-	for (int i = 0; i < acks; ++i) {
-		int seq = conn->seq_nr - conn->cur_window_packets + i;
-		OutgoingPacket *pkt = (OutgoingPacket*)circbuf_get(&conn->outbuf, seq);
-		if (pkt == 0 || pkt->transmissions == 0) continue;
-		assert((int)(pkt->payload) >= 0);
-		acked_bytes += pkt->payload;
-		min_rtt = smin(min_rtt, (int64_t)(UTP_GetMicroseconds() - pkt->time_sent));
-	}
-	
-	// count bytes acked by EACK
-	if (selack_ptr != NULL) {
-		acked_bytes += utp_selective_ack_bytes(conn, (pk_ack_nr + 2) & ACK_NR_MASK,
-												 selack_ptr, selack_ptr[-1], &min_rtt);
-	}
-
-	LOG_UTPV("0x%08x: acks:%d acked_bytes:%u seq_nr:%d cur_window:%u cur_window_packets:%u relative_seqnr:%u max_window:%u min_rtt:%u rtt:%u",
-			 conn, acks, (unsigned)acked_bytes, conn->seq_nr, (unsigned)conn->cur_window, conn->cur_window_packets,
-			 seqnr, (unsigned)conn->max_window, (unsigned)(min_rtt / 1000), conn->rtt);
-
-	conn->last_measured_delay = g_current_ms;
-
-	// get delay in both directions
-	// record the delay to report back
-	const uint32_t their_delay = pk_time == 0 ? 0 : time - pk_time;
-	conn->reply_micro = their_delay;
-	uint32_t prev_delay_base = conn->their_hist.delay_base;
-	if (their_delay != 0) delayhist_add_sample(&conn->their_hist, their_delay);
-
-	// if their new delay base is less than their previous one
-	// we should shift our delay base in the other direction in order
-	// to take the clock skew into account
-	if (prev_delay_base != 0 &&
-		wrapping_compare_less(conn->their_hist.delay_base, prev_delay_base)) {
-		// never adjust more than 10 milliseconds
-		if (prev_delay_base - conn->their_hist.delay_base <= 10000) {
-			delayhist_shift(&conn->our_hist, prev_delay_base - conn->their_hist.delay_base);
-		}
-	}
-
-	const uint32_t actual_delay = pk_delay == INT_MAX ? 0 : pk_delay;
-
-	// if the actual delay is 0, it means the other end
-	// hasn't received a sample from us yet, and doesn't
-	// know what it is. We can't update out history unless
-	// we have a true measured sample
-	prev_delay_base = conn->our_hist.delay_base;
-	if (actual_delay != 0) delayhist_add_sample(&conn->our_hist, actual_delay);
-
-	// if our new delay base is less than our previous one
-	// we should shift the other end's delay base in the other
-	// direction in order to take the clock skew into account
-	// This is commented out because it creates bad interactions
-	// with our adjustment in the other direction. We don't really
-	// need our estimates of the other peer to be very accurate
-	// anyway. The problem with shifting here is that we're more
-	// likely shift it back later because of a low latency. This
-	// second shift back would cause us to shift our delay base
-	// which then get's into a death spiral of shifting delay bases
-/*	if (prev_delay_base != 0 &&
-		wrapping_compare_less(conn->our_hist.delay_base, prev_delay_base)) {
-		// never adjust more than 10 milliseconds
-		if (prev_delay_base - conn->our_hist.delay_base <= 10000) {
-			conn->their_hist.Shift(prev_delay_base - conn->our_hist.delay_base);
+	// acks is the number of packets that was acked
+	int acks = (pk_ack_nr - (conn->seq_nr - 1 - conn->cur_window_packets)) & ACK_NR_MASK;
+
+	// this happens when we receive an old ack nr
+	if (acks > conn->cur_window_packets) acks = 0;
+
+	// if we get the same ack_nr as in the last packet
+	// increase the duplicate_ack counter, otherwise reset
+	// it to 0
+	if (conn->cur_window_packets > 0) {
+		if (pk_ack_nr == ((conn->seq_nr - conn->cur_window_packets - 1) & ACK_NR_MASK) &&
+			conn->cur_window_packets > 0) {
+			//++conn->duplicate_ack;
+		} else {
+			conn->duplicate_ack = 0;
 		}
+
+		// TODO: if duplicate_ack == DUPLICATE_ACK_BEFORE_RESEND
+		// and fast_resend_seq_nr <= ack_nr + 1
+		//    resend ack_nr + 1
 	}
-*/
 
-	// if the delay estimate exceeds the RTT, adjust the base_delay to
-	// compensate
-	if (delayhist_get_value(&conn->our_hist) > (uint32_t)min_rtt) {
-		delayhist_shift(&conn->our_hist, delayhist_get_value(&conn->our_hist) - min_rtt);
+	// figure out how many bytes were acked
+	size_t acked_bytes = 0;
+
+	// the minimum rtt of all acks
+	// this is the upper limit on the delay we get back
+	// from the other peer. Our delay cannot exceed
+	// the rtt of the packet. If it does, clamp it.
+	// this is done in apply_ledbat_ccontrol()
+	int64_t min_rtt = 0x7fffffffffffffff;
+
+	for (int i = 0; i < acks; ++i) {
+		int seq = conn->seq_nr - conn->cur_window_packets + i;
+		OutgoingPacket *pkt = (OutgoingPacket*)circbuf_get(&conn->outbuf, seq);
+		if (pkt == 0 || pkt->transmissions == 0) continue;
+		assert((int)(pkt->payload) >= 0);
+		acked_bytes += pkt->payload;
+		min_rtt = smin(min_rtt, (int64_t)(g_current_us - pkt->time_sent));
 	}
+	
+	// count bytes acked by EACK
+	if (selack_ptr != NULL) {
+		acked_bytes += utp_selective_ack_bytes(conn, (pk_ack_nr + 2) & ACK_NR_MASK,
+												 selack_ptr, selack_ptr[-1], &min_rtt);
+	}
+
+	LOG_UTPV("0x%08x: acks:%d acked_bytes:%u seq_nr:%d cur_window:%u cur_window_packets:%u relative_seqnr:%u max_window:%u min_rtt:%u rtt:%u",
+			 conn, acks, (unsigned)acked_bytes, conn->seq_nr, (unsigned)conn->cur_window, conn->cur_window_packets,
+			 seqnr, (unsigned)conn->max_window, (unsigned)(min_rtt / 1000), conn->rtt);
+
+	const uint32_t actual_delay = utp_take_delay_sample(conn, pk_time, pk_delay, min_rtt);
 
 	// only apply the congestion controller on acks
 	// if we don't have a delay measurement, there's
@@ -1909,13 +3310,7 @@ size_t UTP_ProcessIncoming(UTPSocket *conn, const uint8_t *pkt, size_t len, bool
 	// sanity check, the other end should never ack packets
 	// past the point we've sent
 	if (acks <= conn->cur_window_packets) {
-		conn->max_window_user = pk_wnd_size;
-
-		// If max user window is set to 0, then we startup a timer
-		// That will reset it to 1 after 15 seconds.
-		if (conn->max_window_user == 0)
-			// Reset max_window_user to 1 every 15 seconds.
-			conn->zerowindow_time = g_current_ms + 15000;
+		utp_set_peer_window(conn, pk_wnd_size);
 
 		// Respond to connect message
 		// Switch to CONNECTED state.
@@ -1923,6 +3318,11 @@ size_t UTP_ProcessIncoming(UTPSocket *conn, const uint8_t *pkt, size_t len, bool
 			conn->state = CS_CONNECTED;
 			conn->func.on_state(conn->userdata, UTP_STATE_CONNECT);
 
+			// the other end doesn't have a socket for us until it
+			// hears back (SYN cookies), or holds it as half-open until
+			// then. Don't wait until we have something to send
+			conn->ack_time = g_current_ms;
+
 		// We've sent a fin, and everything was ACKed (including the FIN),
 		// it's safe to destroy the socket. cur_window_packets == acks
 		// means that this packet acked all the remaining packets that
@@ -1974,20 +3374,8 @@ size_t UTP_ProcessIncoming(UTPSocket *conn, const uint8_t *pkt, size_t len, bool
 		// this invariant should always be true
 		assert(conn->cur_window_packets == 0 || circbuf_get(&conn->outbuf, conn->seq_nr - conn->cur_window_packets));
 
-		// flush Nagle
-		if (conn->cur_window_packets == 1) {
-			OutgoingPacket *pkt = (OutgoingPacket*)circbuf_get(&conn->outbuf, conn->seq_nr - 1);
-			// do we still have quota?
-			if (pkt->transmissions == 0 &&
-				(!(USE_PACKET_PACING) || conn->send_quota / 100 >= (int32_t)pkt->length)) {
-				utp_send_packet(conn, pkt);
-
-				// No need to send another ack if there is nothing to reorder.
-				if (conn->reorder_count == 0) {
-					utp_sent_ack(conn);
-				}
-			}
-		}
+		utp_rack_check_recovery(conn);
+		utp_flush_nagle(conn);
 
 		// Fast timeout-retry
 		if (conn->fast_timeout) {
@@ -2017,6 +3405,22 @@ size_t UTP_ProcessIncoming(UTPSocket *conn, const uint8_t *pkt, size_t len, bool
 		utp_selective_ack(conn, pk_ack_nr + 2, selack_ptr, selack_ptr[-1]);
 	}
 
+	// Resend whatever this ack tells us was lost
+	if (utp_rack_detect_loss(conn)) {
+		utp_flush_packets(conn);
+	}
+
+	// something got acked, restart the probe timer for whatever is still in flight
+	if (acked_bytes > 0 || acks > 0) {
+		conn->tlp_in_flight = false;
+		utp_arm_tail_loss_probe(conn);
+	}
+
+	// the window may have changed, and with it how often we want acks
+	if (acked_bytes > 0) {
+		utp_update_ack_frequency(conn);
+	}
+
 	// this invariant should always be true
 	assert(conn->cur_window_packets == 0 || circbuf_get(&conn->outbuf, conn->seq_nr - conn->cur_window_packets));
 
@@ -2024,14 +3428,7 @@ size_t UTP_ProcessIncoming(UTPSocket *conn, const uint8_t *pkt, size_t len, bool
 			 conn, acks, (unsigned)acked_bytes, conn->seq_nr, (unsigned)conn->cur_window, conn->cur_window_packets,
 			 conn->send_quota / 100);
 
-	// In case the ack dropped the current window below
-	// the max_window size, Mark the socket as writable
-	if (conn->state == CS_CONNECTED_FULL && utp_is_writable(conn, utp_get_packet_size(conn))) {
-		conn->state = CS_CONNECTED;
-		LOG_UTPV("0x%08x: Socket writable. max_window:%u cur_window:%u quota:%d packet_size:%u",
-				 conn, (unsigned)conn->max_window, (unsigned)conn->cur_window, conn->send_quota / 100, (unsigned)utp_get_packet_size(conn));
-		conn->func.on_state(conn->userdata, UTP_STATE_WRITABLE);
-	}
+	utp_check_writable(conn);
 
 	if (pk_flags == ST_STATE) {
 		// This is a state packet only.
@@ -2063,13 +3460,18 @@ size_t UTP_ProcessIncoming(UTPSocket *conn, const uint8_t *pkt, size_t len, bool
 	// Getting an in-order packet?
 	if (seqnr == 0) {
 		size_t count = packet_end - data;
+		// the packet is acked before it's passed on, so what the
+		// application sends from on_read, even a FIN, acks it
+		conn->ack_nr++;
+		conn->bytes_since_ack += count;
+		conn->packets_since_ack++;
 		if (count > 0 && conn->state != CS_FIN_SENT) {
 			LOG_UTPV("0x%08x: Got Data len:%u (rb:%u)", conn, (unsigned)count, (unsigned)conn->func.get_rb_size(conn->userdata));
 			// Post bytes to the upper layer
 			conn->func.on_read(conn->userdata, data, count);
+			conn->rcv_delivered += count;
 		}
-		conn->ack_nr++;
-		conn->bytes_since_ack += count;
+		const uint16_t reorder_count = conn->reorder_count;
 
 		// Check if the next packet has been received too, but waiting
 		// in the reorder buffer.
@@ -2107,12 +3509,14 @@ size_t UTP_ProcessIncoming(UTPSocket *conn, const uint8_t *pkt, size_t len, bool
 				break;
 			circbuf_put(&conn->inbuf, conn->ack_nr+1, NULL);
 			count = *(unsigned*)p;
+			conn->ack_nr++;
+			conn->bytes_since_ack += count;
+			conn->packets_since_ack++;
 			if (count > 0 && conn->state != CS_FIN_SENT) {
 				// Pass the bytes to the upper layer
 				conn->func.on_read(conn->userdata, p + sizeof(unsigned), count);
+				conn->rcv_delivered += count;
 			}
-			conn->ack_nr++;
-			conn->bytes_since_ack += count;
 
 			// Free the element from the reorder buffer
 			free(p);
@@ -2120,8 +3524,13 @@ size_t UTP_ProcessIncoming(UTPSocket *conn, const uint8_t *pkt, size_t len, bool
 			conn->reorder_count--;
 		}
 
-		// start the delayed ACK timer
-		conn->ack_time = g_current_ms + min(conn->ack_time - g_current_ms, (unsigned)DELAYED_ACK_TIME_THRESHOLD);
+		// start the delayed ACK timer. If this filled a hole, ack right
+		// away, the other end is waiting to hear about it
+		if (conn->reorder_count != reorder_count) {
+			conn->ack_time = g_current_ms;
+		} else {
+			conn->ack_time = g_current_ms + min(conn->ack_time - g_current_ms, utp_ack_delay(conn));
+		}
 	} else {
 		// Getting an out of order packet.
 		// The packet needs to be remembered and rearranged later.
@@ -2139,7 +3548,7 @@ size_t UTP_ProcessIncoming(UTPSocket *conn, const uint8_t *pkt, size_t len, bool
 		// if the sequence number is entirely off the expected
 		// one, just drop it. We can't allocate buffer space in
 		// the inbuf entirely based on untrusted input
-		if (seqnr > 0x3ff) {
+		if (seqnr >= max_reorder) {
 			LOG_UTPV("0x%08x: Got an invalid packet sequence number, too far off "
 				"reorder_count:%u len:%u (rb:%u)",
 				conn, conn->reorder_count, (unsigned)(packet_end - data), (unsigned)conn->func.get_rb_size(conn->userdata));
@@ -2190,8 +3599,7 @@ size_t UTP_ProcessIncoming(UTPSocket *conn, const uint8_t *pkt, size_t len, bool
 	LOG_UTPV("bytes_since_ack:%u ack_time:%d",
 			 (unsigned)conn->bytes_since_ack, (int)(g_current_ms - conn->ack_time));
 	if (conn->state == CS_CONNECTED || conn->state == CS_CONNECTED_FULL) {
-		if (conn->bytes_since_ack > DELAYED_ACK_BYTE_THRESHOLD ||
-			(int)(g_current_ms - conn->ack_time) >= 0) {
+		if (utp_ack_due(conn)) {
 			utp_send_ack(conn, false);
 		}
 	}
@@ -2200,7 +3608,7 @@ size_t UTP_ProcessIncoming(UTPSocket *conn, const uint8_t *pkt, size_t len, bool
 
 static inline uint8_t UTP_GetVersion(const uint8_t *pkt)
 {
-	if ((pkt[PF1_TYPE] & 0xf) == 1 && (pkt[PF1_TYPE] >> 4) < ST_NUM_STATES && pkt[PF1_EXT] < 3)
+	if ((pkt[PF1_TYPE] & 0xf) == 1 && (pkt[PF1_TYPE] >> 4) < ST_NUM_STATES && pkt[PF1_EXT] < 4)
 		return 1;
 	return 0;
 }
@@ -2226,10 +3634,23 @@ void UTP_Free(UTPSocket *conn)
 	last->idx = conn->idx;
 	
 	g_utp_sockets[conn->idx] = last;
+	g_utp_socket_keys[conn->idx] = g_utp_socket_keys[g_utp_sockets_count - 1];
 
 	// Decrease the count
 	g_utp_sockets_count--;
 
+	utp_seed_index_remove(conn);
+	utp_accept_dequeue(conn);
+	utp_set_half_open(conn, false);
+
+	// Give back its share of the send and receive buffer budgets
+	utp_set_rcvbuf(conn, 0);
+	utp_set_sndbuf(conn, 0);
+
+	assert(g_peers[g_peers[conn->peer].host].conns > 0);
+	g_peers[g_peers[conn->peer].host].conns--;
+	utp_peer_release(conn->peer);
+
 	// Free all memory occupied by the socket object.
 	for (size_t i = 0; i <= conn->inbuf.mask; i++) {
 		free(conn->inbuf.elements[i]);
@@ -2253,9 +3674,12 @@ UTPSocket *UTP_Create(SendToProc *send_to_proc, void *send_to_userdata, const st
 {
 	UTPSocket *conn = (UTPSocket*)calloc(1, sizeof(UTPSocket));
 
-	g_current_ms = UTP_GetMilliseconds();
+	utp_update_clock();
 
 	UTP_SetCallbacks(conn, NULL, NULL);
+	conn->our_hist.delay_base_hist = conn->delay_base_hist[0];
+	conn->their_hist.delay_base_hist = conn->delay_base_hist[1];
+	conn->rtt_hist.delay_base_hist = conn->delay_base_hist[2];
 	delayhist_clear(&conn->our_hist);
 	delayhist_clear(&conn->their_hist);
 	conn->rto = 3000;
@@ -2263,24 +3687,45 @@ UTPSocket *UTP_Create(SendToProc *send_to_proc, void *send_to_userdata, const st
 	conn->seq_nr = 1;
 	conn->ack_nr = 0;
 	conn->max_window_user = 255 * PACKET_SIZE;
-	assert(addrlen <= sizeof(conn->addr));
-	memcpy(&conn->addr, addr, addrlen);
-	conn->addrlen = addrlen;
+	conn->peer = utp_peer_intern(addr, addrlen);
+	g_peers[g_peers[conn->peer].host].conns++;
 	conn->send_to_proc = send_to_proc;
 	conn->send_to_userdata = send_to_userdata;
 	conn->ack_time = g_current_ms + 0x70000000;
 	conn->last_got_packet = g_current_ms;
 	conn->last_sent_packet = g_current_ms;
 	conn->last_measured_delay = g_current_ms + 0x70000000;
-	conn->last_rwin_decay = (int32_t)g_current_ms - MAX_WINDOW_DECAY;
+	conn->tun = g_tunables;
+	conn->last_rwin_decay = (int32_t)g_current_ms - conn->tun.max_window_decay;
 	conn->last_send_quota = g_current_ms;
 	conn->send_quota = PACKET_SIZE * 100;
 	conn->cur_window_packets = 0;
 	conn->fast_resend_seq_nr = conn->seq_nr;
+	conn->rack_reo_wnd_mult = 1;
 
 	// default to version 1
 	UTP_SetSockopt(conn, SO_UTPVERSION, 1);
 
+	if (g_rcvbuf_autotune) {
+		// a socket needs some receive buffer, so this may go over the
+		// budget by up to RCVBUF_AUTO_MIN
+		size_t rcvbuf = RCVBUF_AUTO_INITIAL;
+		if (g_rcvbuf_budget != 0)
+			rcvbuf = max(min(rcvbuf, g_rcvbuf_budget > g_rcvbuf_total ? g_rcvbuf_budget - g_rcvbuf_total : 0), RCVBUF_AUTO_MIN);
+		conn->opt_rcvbuf = 0;
+		conn->rcvbuf_auto = true;
+		utp_set_rcvbuf(conn, rcvbuf);
+		conn->rcv_measure_time = g_current_ms;
+	}
+
+	if (g_sndbuf_autotune) {
+		// SNDBUF_AUTO_MIN whatever is left of the budget, so this may go
+		// over it by up to that, like the receive buffer above
+		conn->opt_sndbuf = 0;
+		conn->sndbuf_auto = true;
+		utp_set_sndbuf(conn, SNDBUF_AUTO_MIN);
+	}
+
 	// we need to fit one packet in the window
 	// when we start the connection
 	conn->max_window = utp_get_packet_size(conn);
@@ -2295,15 +3740,26 @@ UTPSocket *UTP_Create(SendToProc *send_to_proc, void *send_to_userdata, const st
 	if (g_utp_sockets_count >= g_utp_sockets_alloc) {
 		g_utp_sockets_alloc = max((size_t)16, g_utp_sockets_alloc * 2);
 		g_utp_sockets = realloc(g_utp_sockets, g_utp_sockets_alloc * sizeof(g_utp_sockets[0]));
+		g_utp_socket_keys = realloc(g_utp_socket_keys, g_utp_sockets_alloc * sizeof(g_utp_socket_keys[0]));
 	}
 	conn->idx = g_utp_sockets_count++;
 	g_utp_sockets[conn->idx] = conn;
+	g_utp_socket_keys[conn->idx].peer = conn->peer;
+	g_utp_socket_keys[conn->idx].conn_id_recv = 0;
+	g_utp_socket_keys[conn->idx].conn_id_send = 0;
 
 	LOG_UTPV("0x%08x: UTP_Create", conn);
 
 	return conn;
 }
 
+void UTP_SetSystemFunctions(struct UTPSystemFunctions *funcs, void *userdata)
+{
+	g_system.get_microseconds = funcs && funcs->get_microseconds ? funcs->get_microseconds : &default_get_microseconds;
+	g_system.random = funcs && funcs->random ? funcs->random : &default_random;
+	g_system_userdata = userdata;
+}
+
 void UTP_SetCallbacks(UTPSocket *conn, struct UTPFunctionTable *funcs, void *userdata)
 {
 	assert(conn);
@@ -2315,6 +3771,53 @@ void UTP_SetCallbacks(UTPSocket *conn, struct UTPFunctionTable *funcs, void *use
 	conn->userdata = userdata;
 }
 
+// Set one of the protocol tunables, SO_UTPTARGETDELAY and on. Returns
+// false for other options, and values out of range
+static bool utp_set_tunable(struct UTPTunables *tun, int opt, int val)
+{
+	switch (opt) {
+	case SO_UTPTARGETDELAY:
+		if (val <= 0 || val > 10000) return false;
+		tun->target_delay = val * 1000;
+		return true;
+	case SO_UTPMAXCWNDINCREASE:
+		if (val <= 0) return false;
+		tun->max_cwnd_increase = val;
+		return true;
+	case SO_UTPDUPACKS:
+		// duplicate_ack counts up to UINT16_MAX
+		if (val <= 0 || val > UINT16_MAX) return false;
+		tun->duplicate_acks = val;
+		return true;
+	case SO_UTPDELAYEDACKBYTES:
+		if (val < 0) return false;
+		tun->delayed_ack_bytes = val;
+		return true;
+	case SO_UTPDELAYEDACKTIME:
+		// it's sent in 16 bits in the ack frequency extension
+		if (val < 0 || val > 0xffff) return false;
+		tun->delayed_ack_time = val;
+		return true;
+	case SO_UTPKEEPALIVE:
+		if (val <= 0) return false;
+		tun->keepalive_interval = val;
+		return true;
+	case SO_UTPMINWINDOW:
+		if (val <= 0) return false;
+		tun->min_window = val;
+		return true;
+	case SO_UTPPACKETPACING:
+		tun->packet_pacing = val != 0;
+		return true;
+	case SO_UTPMAXWINDOWDECAY:
+		if (val < 0) return false;
+		tun->max_window_decay = val;
+		return true;
+	}
+
+	return false;
+}
+
 bool UTP_SetSockopt(UTPSocket* conn, int opt, int val)
 {
 	assert(conn);
@@ -2322,31 +3825,117 @@ bool UTP_SetSockopt(UTPSocket* conn, int opt, int val)
 	switch (opt) {
 	case SO_SNDBUF:
 		assert(val >= 1);
+		// an explicit send buffer size turns off autotuning
+		utp_set_sndbuf(conn, 0);
+		conn->sndbuf_auto = false;
 		conn->opt_sndbuf = val;
 		return true;
 	case SO_RCVBUF:
+		// an explicit receive buffer size turns off autotuning
+		utp_set_rcvbuf(conn, 0);
+		conn->rcvbuf_auto = false;
 		conn->opt_rcvbuf = val;
 		return true;
+	case SO_UTPLARGEWINDOW:
+		assert(conn->state == CS_IDLE);
+		if (conn->state != CS_IDLE) {
+			// too late
+			return false;
+		}
+		conn->large_window_wanted = val != 0;
+		return true;
+	case SO_UTPACKFREQUENCY:
+		assert(conn->state == CS_IDLE);
+		if (conn->state != CS_IDLE) {
+			// too late
+			return false;
+		}
+		conn->ack_frequency_wanted = val != 0;
+		return true;
 	case SO_UTPVERSION:
 		assert(conn->state == CS_IDLE);
 		if (conn->state != CS_IDLE) {
 			// too late
 			return false;
 		}
+#ifdef UTP_V1_ONLY
+		// the only one built in
+		if (val != 1) return false;
+#endif
 		if (conn->version == 1 && val == 0) {
 			conn->reply_micro = INT_MAX;
-			conn->opt_rcvbuf = 200 * 1024;
-			conn->opt_sndbuf = OUTGOING_BUFFER_MAX_SIZE * PACKET_SIZE;
+			if (!conn->rcvbuf_auto) conn->opt_rcvbuf = 200 * 1024;
+			if (!conn->sndbuf_auto) conn->opt_sndbuf = OUTGOING_BUFFER_MAX_SIZE * PACKET_SIZE;
 		} else if (conn->version == 0 && val == 1) {
 			conn->reply_micro = 0;
-			conn->opt_rcvbuf = 3 * 1024 * 1024 + 512 * 1024;
-			conn->opt_sndbuf = conn->opt_rcvbuf;
+			if (!conn->rcvbuf_auto) conn->opt_rcvbuf = 3 * 1024 * 1024 + 512 * 1024;
+			if (!conn->sndbuf_auto) conn->opt_sndbuf = 3 * 1024 * 1024 + 512 * 1024;
 		}
 		conn->version = val;
+		utp_set_header_template(conn);
 		return true;
 	}
 
-	return false;
+	return utp_set_tunable(&conn->tun, opt, val);
+}
+
+bool UTP_SetGlobalOpt(int opt, int val)
+{
+	switch (opt) {
+	case UTP_GLOBAL_RCVBUF_AUTOTUNE:
+		g_rcvbuf_autotune = val != 0;
+		return true;
+	case UTP_GLOBAL_RCVBUF_BUDGET:
+		if (val < 0 || (size_t)val > SIZE_MAX / 1024) return false;
+		g_rcvbuf_budget = (size_t)val * 1024;
+		return true;
+	case UTP_GLOBAL_SNDBUF_AUTOTUNE:
+		g_sndbuf_autotune = val != 0;
+		return true;
+	case UTP_GLOBAL_SNDBUF_BUDGET:
+		if (val < 0 || (size_t)val > SIZE_MAX / 1024) return false;
+		g_sndbuf_budget = (size_t)val * 1024;
+		return true;
+	case UTP_GLOBAL_SYN_COOKIES:
+		if (val && !g_syn_cookies) {
+			for (size_t i = 0; i < 2; i++)
+				g_syn_cookie_key[i] = (uint64_t)utp_random() << 32 ^ (uint64_t)utp_random() << 16 ^ utp_random();
+		}
+		g_syn_cookies = val != 0;
+		return true;
+	case UTP_GLOBAL_LISTEN_BACKLOG:
+		if (val < 0) return false;
+		g_listen_backlog = (size_t)val;
+		return true;
+	case UTP_GLOBAL_MAX_CONNS_PER_HOST:
+		if (val < 0) return false;
+		g_max_conns_per_host = (size_t)val;
+		return true;
+	case UTP_GLOBAL_MAX_HALF_OPEN:
+		if (val < 0) return false;
+		g_max_half_open = (size_t)val;
+		return true;
+	}
+
+	return utp_set_tunable(&g_tunables, opt, val);
+}
+
+UTPSocket *UTP_Accept(void)
+{
+	if (g_accept_queue_count == 0)
+		return NULL;
+
+	utp_update_clock();
+
+	UTPSocket *conn = g_accept_queue[0];
+	utp_accept_dequeue(conn);
+	conn->accept_pending = false;
+	LOG_UTPV("0x%08x: UTP_Accept in state:%s", conn, statenames[conn->state]);
+
+	// open the receive window again
+	if (conn->state == CS_CONNECTED || conn->state == CS_CONNECTED_FULL)
+		utp_send_ack(conn, false);
+	return conn;
 }
 
 // Try to connect to a specified host.
@@ -2361,22 +3950,30 @@ void UTP_Connect(UTPSocket *conn)
 
 	conn->state = CS_SYN_SENT;
 
-	g_current_ms = UTP_GetMilliseconds();
+	utp_update_clock();
 
-	// Create and send a connect message
-	uint32_t conn_seed = UTP_Random();
+	// Create and send a connect message. The seed is the id we receive
+	// on, and the id the peer sends on, which no other socket to the peer
+	// can have: the packets of one would go to the other. With most of
+	// the ids to a peer taken, give up looking for a free one rather
+	// than spin
+	uint32_t conn_seed;
+	int tries = 0;
+	do {
+		conn_seed = utp_random();
 
-	// we identify newer versions by setting the
-	// first two bytes to 0x0001
-	if (conn->version > 0) {
-		conn_seed &= 0xffff;
-	}
+		// we identify newer versions by setting the
+		// first two bytes to 0x0001
+		if (!utp_is_v0(conn->version)) {
+			conn_seed &= 0xffff;
+		}
+	} while (++tries < 64 && utp_conn_id_in_use(conn, conn->peer, conn_seed));
 
 	// used in parse_log.py
 	LOG_UTP("0x%08x: UTP_Connect conn_seed:%u packet_size:%u (B) "
 			"target_delay:%u (ms) delay_history:%u "
 			"delay_base_history:%u (minutes)",
-			conn, conn_seed, PACKET_SIZE, CCONTROL_TARGET / 1000,
+			conn, conn_seed, PACKET_SIZE, conn->tun.target_delay / 1000,
 			CUR_DELAY_SIZE, DELAY_BASE_HISTORY);
 
 	// Setup initial timeout timer.
@@ -2385,11 +3982,11 @@ void UTP_Connect(UTPSocket *conn)
 	conn->last_rcv_win = utp_get_rcv_window(conn);
 
 	conn->conn_seed = conn_seed;
-	conn->conn_id_recv = conn_seed;
-	conn->conn_id_send = conn_seed+1;
+	// ids are 16 bits in version 1, the one after 0xffff is 0
+	utp_set_conn_ids(conn, conn_seed, utp_is_v0(conn->version) ? conn_seed + 1 : (conn_seed + 1) & 0xffff);
 	// if you need compatibiltiy with 1.8.1, use this. it increases attackability though.
 	//conn->seq_nr = 1;
-	conn->seq_nr = UTP_Random();
+	conn->seq_nr = utp_random();
 
 	// Create the connect packet.
 	const size_t header_ext_size = utp_get_header_extensions_size(conn);
@@ -2400,7 +3997,7 @@ void UTP_Connect(UTPSocket *conn)
 	memset(p, 0, header_ext_size);
 	// SYN packets are special, and have the receive ID in the connid field,
 	// instead of conn_id_send.
-	if (conn->version == 0) {
+	if (utp_is_v0(conn->version)) {
 		set32(p + PF0_CONNID, conn->conn_id_recv);
 		p[PF0_EXT] = 2;
 		p[PF0_WND_SIZE] = DIV_ROUND_UP(conn->last_rcv_win, PACKET_SIZE);
@@ -2408,7 +4005,7 @@ void UTP_Connect(UTPSocket *conn)
 		p[PF0_FLAGS] = ST_SYN;
 		p[PF0_EXT_NEXT] = 0;
 		p[PF0_EXT_LEN] = 8;
-		memset(p + PF0_EXT_DATA, 0, 8);
+		utp_get_extension_bits(conn, p + PF0_EXT_DATA);
 	} else {
 		p[PF1_TYPE] = ST_SYN << 4 | 1;
 		p[PF1_EXT] = 2;
@@ -2417,14 +4014,17 @@ void UTP_Connect(UTPSocket *conn)
 		set16(p + PF1_SEQ_NR, conn->seq_nr);
 		p[PF1_EXT_NEXT] = 0;
 		p[PF1_EXT_LEN] = 8;
-		memset(p + PF1_EXT_DATA, 0, 8);
+		utp_get_extension_bits(conn, p + PF1_EXT_DATA);
 	}
+	pkt->seq_nr = conn->seq_nr;
 	pkt->transmissions = 0;
+	pkt->need_resend = false;
+	pkt->rack_lost = false;
 	pkt->length = header_ext_size;
 	pkt->payload = 0;
 
 	//LOG_UTPV("0x%08x: Sending connect %s [%u].",
-	//		 conn, addrfmt(conn->addr, addrbuf), conn_seed);
+	//		 conn, addrfmt(utp_peer_addr(conn->peer), addrbuf), conn_seed);
 
 	// Remember the message in the outgoing queue.
 	circbuf_ensure_size(&conn->outbuf, conn->seq_nr, conn->cur_window_packets);
@@ -2444,38 +4044,55 @@ bool UTP_IsIncomingUTP(UTPGotIncomingConnection *incoming_proc,
 		return false;
 	}
 
+	utp_update_clock();
+
 	const uint8_t version = UTP_GetVersion(pkt);
-	const uint32_t id = version == 0 ? get32(pkt + PF0_CONNID) : get16(pkt + PF1_CONNID);
+#ifdef UTP_V1_ONLY
+	if (version != 1) {
+		LOG_UTPV("recv %s len:%u not version 1", addrfmt(to, addrbuf), (unsigned)len);
+		return false;
+	}
+#endif
+	const uint32_t id = utp_is_v0(version) ? get32(pkt + PF0_CONNID) : get16(pkt + PF1_CONNID);
 
-	if (version == 0 && len < PF0_SIZE) {
+	if (utp_is_v0(version) && len < PF0_SIZE) {
 		LOG_UTPV("recv %s len:%u version:%u too small", addrfmt(to, addrbuf), (unsigned)len, version);
 		return false;
 	}
 
-	if (version == 1 && len < PF1_SIZE) {
+	if (!utp_is_v0(version) && len < PF1_SIZE) {
 		LOG_UTPV("recv %s len:%u version:%u too small", addrfmt(to, addrbuf), (unsigned)len, version);
 		return false;
 	}
 
 	LOG_UTPV("recv %s len:%u id:%u", addrfmt(to, addrbuf), (unsigned)len, id);
 
-	if (version == 0) {
+	if (utp_is_v0(version)) {
 		LOG_UTPV("recv id:%u seq_nr:%" PRIu16 " ack_nr:%" PRIu16, id, get16(pkt + PF0_SEQ_NR), get16(pkt + PF0_ACK_NR));
 	} else {
 		LOG_UTPV("recv id:%u seq_nr:%" PRIu16 " ack_nr:%" PRIu16, id, get16(pkt + PF1_SEQ_NR), get16(pkt + PF1_ACK_NR));
 	}
 
-	const uint8_t flags = version == 0 ? pkt[PF0_FLAGS] : pkt[PF1_TYPE] >> 4;
+	const uint8_t flags = utp_is_v0(version) ? pkt[PF0_FLAGS] : pkt[PF1_TYPE] >> 4;
+
+	// PEER_NONE if we have nothing for this address
+	const uint32_t peer = utp_peer_find(to);
 
 	for (size_t i = 0; i < g_utp_sockets_count; i++) {
-		UTPSocket *conn = g_utp_sockets[i];
-		//LOG_UTPV("Examining UTPSocket %s for %s and (seed:%u s:%u r:%u) for %u",
-		//		addrfmt(conn->addr, addrbuf), addrfmt(addr, addrbuf2), conn->conn_seed, conn->conn_id_send, conn->conn_id_recv, id);
-		if (!sockaddr_equal((const struct sockaddr *)&conn->addr, to))
+		const struct UTPSocketKey *key = &g_utp_socket_keys[i];
+		if (key->peer != peer)
+			continue;
+		if (key->conn_id_recv != id && (flags != ST_RESET || key->conn_id_send != id))
 			continue;
 
-		if (flags == ST_RESET && (conn->conn_id_send == id || conn->conn_id_recv == id)) {
+		UTPSocket *conn = g_utp_sockets[i];
+		//LOG_UTPV("Examining UTPSocket %s for %s and (seed:%u s:%u r:%u) for %u",
+		//		addrfmt(utp_peer_addr(conn->peer), addrbuf), addrfmt(addr, addrbuf2), conn->conn_seed, conn->conn_id_send, conn->conn_id_recv, id);
+		if (flags == ST_RESET) {
 			LOG_UTPV("0x%08x: recv RST for existing connection", conn);
+			const int err = conn->state == CS_SYN_SENT ?
+				ECONNREFUSED :
+				ECONNRESET;
 			if (!conn->userdata || conn->state == CS_FIN_SENT) {
 				conn->state = CS_DESTROY;
 			} else {
@@ -2484,14 +4101,13 @@ bool UTP_IsIncomingUTP(UTPGotIncomingConnection *incoming_proc,
 			if (conn->userdata) {
 				conn->func.on_overhead(conn->userdata, false, len + utp_get_udp_overhead(conn),
 									   close_overhead);
-				const int err = conn->state == CS_SYN_SENT ?
-					ECONNREFUSED :
-					ECONNRESET;
 				conn->func.on_error(conn->userdata, err);
 			}
 			return true;
-		} else if (flags != ST_SYN && conn->conn_id_recv == id) {
+		} else if (flags != ST_SYN) {
 			LOG_UTPV("0x%08x: recv processing", conn);
+			if (conn->half_open && !utp_complete_handshake(conn, pkt, version))
+				return true;
 			const size_t read = UTP_ProcessIncoming(conn, pkt, len, false);
 			if (conn->userdata) {
 				conn->func.on_overhead(conn->userdata, false,
@@ -2507,16 +4123,68 @@ bool UTP_IsIncomingUTP(UTPGotIncomingConnection *incoming_proc,
 		return true;
 	}
 
-	const uint32_t seq_nr = version == 0 ? get16(pkt + PF0_SEQ_NR) : get16(pkt + PF1_SEQ_NR);
+	const uint32_t seq_nr = utp_is_v0(version) ? get16(pkt + PF0_SEQ_NR) : get16(pkt + PF1_SEQ_NR);
+
+	// Is this the other end getting back to us after a stateless SYN-ACK?
+	if (flags != ST_SYN && g_syn_cookies && incoming_proc) {
+		const uint32_t conn_seed = utp_is_v0(version) ? id - 1 : (id - 1) & 0xffff;
+		const uint16_t ack_nr = utp_is_v0(version) ? get16(pkt + PF0_ACK_NR) : get16(pkt + PF1_ACK_NR);
+		uint8_t ext[8];
+		const int gap = utp_syn_cookie_check(to, conn_seed, seq_nr, ack_nr, ext);
+		if (gap > 1) {
+			LOG_UTPV("recv SYN cookie with %d packets missing, waiting for resend", gap - 1);
+			return true;
+		}
+		if (gap == 1) {
+			LOG_UTPV("Incoming connection from %s uTP version:%u (SYN cookie)", addrfmt(to, addrbuf), version);
+
+			if (utp_refuse_incoming(to)) {
+				utp_send_rst(send_to_proc, send_to_userdata, to, tolen, conn_seed, seq_nr, utp_random(), version);
+				return true;
+			}
+
+			UTPSocket *conn = UTP_Create(send_to_proc, send_to_userdata, to, tolen);
+			conn->conn_seed = conn_seed;
+			utp_set_conn_ids(conn, id, conn_seed);
+			utp_seed_index_add(conn);
+			// the SYN was seq_nr - 1, and our SYN-ACK the cookie
+			conn->ack_nr = (seq_nr - 1) & ACK_NR_MASK;
+			conn->seq_nr = (ack_nr + 1) & SEQ_NR_MASK;
+			conn->fast_resend_seq_nr = conn->seq_nr;
+
+			UTP_SetSockopt(conn, SO_UTPVERSION, version);
+			memcpy(conn->extensions, ext, 8);
+			conn->large_window = ext_bit_isset(ext, EXT_BIT_LARGE_WINDOW);
+			conn->ack_frequency = ext_bit_isset(ext, EXT_BIT_ACK_FREQUENCY);
+			conn->state = CS_CONNECTED;
+
+			if (g_listen_backlog) {
+				conn->accept_pending = true;
+				utp_accept_enqueue(conn);
+			} else {
+				// the packet may carry data already, so let the application
+				// set up the callbacks first
+				incoming_proc(send_to_userdata, conn);
+			}
+
+			const size_t read = UTP_ProcessIncoming(conn, pkt, len, false);
+			if (conn->userdata) {
+				conn->func.on_overhead(conn->userdata, false, (len - read) + utp_get_udp_overhead(conn),
+									   header_overhead);
+			}
+			return true;
+		}
+	}
+
 	if (flags != ST_SYN) {
 		for (size_t i = 0; i < g_rst_info_count; i++) {
 			if (g_rst_info[i].connid != id)
 				continue;
-			if (!sockaddr_equal((const struct sockaddr *)&g_rst_info[i].addr, to))
+			if (g_rst_info[i].peer != peer)
 				continue;
 			if (seq_nr != g_rst_info[i].ack_nr)
 				continue;
-			g_rst_info[i].timestamp = UTP_GetMilliseconds();
+			g_rst_info[i].timestamp = g_current_ms;
 			LOG_UTPV("recv not sending RST to non-SYN (stored)");
 			return true;
 		}
@@ -2530,51 +4198,90 @@ bool UTP_IsIncomingUTP(UTPGotIncomingConnection *incoming_proc,
 			g_rst_info = realloc(g_rst_info, g_rst_info_alloc * sizeof(g_rst_info[0]));
 		}
 		RST_Info *r = &g_rst_info[g_rst_info_count++];
-		assert(tolen <= sizeof(r->addr));
-		memcpy(&r->addr, to, tolen);
-		r->addrlen = tolen;
+		r->peer = utp_peer_intern(to, tolen);
 		r->connid = id;
 		r->ack_nr = seq_nr;
-		r->timestamp = UTP_GetMilliseconds();
+		r->timestamp = g_current_ms;
 
-		utp_send_rst(send_to_proc, send_to_userdata, to, tolen, id, seq_nr, UTP_Random(), version);
+		utp_send_rst(send_to_proc, send_to_userdata, to, tolen, id, seq_nr, utp_random(), version);
 		return true;
 	}
 
-	if (incoming_proc) {
-		LOG_UTPV("Incoming connection from %s uTP version:%u", addrfmt(to, addrbuf), version);
+	// A SYN we've already answered, our SYN-ACK was probably lost
+	UTPSocket *dup = utp_seed_index_find(peer, id);
+	if (dup) {
+		LOG_UTPV("0x%08x: recv duplicate SYN", dup);
+		// only while we haven't sent anything else. The other end takes
+		// its ack_nr from the SYN-ACK's seq_nr
+		if ((dup->state == CS_CONNECTED || dup->state == CS_CONNECTED_FULL) &&
+			dup->cur_window_packets == 0) {
+			// the extension bits, unless we have to send an EACK
+			utp_send_ack(dup, dup->reorder_count == 0);
+		}
+		return true;
+	}
 
-		// Create a new UTP socket to handle this new connection
-		UTPSocket *conn = UTP_Create(send_to_proc, send_to_userdata, to, tolen);
-		// Need to track this value to be able to detect duplicate CONNECTs
-		conn->conn_seed = id;
-		// This is value that identifies this connection for them.
-		conn->conn_id_send = id;
-		// This is value that identifies this connection for us.
-		conn->conn_id_recv = id+1;
-		conn->ack_nr = seq_nr;
-		conn->seq_nr = UTP_Random();
-		conn->fast_resend_seq_nr = conn->seq_nr;
+	if (!incoming_proc) {
+		return true;
+	}
 
-		UTP_SetSockopt(conn, SO_UTPVERSION, version);
-		conn->state = CS_CONNECTED;
+	if (utp_refuse_incoming(to)) {
+		utp_send_rst(send_to_proc, send_to_userdata, to, tolen, id, seq_nr, utp_random(), version);
+		return true;
+	}
+
+	if (g_syn_cookies) {
+		// don't keep any state until the other end acks the SYN-ACK
+		uint8_t ext[8];
+		utp_syn_cookie_extensions(pkt, len, version, ext);
+		const uint16_t cookie = utp_syn_cookie(to, id, (uint16_t)seq_nr, g_current_ms / SYN_COOKIE_PERIOD, ext);
+		utp_send_syn_cookie_ack(send_to_proc, send_to_userdata, to, tolen, version, id, (uint16_t)seq_nr, cookie, ext);
+		return true;
+	}
+
+	if (g_max_half_open && g_half_open_count >= g_max_half_open) {
+		// the SYN will be resent, maybe there's room by then
+		LOG_UTPV("recv SYN, too many half-open connections (%u)", (unsigned)g_half_open_count);
+		return true;
+	}
 
-		const size_t read = UTP_ProcessIncoming(conn, pkt, len, true);
+	LOG_UTPV("Incoming connection from %s uTP version:%u", addrfmt(to, addrbuf), version);
+
+	// Create a new UTP socket to handle this new connection
+	UTPSocket *conn = UTP_Create(send_to_proc, send_to_userdata, to, tolen);
+	// Need to track this value to be able to detect duplicate CONNECTs
+	conn->conn_seed = id;
+	utp_seed_index_add(conn);
+	// The first value identifies this connection for us, the second
+	// one for them.
+	utp_set_conn_ids(conn, utp_is_v0(version) ? id + 1 : (id + 1) & 0xffff, id);
+	conn->ack_nr = seq_nr;
+	conn->seq_nr = utp_random();
+	conn->fast_resend_seq_nr = conn->seq_nr;
+
+	UTP_SetSockopt(conn, SO_UTPVERSION, version);
+	conn->state = CS_CONNECTED;
+	utp_set_half_open(conn, true);
+	conn->accept_pending = g_listen_backlog != 0;
 
-		LOG_UTPV("0x%08x: recv send connect ACK", conn);
-		utp_send_ack(conn, true);
+	const size_t read = UTP_ProcessIncoming(conn, pkt, len, true);
 
+	LOG_UTPV("0x%08x: recv send connect ACK", conn);
+	utp_send_ack(conn, true);
+
+	// with a backlog, it's queued for UTP_Accept() once the other
+	// end gets back to us
+	if (!conn->accept_pending)
 		incoming_proc(send_to_userdata, conn);
 
-		// we report overhead after incoming_proc, because the callbacks are setup now
-		if (conn->userdata) {
-			// SYN
-			conn->func.on_overhead(conn->userdata, false, (len - read) + utp_get_udp_overhead(conn),
-								   header_overhead);
-			// SYNACK
-			conn->func.on_overhead(conn->userdata, true, utp_get_overhead(conn),
-								   ack_overhead);
-		}
+	// we report overhead after incoming_proc, because the callbacks are setup now
+	if (conn->userdata) {
+		// SYN
+		conn->func.on_overhead(conn->userdata, false, (len - read) + utp_get_udp_overhead(conn),
+							   header_overhead);
+		// SYNACK
+		conn->func.on_overhead(conn->userdata, true, utp_get_overhead(conn),
+							   ack_overhead);
 	}
 
 	return true;
@@ -2588,30 +4295,33 @@ bool UTP_HandleICMP(const uint8_t *pkt, size_t len, const struct sockaddr *to, s
 	}
 
 	const uint8_t version = UTP_GetVersion(pkt);
-	const uint32_t id = version == 0 ? get32(pkt + PF0_CONNID) : get16(pkt + PF1_CONNID);
+#ifdef UTP_V1_ONLY
+	if (version != 1) return false;
+#endif
+	const uint32_t id = utp_is_v0(version) ? get32(pkt + PF0_CONNID) : get16(pkt + PF1_CONNID);
 
+	const uint32_t peer = utp_peer_find(to);
 	for (size_t i = 0; i < g_utp_sockets_count; ++i) {
+		if (g_utp_socket_keys[i].peer != peer || g_utp_socket_keys[i].conn_id_recv != id)
+			continue;
 		UTPSocket *conn = g_utp_sockets[i];
-		if (sockaddr_equal((const struct sockaddr *)&conn->addr, to) &&
-			conn->conn_id_recv == id) {
-			// Don't pass on errors for idle/closed connections
-			if (conn->state != CS_IDLE) {
-				if (!conn->userdata || conn->state == CS_FIN_SENT) {
-					LOG_UTPV("0x%08x: icmp packet causing socket destruction", conn);
-					conn->state = CS_DESTROY;
-				} else {
-					conn->state = CS_RESET;
-				}
-				if (conn->userdata) {
-					const int err = conn->state == CS_SYN_SENT ?
-						ECONNREFUSED :
-						ECONNRESET;
-					LOG_UTPV("0x%08x: icmp packet causing error on socket:%d", conn, err);
-					conn->func.on_error(conn->userdata, err);
-				}
+		// Don't pass on errors for idle/closed connections
+		if (conn->state != CS_IDLE) {
+			if (!conn->userdata || conn->state == CS_FIN_SENT) {
+				LOG_UTPV("0x%08x: icmp packet causing socket destruction", conn);
+				conn->state = CS_DESTROY;
+			} else {
+				conn->state = CS_RESET;
+			}
+			if (conn->userdata) {
+				const int err = conn->state == CS_SYN_SENT ?
+					ECONNREFUSED :
+					ECONNRESET;
+				LOG_UTPV("0x%08x: icmp packet causing error on socket:%d", conn, err);
+				conn->func.on_error(conn->userdata, err);
 			}
-			return true;
 		}
+		return true;
 	}
 	return false;
 }
@@ -2631,7 +4341,7 @@ bool UTP_Write(UTPSocket *conn, size_t bytes)
 		return false;
 	}
 
-	g_current_ms = UTP_GetMilliseconds();
+	utp_update_clock();
 
 	utp_update_send_quota(conn);
 
@@ -2668,6 +4378,8 @@ void UTP_RBDrained(UTPSocket *conn)
 {
 	assert(conn);
 
+	utp_update_clock();
+
 	const size_t rcvwin = utp_get_rcv_window(conn);
 
 	if (rcvwin > conn->last_rcv_win) {
@@ -2675,18 +4387,19 @@ void UTP_RBDrained(UTPSocket *conn)
 		if (conn->last_rcv_win == 0) {
 			utp_send_ack(conn, false);
 		} else {
-			conn->ack_time = g_current_ms + min(conn->ack_time - g_current_ms, (unsigned)DELAYED_ACK_TIME_THRESHOLD);
+			conn->ack_time = g_current_ms + min(conn->ack_time - g_current_ms, conn->tun.delayed_ack_time);
 		}
 	}
 }
 
 void UTP_CheckTimeouts()
 {
-	g_current_ms = UTP_GetMilliseconds();
+	utp_update_clock();
 
 	for (size_t i = 0; i < g_rst_info_count; i++) {
 		if ((int)(g_current_ms - g_rst_info[i].timestamp) >= RST_INFO_TIMEOUT) {
 			assert(i < g_rst_info_count);
+			utp_peer_release(g_rst_info[i].peer);
 			size_t c = --g_rst_info_count;
 			if (i != c)
 				g_rst_info[i] = g_rst_info[c];
@@ -2711,6 +4424,76 @@ void UTP_CheckTimeouts()
 	}
 }
 
+// milliseconds until utp_check_timeouts() has something to do for
+// this socket, at most max_ms. Follows the checks made there
+static uint32_t utp_next_timeout(UTPSocket *conn, uint32_t max_ms)
+{
+	uint32_t next = max_ms;
+#define UTP_DEADLINE(t) do { \
+		const int32_t d = (int32_t)((t) - g_current_ms); \
+		next = d <= 0 ? 0 : min(next, (uint32_t)d); \
+	} while (0)
+
+	if (conn->rack_timer) UTP_DEADLINE(conn->rack_timeout);
+	if (conn->rcvbuf_auto && conn->userdata)
+		UTP_DEADLINE(conn->rcv_measure_time + utp_rcvbuf_interval(conn));
+	if (conn->accept_pending && conn->half_open)
+		UTP_DEADLINE(conn->half_open_time + HALF_OPEN_TIMEOUT);
+
+	switch (conn->state) {
+	case CS_SYN_SENT:
+	case CS_CONNECTED_FULL:
+	case CS_CONNECTED:
+	case CS_FIN_SENT:
+		if (conn->max_window_user == 0) UTP_DEADLINE(conn->zerowindow_time);
+		if (conn->cur_window_packets > 0) {
+			if (conn->tlp_timer) UTP_DEADLINE(conn->tlp_timeout);
+			if (conn->rto_timeout > 0) UTP_DEADLINE(conn->rto_timeout);
+		}
+		if (conn->state != CS_SYN_SENT) {
+			UTP_DEADLINE(conn->ack_time);
+			UTP_DEADLINE(conn->last_sent_packet + conn->tun.keepalive_interval);
+		}
+		// waiting for the send quota to cover another packet, see
+		// utp_update_send_quota()
+		if (conn->tun.packet_pacing && (conn->state == CS_CONNECTED_FULL || conn->cur_window_packets > 0)) {
+			const int32_t need = (int32_t)utp_get_packet_size(conn) * 100 - conn->send_quota;
+			if (need > 0 && conn->max_window > 0) {
+				const uint64_t rtt = conn->rtt_hist.delay_base ? conn->rtt_hist.delay_base : 50;
+				const uint64_t rate = (uint64_t)conn->max_window * 100;
+				const uint64_t wait = DIV_ROUND_UP(need * rtt, rate);
+				next = (uint32_t)min((uint64_t)next, wait);
+			}
+		}
+		break;
+	case CS_GOT_FIN:
+	case CS_DESTROY_DELAY:
+		UTP_DEADLINE(conn->rto_timeout);
+		break;
+	case CS_IDLE:
+	case CS_RESET:
+	case CS_DESTROY:
+		break;
+	}
+#undef UTP_DEADLINE
+	return next;
+}
+
+int UTP_NextTimeout()
+{
+	utp_update_clock();
+
+	uint32_t next = NEXT_TIMEOUT_MAX;
+	for (size_t i = 0; i < g_rst_info_count && next > 0; i++) {
+		const int32_t d = (int32_t)(g_rst_info[i].timestamp + RST_INFO_TIMEOUT - g_current_ms);
+		next = d <= 0 ? 0 : min(next, (uint32_t)d);
+	}
+	for (size_t i = 0; i != g_utp_sockets_count && next > 0; i++) {
+		next = utp_next_timeout(g_utp_sockets[i], next);
+	}
+	return (int)next;
+}
+
 size_t UTP_GetPacketSize(UTPSocket *socket)
 {
 	return utp_get_packet_size(socket);
@@ -2720,8 +4503,8 @@ void UTP_GetPeerName(UTPSocket *conn, struct sockaddr *addr, socklen_t *addrlen)
 {
 	assert(conn);
 
-	*addrlen = min(conn->addrlen, *addrlen);
-	memcpy(addr, &conn->addr, *addrlen);
+	*addrlen = min(utp_peer_addrlen(conn->peer), *addrlen);
+	memcpy(addr, utp_peer_addr(conn->peer), *addrlen);
 }
 
 void UTP_GetDelays(UTPSocket *conn, int32_t *ours, int32_t *theirs, uint32_t *age)
@@ -2742,6 +4525,26 @@ void UTP_GetStats(UTPSocket *conn, struct UTPStats *stats)
 }
 #endif // _DEBUG
 
+void UTP_GetLossStats(UTPSocket *conn, struct UTPLossStats *stats)
+{
+	assert(conn);
+
+	stats->_nlost = conn->lost_packets;
+	stats->_nspurious = conn->spurious_resends;
+	stats->_ntimeout = conn->timeouts;
+	stats->_nprobe = conn->tail_probes;
+	stats->_reorder_window = (uint32_t)utp_rack_reo_wnd(conn);
+}
+
+void UTP_GetBufferStats(UTPSocket *conn, struct UTPBufferStats *stats)
+{
+	assert(conn);
+
+	stats->_max_window = conn->max_window;
+	stats->_sndbuf = conn->opt_sndbuf;
+	stats->_rcvbuf = conn->opt_rcvbuf;
+}
+
 void UTP_GetGlobalStats(struct UTPGlobalStats *stats)
 {
 	*stats = _global_stats;
@@ -2758,6 +4561,8 @@ void UTP_Close(UTPSocket *conn)
 
 	LOG_UTPV("0x%08x: UTP_Close in state:%s", conn, statenames[conn->state]);
 
+	utp_update_clock();
+
 	switch(conn->state) {
 	case CS_CONNECTED:
 	case CS_CONNECTED_FULL:
@@ -2766,7 +4571,7 @@ void UTP_Close(UTPSocket *conn)
 		break;
 
 	case CS_SYN_SENT:
-		conn->rto_timeout = UTP_GetMilliseconds() + min(conn->rto * 2, 60u);
+		conn->rto_timeout = g_current_ms + min(conn->rto * 2, 60u);
 	case CS_GOT_FIN:
 		conn->state = CS_DESTROY_DELAY;
 		break;
@@ -36,6 +36,60 @@ struct UTPSocket;
 // the uTP socket is connected
 #define SO_UTPVERSION 99
 
+// Used to ask for the large window extension on outgoing connections,
+// allowing many more packets in flight than the usual 511, for paths
+// with a large bandwidth-delay product. Incoming connections agree to it
+// when the other end asks. SO_SNDBUF and SO_RCVBUF usually need raising
+// as well to make use of it. This can only be called before the uTP
+// socket is connected
+#define SO_UTPLARGEWINDOW 100
+
+// Negotiate the ack frequency extension. When sending, we tell the other
+// end how many packets and how much time may pass before it acks, based
+// on our congestion window and rtt, to cut down on acks at high rates.
+// Incoming connections agree to it when the other end asks. This can only
+// be called before the uTP socket is connected
+#define SO_UTPACKFREQUENCY 101
+
+// The protocol tunables. A socket starts out with the defaults, which
+// UTP_SetGlobalOpt() changes for the sockets created after it, with the
+// same options, and UTP_SetSockopt() changes them for one socket at any
+// time. Values out of range are refused
+
+// The queueing delay LEDBAT aims for, in milliseconds. 100 by default
+#define SO_UTPTARGETDELAY 102
+
+// The most the congestion window grows per round trip, in bytes, while
+// the delay is well under target. 3000 by default
+#define SO_UTPMAXCWNDINCREASE 103
+
+// Resend a packet once this many packets after it have been acked, when
+// the network isn't known to reorder packets. 3 by default
+#define SO_UTPDUPACKS 104
+
+// Ack received data once more than this many bytes haven't been acked,
+// or after SO_UTPDELAYEDACKTIME milliseconds. 2400 and 100 by default.
+// The ack frequency extension, SO_UTPACKFREQUENCY, takes over from them
+// when it's in use, and SO_UTPDELAYEDACKTIME caps what it may ask for
+#define SO_UTPDELAYEDACKBYTES 105
+#define SO_UTPDELAYEDACKTIME 106
+
+// Send a keepalive after this many milliseconds of not sending anything,
+// to keep NAT mappings open. 29000 by default
+#define SO_UTPKEEPALIVE 107
+
+// The congestion window never shrinks below this many bytes. 10 by
+// default
+#define SO_UTPMINWINDOW 108
+
+// Pace the packets when the congestion window is smaller than a packet,
+// rather than send nothing until a timeout. 1 by default
+#define SO_UTPPACKETPACING 109
+
+// Halve the congestion window on loss at most once per this many
+// milliseconds. 100 by default
+#define SO_UTPMAXWINDOWDECAY 110
+
 enum {
 	// socket has reveived syn-ack (notification only for outgoing connection completion)
 	// this implies writability
@@ -93,6 +147,29 @@ typedef void UTPGotIncomingConnection(void *userdata, struct UTPSocket* s);
 typedef void SendToProc(void *userdata, const uint8_t *p, size_t len, const struct sockaddr *to, socklen_t tolen);
 
 
+// The clock and random numbers of the uTP socket layer. By default they
+// are UTP_GetMicroseconds() and UTP_Random() from utp_utils.h
+
+// The uTP socket layer calls this for the time, in monotonically
+// increasing microseconds. The start point does not matter
+typedef uint64_t UTPGetMicrosecondsProc(void *userdata);
+
+// The uTP socket layer calls this for a random uint32_t
+typedef uint32_t UTPRandomProc(void *userdata);
+
+struct UTPSystemFunctions {
+	UTPGetMicrosecondsProc *get_microseconds;
+	UTPRandomProc *random;
+};
+
+// Replace the clock and random numbers of all uTP sockets, for instance
+// with a simulator's virtual time, or a clock cached by the event loop.
+// NULL, or a NULL member, puts back the default. The clock must not go
+// back when it's replaced, so do this before creating any sockets, or
+// switch to a clock that carries on from the old one
+void UTP_SetSystemFunctions(struct UTPSystemFunctions *funcs, void *userdata);
+
+
 // Functions which can be called with a uTP socket
 
 // Create a uTP socket
@@ -102,9 +179,73 @@ struct UTPSocket *UTP_Create(SendToProc *send_to_proc, void *send_to_userdata,
 // Setup the callbacks - must be done before connect or on incoming connection
 void UTP_SetCallbacks(struct UTPSocket *socket, struct UTPFunctionTable *func, void *userdata);
 
-// Valid options include SO_SNDBUF, SO_RCVBUF and SO_UTPVERSION
+// Valid options include SO_SNDBUF, SO_RCVBUF, SO_UTPVERSION, SO_UTPLARGEWINDOW,
+// SO_UTPACKFREQUENCY and the protocol tunables, SO_UTPTARGETDELAY and on
 bool UTP_SetSockopt(struct UTPSocket *socket, int opt, int val);
 
+// Options that apply to all uTP sockets
+enum {
+	// Autotune the receive buffer of new sockets, unless they set SO_RCVBUF.
+	// It grows with how fast the application drains data, and shrinks when
+	// the application falls behind
+	UTP_GLOBAL_RCVBUF_AUTOTUNE = 1,
+
+	// Memory budget for the receive buffers of all autotuned sockets,
+	// in kilobytes. 0 means unlimited. It limits how far they grow, but
+	// every one of them keeps at least 16 kB, so with enough sockets the
+	// total goes over it by up to 16 kB a socket
+	UTP_GLOBAL_RCVBUF_BUDGET = 2,
+
+	// Autotune the send buffer of new sockets, unless they set SO_SNDBUF.
+	// It's kept at twice the congestion window
+	UTP_GLOBAL_SNDBUF_AUTOTUNE = 3,
+
+	// Memory budget for the send buffers of all autotuned sockets,
+	// in kilobytes. 0 means unlimited. It limits how far they grow, but
+	// every one of them starts out with 64 kB, so with enough sockets the
+	// total goes over it by up to 64 kB a socket
+	UTP_GLOBAL_SNDBUF_BUDGET = 4,
+
+	// Answer SYNs without creating a socket. The sequence number of the
+	// SYN-ACK is a keyed hash (a SYN cookie), and the socket is only created
+	// when the other end sends its first packet after it, which acks the
+	// cookie. Half-open connections cost no memory. The cookie carries 14
+	// bits of hash, and up to 16 values are accepted for it, so a spoofed
+	// packet matches about 1 time in 1024. Connecting peers running older
+	// versions only complete the connection once they send something
+	UTP_GLOBAL_SYN_COOKIES = 5,
+
+	// Queue up to this many incoming connections for UTP_Accept() instead
+	// of handing them to incoming_proc, which still has to be passed to
+	// UTP_IsIncomingUTP() to accept connections at all. A connection is
+	// queued once the other end gets back to us after the SYN-ACK, and is
+	// dropped if that takes more than 10 seconds. Until it's accepted, the
+	// other end is told our receive window is closed. SYNs are refused
+	// with a RST while the queue is full. 0, the default, calls
+	// incoming_proc right away
+	UTP_GLOBAL_LISTEN_BACKLOG = 6,
+
+	// Refuse SYNs with a RST from hosts we already have this many
+	// connections with, on any port. 0 means unlimited
+	UTP_GLOBAL_MAX_CONNS_PER_HOST = 7,
+
+	// Drop SYNs while this many incoming connections haven't heard back
+	// from the other end since the SYN-ACK. The other end resends the SYN
+	// later. Peers running older versions may not get back to us until
+	// they have something to send. 0 means unlimited. With SYN cookies
+	// there are no half-open connections
+	UTP_GLOBAL_MAX_HALF_OPEN = 8,
+};
+
+// Set an option that applies to all uTP sockets, or the default of one of
+// the protocol tunables, SO_UTPTARGETDELAY and on, for new sockets.
+// Returns false for an unknown option, or a value out of its range
+bool UTP_SetGlobalOpt(int opt, int val);
+
+// Take the next incoming connection off the accept queue, or NULL if it's
+// empty. Set up its callbacks right away. See UTP_GLOBAL_LISTEN_BACKLOG
+struct UTPSocket *UTP_Accept(void);
+
 // Try to connect to a specified host.
 void UTP_Connect(struct UTPSocket *socket);
 
@@ -128,6 +269,12 @@ void UTP_RBDrained(struct UTPSocket *socket);
 // Call periodically to process timeouts and other periodic events
 void UTP_CheckTimeouts(void);
 
+// The number of milliseconds until UTP_CheckTimeouts() needs to be called
+// again, at most 500. Anything that happens in the meantime, a packet
+// arriving or a call to UTP_Write(), can make it sooner, so ask again
+// after those. Calling UTP_CheckTimeouts() earlier is harmless
+int UTP_NextTimeout(void);
+
 // Retrieves the peer address of the specified socket, stores this address in the
 // sockaddr structure pointed to by the addr argument, and stores the length of this
 // address in the object pointed to by the addrlen argument.
@@ -152,6 +299,26 @@ struct UTPStats {
 void UTP_GetStats(struct UTPSocket *socket, struct UTPStats *stats);
 #endif
 
+struct UTPLossStats {
+	uint32_t _nlost;			// packets declared lost by loss detection
+	uint32_t _nspurious;		// packets declared lost by RACK that turned out not to be
+	uint32_t _ntimeout;			// retransmission timeouts
+	uint32_t _nprobe;			// tail loss probes sent
+	uint32_t _reorder_window;	// current reordering window, in microseconds
+};
+
+// Get loss detection stats for UTP socket
+void UTP_GetLossStats(struct UTPSocket *socket, struct UTPLossStats *stats);
+
+struct UTPBufferStats {
+	size_t _max_window;		// congestion window, in bytes
+	size_t _sndbuf;			// send buffer, in bytes, see UTP_GLOBAL_SNDBUF_AUTOTUNE
+	size_t _rcvbuf;			// receive buffer, in bytes, see UTP_GLOBAL_RCVBUF_AUTOTUNE
+};
+
+// Get the congestion window and buffer sizes of UTP socket
+void UTP_GetBufferStats(struct UTPSocket *socket, struct UTPBufferStats *stats);
+
 // Close the UTP socket.
 // It is not valid to issue commands for this socket after it is closed.
 // This does not actually destroy the socket until outstanding data is sent, at which
@@ -161,6 +328,8 @@ void UTP_Close(struct UTPSocket *socket);
 struct UTPGlobalStats {
 	uint32_t _nraw_recv[5];	// total packets recieved less than 300/600/1200/MTU bytes fpr all connections (global)
 	uint32_t _nraw_send[5];	// total packets sent less than 300/600/1200/MTU bytes for all connections (global)
+	uint32_t _npredicted_ack;	// acks handled by the header prediction fast path
+	uint32_t _npredicted_data;	// data packets handled by the header prediction fast path
 };
 
 void UTP_GetGlobalStats(struct UTPGlobalStats *stats);
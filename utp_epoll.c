@@ -0,0 +1,366 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#include "utp_epoll.h"
+#include "utp_utils.h"
+
+// packets received or sent with one system call
+#define EPOLL_BATCH 32
+// the largest packet sent or received. uTP packets fit in one UDP packet
+// on an ethernet link
+#define EPOLL_PACKET_SIZE 1500
+// receive at most this many batches from a socket per UTPEpoll_Poll(), so
+// a busy socket doesn't hold up the others or the timers
+#define EPOLL_RECV_BATCHES 8
+// packets queued per UDP socket while its kernel send buffer is full.
+// More than that are dropped, uTP resends them
+#define EPOLL_SEND_QUEUE_MAX 4096
+// the send buffer and receive buffer of the UDP sockets
+#define EPOLL_SOCKET_BUFFER (2 * 1024 * 1024)
+
+struct UTPEpollPacket {
+	struct sockaddr_storage to;
+	socklen_t tolen;
+	size_t len;
+	unsigned char buf[EPOLL_PACKET_SIZE];
+};
+
+struct UTPEpollSocket {
+	struct UTPEpoll *ep;
+	int fd;
+	UTPGotIncomingConnection *incoming_proc;
+	void *userdata;
+
+	// packets waiting to be sent. queue_sent of them went out already,
+	// the rest are sent by utp_epoll_flush_socket()
+	struct UTPEpollPacket *queue;
+	size_t queue_alloc;
+	size_t queue_count;
+	size_t queue_sent;
+	// the kernel's send buffer is full, we're waiting for EPOLLOUT
+	bool blocked;
+};
+
+struct UTPEpoll {
+	int epfd;
+	int timerfd;
+	// the timer expires at this UTP_GetMilliseconds(), if armed
+	uint32_t timer_deadline;
+	bool timer_armed;
+
+	struct UTPEpollSocket **sockets;
+	size_t sockets_count;
+
+	// receive buffers for recvmmsg()
+	struct mmsghdr recv_msgs[EPOLL_BATCH];
+	struct iovec recv_iov[EPOLL_BATCH];
+	struct sockaddr_storage recv_from[EPOLL_BATCH];
+	unsigned char recv_buf[EPOLL_BATCH][EPOLL_PACKET_SIZE];
+};
+
+static void utp_epoll_flush_socket(struct UTPEpollSocket *s);
+
+static void utp_epoll_watch(struct UTPEpollSocket *s, bool out)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | (out ? EPOLLOUT : 0);
+	ev.data.ptr = s;
+	epoll_ctl(s->ep->epfd, EPOLL_CTL_MOD, s->fd, &ev);
+}
+
+static void utp_epoll_send_to(void *userdata, const uint8_t *p, size_t len, const struct sockaddr *to, socklen_t tolen)
+{
+	struct UTPEpollSocket *s = (struct UTPEpollSocket*)userdata;
+
+	assert(len <= EPOLL_PACKET_SIZE);
+	if (len > EPOLL_PACKET_SIZE || tolen > sizeof(struct sockaddr_storage))
+		return;
+
+	if (s->queue_count == s->queue_alloc) {
+		if (s->queue_sent > 0) {
+			memmove(s->queue, s->queue + s->queue_sent, (s->queue_count - s->queue_sent) * sizeof(s->queue[0]));
+			s->queue_count -= s->queue_sent;
+			s->queue_sent = 0;
+		} else if (s->queue_alloc < EPOLL_SEND_QUEUE_MAX) {
+			const size_t alloc = s->queue_alloc ? s->queue_alloc * 2 : EPOLL_BATCH;
+			struct UTPEpollPacket *queue = (struct UTPEpollPacket*)realloc(s->queue, alloc * sizeof(s->queue[0]));
+			if (queue == NULL) return;
+			s->queue = queue;
+			s->queue_alloc = alloc;
+		} else {
+			return;
+		}
+	}
+
+	struct UTPEpollPacket *pkt = &s->queue[s->queue_count++];
+	memcpy(&pkt->to, to, tolen);
+	pkt->tolen = tolen;
+	pkt->len = len;
+	memcpy(pkt->buf, p, len);
+
+	// a full batch goes out right away
+	if (!s->blocked && s->queue_count - s->queue_sent >= EPOLL_BATCH)
+		utp_epoll_flush_socket(s);
+}
+
+static void utp_epoll_flush_socket(struct UTPEpollSocket *s)
+{
+	struct mmsghdr msgs[EPOLL_BATCH];
+	struct iovec iov[EPOLL_BATCH];
+
+	while (s->queue_sent < s->queue_count) {
+		const size_t n = s->queue_count - s->queue_sent < EPOLL_BATCH ?
+			s->queue_count - s->queue_sent : EPOLL_BATCH;
+		for (size_t i = 0; i < n; i++) {
+			struct UTPEpollPacket *pkt = &s->queue[s->queue_sent + i];
+			iov[i].iov_base = pkt->buf;
+			iov[i].iov_len = pkt->len;
+			memset(&msgs[i], 0, sizeof(msgs[i]));
+			msgs[i].msg_hdr.msg_name = &pkt->to;
+			msgs[i].msg_hdr.msg_namelen = pkt->tolen;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		const int sent = sendmmsg(s->fd, msgs, (unsigned)n, 0);
+		if (sent < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (!s->blocked) {
+					s->blocked = true;
+					utp_epoll_watch(s, true);
+				}
+				return;
+			}
+			// this packet can't be sent (no route, too big, ...). Drop it
+			s->queue_sent++;
+			continue;
+		}
+		s->queue_sent += (size_t)sent;
+	}
+
+	s->queue_count = 0;
+	s->queue_sent = 0;
+	if (s->blocked) {
+		s->blocked = false;
+		utp_epoll_watch(s, false);
+	}
+}
+
+static void utp_epoll_incoming(void *userdata, struct UTPSocket *conn)
+{
+	struct UTPEpollSocket *s = (struct UTPEpollSocket*)userdata;
+	s->incoming_proc(s->userdata, conn);
+}
+
+static int utp_epoll_receive(struct UTPEpoll *ep, struct UTPEpollSocket *s)
+{
+	int received = 0;
+
+	for (int batch = 0; batch < EPOLL_RECV_BATCHES; batch++) {
+		for (size_t i = 0; i < EPOLL_BATCH; i++) {
+			ep->recv_iov[i].iov_base = ep->recv_buf[i];
+			ep->recv_iov[i].iov_len = EPOLL_PACKET_SIZE;
+			memset(&ep->recv_msgs[i], 0, sizeof(ep->recv_msgs[i]));
+			ep->recv_msgs[i].msg_hdr.msg_name = &ep->recv_from[i];
+			ep->recv_msgs[i].msg_hdr.msg_namelen = sizeof(ep->recv_from[i]);
+			ep->recv_msgs[i].msg_hdr.msg_iov = &ep->recv_iov[i];
+			ep->recv_msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		const int n = recvmmsg(s->fd, ep->recv_msgs, EPOLL_BATCH, MSG_DONTWAIT, NULL);
+		if (n < 0) {
+			// ECONNREFUSED - an ICMP port unreachable for an earlier
+			// packet. Anything else, like EAGAIN, means we're done
+			if (errno == EINTR || errno == ECONNREFUSED) continue;
+			break;
+		}
+
+		for (int i = 0; i < n; i++) {
+			const struct msghdr *hdr = &ep->recv_msgs[i].msg_hdr;
+			// too big to be uTP
+			if (hdr->msg_flags & MSG_TRUNC) continue;
+			UTP_IsIncomingUTP(s->incoming_proc ? &utp_epoll_incoming : NULL, &utp_epoll_send_to, s,
+							  ep->recv_buf[i], ep->recv_msgs[i].msg_len,
+							  (const struct sockaddr*)&ep->recv_from[i], hdr->msg_namelen);
+		}
+		received += n;
+
+		if (n < EPOLL_BATCH) break;
+	}
+	return received;
+}
+
+// arm the timer for the next uTP timeout, unless it goes off before that
+static void utp_epoll_arm(struct UTPEpoll *ep)
+{
+	int timeout = UTP_NextTimeout();
+	if (timeout == 0) {
+		UTP_CheckTimeouts();
+		UTPEpoll_Flush(ep);
+		timeout = UTP_NextTimeout();
+	}
+	if (timeout < 1) timeout = 1;
+
+	const uint32_t deadline = UTP_GetMilliseconds() + (uint32_t)timeout;
+	if (ep->timer_armed && (int32_t)(ep->timer_deadline - deadline) <= 0)
+		return;
+
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = timeout / 1000;
+	its.it_value.tv_nsec = (long)(timeout % 1000) * 1000000;
+	if (timerfd_settime(ep->timerfd, 0, &its, NULL) == 0) {
+		ep->timer_deadline = deadline;
+		ep->timer_armed = true;
+	}
+}
+
+struct UTPEpoll *UTPEpoll_Create(void)
+{
+	struct UTPEpoll *ep = (struct UTPEpoll*)calloc(1, sizeof(struct UTPEpoll));
+	if (ep == NULL) return NULL;
+
+	ep->epfd = epoll_create1(EPOLL_CLOEXEC);
+	ep->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	// the timer is the event without a socket
+	ev.data.ptr = NULL;
+	if (ep->epfd < 0 || ep->timerfd < 0 || epoll_ctl(ep->epfd, EPOLL_CTL_ADD, ep->timerfd, &ev) < 0) {
+		const int err = errno;
+		if (ep->epfd >= 0) close(ep->epfd);
+		if (ep->timerfd >= 0) close(ep->timerfd);
+		free(ep);
+		errno = err;
+		return NULL;
+	}
+	return ep;
+}
+
+void UTPEpoll_Destroy(struct UTPEpoll *ep)
+{
+	for (size_t i = 0; i < ep->sockets_count; i++) {
+		close(ep->sockets[i]->fd);
+		free(ep->sockets[i]->queue);
+		free(ep->sockets[i]);
+	}
+	free(ep->sockets);
+	close(ep->timerfd);
+	close(ep->epfd);
+	free(ep);
+}
+
+int UTPEpoll_Bind(struct UTPEpoll *ep, const struct sockaddr *addr, socklen_t addrlen,
+				  UTPGotIncomingConnection *incoming_proc, void *userdata)
+{
+	const int fd = socket(addr->sa_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) return -1;
+
+	if (bind(fd, addr, addrlen) < 0) {
+		const int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	// not fatal, the system may cap these
+	const int size = EPOLL_SOCKET_BUFFER;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+	struct UTPEpollSocket *s = (struct UTPEpollSocket*)calloc(1, sizeof(struct UTPEpollSocket));
+	struct UTPEpollSocket **sockets = (struct UTPEpollSocket**)realloc(ep->sockets,
+		(ep->sockets_count + 1) * sizeof(ep->sockets[0]));
+	if (s == NULL || sockets == NULL) {
+		free(s);
+		close(fd);
+		errno = ENOMEM;
+		return -1;
+	}
+	ep->sockets = sockets;
+	s->ep = ep;
+	s->fd = fd;
+	s->incoming_proc = incoming_proc;
+	s->userdata = userdata;
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = s;
+	if (epoll_ctl(ep->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		const int err = errno;
+		free(s);
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	ep->sockets[ep->sockets_count++] = s;
+	return fd;
+}
+
+struct UTPSocket *UTPEpoll_CreateSocket(struct UTPEpoll *ep, int fd,
+										const struct sockaddr *addr, socklen_t addrlen)
+{
+	for (size_t i = 0; i < ep->sockets_count; i++) {
+		if (ep->sockets[i]->fd == fd)
+			return UTP_Create(&utp_epoll_send_to, ep->sockets[i], addr, addrlen);
+	}
+	errno = EBADF;
+	return NULL;
+}
+
+int UTPEpoll_GetFd(struct UTPEpoll *ep)
+{
+	return ep->epfd;
+}
+
+void UTPEpoll_Flush(struct UTPEpoll *ep)
+{
+	for (size_t i = 0; i < ep->sockets_count; i++) {
+		if (!ep->sockets[i]->blocked)
+			utp_epoll_flush_socket(ep->sockets[i]);
+	}
+}
+
+int UTPEpoll_Poll(struct UTPEpoll *ep, int timeout)
+{
+	UTPEpoll_Flush(ep);
+	utp_epoll_arm(ep);
+
+	struct epoll_event events[16];
+	const int n = epoll_wait(ep->epfd, events, sizeof(events) / sizeof(events[0]), timeout);
+	if (n < 0) return errno == EINTR ? 0 : -1;
+
+	int received = 0;
+	for (int i = 0; i < n; i++) {
+		struct UTPEpollSocket *s = (struct UTPEpollSocket*)events[i].data.ptr;
+		if (s == NULL) {
+			uint64_t expirations;
+			if (read(ep->timerfd, &expirations, sizeof(expirations)) < 0) {}
+			ep->timer_armed = false;
+			UTP_CheckTimeouts();
+			continue;
+		}
+		if (events[i].events & EPOLLOUT)
+			utp_epoll_flush_socket(s);
+		if (events[i].events & (EPOLLIN | EPOLLERR))
+			received += utp_epoll_receive(ep, s);
+	}
+
+	UTPEpoll_Flush(ep);
+	utp_epoll_arm(ep);
+	return received;
+}
@@ -0,0 +1,52 @@
+#ifndef __UTP_EPOLL_H__
+#define __UTP_EPOLL_H__
+
+// An I/O driver for uTP on Linux. It owns the UDP sockets, waits on them
+// with epoll, receives and sends in batches with recvmmsg() and
+// sendmmsg(), and keeps a timerfd armed for UTP_NextTimeout(), so all the
+// application has to do is call UTPEpoll_Poll() in a loop, or whenever
+// the fd from UTPEpoll_GetFd() is readable in an event loop of its own.
+
+#include "utp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct UTPEpoll;
+
+// Create a driver. Returns NULL with errno set on failure
+struct UTPEpoll *UTPEpoll_Create(void);
+
+// Close the driver and its UDP sockets. The uTP sockets created on them
+// must have been destroyed first
+void UTPEpoll_Destroy(struct UTPEpoll *ep);
+
+// Open a non-blocking UDP socket bound to addr. Incoming connections on
+// it are passed to incoming_proc with userdata. incoming_proc may be NULL
+// to not accept any. Returns the socket, or -1 with errno set
+int UTPEpoll_Bind(struct UTPEpoll *ep, const struct sockaddr *addr, socklen_t addrlen,
+				  UTPGotIncomingConnection *incoming_proc, void *userdata);
+
+// Create a uTP socket to addr, sending from the UDP socket fd returned by
+// UTPEpoll_Bind()
+struct UTPSocket *UTPEpoll_CreateSocket(struct UTPEpoll *ep, int fd,
+										const struct sockaddr *addr, socklen_t addrlen);
+
+// The epoll fd. It's readable when UTPEpoll_Poll() has something to do
+int UTPEpoll_GetFd(struct UTPEpoll *ep);
+
+// Wait up to timeout milliseconds (-1 for no limit) for packets or uTP
+// timers, and handle them. Packets sent in the meantime are queued, and
+// sent in one go before waiting, and after handling. Returns the number
+// of packets received, or -1 with errno set
+int UTPEpoll_Poll(struct UTPEpoll *ep, int timeout);
+
+// Send the queued packets now, rather than at the next UTPEpoll_Poll()
+void UTPEpoll_Flush(struct UTPEpoll *ep);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__UTP_EPOLL_H__
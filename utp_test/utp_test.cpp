@@ -1,510 +1,508 @@
-#ifdef WIN32
-#define _CRT_SECURE_NO_DEPRECATE
-#define WIN32_LEAN_AND_MEAN
-#endif
+// A load generator: m uTP connections over UDP, between two ends in this
+// process on localhost, or between this process and one running with -l.
+// The client end of each connection sends requests, and the server end
+// answers each with a response of the size the request asks for. With a
+// response size of 0 there are no responses, and the requests go back
+// to back, a stream.
+//
+// It reports the goodput, what the application read at the ends in this
+// process, in total and by connection, the CPU time per GB of it, and
+// for requests and responses, the time from writing a request to
+// reading the last of its response.
+//
+// A request starts with a header: its length, the length of its
+// response, and the connection's index, 32 bits each in network order.
+// Responses are just their bytes.
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <stdarg.h>
 #include <string.h>
-#include <fcntl.h>
-#include <assert.h>
 #include <errno.h>
 
-#ifdef WIN32
-// newer versions of MSVC define these in errno.h
-#ifndef ECONNRESET
-#define ECONNRESET WSAECONNRESET
-#define EMSGSIZE WSAEMSGSIZE
-#define ECONNREFUSED WSAECONNREFUSED
-#define ECONNRESET WSAECONNRESET
-#define ETIMEDOUT WSAETIMEDOUT
-#endif
-#endif
-
-// platform-specific includes
-#ifdef POSIX
 #include <unistd.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
-#ifdef __APPLE__
-#include <sys/param.h>
-#include <sys/mount.h>
-#include <sys/uio.h>
-#include <ifaddrs.h>
-#include <net/if_dl.h>
-#include <sys/sysctl.h>
-#include <mach-o/dyld.h>
-#include <mach/mach.h>
-#include <mach/mach_time.h>
-#endif
-
-#ifdef FREEBSD
-#include <strings.h>            // POSIX requires this split-up between string.h and strings.h
-#include <sys/uio.h>            // FreeBSD:  for readv, writev
-#include <sys/mount.h>          // FreeBSD:  for statfs
-#include <ifaddrs.h>            // FreeBSD:  for ifaddrs, getifaddrs, freeifaddrs
-#include <net/if_dl.h>          // FreeBSD:  for sockaddr_dl
-#include <sys/sysctl.h>         // FreeBSD:  for system control in util_posix.cpp
-#endif
-
-#else  // WIN32
-
-#include <windows.h>
-#include <winsock2.h>
-#include <ws2tcpip.h>
-#include "win32_inet_ntop.h"
-
-#endif //WIN32
+#include <algorithm>
+#include <vector>
 
 #include "utp.h"
 #include "utp_utils.h"
+#include "utp_epoll.h"
 
-#include "udp.h"
+#define HEADER_SIZE 12
 
-// These are for casting the options for getsockopt
-// and setsockopt which if incorrect can cause these
-// calls to fail.
-#ifdef WIN32
-typedef char * SOCKOPTP;
-typedef const char * CSOCKOPTP;
-#else
-typedef void * SOCKOPTP;
-typedef const void * CSOCKOPTP;
-#endif
+// how far a stream writes ahead of the send window
+#define STREAM_AHEAD (1024 * 1024)
 
-FILE* log_file = 0;
-
-int g_send_limit = 50 * 1024 * 1024;
-int g_total_sent = 0;
-
-struct socket_state
+struct conn_state
 {
-	socket_state(): total_sent(0), state(0), s(0) {}
-	int total_sent;
-	int state;
-	UTPSocket* s;
-
-	bool operator==(socket_state const& rhs) const { return s == rhs.s; }
+	conn_state(UTPSocket *s, bool client, uint32_t index):
+		s(s), client(client), index(index), pending(0), write_offset(0), header_len(0),
+		body_left(0), received(0), request_time(0), response_left(0), closed(false), destroyed(false) {}
+
+	UTPSocket *s;
+	bool client;
+	// the connection's index. The server end learns it from the requests
+	uint32_t index;
+	// bytes to write that haven't fit in the send window yet
+	size_t pending;
+	// the client end's offset in the request it's writing
+	size_t write_offset;
+	// the server end's offset in the header of the request it's reading,
+	// and what's left of the request after the header
+	unsigned char header[HEADER_SIZE];
+	size_t header_len;
+	size_t body_left;
+	// bytes read while measuring
+	uint64_t received;
+	// when the client end wrote its request, and the bytes of the
+	// response still to come
+	uint64_t request_time;
+	size_t response_left;
+	bool closed;
+	bool destroyed;
 };
 
-socket_state *g_sockets;
-size_t g_sockets_alloc;
-size_t g_sockets_count;
+static std::vector<conn_state*> g_conns;
+static size_t g_request_size = 65536;
+static size_t g_response_size = 0;
+// whether the client ends write requests, and whether what's read is
+// counted
+static bool g_running = true;
+static bool g_measuring;
+static size_t g_connected;
+static int g_errors;
+// request to response, in microseconds
+static std::vector<uint32_t> g_latencies;
+
+static void put32(unsigned char *p, uint32_t v) { v = htonl(v); memcpy(p, &v, 4); }
+static uint32_t get32(const unsigned char *p) { uint32_t v; memcpy(&v, p, 4); return ntohl(v); }
+
+static void close_conn(conn_state *c)
+{
+	if (c->closed) return;
+	c->closed = true;
+	UTP_Close(c->s);
+}
 
-static void g_sockets_append(socket_state *s)
+static void write_pending(conn_state *c)
 {
-	if (g_sockets_count >= g_sockets_alloc) {
-		g_sockets_alloc = g_sockets_alloc ? g_sockets_alloc * 2 : 16;
-		g_sockets = (socket_state *)realloc(g_sockets, g_sockets_alloc * sizeof(g_sockets[0]));
-	}
-	g_sockets[g_sockets_count++] = *s;
+	if (c->pending > 0) UTP_Write(c->s, c->pending);
 }
 
-void utp_log(char const* fmt, ...)
+static void send_request(conn_state *c)
 {
-	fprintf(log_file, "[%u] ", UTP_GetMilliseconds());
-	va_list vl;
-	va_start(vl, fmt);
-	vfprintf(log_file, fmt, vl);
-	va_end(vl);
-	fputs("\n", log_file);
+	c->request_time = UTP_GetMicroseconds();
+	c->response_left = g_response_size;
+	c->pending += g_request_size;
+	write_pending(c);
 }
 
-UDPSocketManager::UDPSocketManager()
-	: _socket(INVALID_SOCKET), pos(0), count(0)
+// keep STREAM_AHEAD queued until the send window fills up
+static void stream(conn_state *c)
 {
+	do {
+		while (c->pending < STREAM_AHEAD) c->pending += g_request_size;
+	} while (g_running && UTP_Write(c->s, c->pending));
 }
 
-// Send a message on the actual UDP socket
-void UDPSocketManager::Send(const unsigned char *p, size_t len, const struct sockaddr *to, socklen_t tolen)
+static void utp_read(void *socket, const unsigned char *bytes, size_t count)
 {
-	assert(len <= UTP_GetUDPMTU(to, tolen));
-
-	if (count > 0 ||
-		sendto(_socket, (char*)p, len, 0, (struct sockaddr*)to, tolen) < 0) {
-		// Buffer a packet.
-		if (
-#ifndef WIN32
-			errno != EPERM && errno != EINVAL && 
-#endif
-			count < UDP_OUTGOING_SIZE) {
-			UdpOutgoing *q = (UdpOutgoing*)malloc(sizeof(UdpOutgoing) - 1 + len);
-			memcpy(&q->to, to, tolen);
-			q->len = len;
-			memcpy(q->mem, p, len);
-			buff[pos] = q;
-			pos = (pos + 1) & (UDP_OUTGOING_SIZE-1);
-			count++;
-			printf("buffering packet: %d %s\n", count, strerror(errno));
-		} else {
-			printf("sendto failed: %s\n", strerror(errno));
+	conn_state *c = (conn_state*)socket;
+	if (g_measuring) c->received += count;
+
+	if (c->client) {
+		// responses
+		if (count > c->response_left) {
+			fprintf(stderr, "%u bytes more than the response\n", (unsigned)(count - c->response_left));
+			++g_errors;
+			return;
 		}
+		c->response_left -= count;
+		if (c->response_left > 0) return;
+		if (g_measuring) g_latencies.push_back((uint32_t)(UTP_GetMicroseconds() - c->request_time));
+		if (g_running) send_request(c);
+		else close_conn(c);
+		return;
 	}
-}
 
-void UDPSocketManager::Flush()
-{
-	assert(count >= 0);
-	while (count != 0) {
-		UdpOutgoing *uo = buff[(pos - count) & (UDP_OUTGOING_SIZE-1)];
-
-		if (sendto(_socket, (char*)uo->mem, uo->len, 0, (struct sockaddr*)&uo->to, sizeof(uo->to)) < 0) {
-#ifndef WIN32
-			if (errno == EAGAIN || errno == EWOULDBLOCK) {
-				printf("sendto failed: %s\n", strerror(errno));
-				break;
+	// requests
+	while (count > 0) {
+		if (c->header_len < HEADER_SIZE) {
+			const size_t n = std::min(count, HEADER_SIZE - c->header_len);
+			memcpy(c->header + c->header_len, bytes, n);
+			c->header_len += n;
+			bytes += n;
+			count -= n;
+			if (c->header_len < HEADER_SIZE) return;
+			if (get32(c->header) < HEADER_SIZE) {
+				fprintf(stderr, "request of %u bytes, shorter than its header\n", get32(c->header));
+				++g_errors;
+				close_conn(c);
+				return;
 			}
-#endif
+			c->index = get32(c->header + 8);
+			c->body_left = get32(c->header) - HEADER_SIZE;
+		}
+		const size_t n = std::min(count, c->body_left);
+		c->body_left -= n;
+		bytes += n;
+		count -= n;
+		if (c->body_left > 0) continue;
+		c->header_len = 0;
+		const uint32_t response_size = get32(c->header + 4);
+		if (response_size > 0) {
+			c->pending += response_size;
+			write_pending(c);
 		}
-
-		free(uo);
-		count--;
 	}
-	assert(count >= 0);
 }
 
-SOCKET make_socket(const struct sockaddr *addr, socklen_t addrlen)
+static void utp_write(void *socket, unsigned char *bytes, size_t count)
 {
-	SOCKET s = socket(addr->sa_family, SOCK_DGRAM, 0);
-	if (s == INVALID_SOCKET) return s;
-
-	if (bind(s, addr, addrlen) < 0) {
-		char str[20];
-		printf("UDP port bind failed %s: (%d) %s\n",
-			   inet_ntop(addr->sa_family, (sockaddr*)addr, str, sizeof(str)), errno, strerror(errno));
-		closesocket(s);
-		return INVALID_SOCKET;
+	conn_state *c = (conn_state*)socket;
+	c->pending -= count;
+	if (!c->client) {
+		memset(bytes, 0, count);
+		return;
 	}
 
-	// Mark to hold a couple of megabytes
-	int size = 2 * 1024 * 1024;
-
-	if (setsockopt(s, SOL_SOCKET, SO_RCVBUF, (CSOCKOPTP)&size, sizeof(size)) < 0) {
-		printf("UDP setsockopt(SO_RCVBUF, %d) failed: %d %s\n", size, errno, strerror(errno));
-	}
-	if (setsockopt(s, SOL_SOCKET, SO_SNDBUF, (CSOCKOPTP)&size, sizeof(size)) < 0) {
-		printf("UDP setsockopt(SO_SNDBUF, %d) failed: %d %s\n", size, errno, strerror(errno));
+	unsigned char header[HEADER_SIZE];
+	put32(header, (uint32_t)g_request_size);
+	put32(header + 4, (uint32_t)g_response_size);
+	put32(header + 8, c->index);
+	while (count > 0) {
+		size_t n;
+		if (c->write_offset < HEADER_SIZE) {
+			n = std::min(count, HEADER_SIZE - c->write_offset);
+			memcpy(bytes, header + c->write_offset, n);
+		} else {
+			n = std::min(count, g_request_size - c->write_offset);
+			memset(bytes, 0, n);
+		}
+		c->write_offset = (c->write_offset + n) % g_request_size;
+		bytes += n;
+		count -= n;
 	}
-
-	// make socket non blocking
-#ifdef _WIN32
-	u_long b = 1;
-	ioctlsocket(s, FIONBIO, &b);
-#else
-	int flags = fcntl(s, F_GETFL, 0);
-	fcntl(s, F_SETFL, flags | O_NONBLOCK);
-#endif
-
-	return s;
 }
 
-void UDPSocketManager::set_socket(SOCKET s)
+static size_t utp_get_rb_size(void *socket)
 {
-	if (_socket != INVALID_SOCKET) closesocket(_socket);
-	assert(s != INVALID_SOCKET);
-	_socket = s;
+	return 0;
 }
 
-void send_to(void *userdata, const unsigned char *p, size_t len, const struct sockaddr *to, socklen_t tolen)
+static void utp_state(void *socket, int state)
 {
-	((UDPSocketManager*)userdata)->Send(p, len, to, tolen);
+	conn_state *c = (conn_state*)socket;
+	switch (state) {
+	case UTP_STATE_CONNECT:
+		if (!c->client) break;
+		++g_connected;
+		if (g_response_size == 0) stream(c);
+		else send_request(c);
+		break;
+	case UTP_STATE_WRITABLE:
+		if (c->client && g_response_size == 0 && g_running) stream(c);
+		else write_pending(c);
+		break;
+	case UTP_STATE_EOF:
+		close_conn(c);
+		break;
+	case UTP_STATE_DESTROYING:
+		c->destroyed = true;
+		break;
+	}
 }
 
-void got_incoming_connection(void *userdata, UTPSocket* s)
+static void utp_error(void *socket, int errcode)
 {
-	printf("incoming socket %p\n", s);
-	socket_state sock;
-	sock.s = s;
-	g_sockets_append(&sock);
-	// An application would call UTP_SetCallbacks here, but we don't want to do anything
-	// with this socket except throw away bytes received.
-	//UTP_SetCallbacks(s, &utp_callbacks, &g_sockets[g_sockets_count-1]);
-	// perhaps they would set some sock opts here too
-	//UTP_SetSockopt(s, SO_SNDBUF, 100*300);
+	conn_state *c = (conn_state*)socket;
+	fprintf(stderr, "connection %u: (%d) %s\n", c->index, errcode, strerror(errcode));
+	++g_errors;
+	close_conn(c);
 }
 
-void UDPSocketManager::select(int microsec)
+static void utp_overhead(void *socket, bool send, size_t count, int type)
 {
-	struct timeval tv = {microsec / 1000000, microsec % 1000000};
-	fd_set r, e;
-	FD_ZERO(&r);
-	FD_ZERO(&e);
-	FD_SET(_socket, &r);
-	FD_SET(_socket, &e);
-	int ret = ::select(_socket + 1, &r, 0, &e, &tv);
-
-	if (ret == 0) return;
-
-	if (ret < 0) {
-		printf("select() failed: %s\n", strerror(errno));
-		return;
-	}
-
-	Flush();
-
-	if (FD_ISSET(_socket, &r)) {
-		unsigned char buffer[8192];
-		struct sockaddr_storage sa;
-		socklen_t salen = sizeof(sa);
-
-		for (;;) {
-			int len = recvfrom(_socket, (char*)buffer, sizeof(buffer), 0, (struct sockaddr*)&sa, &salen);
-			if (len < 0) {
-				int err = WSAGetLastError();
-				// ECONNRESET - On a UDP-datagram socket
-				// this error indicates a previous send operation
-				// resulted in an ICMP Port Unreachable message.
-				if (err == ECONNRESET) continue;
-				// EMSGSIZE - The message was too large to fit into
-				// the buffer pointed to by the buf parameter and was
-				// truncated.
-				if (err == EMSGSIZE) continue;
-				// any other error (such as EWOULDBLOCK) results in breaking the loop
-				break;
-			}
-
-			// Lookup the right UTP socket that can handle this message
-			if (UTP_IsIncomingUTP(&got_incoming_connection, &send_to, this,
-								  buffer, (size_t)len, (const struct sockaddr*)&sa, salen))
-				continue;
-		}
-
-		if (FD_ISSET(_socket, &e)) {
-			// error!
-			printf("socket error!\n");
-		}
-	}
-
 }
 
-void utp_read(void* socket, const unsigned char *bytes, size_t count)
+static UTPFunctionTable utp_callbacks = {
+	&utp_read,
+	&utp_write,
+	&utp_get_rb_size,
+	&utp_state,
+	&utp_error,
+	&utp_overhead
+};
+
+static void got_incoming_connection(void *userdata, UTPSocket *s)
 {
+	conn_state *c = new conn_state(s, false, 0);
+	g_conns.push_back(c);
+	UTP_SetCallbacks(s, &utp_callbacks, c);
 }
 
-void utp_write(void* socket, unsigned char *bytes, size_t count)
+static bool all_destroyed()
 {
-	for (size_t i = 0; i < count; ++i) {
-		*bytes = rand();
-		++bytes;
-	}
-	socket_state* s = (socket_state*)socket;
-	s->total_sent += count;
-	g_total_sent += count;
+	for (size_t i = 0; i < g_conns.size(); ++i)
+		if (!g_conns[i]->destroyed) return false;
+	return true;
 }
 
-size_t utp_get_rb_size(void* socket)
+static double cpu_seconds(const rusage &ru, bool user)
 {
-	return 0;
+	const timeval &tv = user ? ru.ru_utime : ru.ru_stime;
+	return tv.tv_sec + tv.tv_usec / 1e6;
 }
 
-void utp_state(void* socket, int state)
+// the value at per-mille p of sorted
+static uint32_t percentile(const std::vector<uint32_t> &sorted, int p)
 {
-	utp_log("[%p] state: %d", socket, state);
-
-	socket_state* s = (socket_state*)socket;
-	s->state = state;
-	if (state == UTP_STATE_WRITABLE || state == UTP_STATE_CONNECT) {
-		if (UTP_Write(s->s, g_send_limit - s->total_sent)) {
-			UTP_Close(s->s);
-			s->s = NULL;
-		}
-	} else if (state == UTP_STATE_DESTROYING) {
-		size_t i;
-		for (i = 0; i != g_sockets_count; i++) {
-			if (g_sockets[i] == *s) {
-				size_t c = --g_sockets_count;
-				if (i != c)
-					g_sockets[i] = g_sockets[c];
-				break;
-			}
-		}
-	}
+	return sorted[std::min(sorted.size() * p / 1000, sorted.size() - 1)];
 }
 
-void utp_error(void* socket, int errcode)
+static void report(uint64_t us, const rusage &start, const rusage &end)
 {
-	socket_state* s = (socket_state*)socket;
-	printf("socket error: (%d) %s\n", errcode, strerror(errcode));
-	if (s->s) {
-		UTP_Close(s->s);
-		s->s = NULL;
+	const double seconds = us / 1e6;
+
+	// by connection, both ends of it if they're both here
+	std::vector<uint64_t> by_index;
+	uint64_t total = 0;
+	for (size_t i = 0; i < g_conns.size(); ++i) {
+		const conn_state *c = g_conns[i];
+		if (c->index >= by_index.size()) by_index.resize(c->index + 1);
+		by_index[c->index] += c->received;
+		total += c->received;
+	}
+	std::sort(by_index.begin(), by_index.end());
+	double sum = 0, sum_squares = 0;
+	for (size_t i = 0; i < by_index.size(); ++i) {
+		sum += by_index[i];
+		sum_squares += (double)by_index[i] * by_index[i];
 	}
-}
 
-void utp_overhead(void *socket, bool send, size_t count, int type)
-{
+	// a client streaming to a server elsewhere
+	if (total == 0) printf("nothing read, the server reports the goodput\n");
+	else printf("goodput: %.1f MB/s, %.1f MB in %.1f s\n", total / seconds / 1e6, total / 1e6, seconds);
+	if (total > 0) {
+		printf("per connection: min %.2f median %.2f max %.2f MB/s, fairness %.3f\n",
+			   by_index.front() / seconds / 1e6, by_index[by_index.size() / 2] / seconds / 1e6,
+			   by_index.back() / seconds / 1e6,
+			   sum_squares > 0 ? sum * sum / (by_index.size() * sum_squares) : 0);
+	}
+	const double user = cpu_seconds(end, true) - cpu_seconds(start, true);
+	const double system = cpu_seconds(end, false) - cpu_seconds(start, false);
+	printf("cpu: %.2f s user, %.2f s system, %.2f s per GB\n",
+		   user, system, total > 0 ? (user + system) / (total / 1e9) : 0);
+	if (!g_latencies.empty()) {
+		std::sort(g_latencies.begin(), g_latencies.end());
+		printf("latency: p50 %u p90 %u p99 %u p99.9 %u max %u us, %u requests\n",
+			   percentile(g_latencies, 500), percentile(g_latencies, 900),
+			   percentile(g_latencies, 990), percentile(g_latencies, 999),
+			   g_latencies.back(), (unsigned)g_latencies.size());
+	}
 }
 
-extern int utp_max_cwnd_increase_bytes_per_rtt;
-extern int utp_target_delay;
-extern int utp_max_window_decay;
-extern int utp_reorder_buffer_size;
-extern int utp_packet_size;
-extern int utp_serializations_per_target;
-extern int utp_min_window_size;
-extern int utp_use_packet_pacing;
-extern int utp_duplicate_acks_before_resend;
-extern int utp_delayed_ack_byte_threshold;
-extern int utp_delayed_ack_time_threshold;
-extern int utp_ratecheck_interval;
-
-struct setting_t
-{
-	char const* name;
-	int* val;
+// The names of the protocol tunables in a configuration file, see
+// load_config()
+static const struct {
+	const char *name;
+	int opt;
+} g_tunables[] = {
+	{ "utp_target_delay", SO_UTPTARGETDELAY },
+	{ "utp_max_cwnd_increase_bytes_per_rtt", SO_UTPMAXCWNDINCREASE },
+	{ "utp_duplicate_acks_before_resend", SO_UTPDUPACKS },
+	{ "utp_delayed_ack_byte_threshold", SO_UTPDELAYEDACKBYTES },
+	{ "utp_delayed_ack_time_threshold", SO_UTPDELAYEDACKTIME },
+	{ "utp_keepalive_interval", SO_UTPKEEPALIVE },
+	{ "utp_min_window_size", SO_UTPMINWINDOW },
+	{ "utp_use_packet_pacing", SO_UTPPACKETPACING },
+	{ "utp_max_window_decay", SO_UTPMAXWINDOWDECAY },
 };
 
-#define SETTING(x) {#x, &x},
-
-setting_t settings[] =
+// Set the defaults of the protocol tunables from a file of lines of a
+// name and a value, like the configs file here. Lines starting with #
+// are comments
+static bool load_config(const char *path)
 {
-	// these are broken because I broke them. they could probably be fixed, though.
-	/*
-	SETTING(utp_max_cwnd_increase_bytes_per_rtt)
-	SETTING(utp_target_delay)
-	SETTING(utp_max_window_decay)
-	SETTING(utp_reorder_buffer_size)
-	SETTING(utp_packet_size)
-	SETTING(utp_serializations_per_target)
-	SETTING(utp_min_window_size)
-	SETTING(utp_use_packet_pacing)
-	SETTING(utp_duplicate_acks_before_resend)
-	SETTING(utp_delayed_ack_byte_threshold)
-	SETTING(utp_delayed_ack_time_threshold)
-	SETTING(utp_ratecheck_interval)
-	*/
-	SETTING(g_send_limit)
-};
-
-const int num_settings = sizeof(settings) / sizeof(setting_t);
-
-int main(int argc, char* argv[])
-{
-	char const* log_file_name = "utp.log";
-	int port = 8000;
-
-	if (argc < 4) {
-		printf("usage: %s listen-port log-file destination [config-file]\n\n"
-			"   listen-port: the port for this node to listen on\n"
-			"   log-file: name and path of the file to log uTP logs to\n"
-			"   destination: destination node to connect to, in the form <host>:<port>\n"
-			"   config-file: name and path of configuration file\n\n"
-			, argv[0]);
-		return 1;
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return false;
 	}
-
-	port = atoi(argv[1]);
-	log_file_name = argv[2];
-	char *dest = argv[3];
-	char const* disabled = "disabled";
-	char const* settings_file = disabled;
-	if (argc > 4) settings_file = argv[4];
-
-	printf("listening on port %d\n", port);
-	printf("logging to '%s'\n", log_file_name);
-	printf("connecting to %s\n", dest);
-	printf("using settings file %s\n", settings_file);
-
-	if (settings_file != disabled) {
-		FILE* config = fopen(settings_file, "r");
-		if (config == 0) {
-			fprintf(stderr, "failed to open config file \"%s\": %s\n", settings_file, strerror(errno));
-			return 1;
+	bool ok = true;
+	char line[256];
+	for (int n = 1; fgets(line, sizeof(line), f) != NULL; ++n) {
+		char name[128];
+		int val;
+		if (line[0] == '#' || sscanf(line, "%127s", name) != 1) continue;
+		size_t i = 0;
+		while (i < sizeof(g_tunables) / sizeof(g_tunables[0]) && strcmp(g_tunables[i].name, name) != 0) ++i;
+		if (i == sizeof(g_tunables) / sizeof(g_tunables[0])) {
+			fprintf(stderr, "%s:%d: unknown setting %s\n", path, n, name);
+			ok = false;
+		} else if (sscanf(line, "%*s %d", &val) != 1 || !UTP_SetGlobalOpt(g_tunables[i].opt, val)) {
+			fprintf(stderr, "%s:%d: bad value for %s\n", path, n, name);
+			ok = false;
 		}
-		char name[100];
-		int value;
-		while (fscanf(config, "%s%d\n", name, &value) == 2) {
-			bool found_setting = false;
-			for (int i = 0; i < num_settings; ++i) {
-				if (strcmp(settings[i].name, name) != 0) continue;
-				found_setting = true;
-				*settings[i].val = value;
-				break;
-			}
-			if (!found_setting) fprintf(stderr, "ignored unrecognized setting: \"%s\"\n", name);
-		}
-		fclose(config);
 	}
+	fclose(f);
+	return ok;
+}
 
-	log_file = fopen(log_file_name, "w+");
+static void usage(const char *argv0)
+{
+	printf("usage: %s [options]\n\n"
+		"   -n connections  the number of connections (1)\n"
+		"   -s bytes        the size of a request, at least %d (65536)\n"
+		"   -r bytes        the size of a response, 0 to stream requests (0)\n"
+		"   -t seconds      how long to measure for (10)\n"
+		"   -p port         the server's port on localhost (8000)\n"
+		"   -l port         only be the server, on port, until the client is done\n"
+		"   -c host:port    only be the client, of the server at host:port\n"
+		"   -f file         set the protocol tunables from file, see configs\n\n"
+		, argv0, HEADER_SIZE);
+}
 
-	puts("using configuration:\n");
-	for (int i = 0; i < num_settings; ++i) {
-		printf("   %s: %d\n", settings[i].name, *settings[i].val);
+int main(int argc, char *argv[])
+{
+	int connections = 1;
+	int seconds = 10;
+	int port = 8000;
+	int listen_port = 0;
+	char *dest = NULL;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:s:r:t:p:l:c:f:")) != -1) {
+		switch (opt) {
+		case 'n': connections = atoi(optarg); break;
+		case 's': g_request_size = strtoul(optarg, NULL, 10); break;
+		case 'r': g_response_size = strtoul(optarg, NULL, 10); break;
+		case 't': seconds = atoi(optarg); break;
+		case 'p': port = atoi(optarg); break;
+		case 'l': listen_port = atoi(optarg); break;
+		case 'c': dest = optarg; break;
+		case 'f': if (!load_config(optarg)) return 1; break;
+		default: usage(argv[0]); return 1;
+		}
 	}
-	puts("\n");
-
-#ifdef WIN32
-	// ow
-	WSADATA wsa;
-	BYTE byMajorVersion = 2, byMinorVersion = 2;
-	int result = WSAStartup(MAKEWORD(byMajorVersion, byMinorVersion), &wsa);
-	if (result != 0 || LOBYTE(wsa.wVersion) != byMajorVersion ||
-		HIBYTE(wsa.wVersion) != byMinorVersion ) {
-		if (result == 0)
-			WSACleanup();
-		return -1;
+	if (connections < 1 || seconds < 1 || g_request_size < HEADER_SIZE || optind != argc ||
+		(listen_port != 0 && dest != NULL)) {
+		usage(argv[0]);
+		return 1;
 	}
-#endif
 
-	UDPSocketManager sm;
+	UTPEpoll *ep = UTPEpoll_Create();
+	if (ep == NULL) {
+		printf("failed to create the I/O driver: %s\n", strerror(errno));
+		return 1;
+	}
 
 	sockaddr_in sin;
-
 	memset(&sin, 0, sizeof(sin));
 	sin.sin_family = AF_INET;
-	sin.sin_addr.s_addr = INADDR_ANY;
-	sin.sin_port = htons(port);
-	SOCKET sock = make_socket((const struct sockaddr*)&sin, sizeof(sin));
 
-	sm.set_socket(sock);
+	if (listen_port != 0) {
+		sin.sin_addr.s_addr = INADDR_ANY;
+		sin.sin_port = htons(listen_port);
+		if (UTPEpoll_Bind(ep, (const struct sockaddr*)&sin, sizeof(sin), &got_incoming_connection, NULL) < 0) {
+			printf("UDP port bind failed: (%d) %s\n", errno, strerror(errno));
+			return 1;
+		}
+		printf("listening on port %d\n", listen_port);
+
+		// from the first connection until they've all closed
+		g_measuring = true;
+		uint64_t start = 0;
+		rusage ru_start;
+		while (g_conns.empty() || !all_destroyed()) {
+			UTPEpoll_Poll(ep, 50);
+			if (start == 0 && !g_conns.empty()) {
+				start = UTP_GetMicroseconds();
+				getrusage(RUSAGE_SELF, &ru_start);
+			}
+		}
+		rusage ru_end;
+		getrusage(RUSAGE_SELF, &ru_end);
+		printf("%u connections\n", (unsigned)g_conns.size());
+		report(UTP_GetMicroseconds() - start, ru_start, ru_end);
+	} else {
+		// the server, unless it's elsewhere
+		if (dest == NULL) {
+			sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			sin.sin_port = htons(port);
+			if (UTPEpoll_Bind(ep, (const struct sockaddr*)&sin, sizeof(sin), &got_incoming_connection, NULL) < 0) {
+				printf("UDP port bind failed: (%d) %s\n", errno, strerror(errno));
+				return 1;
+			}
+		} else {
+			char *portchr = strchr(dest, ':');
+			if (portchr == NULL) {
+				usage(argv[0]);
+				return 1;
+			}
+			*portchr++ = 0;
+			sin.sin_addr.s_addr = inet_addr(dest);
+			sin.sin_port = htons(atoi(portchr));
+		}
+		sockaddr_in server = sin;
+
+		sin.sin_addr.s_addr = dest == NULL ? htonl(INADDR_LOOPBACK) : INADDR_ANY;
+		sin.sin_port = 0;
+		const int sock = UTPEpoll_Bind(ep, (const struct sockaddr*)&sin, sizeof(sin), NULL, NULL);
+		if (sock < 0) {
+			printf("UDP port bind failed: (%d) %s\n", errno, strerror(errno));
+			return 1;
+		}
 
-	char *portchr = strchr(dest, ':');
-	*portchr = 0;
-	portchr++;
+		printf("%d connections, %u byte requests, ", connections, (unsigned)g_request_size);
+		if (g_response_size > 0) printf("%u byte responses\n", (unsigned)g_response_size);
+		else printf("streamed\n");
+		fflush(stdout);
+
+		for (int i = 0; i < connections; ++i) {
+			UTPSocket *s = UTPEpoll_CreateSocket(ep, sock, (const struct sockaddr*)&server, sizeof(server));
+			conn_state *c = new conn_state(s, true, i);
+			g_conns.push_back(c);
+			UTP_SetCallbacks(s, &utp_callbacks, c);
+			UTP_Connect(s);
+		}
 
-	memset(&sin, 0, sizeof(sin));
-	sin.sin_family = AF_INET;
-	sin.sin_addr.s_addr = inet_addr(dest);
-	sin.sin_port = htons(atoi(portchr));
-
-	socket_state s;
-	s.s = UTP_Create(&send_to, &sm, (const struct sockaddr*)&sin, sizeof(sin));
-	UTP_SetSockopt(s.s, SO_SNDBUF, 100*300);
-	s.state = 0;
-	printf("creating socket %p\n", s.s);
-
-	UTPFunctionTable utp_callbacks = {
-		&utp_read,
-		&utp_write,
-		&utp_get_rb_size,
-		&utp_state,
-		&utp_error,
-		&utp_overhead
-	};
-	g_sockets_append(&s);
-	UTP_SetCallbacks(s.s, &utp_callbacks, &g_sockets[g_sockets_count-1]);
-
-	printf("connecting socket %p\n", s.s);
-	UTP_Connect(s.s);
-
-	int last_sent = 0;
-	unsigned int last_time = UTP_GetMilliseconds();
-
-	while (g_sockets_count > 0) {
-		sm.select(50000);
-		UTP_CheckTimeouts();
-		unsigned int cur_time = UTP_GetMilliseconds();
-		if (cur_time >= last_time + 1000) {
-			float rate = (g_total_sent - last_sent) * 1000.f / (cur_time - last_time);
-			last_sent = g_total_sent;
-			last_time = cur_time;
-			printf("\r[%u] sent: %d/%d  %.1f bytes/s  ", cur_time, g_total_sent, g_send_limit, rate);
-			fflush(stdout);
+		// measure once they're all connected
+		const uint64_t connect_timeout = UTP_GetMicroseconds() + 10000000;
+		while (g_connected < (size_t)connections && g_errors == 0 && UTP_GetMicroseconds() < connect_timeout)
+			UTPEpoll_Poll(ep, 50);
+		if (g_connected < (size_t)connections) {
+			printf("%u of %d connections connected\n", (unsigned)g_connected, connections);
+			return 1;
 		}
+
+		g_measuring = true;
+		rusage ru_start;
+		getrusage(RUSAGE_SELF, &ru_start);
+		const uint64_t start = UTP_GetMicroseconds();
+		const uint64_t end = start + seconds * 1000000ull;
+		while (UTP_GetMicroseconds() < end)
+			UTPEpoll_Poll(ep, std::max((int)((end - UTP_GetMicroseconds()) / 1000), 1));
+		g_measuring = false;
+		g_running = false;
+		rusage ru_end;
+		getrusage(RUSAGE_SELF, &ru_end);
+		report(UTP_GetMicroseconds() - start, ru_start, ru_end);
+
+		// after the responses still to come, so the server ends don't
+		// send to connections that are gone
+		for (size_t i = 0; i < g_conns.size(); ++i)
+			if (g_conns[i]->client && g_conns[i]->response_left == 0) close_conn(g_conns[i]);
+		const uint64_t close_timeout = UTP_GetMicroseconds() + 10000000;
+		while (!all_destroyed() && UTP_GetMicroseconds() < close_timeout)
+			UTPEpoll_Poll(ep, 50);
 	}
 
-	fclose(log_file);
+	// the driver can only go once the sockets have
+	if (all_destroyed()) UTPEpoll_Destroy(ep);
+	for (size_t i = 0; i < g_conns.size(); ++i) delete g_conns[i];
+	return g_errors != 0;
 }
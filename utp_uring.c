@@ -0,0 +1,542 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "utp_uring.h"
+#include "utp_utils.h"
+
+// submission queue entries. Sends are submitted whenever a batch of
+// URING_BATCH has built up, so this only needs room for a few batches
+#define URING_ENTRIES 256
+// completion queue entries. Room for every send and receive that can be
+// in flight at once
+#define URING_CQ_ENTRIES 8192
+// sends submitted at a time, without waiting for UTPUring_Poll()
+#define URING_BATCH 32
+// receive buffers, shared by all sockets. A power of 2
+#define URING_BUFFERS 512
+// the largest packet sent or received. uTP packets fit in one UDP packet
+// on an ethernet link
+#define URING_PACKET_SIZE 1500
+// a receive buffer holds a struct io_uring_recvmsg_out, the address of
+// the sender and the packet
+#define URING_BUFFER_SIZE 2048
+// sends in flight. More than that are dropped, uTP resends them
+#define URING_SEND_MAX 4096
+// the send buffer and receive buffer of the UDP sockets
+#define URING_SOCKET_BUFFER (2 * 1024 * 1024)
+#define URING_BGID 0
+
+// what a completion is for, in the low bits of its user_data. The rest
+// is a pointer to the socket, the send or the driver
+enum {
+	URING_SEND = 0,
+	URING_RECV = 1,
+	URING_TIMEOUT = 2,
+	URING_IGNORE = 3,
+	URING_KIND_MASK = 3,
+};
+
+struct UTPUringSend {
+	struct msghdr msg;
+	struct iovec iov;
+	struct sockaddr_storage to;
+	unsigned char buf[URING_PACKET_SIZE];
+	// next in the free list
+	struct UTPUringSend *next;
+};
+
+struct UTPUringSocket {
+	struct UTPUring *ur;
+	int fd;
+	UTPGotIncomingConnection *incoming_proc;
+	void *userdata;
+
+	// the multishot recvmsg. It ends when we run out of buffers,
+	// and is rearmed by UTPUring_Poll()
+	struct msghdr recv_msg;
+	bool recv_armed;
+};
+
+struct UTPUring {
+	int fd;
+
+	// submission queue
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_flags;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	// our copy of the tail. What's between the head and it hasn't been
+	// submitted yet
+	unsigned sq_local_tail;
+	// the last send queued, which the next send is linked to
+	struct io_uring_sqe *last_send;
+	unsigned sends_queued;
+
+	// completion queue
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+
+	// the receive buffers, and the ring we hand them to the kernel with
+	struct io_uring_buf_ring *buf_ring;
+	size_t buf_ring_size;
+	unsigned char *bufs;
+	uint16_t buf_tail;
+
+	// the timeout for the next uTP timer, if armed. It expires at this
+	// UTP_GetMilliseconds()
+	struct __kernel_timespec timeout_ts;
+	uint32_t timeout_deadline;
+	bool timeout_armed;
+
+	struct UTPUringSocket **sockets;
+	size_t sockets_count;
+
+	struct UTPUringSend *free_sends;
+	size_t sends_allocated;
+};
+
+static int uring_enter(struct UTPUring *ur, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, ur->fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// submit what's queued, and wait for min_complete completions
+static int uring_submit(struct UTPUring *ur, unsigned min_complete)
+{
+	__atomic_store_n(ur->sq_tail, ur->sq_local_tail, __ATOMIC_RELEASE);
+	const unsigned to_submit = ur->sq_local_tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+	ur->last_send = NULL;
+	ur->sends_queued = 0;
+	if (to_submit == 0 && min_complete == 0 &&
+		!(__atomic_load_n(ur->sq_flags, __ATOMIC_RELAXED) & (IORING_SQ_CQ_OVERFLOW | IORING_SQ_TASKRUN)))
+		return 0;
+
+	int ret;
+	do {
+		ret = uring_enter(ur, to_submit, min_complete,
+						  min_complete > 0 || to_submit == 0 ? IORING_ENTER_GETEVENTS : 0);
+	} while (ret < 0 && errno == EINTR && min_complete == 0);
+	return ret;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct UTPUring *ur)
+{
+	if (ur->sq_local_tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) >= ur->sq_entries) {
+		uring_submit(ur, 0);
+		if (ur->sq_local_tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) >= ur->sq_entries)
+			return NULL;
+	}
+	const unsigned idx = ur->sq_local_tail & ur->sq_mask;
+	struct io_uring_sqe *sqe = &ur->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ur->sq_array[idx] = idx;
+	ur->sq_local_tail++;
+	return sqe;
+}
+
+// hand a receive buffer (back) to the kernel. Published by uring_publish_buffers()
+static void uring_add_buffer(struct UTPUring *ur, uint16_t bid)
+{
+	struct io_uring_buf *buf = &ur->buf_ring->bufs[ur->buf_tail & (URING_BUFFERS - 1)];
+	buf->addr = (uintptr_t)(ur->bufs + (size_t)bid * URING_BUFFER_SIZE);
+	buf->len = URING_BUFFER_SIZE;
+	buf->bid = bid;
+	ur->buf_tail++;
+}
+
+static void uring_publish_buffers(struct UTPUring *ur)
+{
+	__atomic_store_n(&ur->buf_ring->tail, ur->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_arm_recv(struct UTPUringSocket *s)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(s->ur);
+	if (sqe == NULL) return;
+	// sends queued after this aren't linked to the ones before
+	s->ur->last_send = NULL;
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = s->fd;
+	sqe->addr = (uintptr_t)&s->recv_msg;
+	sqe->len = 1;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->user_data = (uintptr_t)s | URING_RECV;
+	s->recv_armed = true;
+}
+
+static void uring_send_to(void *userdata, const uint8_t *p, size_t len, const struct sockaddr *to, socklen_t tolen)
+{
+	struct UTPUringSocket *s = (struct UTPUringSocket*)userdata;
+	struct UTPUring *ur = s->ur;
+
+	assert(len <= URING_PACKET_SIZE);
+	if (len > URING_PACKET_SIZE || tolen > sizeof(struct sockaddr_storage))
+		return;
+
+	struct UTPUringSend *send = ur->free_sends;
+	if (send != NULL) {
+		ur->free_sends = send->next;
+	} else if (ur->sends_allocated < URING_SEND_MAX) {
+		send = (struct UTPUringSend*)malloc(sizeof(struct UTPUringSend));
+		if (send == NULL) return;
+		ur->sends_allocated++;
+	} else {
+		return;
+	}
+
+	// this may submit what's queued, ending the chain of sends
+	struct io_uring_sqe *sqe = uring_get_sqe(ur);
+	if (sqe == NULL) {
+		send->next = ur->free_sends;
+		ur->free_sends = send;
+		return;
+	}
+
+	memcpy(&send->to, to, tolen);
+	memcpy(send->buf, p, len);
+	send->iov.iov_base = send->buf;
+	send->iov.iov_len = len;
+	memset(&send->msg, 0, sizeof(send->msg));
+	send->msg.msg_name = &send->to;
+	send->msg.msg_namelen = tolen;
+	send->msg.msg_iov = &send->iov;
+	send->msg.msg_iovlen = 1;
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = s->fd;
+	sqe->addr = (uintptr_t)&send->msg;
+	sqe->len = 1;
+	sqe->user_data = (uintptr_t)send | URING_SEND;
+
+	// keep the packets in order. A link is to the next entry in the
+	// queue, so the chain ends at anything else queued in between, and
+	// when the queue is submitted
+	if (ur->last_send != NULL)
+		ur->last_send->flags |= IOSQE_IO_LINK;
+	ur->last_send = sqe;
+
+	if (++ur->sends_queued >= URING_BATCH)
+		uring_submit(ur, 0);
+}
+
+static void uring_incoming(void *userdata, struct UTPSocket *conn)
+{
+	struct UTPUringSocket *s = (struct UTPUringSocket*)userdata;
+	s->incoming_proc(s->userdata, conn);
+}
+
+// arm the timeout for the next uTP timer, or for timeout milliseconds
+// if that's sooner, unless it expires before that already
+static void uring_arm_timeout(struct UTPUring *ur, int timeout)
+{
+	int next = UTP_NextTimeout();
+	if (next == 0) {
+		UTP_CheckTimeouts();
+		next = UTP_NextTimeout();
+	}
+	if (timeout >= 0 && timeout < next) next = timeout;
+	if (next < 1) next = 1;
+
+	const uint32_t deadline = UTP_GetMilliseconds() + (uint32_t)next;
+	if (ur->timeout_armed && (int32_t)(ur->timeout_deadline - deadline) <= 0)
+		return;
+
+	struct io_uring_sqe *sqe = uring_get_sqe(ur);
+	if (sqe == NULL) return;
+	ur->last_send = NULL;
+	ur->timeout_ts.tv_sec = next / 1000;
+	ur->timeout_ts.tv_nsec = (long long)(next % 1000) * 1000000;
+	if (ur->timeout_armed) {
+		// move the timeout we have forward
+		sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+		sqe->addr = (uintptr_t)ur | URING_TIMEOUT;
+		sqe->addr2 = (uintptr_t)&ur->timeout_ts;
+		sqe->timeout_flags = IORING_TIMEOUT_UPDATE;
+		sqe->user_data = URING_IGNORE;
+	} else {
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->addr = (uintptr_t)&ur->timeout_ts;
+		sqe->len = 1;
+		sqe->user_data = (uintptr_t)ur | URING_TIMEOUT;
+	}
+	ur->timeout_deadline = deadline;
+	ur->timeout_armed = true;
+}
+
+// handle everything in the completion queue. Returns the number of
+// packets received
+static int uring_reap(struct UTPUring *ur)
+{
+	int received = 0;
+	unsigned head = *ur->cq_head;
+	const unsigned tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		const struct io_uring_cqe *cqe = &ur->cqes[head & ur->cq_mask];
+		const uint64_t user_data = cqe->user_data;
+		const int res = cqe->res;
+		const unsigned flags = cqe->flags;
+
+		switch (user_data & URING_KIND_MASK) {
+		case URING_SEND: {
+			// a failed send is dropped, and the ones linked after it
+			// come back cancelled. uTP resends them
+			struct UTPUringSend *send = (struct UTPUringSend*)(uintptr_t)user_data;
+			send->next = ur->free_sends;
+			ur->free_sends = send;
+			break;
+		}
+		case URING_RECV: {
+			struct UTPUringSocket *s = (struct UTPUringSocket*)(uintptr_t)(user_data & ~(uint64_t)URING_KIND_MASK);
+			if (!(flags & IORING_CQE_F_MORE))
+				s->recv_armed = false;
+			if (!(flags & IORING_CQE_F_BUFFER))
+				break;
+			const uint16_t bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+			unsigned char *buf = ur->bufs + (size_t)bid * URING_BUFFER_SIZE;
+			const struct io_uring_recvmsg_out *out = (const struct io_uring_recvmsg_out*)buf;
+			// too big to be uTP, if it's truncated
+			if (res >= 0 && !(out->flags & MSG_TRUNC)) {
+				const unsigned char *name = buf + sizeof(*out);
+				const unsigned char *payload = name + s->recv_msg.msg_namelen;
+				const socklen_t namelen = out->namelen < s->recv_msg.msg_namelen ?
+					out->namelen : s->recv_msg.msg_namelen;
+				UTP_IsIncomingUTP(s->incoming_proc ? &uring_incoming : NULL, &uring_send_to, s,
+								  payload, out->payloadlen, (const struct sockaddr*)name, namelen);
+				received++;
+			}
+			uring_add_buffer(ur, bid);
+			break;
+		}
+		case URING_TIMEOUT:
+			// -ETIME when it expired
+			ur->timeout_armed = false;
+			UTP_CheckTimeouts();
+			break;
+		case URING_IGNORE:
+			break;
+		}
+	}
+
+	__atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+	uring_publish_buffers(ur);
+	return received;
+}
+
+struct UTPUring *UTPUring_Create(void)
+{
+	struct UTPUring *ur = (struct UTPUring*)calloc(1, sizeof(struct UTPUring));
+	if (ur == NULL) return NULL;
+	ur->fd = -1;
+
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+		IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG;
+	p.cq_entries = URING_CQ_ENTRIES;
+	ur->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (ur->fd < 0 && errno == EINVAL) {
+		// older kernels, without the flags that only save work
+		memset(&p, 0, sizeof(p));
+		p.flags = IORING_SETUP_CQSIZE;
+		p.cq_entries = URING_CQ_ENTRIES;
+		ur->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	}
+	if (ur->fd < 0)
+		goto fail;
+
+	ur->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ur->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur->cq_ring_size > ur->sq_ring_size) ur->sq_ring_size = ur->cq_ring_size;
+		ur->cq_ring_size = ur->sq_ring_size;
+	}
+	ur->sq_ring = mmap(NULL, ur->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					   ur->fd, IORING_OFF_SQ_RING);
+	if (ur->sq_ring == MAP_FAILED) {
+		ur->sq_ring = NULL;
+		goto fail;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ur->cq_ring = ur->sq_ring;
+	} else {
+		ur->cq_ring = mmap(NULL, ur->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+						   ur->fd, IORING_OFF_CQ_RING);
+		if (ur->cq_ring == MAP_FAILED) {
+			ur->cq_ring = NULL;
+			goto fail;
+		}
+	}
+	ur->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur->sqes = (struct io_uring_sqe*)mmap(NULL, ur->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+										  ur->fd, IORING_OFF_SQES);
+	if (ur->sqes == MAP_FAILED) {
+		ur->sqes = NULL;
+		goto fail;
+	}
+
+	unsigned char *sq = (unsigned char*)ur->sq_ring;
+	ur->sq_head = (unsigned*)(sq + p.sq_off.head);
+	ur->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	ur->sq_flags = (unsigned*)(sq + p.sq_off.flags);
+	ur->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+	ur->sq_entries = *(unsigned*)(sq + p.sq_off.ring_entries);
+	ur->sq_array = (unsigned*)(sq + p.sq_off.array);
+	ur->sq_local_tail = *ur->sq_tail;
+
+	unsigned char *cq = (unsigned char*)ur->cq_ring;
+	ur->cq_head = (unsigned*)(cq + p.cq_off.head);
+	ur->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	ur->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+	// the buffer ring has to be page aligned
+	ur->buf_ring_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+	ur->buf_ring = (struct io_uring_buf_ring*)mmap(NULL, ur->buf_ring_size, PROT_READ | PROT_WRITE,
+												   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ur->buf_ring == MAP_FAILED) {
+		ur->buf_ring = NULL;
+		goto fail;
+	}
+	ur->bufs = (unsigned char*)malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+	if (ur->bufs == NULL) {
+		errno = ENOMEM;
+		goto fail;
+	}
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)ur->buf_ring;
+	reg.ring_entries = URING_BUFFERS;
+	reg.bgid = URING_BGID;
+	if (syscall(__NR_io_uring_register, ur->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		goto fail;
+	for (unsigned i = 0; i < URING_BUFFERS; i++)
+		uring_add_buffer(ur, (uint16_t)i);
+	uring_publish_buffers(ur);
+
+	return ur;
+
+fail: {
+		const int err = errno;
+		UTPUring_Destroy(ur);
+		errno = err;
+		return NULL;
+	}
+}
+
+void UTPUring_Destroy(struct UTPUring *ur)
+{
+	// closing the ring cancels what's in flight
+	if (ur->fd >= 0) close(ur->fd);
+	for (size_t i = 0; i < ur->sockets_count; i++) {
+		close(ur->sockets[i]->fd);
+		free(ur->sockets[i]);
+	}
+	free(ur->sockets);
+	while (ur->free_sends != NULL) {
+		struct UTPUringSend *next = ur->free_sends->next;
+		free(ur->free_sends);
+		ur->free_sends = next;
+	}
+	if (ur->sqes) munmap(ur->sqes, ur->sqes_size);
+	if (ur->cq_ring && ur->cq_ring != ur->sq_ring) munmap(ur->cq_ring, ur->cq_ring_size);
+	if (ur->sq_ring) munmap(ur->sq_ring, ur->sq_ring_size);
+	if (ur->buf_ring) munmap(ur->buf_ring, ur->buf_ring_size);
+	free(ur->bufs);
+	free(ur);
+}
+
+int UTPUring_Bind(struct UTPUring *ur, const struct sockaddr *addr, socklen_t addrlen,
+				  UTPGotIncomingConnection *incoming_proc, void *userdata)
+{
+	const int fd = socket(addr->sa_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) return -1;
+
+	if (bind(fd, addr, addrlen) < 0) {
+		const int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	// not fatal, the system may cap these
+	const int size = URING_SOCKET_BUFFER;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+	struct UTPUringSocket *s = (struct UTPUringSocket*)calloc(1, sizeof(struct UTPUringSocket));
+	struct UTPUringSocket **sockets = (struct UTPUringSocket**)realloc(ur->sockets,
+		(ur->sockets_count + 1) * sizeof(ur->sockets[0]));
+	if (s == NULL || sockets == NULL) {
+		free(s);
+		close(fd);
+		errno = ENOMEM;
+		return -1;
+	}
+	ur->sockets = sockets;
+	s->ur = ur;
+	s->fd = fd;
+	s->incoming_proc = incoming_proc;
+	s->userdata = userdata;
+	s->recv_msg.msg_namelen = sizeof(struct sockaddr_storage);
+	ur->sockets[ur->sockets_count++] = s;
+
+	uring_arm_recv(s);
+	return fd;
+}
+
+struct UTPSocket *UTPUring_CreateSocket(struct UTPUring *ur, int fd,
+										const struct sockaddr *addr, socklen_t addrlen)
+{
+	for (size_t i = 0; i < ur->sockets_count; i++) {
+		if (ur->sockets[i]->fd == fd)
+			return UTP_Create(&uring_send_to, ur->sockets[i], addr, addrlen);
+	}
+	errno = EBADF;
+	return NULL;
+}
+
+void UTPUring_Flush(struct UTPUring *ur)
+{
+	uring_submit(ur, 0);
+}
+
+int UTPUring_Poll(struct UTPUring *ur, int timeout)
+{
+	for (size_t i = 0; i < ur->sockets_count; i++) {
+		if (!ur->sockets[i]->recv_armed)
+			uring_arm_recv(ur->sockets[i]);
+	}
+	uring_arm_timeout(ur, timeout);
+
+	// nothing to wait for if there's something to handle already
+	const bool ready = *ur->cq_head != __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+	if (uring_submit(ur, timeout == 0 || ready ? 0 : 1) < 0 && errno != EINTR && errno != ETIME)
+		return -1;
+
+	return uring_reap(ur);
+}
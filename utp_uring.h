@@ -0,0 +1,52 @@
+#ifndef __UTP_URING_H__
+#define __UTP_URING_H__
+
+// An io_uring I/O driver for uTP on Linux, an alternative to the one in
+// utp_epoll.h with the same interface. Packets are received with
+// multishot recvmsg into buffers registered with the kernel, and handed
+// to UTP_IsIncomingUTP() where they land. Sends are queued as linked
+// sendmsg requests, and the uTP timers are an io_uring timeout, so one
+// system call submits everything queued up and waits for what comes
+// next. It needs Linux 6.0 or later.
+
+#include "utp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct UTPUring;
+
+// Create a driver. Returns NULL with errno set on failure, for instance
+// when the kernel doesn't support io_uring, or the features used
+struct UTPUring *UTPUring_Create(void);
+
+// Close the driver and its UDP sockets. The uTP sockets created on them
+// must have been destroyed first
+void UTPUring_Destroy(struct UTPUring *ur);
+
+// Open a UDP socket bound to addr. Incoming connections on it are passed
+// to incoming_proc with userdata. incoming_proc may be NULL to not accept
+// any. Returns the socket, or -1 with errno set
+int UTPUring_Bind(struct UTPUring *ur, const struct sockaddr *addr, socklen_t addrlen,
+				  UTPGotIncomingConnection *incoming_proc, void *userdata);
+
+// Create a uTP socket to addr, sending from the UDP socket fd returned by
+// UTPUring_Bind()
+struct UTPSocket *UTPUring_CreateSocket(struct UTPUring *ur, int fd,
+										const struct sockaddr *addr, socklen_t addrlen);
+
+// Wait up to timeout milliseconds (-1 for no limit) for packets or uTP
+// timers, and handle them. Packets sent in the meantime are queued, and
+// submitted together with the wait. Returns the number of packets
+// received, or -1 with errno set
+int UTPUring_Poll(struct UTPUring *ur, int timeout);
+
+// Submit the queued packets now, rather than at the next UTPUring_Poll()
+void UTPUring_Flush(struct UTPUring *ur);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__UTP_URING_H__
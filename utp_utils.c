@@ -111,7 +111,12 @@ static uint64_t GetMicroseconds()
    POSIX clocks work -- we could be running a recent libc with an ancient
    kernel (think OpenWRT). -- jch */
 
+#if defined(UTP_TSC_CLOCK) && defined(__x86_64__) && defined(__GNUC__)
+#define USE_TSC_CLOCK 1
+static uint64_t GetMonotonicMicroseconds()
+#else
 static uint64_t GetMicroseconds()
+#endif
 {
 	static int have_posix_clocks = -1;
 
@@ -138,21 +143,177 @@ static uint64_t GetMicroseconds()
 		return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
 	}
 }
+
+#ifdef USE_TSC_CLOCK
+#include <cpuid.h>
+#include <x86intrin.h>
+
+/* Invariant TSC clock (UTP_TSC_CLOCK). Reading the TSC is much cheaper
+   than clock_gettime(). Ticks are converted to microseconds with a scale
+   calibrated against the monotonic clock, relative to an anchor: a TSC
+   reading and the monotonic time it corresponds to. The anchor is moved
+   forward every TSC_ANCHOR_INTERVAL, which refines the scale as well. If
+   the TSC ever disagrees with the monotonic clock by more than
+   TSC_MAX_DRIFT, or the CPU doesn't advertise an invariant TSC, we fall
+   back to the monotonic clock for good.
+
+   The anchor is protected by a sequence lock. Readers retry if it
+   changed while they read it. Only one thread at a time updates it,
+   the others use the monotonic clock meanwhile. */
+
+#define TSC_CALIBRATE_INTERVAL 10000 // us
+#define TSC_ANCHOR_INTERVAL 1000000 // us
+#define TSC_MAX_DRIFT 1000 // us
+
+enum { TSC_UNKNOWN, TSC_CALIBRATING, TSC_OK, TSC_UNRELIABLE };
+
+static struct {
+	// odd while the anchor is being updated
+	uint32_t seq;
+	int state;
+	uint64_t tsc;
+	uint64_t us;
+	// microseconds per tick, as 32.32 fixed point
+	uint64_t scale;
+	// move the anchor once the TSC passes this
+	uint64_t next_tsc;
+} tsc_clock;
+static bool tsc_lock;
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+static bool tsc_is_invariant()
+{
+	unsigned eax, ebx, ecx, edx;
+	if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007)
+		return false;
+	__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+	return (edx & (1 << 8)) != 0;
+}
+
+static uint64_t tsc_to_us(uint64_t tsc, uint64_t anchor_tsc, uint64_t anchor_us, uint64_t scale)
+{
+	return anchor_us + (uint64_t)(((unsigned __int128)(tsc - anchor_tsc) * scale) >> 32);
+}
+
+// Calibrate, or move the anchor. Returns the current time
+static uint64_t tsc_update()
+{
+	if (__atomic_test_and_set(&tsc_lock, __ATOMIC_ACQUIRE))
+		return GetMonotonicMicroseconds();
+
+	const uint64_t now = GetMonotonicMicroseconds();
+	const uint64_t tsc = __rdtsc();
+	uint64_t ret = now;
+
+	__atomic_store_n(&tsc_clock.seq, tsc_clock.seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	switch (tsc_clock.state) {
+	case TSC_UNKNOWN:
+		STORE(tsc_clock.state, tsc_is_invariant() ? TSC_CALIBRATING : TSC_UNRELIABLE);
+		STORE(tsc_clock.tsc, tsc);
+		STORE(tsc_clock.us, now);
+		break;
+	case TSC_CALIBRATING:
+	case TSC_OK: {
+		if ((int64_t)(now - tsc_clock.us) < TSC_CALIBRATE_INTERVAL) break;
+		if (tsc <= tsc_clock.tsc) {
+			STORE(tsc_clock.state, TSC_UNRELIABLE);
+			break;
+		}
+		if (tsc_clock.state == TSC_OK) {
+			const uint64_t predicted = tsc_to_us(tsc, tsc_clock.tsc, tsc_clock.us, tsc_clock.scale);
+			const int64_t drift = (int64_t)(predicted - now);
+			if (drift > TSC_MAX_DRIFT || drift < -TSC_MAX_DRIFT) {
+				STORE(tsc_clock.state, TSC_UNRELIABLE);
+				break;
+			}
+			// never step back from what readers may already have seen
+			if (predicted > ret) ret = predicted;
+		}
+		const uint64_t scale = ((now - tsc_clock.us) << 32) / (tsc - tsc_clock.tsc);
+		if (scale == 0) {
+			STORE(tsc_clock.state, TSC_UNRELIABLE);
+			break;
+		}
+		STORE(tsc_clock.scale, scale);
+		STORE(tsc_clock.tsc, tsc);
+		STORE(tsc_clock.us, ret);
+		STORE(tsc_clock.next_tsc, tsc + ((uint64_t)TSC_ANCHOR_INTERVAL << 32) / scale);
+		STORE(tsc_clock.state, TSC_OK);
+		break;
+	}
+	}
+
+	__atomic_store_n(&tsc_clock.seq, tsc_clock.seq + 1, __ATOMIC_RELEASE);
+	__atomic_clear(&tsc_lock, __ATOMIC_RELEASE);
+	return ret;
+}
+
+static uint64_t GetMicroseconds()
+{
+	for (;;) {
+		const uint32_t seq = __atomic_load_n(&tsc_clock.seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) return GetMonotonicMicroseconds();
+
+		const int state = LOAD(tsc_clock.state);
+		const uint64_t anchor_tsc = LOAD(tsc_clock.tsc);
+		const uint64_t anchor_us = LOAD(tsc_clock.us);
+		const uint64_t scale = LOAD(tsc_clock.scale);
+		const uint64_t next_tsc = LOAD(tsc_clock.next_tsc);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (LOAD(tsc_clock.seq) != seq) continue;
+
+		if (state == TSC_UNRELIABLE) return GetMonotonicMicroseconds();
+		if (state != TSC_OK) return tsc_update();
+
+		const uint64_t tsc = __rdtsc();
+		// time to move the anchor, or this core's TSC is behind it
+		if (tsc >= next_tsc || tsc < anchor_tsc) return tsc_update();
+		return tsc_to_us(tsc, anchor_tsc, anchor_us, scale);
+	}
+}
+
+#undef LOAD
+#undef STORE
+#endif //USE_TSC_CLOCK
+
 #endif //!__APPLE__
 
 #endif //!WIN32
 
+#ifdef _MSC_VER
+#define SPIN_LOCK(l) while (InterlockedExchange(&(l), 1)) {}
+#define SPIN_UNLOCK(l) InterlockedExchange(&(l), 0)
+static volatile LONG monotonic_lock;
+#else
+#define SPIN_LOCK(l) while (__atomic_test_and_set(&(l), __ATOMIC_ACQUIRE)) {}
+#define SPIN_UNLOCK(l) __atomic_clear(&(l), __ATOMIC_RELEASE)
+static bool monotonic_lock;
+#endif
+
 uint64_t UTP_GetMicroseconds()
 {
 	static uint64_t offset = 0, previous = 0;
 
-	uint64_t now = GetMicroseconds() + offset;
+	uint64_t now = GetMicroseconds();
+	// the lock makes this safe to call from multiple threads
+	SPIN_LOCK(monotonic_lock);
+	now += offset;
+	if (previous > now) {
+		// another thread may have read the clock after us, but
+		// got the lock first. Read it again to tell
+		now = GetMicroseconds() + offset;
+	}
 	if (previous > now) {
 		/* Eek! */
 		offset += previous - now;
 		now = previous;
 	}
 	previous = now;
+	SPIN_UNLOCK(monotonic_lock);
 	return now;
 }
 